@@ -10,6 +10,18 @@ if [ ! -e "./lib/quickjs.h" ]; then
   echo "✓ Headers downloaded"
 fi
 
+# TLS needs the OpenSSL headers; without them the tls_* functions throw
+TLS_FLAGS=""
+if pkg-config --exists openssl 2>/dev/null; then
+  TLS_FLAGS="-DQJS_TLS $(pkg-config --cflags --libs openssl)"
+  echo "✓ OpenSSL found, TLS enabled"
+elif [ -e /usr/include/openssl/ssl.h ]; then
+  TLS_FLAGS="-DQJS_TLS -lssl -lcrypto"
+  echo "✓ OpenSSL found, TLS enabled"
+else
+  echo "OpenSSL headers not found, building without TLS"
+fi
+
 echo "Compiling with optimizations..."
 
 # PERFORMANCE BUILD - Maximum speed
@@ -30,7 +42,9 @@ gcc \
   ./src/qjs_sockets.c \
   -I ./lib/ \
   -Wall \
-  -Wextra
+  -Wextra \
+  $TLS_FLAGS \
+  -lpthread
 
 if [ $? -eq 0 ]; then
   SIZE=$(du -h ./dist/network_sockets.so | cut -f1)
@@ -0,0 +1,65 @@
+import createSocket from '../extra/udp.js';
+
+// Minimal statsd-style ingestion endpoint: "name:value|type" lines,
+// several per datagram, aggregated in memory and flushed every interval.
+const PORT = 8125;
+const FLUSH_MS = 10000;
+
+const counters = new Map();
+const gauges = new Map();
+const timers = new Map();
+let packets = 0;
+let lastFlush = Date.now();
+
+function ingest(line) {
+  const colon = line.indexOf(':');
+  const pipe = line.indexOf('|', colon);
+  if (colon <= 0 || pipe < 0) return;
+
+  const name = line.slice(0, colon);
+  const value = Number(line.slice(colon + 1, pipe));
+  const type = line.slice(pipe + 1, pipe + 3);
+
+  if (type === 'c') {
+    counters.set(name, (counters.get(name) || 0) + value);
+  } else if (type === 'g') {
+    gauges.set(name, value);
+  } else if (type === 'ms') {
+    let t = timers.get(name);
+    if (!t) timers.set(name, t = { count: 0, sum: 0, max: 0 });
+    t.count++;
+    t.sum += value;
+    if (value > t.max) t.max = value;
+  }
+}
+
+function flush() {
+  const seconds = (Date.now() - lastFlush) / 1000;
+  console.log(`--- ${packets} packets (${Math.round(packets / seconds)} pkt/s)`);
+  for (const [name, value] of counters) console.log(`${name} ${value}`);
+  for (const [name, value] of gauges) console.log(`${name} ${value}`);
+  for (const [name, t] of timers) console.log(`${name} count=${t.count} avg=${(t.sum / t.count).toFixed(2)} max=${t.max}`);
+  counters.clear();
+  timers.clear();
+  packets = 0;
+  lastFlush = Date.now();
+}
+
+const server = createSocket({ batchSize: 512, slotSize: 1500, recvBufferSize: 8 * 1024 * 1024 });
+
+server.onError = (e) => console.log('UDP error:', e.message);
+
+server.listen(PORT, '0.0.0.0', (batch, count) => {
+  packets += count;
+  for (let i = 0; i < count; i++) {
+    const text = batch.text(i);
+    let start = 0;
+    while (start < text.length) {
+      let end = text.indexOf('\n', start);
+      if (end < 0) end = text.length;
+      if (end > start) ingest(text.slice(start, end));
+      start = end + 1;
+    }
+  }
+  if (Date.now() - lastFlush >= FLUSH_MS) flush();
+});
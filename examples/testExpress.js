@@ -1,4 +1,5 @@
 import express from '../extra/express.js';
+import sockets from '../dist/network_sockets.so';
 
 const app = express();
 
@@ -9,19 +10,17 @@ const db = {
   ]
 };
 
-// Loggin Middleware
-app.use((req, res, next) => {
-  console.log(`[${new Date().toISOString()}] ${req.method} ${req.path}`);
-  next();
-});
+// Access log, formatted and written by a native thread off the request path
+app.accessLog('access.log');
 
 app.get('/', (req, res) => {
   res.send(`<html><body>Hello :D</body></html>`);
 });
 
-// users CRUD
+// users CRUD. The list is served from the native response cache for up to
+// a second; writes below drop the cache so readers see them immediately.
 app.get('/api/users', (req, res) => {
-  res.json(db.users);
+  res.cache(1000).json(db.users);
 });
 
 app.get('/api/users/:id', (req, res) => {
@@ -40,13 +39,28 @@ app.post('/api/users', (req, res) => {
     email: req.body.email || 'noemail@email.com'
   };
   db.users.push(newUser);
+  sockets.cache_clear();
   res.status(201).json(newUser);
 });
 
+// CPU-heavy work runs on the offload pool while the loop keeps serving
+app.get('/api/users/stats', async (req, res) => {
+  const stats = await sockets.offload((users) => {
+    const domains = {};
+    for (const u of users) {
+      const domain = u.email.split('@')[1];
+      domains[domain] = (domains[domain] || 0) + 1;
+    }
+    return { count: users.length, domains };
+  }, db.users);
+  res.json(stats);
+});
+
 app.delete('/api/users/:id', (req, res) => {
   const index = db.users.findIndex(u => u.id == req.params.id);
   if (index !== -1) {
     db.users.splice(index, 1);
+    sockets.cache_clear();
     res.status(204).send('');
   } else {
     res.status(404).json({ error: 'User not found' });
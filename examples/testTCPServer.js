@@ -1,6 +1,6 @@
 import createServer from '../extra/tcp.js';
+import sockets from '../dist/network_sockets.so';
 import * as std from 'std';
-import * as os from 'os';
 
 const server = createServer();
 
@@ -10,6 +10,7 @@ const logger = {};
 logger.logFile = "server.log";
 logger.enableConsole = true;
 logger.enableFile = true;
+logger.fileOpen = false;
 
 logger.formatTimestamp = () => {
   const now = new Date();
@@ -24,20 +25,18 @@ logger.formatTimestamp = () => {
 };
 
 logger.log = (message) => {
-  const timestamp = logger.formatTimestamp();
-  const logLine = `[${timestamp}] ${message}\n`;
-  
   if (logger.enableConsole) {
-    console.log(logLine.trim());
+    console.log(`[${logger.formatTimestamp()}] ${message}`);
   }
-  
+
+  // Queued for the native writer thread, which timestamps and appends in batches
   if (logger.enableFile) {
     try {
-      const file = std.open(logger.logFile, "a");
-      if (file) {
-        file.puts(logLine);
-        file.close();
+      if (!logger.fileOpen) {
+        sockets.log_open(logger.logFile);
+        logger.fileOpen = true;
       }
+      sockets.log_message(message);
     } catch (err) {
       console.error(`Failed to write to log file: ${err}`);
     }
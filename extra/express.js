@@ -1,4 +1,35 @@
 import sockets from '../dist/network_sockets.so';
+import { clientLoop } from './http.js';
+
+const H2_PREFACE = 'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n';
+
+// Connections are read as bytes, so bodies reach the native side as sent
+const BINARY = { binary: true };
+const NO_BYTES = new Uint8Array(0);
+
+// a followed by b, as one Uint8Array
+function joinBytes(a, b) {
+  if (a.length === 0) return b;
+  if (b.length === 0) return a;
+  const joined = new Uint8Array(a.length + b.length);
+  joined.set(a);
+  joined.set(b, a.length);
+  return joined;
+}
+
+// Index of the ASCII string seq in the bytes buf, or -1
+function indexOfBytes(buf, seq) {
+  const first = seq.charCodeAt(0);
+  for (let i = buf.indexOf(first); i >= 0 && i + seq.length <= buf.length; i = buf.indexOf(first, i + 1)) {
+    let j = 1;
+    while (j < seq.length && buf[i + j] === seq.charCodeAt(j)) j++;
+    if (j === seq.length) return i;
+  }
+  return -1;
+}
+
+// Mirrors sockets.trace_enabled(), refreshed every loop turn
+let tracing = false;
 
 let debugCounter = 1;
 const deb = msg => {
@@ -17,11 +48,139 @@ class Request {
     this.body = parsedRequest.body || '';
     this.httpVersion = parsedRequest.httpVersion || 'HTTP/1.1';
     this.params = {};
+    this.bodyFd = -1; // temp file holding a spilled body, read from its start
+    this.files = []; // file parts of a multipart body: {name, filename, type, fd, size}
+    this._stream = null; // BodyStream of a body(prefix, {stream: true}) request
+    this._native = false; // the body's native state (files) lasts until the response is out
   }
   
   get(header) {
     return this.headers[header.toLowerCase()];
   }
+
+  // Streamed bodies: 'data' gets each ArrayBuffer as it arrives, then 'end';
+  // 'error' gets an Error with status 413 or 400, or 0 if the client left.
+  // A streamed form gets 'field' ({name, value}) and 'file' ({name,
+  // filename, type, fd, size}) as each part completes instead of 'data'.
+  // Other requests have their whole body in req.body and only see 'end'.
+  on(event, listener) {
+    if (this._stream !== null) {
+      this._stream.on(event, listener);
+    } else if (event === 'end') {
+      Promise.resolve().then(listener);
+    }
+    return this;
+  }
+
+  // for await (const chunk of req) over a streamed body, or its form parts
+  [Symbol.asyncIterator]() {
+    return { next: () => this._stream !== null ? this._stream.next() : Promise.resolve({ value: undefined, done: true }) };
+  }
+
+  // The body is in file; req.body reads it back on first use
+  _spilled(fd, file) {
+    this.bodyFd = file;
+    this._native = true;
+    let body;
+    Object.defineProperty(this, 'body', {
+      get: () => (body === undefined ? (body = sockets.body_value(fd)) : body),
+      set: (value) => { body = value; },
+      enumerable: true,
+      configurable: true
+    });
+  }
+}
+
+// Bytes of a streamed request body between the native reads and the
+// handler. Chunks (ArrayBuffers, or the parts of a form) wait here until a
+// listener or the iterator takes them; while too many bytes wait, resume()
+// is due once they are taken.
+class BodyStream {
+  constructor(resume) {
+    this.resume = resume;
+    this.chunks = [];
+    this.queued = 0; // bytes in chunks
+    this.paused = false;
+    this.ended = false;
+    this.error = null;
+    this.listeners = { data: [], field: [], file: [], end: [], error: [] };
+    this.waiter = null; // resolve/reject of a pending next()
+    this.told = false; // 'end' or 'error' delivered
+    this.settled = null; // resolves finished() once told
+  }
+
+  on(event, listener) {
+    if (!this.listeners[event]) return;
+    this.listeners[event].push(listener);
+    if (this.told && event === (this.error ? 'error' : 'end')) listener(this.error);
+    else this._deliver();
+  }
+
+  // Resolves once 'end' or 'error' has gone to the listeners
+  finished() {
+    return new Promise((resolve) => {
+      if (this.told) resolve();
+      else this.settled = resolve;
+    });
+  }
+
+  next() {
+    return new Promise((resolve, reject) => {
+      this.waiter = { resolve, reject };
+      this._deliver();
+    });
+  }
+
+  push(chunk) {
+    this.chunks.push(chunk);
+    this.queued += chunk.byteLength || 0;
+    this._deliver();
+  }
+
+  // status null: the whole body is in
+  end(status) {
+    if (this.ended) return;
+    this.ended = true;
+    if (status !== null) {
+      this.error = new Error(status ? `Request body refused with ${status}` : 'Client closed the connection');
+      this.error.status = status;
+    }
+    this._deliver();
+  }
+
+  _take() {
+    const chunk = this.chunks.shift();
+    this.queued -= chunk.byteLength || 0;
+    return chunk;
+  }
+
+  static _event(chunk) {
+    if (chunk instanceof ArrayBuffer) return 'data';
+    return chunk.filename !== undefined ? 'file' : 'field';
+  }
+
+  _deliver() {
+    while (this.chunks.length > 0 && this.listeners[BodyStream._event(this.chunks[0])].length > 0) {
+      const chunk = this._take();
+      for (const listener of this.listeners[BodyStream._event(chunk)]) listener(chunk);
+    }
+    if (this.waiter !== null && (this.chunks.length > 0 || this.ended)) {
+      const waiter = this.waiter;
+      this.waiter = null;
+      if (this.chunks.length > 0) waiter.resolve({ value: this._take(), done: false });
+      else if (this.error !== null) waiter.reject(this.error);
+      else waiter.resolve({ value: undefined, done: true });
+    }
+    if (this.ended && this.chunks.length === 0 && !this.told) {
+      this.told = true;
+      for (const listener of this.error ? this.listeners.error : this.listeners.end) listener(this.error);
+      if (this.settled !== null) this.settled();
+    }
+    if (this.paused && this.queued === 0) {
+      this.paused = false;
+      this.resume();
+    }
+  }
 }
 
 class Response {
@@ -34,7 +193,16 @@ class Response {
       'Server': 'qjs-express/1.0'
     };
     this.sent = false;
+    this.headOnly = false; // HEAD: headers describe the body, which is not sent
+    this.routedUs = 0; // set when tracing: middleware done, route matched
+    this.req = null;
+    this.rawRequest = ''; // request bytes this answers, for the response cache
+    this.app = null;
+    this.upgrade = null; // set by websocket() and sse()
+    this.stream = 0; // HTTP/2 stream this answers, 0 on HTTP/1.x
+    this._cache = null;
     this._buffer = '';
+    this._body = ''; // HTTP/2: the body alone, framed natively with the headers
   }
 
   status(code) {
@@ -118,6 +286,12 @@ class Response {
     if (!this.headers.Date) {
       this.headers.Date = new Date().toUTCString();
     }
+
+    if (this.stream > 0) {
+      this._body = this.statusCode !== 204 && this.statusCode !== 304 && data && !this.headOnly ? data : '';
+      this.sent = true;
+      return this._body;
+    }
     
     for (const [key, value] of Object.entries(this.headers)) {
       response += `${key}: ${value}\r\n`;
@@ -125,7 +299,7 @@ class Response {
 
     response += '\r\n'; 
     
-    if (this.statusCode !== 204 && this.statusCode !== 304 && data) {
+    if (this.statusCode !== 204 && this.statusCode !== 304 && data && !this.headOnly) {
       response += data;
     }
     
@@ -222,6 +396,65 @@ class Response {
     return this;
   }
 
+  // Keep the serialized response in the native cache for ttlMs; later
+  // keep-alive GET/HEAD requests for the same target (and the same values
+  // of the vary headers) are answered without running any JS. For
+  // options.stale ms after expiry one request regenerates the entry while
+  // the others get the old copy. Responses that set cookies are not cached.
+  cache(ttlMs, options = {}) {
+    this._cache = {
+      ttl: ttlMs,
+      stale: options.stale !== undefined ? options.stale : ttlMs,
+      vary: options.vary || []
+    };
+    return this;
+  }
+
+  // Complete the WebSocket handshake for this request and return the socket,
+  // or answer 426 and return null if it is not a valid upgrade
+  // (options: {protocol, maxMessage}, see sockets.ws_upgrade)
+  websocket(options = {}) {
+    if (this.sent) return null;
+    if (this.stream > 0) {
+      this.status(426).send('Upgrade Required'); // not over HTTP/2
+      return null;
+    }
+    if (!sockets.ws_upgrade(this.clientFd, this.rawRequest, options)) {
+      this.status(426).set('Sec-WebSocket-Version', '13').send('Upgrade Required');
+      return null;
+    }
+    this.statusCode = 101;
+    this.sent = true;
+    this.upgrade = new WebSocket(this.app, this.clientFd, this.req);
+    return this.upgrade;
+  }
+
+  // Answer with a text/event-stream that stays open; returns the EventStream
+  // that writes to it (options: {retry}, ms the client waits to reconnect)
+  sse(options = {}) {
+    if (this.sent) return null;
+    if (this.stream > 0) {
+      this.status(505).send('HTTP Version Not Supported'); // streams are HTTP/1.1 only
+      return null;
+    }
+    this.headers['Content-Type'] = 'text/event-stream';
+    this.headers['Cache-Control'] = 'no-cache';
+    this.headers.Connection = 'keep-alive';
+    delete this.headers['Keep-Alive'];
+    let head = 'HTTP/1.1 200 OK\r\n';
+    for (const [key, value] of Object.entries(this.headers)) {
+      head += `${key}: ${value}\r\n`;
+    }
+    this.statusCode = 200;
+    this.sent = true;
+    this.upgrade = new EventStream(this.app, this.clientFd);
+    if (!sockets.sse_open(this.clientFd, head + '\r\n', options)) {
+      this.upgrade.closed = true;
+      this.app._closeClient(this.clientFd);
+    }
+    return this.upgrade;
+  }
+
   setCors(origin = '*') {
     this.set('Access-Control-Allow-Origin', origin);
     this.set('Access-Control-Allow-Methods', 'GET, POST, PUT, DELETE, OPTIONS');
@@ -241,6 +474,113 @@ class Response {
   }
 }
 
+// An upgraded connection. Frames are parsed and written by the native module;
+// onmessage(data) gets strings for text and ArrayBuffers for binary messages.
+class WebSocket {
+  constructor(app, fd, req) {
+    this.app = app;
+    this.fd = fd;
+    this.req = req;
+    this.readyState = WebSocket.OPEN;
+    this.bufferedAmount = 0; // bytes the socket has not taken yet
+    this.onmessage = null;
+    this.onclose = null; // (code, reason)
+    this.ondrain = null; // bufferedAmount is back to 0
+    this._pinged = false;
+  }
+
+  // Returns false once closing; a client more than 4 MB behind is dropped
+  send(data) {
+    if (this.readyState !== WebSocket.OPEN) return false;
+    const queued = sockets.ws_send(this.fd, data);
+    if (queued < 0) {
+      this.app._closeClient(this.fd);
+      return false;
+    }
+    this.bufferedAmount = queued;
+    return true;
+  }
+
+  ping() {
+    if (this.readyState === WebSocket.OPEN) sockets.ws_ping(this.fd);
+  }
+
+  // Messages published to topic (app.publish) reach this socket until it closes
+  subscribe(topic) {
+    sockets.pubsub_subscribe(this.fd, topic);
+    return this;
+  }
+
+  unsubscribe(topic) {
+    sockets.pubsub_unsubscribe(this.fd, topic);
+    return this;
+  }
+
+  // The connection is closed when the client answers, or by the timeout check
+  close(code = 1000, reason = '') {
+    if (this.readyState !== WebSocket.OPEN) return;
+    this.readyState = WebSocket.CLOSING;
+    if (sockets.ws_close(this.fd, code, reason) < 0) this.app._closeClient(this.fd);
+  }
+
+  _closed(code, reason) {
+    this.readyState = WebSocket.CLOSED;
+    if (this.onclose) this.onclose(code, reason);
+  }
+}
+
+WebSocket.CONNECTING = 0;
+WebSocket.OPEN = 1;
+WebSocket.CLOSING = 2;
+WebSocket.CLOSED = 3;
+
+// Server-sent events on a connection kept open by res.sse(). Everything
+// lives in the native module except onclose.
+class EventStream {
+  constructor(app, fd) {
+    this.app = app;
+    this.fd = fd;
+    this.closed = false;
+    this.onclose = null;
+  }
+
+  // Non-string data is sent as JSON. Returns false once closed; a client
+  // more than 4 MB behind is dropped.
+  event(id, data, type) {
+    if (this.closed) return false;
+    const text = typeof data === 'string' ? data : JSON.stringify(data);
+    if (sockets.sse_event(this.fd, text, id === undefined || id === null ? undefined : String(id), type) < 0) {
+      this.app._closeClient(this.fd);
+      return false;
+    }
+    return true;
+  }
+
+  send(data) {
+    return this.event(undefined, data);
+  }
+
+  // Messages published to topic (app.publish) reach this stream until it closes
+  subscribe(topic) {
+    sockets.pubsub_subscribe(this.fd, topic);
+    return this;
+  }
+
+  unsubscribe(topic) {
+    sockets.pubsub_unsubscribe(this.fd, topic);
+    return this;
+  }
+
+  close() {
+    if (!this.closed) this.app._closeClient(this.fd);
+  }
+
+  _closed() {
+    this.closed = true;
+    if (this.onclose) this.onclose();
+  }
+}
+
 class Router {
   constructor() {
     this.routes = [];
@@ -281,13 +621,22 @@ class Router {
     return this._addRoute('PATCH', path, handler);
   }
 
+  // handler(ws, req) runs once the handshake is done
+  ws(path, handler) {
+    return this._addRoute('GET', path, (req, res) => {
+      const ws = res.websocket();
+      if (ws) return handler(ws, req);
+    });
+  }
+
   all(path, handler) {
     return this._addRoute('*', path, handler);
   }
   
   _matchRoute(method, path) {
     for (const route of this.routes) {
-      if (route.method !== '*' && route.method !== method) continue;
+      if (route.method !== '*' && route.method !== method &&
+          !(method === 'HEAD' && route.method === 'GET')) continue;
 
       const params = this._matchPath(route.path, path);
       if (params !== null) {
@@ -337,10 +686,11 @@ class Router {
     
     // Find matching route
     const match = this._matchRoute(req.method, req.path);
-    
+    if (tracing) res.routedUs = sockets.now_us();
+
     if (match) {
       req.params = match.params;
-      match.handler(req, res);
+      return match.handler(req, res);
     } else {
       res.status(404).send('Not Found');
     }
@@ -352,22 +702,176 @@ class Express extends Router {
     super();
     this.serverFd = null;
     this.epollFd = null;
+    this.offloadFd = null;
+    this.dnsFd = null;
+    this.watchers = new Map(); // fd -> callback for other pollable fds sharing this loop
     this.clients = new Map();
     this.timeoutCheckInterval = 1000; 
     this.keepAliveTimeout = 5000; 
+    this.ipv6Only = false; // '::' listeners accept IPv4 too unless set
+    this.family = sockets.AF_INET;
     this.lastTimeoutCheck = Date.now();
+    this.metricsPath = null;
+    this.accessLogPath = null;
+    this.cacheActive = false; // set once a handler's res.cache() stored something
+    this.rateLimited = false; // set by rateLimit()
+    this.overloadOptions = null; // set by overload()
+    this.http2Options = null; // set by http2()
+    this.tlsOptions = null; // set by tls()
+    this.proxyRoutes = []; // {prefix, pool} from proxy(), longest prefix first
+    this.bodyRules = []; // {prefix, limit, spill, stream, maxFiles} from body(), longest prefix first
+    this.maxBody = 1048576; // request body bytes allowed where no body() rule applies
+    this.bodySpill = 65536; // larger bodies are read natively into a temp file
+    this.maxBuffered = 0; // cap on unparsed request bytes across all clients, 0: none
+    this.buffered = 0;
+    // Per-turn budgets: a connection that uses its share waits in readyQueue for the next turn
+    this.readBudget = 65536; // bytes read from one connection
+    this.requestBudget = 16; // requests dispatched for one connection
+    this.acceptBudget = 64; // connections accepted
+    this.readyQueue = []; // fds (the listen fd for pending accepts) with work left over
+    this.wsPingInterval = 30000; // idle WebSockets are pinged, and closed after twice this, 0: never
+    this.sseHeartbeat = 15000; // ms without a write before an event stream gets a comment line, 0: never
+    this.idleGcInterval = 1000; // ms between cycle collections in idle turns, 0: off
     this.running = true;
   }
+
+  // Append one line per response to path from a native writer thread
+  // (options: {sample, records}, see sockets.log_open)
+  accessLog(path, options = {}) {
+    sockets.log_open(path, options);
+    this.accessLogPath = path;
+    return this;
+  }
+
+  // Token-bucket limit per client on paths starting with prefix, enforced natively
+  // before parsing (options: {rate, burst, header, accept, close}, see sockets.limit_rule)
+  rateLimit(prefix, options) {
+    sockets.limit_rule(prefix, options);
+    this.rateLimited = true;
+    return this;
+  }
+
+  // Shed load past saturation: pause accepting and answer 503 while the loop lags
+  // (options: {lagMs, queueMs, maxConnections, retryAfter, maxBuffered}, see sockets.overload_enable)
+  overload(options = {}) {
+    this.overloadOptions = options;
+    this.maxBuffered = options.maxBuffered || 0;
+    if (this.serverFd !== null) {
+      sockets.overload_enable(this.epollFd, this.serverFd, sockets.EPOLLIN | sockets.EPOLLET, options);
+    }
+    return this;
+  }
+
+  // Speak cleartext HTTP/2 to clients that open with its preface or ask for
+  // Upgrade: h2c (options: {maxStreams, maxBody}, see sockets.h2_open)
+  http2(options = {}) {
+    this.http2Options = options;
+    return this;
+  }
+
+  // Serve every connection over TLS (options: {cert, key, ticketKey, cache,
+  // ktls}, see sockets.tls_server). ALPN offers h2 once http2() is on.
+  tls(options) {
+    this.tlsOptions = options;
+    return this;
+  }
+
+  // Forward requests under prefix to upstreams ("host:port" or a Unix socket
+  // path), natively and with keep-alive, balancing and passive health checks.
+  // policy is 'round-robin', 'least-conn', 'hash' or {balance, key, maxIdle,
+  // maxFails, failTimeout, timeout, strip} (see sockets.http_upstream);
+  // strip: true takes prefix off the forwarded path.
+  proxy(prefix, upstreams, policy = {}) {
+    const options = typeof policy === 'string' ? { balance: policy } : Object.assign({}, policy);
+    if (options.strip === true) options.strip = prefix;
+    else if (!options.strip) delete options.strip;
+    const pool = sockets.http_upstream(upstreams, options);
+    this.proxyRoutes.push({ prefix, pool });
+    this.proxyRoutes.sort((a, b) => b.prefix.length - a.prefix.length);
+    return this;
+  }
+
+  // Counters for the upstreams behind prefix (see sockets.http_upstream_stats)
+  proxyStats(prefix) {
+    const route = this.proxyRoutes.find((r) => r.prefix === prefix);
+    return route ? sockets.http_upstream_stats(route.pool) : null;
+  }
+
+  // Request bodies under prefix: at most limit bytes (413 as soon as the head
+  // says more), gathered in memory up to spill bytes (1 MB at most) and in a
+  // temp file past that, or with stream: true handed to the handler as they
+  // arrive (req.on('data'), for await). Forms are parsed natively either
+  // way, uploaded files going to temp files, at most maxFiles (16) of them
+  // per request. See sockets.body_open.
+  body(prefix, options = {}) {
+    const rule = {
+      prefix,
+      limit: options.limit !== undefined ? options.limit : this.maxBody,
+      spill: Math.min(options.spill !== undefined ? options.spill : this.bodySpill, 1048576),
+      stream: !!options.stream,
+      maxFiles: options.maxFiles
+    };
+    this.bodyRules = this.bodyRules.filter((r) => r.prefix !== prefix);
+    this.bodyRules.push(rule);
+    this.bodyRules.sort((a, b) => b.prefix.length - a.prefix.length);
+    return this;
+  }
+
+  // Send data to every WebSocket subscribed to topic; returns how many get it
+  publish(topic, data) {
+    return sockets.pubsub_publish(topic, data);
+  }
+
+  // How topic treats subscribers that fall behind (options: {policy, highWater},
+  // see sockets.pubsub_topic)
+  topic(name, options = {}) {
+    sockets.pubsub_topic(name, options);
+    return this;
+  }
+
+  // Serve sockets.metrics_text() at path, ahead of every middleware
+  metrics(path = '/metrics') {
+    this.metricsPath = path;
+    return this;
+  }
   
+  // listen(port, host, cb) for TCP ('::' for dual-stack), or
+  // listen('/run/app.sock', cb) / listen('@name', cb) for a Unix socket
   listen(port, host = '0.0.0.0', callback) {
-    this.serverFd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+    if (typeof host === 'function') {
+      callback = host;
+      host = '0.0.0.0';
+    }
+
+    const unixPath = typeof port === 'string' && !/^\d+$/.test(port) ? port : null;
+    if (unixPath !== null) {
+      this.family = sockets.AF_UNIX;
+    } else {
+      this.family = host.includes(':') ? sockets.AF_INET6 : sockets.AF_INET;
+    }
+
+    if (this.tlsOptions !== null) {
+      const alpn = this.http2Options !== null ? ['h2', 'http/1.1'] : ['http/1.1'];
+      sockets.tls_server(Object.assign({ alpn }, this.tlsOptions));
+    }
+
+    this.serverFd = sockets.socket(this.family, sockets.SOCK_STREAM, 0);
     
-    sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
-    sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_REUSEPORT, 1);
+    if (this.family !== sockets.AF_UNIX) {
+      sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+      sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_REUSEPORT, 1);
+    }
+    if (this.family === sockets.AF_INET6) {
+      sockets.setsockopt(this.serverFd, sockets.IPPROTO_IPV6, sockets.IPV6_V6ONLY, this.ipv6Only ? 1 : 0);
+    }
     sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_RCVBUF, 262144);
     sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_SNDBUF, 262144);
 
-    sockets.bind(this.serverFd, host, port);
+    if (unixPath !== null) {
+      sockets.bind(this.serverFd, unixPath, 0);
+    } else {
+      sockets.bind(this.serverFd, host, Number(port));
+    }
     sockets.listen(this.serverFd, 2048);
     sockets.setnonblocking(this.serverFd);
 
@@ -379,58 +883,158 @@ class Express extends Router {
       this.serverFd,
       sockets.EPOLLIN | sockets.EPOLLET
     );
+    if (this.overloadOptions !== null) {
+      sockets.overload_enable(this.epollFd, this.serverFd, sockets.EPOLLIN | sockets.EPOLLET, this.overloadOptions);
+    }
+
+    // Completions from sockets.offload() wake the loop through this eventfd
+    this.offloadFd = sockets.offload_fd();
+    sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_ADD, this.offloadFd, sockets.EPOLLIN);
+
+    // Answers for sockets.resolve() arrive on the resolver's sockets, behind dns_fd()
+    this.dnsFd = sockets.dns_fd();
+    sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_ADD, this.dnsFd, sockets.EPOLLIN);
+
+    for (const fd of this.watchers.keys()) {
+      sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_ADD, fd, sockets.EPOLLIN);
+    }
+
+    // Forwarded requests move on the proxy's own epoll set
+    if (this.proxyRoutes.length > 0) {
+      this.watch(sockets.proxy_fd(), () => sockets.proxy_poll());
+    }
+
+    // Collect cycles while the loop has nothing to do, not mid-request
+    sockets.gc_idle(this.idleGcInterval);
+
+    // Outbound requests from extra/http.js run on this loop too
+    this.watch(clientLoop.fd, () => clientLoop.poll(0));
 
     if (typeof callback === 'function') {
       callback();
     }
 
-    console.log(`Server listening on ${host}:${port}`);
+    if (unixPath !== null) {
+      console.log(`Server listening on ${unixPath}`);
+    } else {
+      console.log(`Server listening on ${host}:${port}`);
+    }
+
+    tracing = sockets.trace_enabled();
 
     while (this.running) {
       try {
-        const events = sockets.epoll_wait(this.epollFd, 512, 10); // 10ms timeout
+        // Don't sleep while connections have work queued from the last turn
+        const ready = this.readyQueue;
+        this.readyQueue = [];
+        const events = sockets.epoll_wait(this.epollFd, 512, ready.length > 0 ? 0 : 10); // 10ms timeout
         
         this._checkTimeouts();
         
         for (const event of events) {
           if (event.fd === this.serverFd) {
             this._acceptConnections();
+          } else if (event.fd === this.offloadFd) {
+            sockets.offload_poll();
+          } else if (event.fd === this.dnsFd) {
+            sockets.dns_poll();
+          } else if (this.watchers.has(event.fd)) {
+            this.watchers.get(event.fd)();
           } else {
             this._handleClientEvent(event);
           }
         }
+
+        // Then the leftovers, one budget each; anything still unfinished goes to the next turn
+        for (const fd of ready) {
+          if (fd === this.serverFd) {
+            this._acceptConnections();
+            continue;
+          }
+          const clientData = this.clients.get(fd);
+          if (clientData && clientData.queued && !clientData.closing) {
+            clientData.queued = false;
+            this._handleRead(fd, clientData);
+          }
+        }
+
+        clientLoop.tick();
+        tracing = sockets.trace_enabled();
+
+        // The loop never yields to the host, so settle async handlers here
+        sockets.run_pending_jobs();
       } catch (e) {
         // Ignore errors en epoll_wait
       }
     }
   }
 
+  // Wake callback() whenever fd is readable (an eventfd, epoll fd, UDP socket...)
+  watch(fd, callback) {
+    const added = !this.watchers.has(fd);
+    this.watchers.set(fd, callback);
+    if (added && this.epollFd !== null) {
+      sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_ADD, fd, sockets.EPOLLIN);
+    }
+    return this;
+  }
+
+  unwatch(fd) {
+    if (this.watchers.delete(fd) && this.epollFd !== null) {
+      try {
+        sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_DEL, fd, 0);
+      } catch (e) {
+        // Already closed
+      }
+    }
+    return this;
+  }
+
   _acceptConnections() {
-    while (true) {
+    for (let accepted = 0; ; accepted++) {
+      // The listen fd is edge-triggered: no new event comes for connections left in the backlog
+      if (accepted === this.acceptBudget) {
+        this.readyQueue.push(this.serverFd);
+        break;
+      }
       try {
         const client = sockets.accept(this.serverFd);
         if (!client) break;
         
         sockets.setnonblocking(client.fd);
-        sockets.setsockopt(client.fd, sockets.IPPROTO_TCP, sockets.TCP_NODELAY, 1);
-        sockets.setsockopt(client.fd, sockets.SOL_SOCKET, sockets.SO_KEEPALIVE, 1);
+        if (this.family !== sockets.AF_UNIX) {
+          sockets.setsockopt(client.fd, sockets.IPPROTO_TCP, sockets.TCP_NODELAY, 1);
+          sockets.setsockopt(client.fd, sockets.SOL_SOCKET, sockets.SO_KEEPALIVE, 1);
+        }
         sockets.setsockopt(client.fd, sockets.SOL_SOCKET, sockets.SO_RCVBUF, 65536);
         sockets.setsockopt(client.fd, sockets.SOL_SOCKET, sockets.SO_SNDBUF, 65536);
 
+        // TLS connections also wait for EPOLLOUT: records the socket refused
+        // go out from there
+        const tls = this.tlsOptions !== null;
+        if (tls) sockets.tls_accept(client.fd);
         sockets.epoll_ctl(
           this.epollFd,
           sockets.EPOLL_CTL_ADD,
           client.fd,
-          sockets.EPOLLIN | sockets.EPOLLET | sockets.EPOLLRDHUP
+          sockets.EPOLLIN | sockets.EPOLLET | sockets.EPOLLRDHUP | (tls ? sockets.EPOLLOUT : 0)
         );
 
         this.clients.set(client.fd, {
           info: client,
-          buffer: '',
+          buffer: NO_BYTES, // bytes read but not yet taken by a request
           requestCount: 0,
           lastActivity: Date.now(),
           keepAlive: false,
-          httpVersion: 'HTTP/1.1'
+          httpVersion: 'HTTP/1.1',
+          pending: false,
+          forwarding: false, // sockets.http_forward() has the connection
+          body: null, // {head, req, res} while sockets.body_read() has the request body
+          expected: false, // 100 Continue sent for the request in the buffer
+          tls,
+          closing: false, // the last response is still being flushed
+          queued: false, // in readyQueue
+          budget: 0 // requests left this turn
         });
         
       } catch (e) {
@@ -443,55 +1047,391 @@ class Express extends Router {
     const clientData = this.clients.get(event.fd);
     if (!clientData) return;
 
+    if (clientData.sse) {
+      if (event.events & (sockets.EPOLLERR | sockets.EPOLLHUP | sockets.EPOLLRDHUP)) {
+        this._closeClient(event.fd);
+      } else if (event.events & sockets.EPOLLOUT) {
+        this._flushStream(event.fd, clientData);
+      }
+      return;
+    }
+
+    if (clientData.h2) {
+      if (event.events & sockets.EPOLLOUT) {
+        this._flushStream(event.fd, clientData);
+        if (this.clients.get(event.fd) !== clientData) return;
+      }
+      // Hangups are read too: h2_read reports them
+      if ((event.events & ~sockets.EPOLLOUT) && !clientData.queued) {
+        this._readH2(event.fd, clientData);
+      }
+      return;
+    }
+
+    if (clientData.ws) {
+      if (event.events & sockets.EPOLLOUT) {
+        this._flushStream(event.fd, clientData);
+        if (this.clients.get(event.fd) !== clientData) return;
+      }
+      // Hangups are read too: ws_read reports the close status
+      if ((event.events & ~sockets.EPOLLOUT) && !clientData.queued) {
+        this._readWebSocket(event.fd, clientData);
+      }
+      return;
+    }
+
     if (event.events & (sockets.EPOLLERR | sockets.EPOLLHUP | sockets.EPOLLRDHUP)) {
       this._closeClient(event.fd);
       return;
     }
 
-    if (event.events & sockets.EPOLLIN) {
+    if (clientData.tls && (event.events & sockets.EPOLLOUT)) {
+      const waiting = sockets.tls_flush(event.fd);
+      if (waiting < 0 || (waiting === 0 && clientData.closing)) {
+        this._closeClient(event.fd);
+        return;
+      }
+    }
+    if (clientData.closing) return;
+
+    // Queued connections are read after the events, with the rest of the queue
+    if ((event.events & sockets.EPOLLIN) && !clientData.queued) {
       this._handleRead(event.fd, clientData);
     }
   }
 
+  // Give fd another turn; edge-triggered sockets are not reported again until new data arrives
+  _schedule(fd, clientData) {
+    if (!clientData.queued) {
+      clientData.queued = true;
+      this.readyQueue.push(fd);
+    }
+  }
+
   _handleRead(fd, clientData) {
+    if (clientData.ws) {
+      this._readWebSocket(fd, clientData);
+      return;
+    }
+    if (clientData.h2) {
+      this._readH2(fd, clientData);
+      return;
+    }
+    if (clientData.body !== null) {
+      this._readBody(fd, clientData);
+      return;
+    }
     try {
       let totalRead = 0;
-      const maxReadPerCall = 65536;
+      clientData.budget = this.requestBudget;
+
+      // HTTP/2 with prior knowledge: the preface is only peeked at, and a
+      // connection that starts any other way is HTTP/1.x for good
+      if (this.http2Options !== null && clientData.requestCount === 0 && !clientData.pending &&
+          clientData.buffer.length === 0) {
+        const head = sockets.recv(fd, H2_PREFACE.length, sockets.MSG_PEEK);
+        if (head.length > 0 && head.length < H2_PREFACE.length && H2_PREFACE.startsWith(head)) {
+          return; // the rest comes with the next edge
+        }
+        if (head === H2_PREFACE) {
+          if (this._openH2(fd, clientData)) this._readH2(fd, clientData);
+          else this._closeClient(fd);
+          return;
+        }
+      }
+
+      // Proxied prefixes: the request line is only peeked at, and a request
+      // for one goes to the native proxy without entering the buffer
+      if (this.proxyRoutes.length > 0 && clientData.buffer.length === 0 && !clientData.pending) {
+        const peek = sockets.recv(fd, 2048, sockets.MSG_PEEK);
+        const eol = peek.indexOf('\r\n');
+        if (eol < 0 && peek.length > 0 && peek.length < 2048) {
+          return; // the rest of the line comes with the next edge
+        }
+        if (eol > 0 && this._proxyPool(peek.substring(0, eol)) >= 0) {
+          this._forward(fd, clientData, peek.substring(0, eol), '');
+          return;
+        }
+      }
+
+      // Requests left over from the last turn go first
+      if (clientData.buffer.length > 0) {
+        this._processBuffer(fd, clientData);
+        if (!this.clients.has(fd) || clientData.closing) {
+          return;
+        }
+      }
       
-      while (totalRead < maxReadPerCall) {
-        const chunk = sockets.recv(fd, 8192, 0);
+      while (totalRead < this.readBudget) {
+        // Stop pulling in requests that cannot be dispatched yet; _finishAsync and
+        // _processBuffer reschedule the connection. A body being read natively
+        // is not the buffer's.
+        if (clientData.pending || clientData.budget <= 0 || clientData.body !== null) {
+          return;
+        }
+
+        const chunk = new Uint8Array(sockets.recv(fd, 8192, 0, BINARY));
         
-        if (!chunk || chunk.length === 0) {
-          break;
+        if (chunk.length === 0) {
+          return; // drained: the next edge reports new data
         }
         
-        clientData.buffer += chunk;
+        clientData.buffer = joinBytes(clientData.buffer, chunk);
+        this.buffered += chunk.length;
         totalRead += chunk.length;
         clientData.lastActivity = Date.now();
         
         if (clientData.buffer.length > 0) {
           this._processBuffer(fd, clientData);
-          if (!this.clients.has(fd)) {
+          if (!this.clients.has(fd) || clientData.closing) {
             return;
           }
         }
+
+        // Over the worker's budget, the client still holding unparsed bytes goes
+        if (this.maxBuffered > 0 && this.buffered > this.maxBuffered && clientData.buffer.length > 0) {
+          sockets.overload_reject(fd);
+          this._closeClient(fd);
+          return;
+        }
       }
+
+      // Read budget spent with data possibly left in the socket
+      this._schedule(fd, clientData);
     } catch (e) {
       this._closeClient(fd);
     }
   }
 
+  _readWebSocket(fd, clientData) {
+    const ws = clientData.ws;
+    let r;
+    try {
+      r = sockets.ws_read(fd, this.readBudget);
+    } catch (e) {
+      this._closeClient(fd);
+      return;
+    }
+    clientData.lastActivity = Date.now();
+    ws._pinged = false;
+
+    for (const message of r.messages) {
+      if (ws.readyState === WebSocket.CLOSED) return;
+      try {
+        if (ws.onmessage) ws.onmessage(message);
+      } catch (e) {
+        console.error('Error in WebSocket handler on fd=' + fd + ':', e.message || e);
+      }
+    }
+
+    if (r.close !== undefined) {
+      this._closeClient(fd, r.close, r.reason);
+    } else if (r.more) {
+      this._schedule(fd, clientData);
+    }
+  }
+
+  // From here on the connection carries HTTP/2 frames for _readH2. upgrade
+  // is the HTTP2-Settings value when it came as an HTTP/1.1 request.
+  _openH2(fd, clientData, upgrade) {
+    const options = Object.assign({}, this.http2Options);
+    if (upgrade !== undefined) options.upgrade = upgrade;
+    if (!sockets.h2_open(fd, options)) return false;
+    clientData.h2 = true;
+    clientData.keepAlive = true;
+    clientData.httpVersion = 'HTTP/2.0';
+    this.buffered -= clientData.buffer.length;
+    clientData.buffer = NO_BYTES;
+    clientData.lastActivity = Date.now();
+    // EPOLLOUT edges let responses held back by flow control go out
+    sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_MOD, fd,
+      sockets.EPOLLIN | sockets.EPOLLOUT | sockets.EPOLLET | sockets.EPOLLRDHUP);
+    return true;
+  }
+
+  // Returns true once requestData went out as stream 1; false leaves it to
+  // HTTP/1.1. head is its head as text.
+  _upgradeH2(fd, clientData, requestData, head) {
+    const settings = head.match(/^http2-settings:[ \t]*([A-Za-z0-9_=-]*)[ \t]*\r?$/im);
+    if (!settings || !/^upgrade:[^\r\n]*\bh2c\b/im.test(head)) return false;
+    let parsedRequest;
+    try {
+      parsedRequest = sockets.parse_http_request(requestData, fd);
+    } catch (e) {
+      return false;
+    }
+    if (!this._openH2(fd, clientData, settings[1])) return false;
+    parsedRequest.stream = 1;
+    this._dispatchStream(fd, clientData, parsedRequest);
+    return true;
+  }
+
+  _readH2(fd, clientData) {
+    let r;
+    try {
+      r = sockets.h2_read(fd, this.readBudget);
+    } catch (e) {
+      this._closeClient(fd);
+      return;
+    }
+    clientData.lastActivity = Date.now();
+    for (const request of r.requests) {
+      this._dispatchStream(fd, clientData, request);
+      if (this.clients.get(fd) !== clientData) return;
+    }
+    if (r.close) {
+      this._closeClient(fd);
+    } else if (r.more) {
+      this._schedule(fd, clientData);
+    }
+  }
+
+  // One request on an HTTP/2 connection. Streams do not wait for each other:
+  // an async handler holds back only its own response. Rate limits and the
+  // response cache work on HTTP/1.x bytes and do not apply here.
+  _dispatchStream(fd, clientData, parsedRequest) {
+    const req = new Request(parsedRequest, clientData.info);
+    const res = new Response(fd);
+    res.req = req;
+    res.app = this;
+    res.stream = parsedRequest.stream;
+    res.headOnly = req.method === 'HEAD';
+    const startUs = sockets.now_us();
+
+    const shed = this.overloadOptions !== null ? sockets.overload_check(fd) : 0;
+    if (shed < 0) {
+      this._closeClient(fd);
+      return;
+    }
+    if (shed > 0) {
+      res.status(503).set('Retry-After', this.overloadOptions.retryAfter || 1).send('Service Unavailable');
+      this._respondStream(fd, clientData, res, startUs);
+      return;
+    }
+
+    let result;
+    try {
+      if (req.path === this.metricsPath && (req.method === 'GET' || req.method === 'HEAD')) {
+        res.set('Content-Type', 'text/plain; version=0.0.4');
+        res.send(sockets.metrics_text());
+      } else {
+        result = this._handleRequest(req, res);
+      }
+    } catch (e) {
+      console.error('Error processing request on fd=' + fd + ':', e.message || e);
+      res.sent = false;
+      res.status(500).send('Internal Server Error');
+    }
+
+    if (!res.sent && result && typeof result.then === 'function') {
+      result.then(
+        () => this._respondStream(fd, clientData, res, startUs),
+        (e) => {
+          console.error('Error processing request on fd=' + fd + ':', (e && e.message) || e);
+          res.sent = false;
+          res.status(500).send('Internal Server Error');
+          this._respondStream(fd, clientData, res, startUs);
+        }
+      );
+      return;
+    }
+    this._respondStream(fd, clientData, res, startUs);
+  }
+
+  _respondStream(fd, clientData, res, startUs) {
+    // The client may have gone away while the handler was busy
+    if (this.clients.get(fd) !== clientData) return;
+    if (!res.sent) res.status(500).send('Internal Server Error');
+
+    const readyUs = sockets.now_us();
+    const fields = [];
+    for (const [key, value] of Object.entries(res.headers)) {
+      if (Array.isArray(value)) {
+        for (const v of value) fields.push(key, String(v));
+      } else {
+        fields.push(key, String(value));
+      }
+    }
+    let queued;
+    try {
+      queued = sockets.h2_respond(fd, res.stream, res.statusCode, fields, res._body);
+    } catch (e) {
+      // A field the handler set cannot be sent; the client still gets an answer
+      console.error('Error sending response on fd=' + fd + ':', e.message || e);
+      res.statusCode = 500;
+      queued = sockets.h2_respond(fd, res.stream, 500, [], 'Internal Server Error');
+    }
+    if (queued < 0) {
+      this._closeClient(fd);
+      return;
+    }
+
+    sockets.metrics_request(res.statusCode, startUs, readyUs);
+    if (tracing) sockets.trace_request(fd, res.statusCode, startUs, res.routedUs || startUs, readyUs);
+    if (this.accessLogPath !== null) {
+      sockets.log_access(clientData.info.address || '-', res.req.method, res.req.url, res.statusCode,
+        res._body.length, startUs);
+    }
+    clientData.requestCount++;
+    clientData.lastActivity = Date.now();
+  }
+
+  _flushStream(fd, clientData) {
+    const queued = sockets.ws_flush(fd);
+    if (queued < 0) {
+      this._closeClient(fd);
+      return;
+    }
+    const ws = clientData.ws;
+    if (!ws) return;
+    const drained = ws.bufferedAmount > 0 && queued === 0;
+    ws.bufferedAmount = queued;
+    if (drained && ws.ondrain) ws.ondrain();
+  }
+
+  // From here on the connection carries WebSocket frames for _readWebSocket,
+  // or an event stream written by the native module
+  _adoptStream(fd, clientData, res, startUs) {
+    if (this.clients.get(fd) !== clientData) return; // the handler's first write failed
+    if (res.upgrade instanceof WebSocket) {
+      clientData.ws = res.upgrade;
+    } else {
+      clientData.sse = res.upgrade;
+    }
+    // Nothing may follow the request before its response reached the client
+    this.buffered -= clientData.buffer.length;
+    clientData.buffer = NO_BYTES;
+    clientData.lastActivity = Date.now();
+    sockets.metrics_request(res.statusCode, startUs, sockets.now_us());
+    if (this.accessLogPath !== null) {
+      sockets.log_access(clientData.info.address || '-', res.req.method, res.req.url, res.statusCode, 0, startUs);
+    }
+    // EPOLLOUT edges flush what a slow client's socket did not take
+    sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_MOD, fd,
+      sockets.EPOLLIN | sockets.EPOLLOUT | sockets.EPOLLET | sockets.EPOLLRDHUP);
+  }
+
   _processBuffer(fd, clientData) {
     while (clientData.buffer.length > 0) {
-      let headerEnd = clientData.buffer.indexOf('\r\n\r\n');
+      // Pipelined requests wait until the async response ahead of them is out
+      if (clientData.pending) return;
+
+      if (clientData.budget <= 0) {
+        this._schedule(fd, clientData);
+        return;
+      }
+
+      let headerEnd = indexOfBytes(clientData.buffer, '\r\n\r\n');
+      let headerDelimiterLength = 4;
       if (headerEnd === -1) {
-        headerEnd = clientData.buffer.indexOf('\n\n');
+        headerEnd = indexOfBytes(clientData.buffer, '\n\n');
+        headerDelimiterLength = 2;
         if (headerEnd === -1) {
           return; 
         }
       }
 
-      const headersPart = clientData.buffer.substring(0, headerEnd);
+      const headersPart = sockets.buffer_string(clientData.buffer, 0, headerEnd);
       
       let contentLength = 0;
       const contentLengthMatch = headersPart.match(/content-length:\s*(\d+)/i);
@@ -499,127 +1439,510 @@ class Express extends Router {
         contentLength = parseInt(contentLengthMatch[1], 10);
       }
       
-      const headerDelimiterLength = clientData.buffer.includes('\r\n\r\n') ? 4 : 2;
       const totalLength = headerEnd + headerDelimiterLength + contentLength;
-      
-      if (clientData.buffer.length < totalLength) {
-        return; 
+
+      // A proxied request goes as it is, with whatever of its body is here;
+      // the native side reads the rest and hands back what follows
+      if (this.proxyRoutes.length > 0) {
+        const eol = headersPart.indexOf('\r\n');
+        const line = eol < 0 ? headersPart : headersPart.substring(0, eol);
+        if (this._proxyPool(line) >= 0) {
+          const data = clientData.buffer;
+          this.buffered -= data.length;
+          clientData.buffer = NO_BYTES;
+          clientData.budget--;
+          this._forward(fd, clientData, line, data);
+          return;
+        }
+      }
+
+      // The head decides what happens to the body: a 413, reading it
+      // natively, or gathering it in the buffer
+      const chunked = /^transfer-encoding:[^\r\n]*chunked/im.test(headersPart);
+      if (chunked || contentLength > 0) {
+        if (this._checkBody(fd, clientData, headersPart, headerEnd + headerDelimiterLength, contentLength, chunked)) {
+          return;
+        }
+        if (clientData.buffer.length < totalLength) {
+          return;
+        }
       }
 
-      const requestData = clientData.buffer.substring(0, totalLength);
-      clientData.buffer = clientData.buffer.substring(totalLength);
+      const requestData = clientData.buffer.subarray(0, totalLength);
+      clientData.buffer = clientData.buffer.subarray(totalLength);
+      this.buffered -= totalLength;
+      clientData.budget--;
+      clientData.expected = false;
       
       clientData.lastActivity = Date.now();
 
-      try {
-        const parsedRequest = sockets.parse_http_request(requestData);
-        
-        const req = new Request(parsedRequest, clientData.info);
-        const res = new Response(fd);
-        
-        const httpVersion = parsedRequest.httpVersion || 'HTTP/1.1';
-        const connectionHeader = parsedRequest.headers?.connection || '';
-        
-        // HTTP/1.1: keep-alive by default unless "close"
-        // HTTP/1.0: close by default unless "keep-alive"
-        let keepAlive = false;
-        if (httpVersion === 'HTTP/1.1') {
-          keepAlive = connectionHeader.toLowerCase() !== 'close';
-        } else {
-          keepAlive = connectionHeader.toLowerCase() === 'keep-alive';
+      // Upgrade: h2c makes this request stream 1 of an HTTP/2 connection
+      if (this.http2Options !== null && clientData.buffer.length === 0 &&
+          this._upgradeH2(fd, clientData, requestData, headersPart)) {
+        return;
+      }
+
+      if (!this._dispatch(fd, clientData, requestData, null, null)) {
+        return;
+      }
+    }
+  }
+
+  // Runs the request in requestData. A body read by sockets.body_read() comes
+  // as gathered (its last result) or, for a streamed one, as the record the
+  // reads feed. Returns false when the connection is not free for the next
+  // request: closed, or waiting for an async handler.
+  _dispatch(fd, clientData, requestData, gathered, streamed) {
+    // Shed before spending anything on a request that waited too long
+    if (this.overloadOptions !== null && sockets.overload_check(fd) < 0) {
+      this._closeClient(fd);
+      return false;
+    }
+
+    // Rate limits and cached responses are answered by the native module, before any parsing
+    if (this.rateLimited) {
+      const limited = sockets.limit_request(fd, requestData, clientData.info.address || '');
+      if (limited < 0) {
+        this._closeClient(fd);
+        return false;
+      }
+      if (limited > 0) {
+        if (++clientData.requestCount >= 1000) {
+          this._closeClient(fd);
+          return false;
         }
-        
-        if (keepAlive) {
-          res.headers.Connection = 'keep-alive';
-          res.headers['Keep-Alive'] = 'timeout=5, max=1000';
+        return true;
+      }
+    }
+    if (this.cacheActive) {
+      const served = sockets.cache_serve(fd, requestData,
+        this.accessLogPath !== null ? clientData.info.address || '-' : undefined);
+      if (served < 0) {
+        this._closeClient(fd);
+        return false;
+      }
+      if (served > 0) {
+        if (++clientData.requestCount >= 1000) {
+          this._closeClient(fd);
+          return false;
+        }
+        return true;
+      }
+    }
+
+    try {
+      const parsedRequest = sockets.parse_http_request(requestData, fd);
+      
+      const req = new Request(parsedRequest, clientData.info);
+      const res = new Response(fd);
+      res.req = req;
+      res.app = this;
+      res.rawRequest = requestData;
+      res.headOnly = req.method === 'HEAD';
+
+      if (gathered !== null && gathered.file !== undefined) {
+        req._spilled(fd, gathered.file);
+      } else if (gathered !== null && gathered.fields !== undefined) {
+        req.body = gathered.fields;
+        req.files = gathered.files;
+        req._native = gathered.files.length > 0;
+      } else if (gathered !== null) {
+        req.body = gathered.body;
+      } else if (streamed !== null) {
+        req._stream = new BodyStream(() => this._resumeBody(fd, clientData));
+        streamed.req = req;
+        streamed.res = res;
+      }
+      
+      const httpVersion = parsedRequest.httpVersion || 'HTTP/1.1';
+      const connectionHeader = parsedRequest.headers?.connection || '';
+      
+      // HTTP/1.1: keep-alive by default unless "close"
+      // HTTP/1.0: close by default unless "keep-alive"
+      let keepAlive = false;
+      if (httpVersion === 'HTTP/1.1') {
+        keepAlive = connectionHeader.toLowerCase() !== 'close';
+      } else {
+        keepAlive = connectionHeader.toLowerCase() === 'keep-alive';
+      }
+      
+      if (keepAlive) {
+        res.headers.Connection = 'keep-alive';
+        res.headers['Keep-Alive'] = 'timeout=5, max=1000';
+      } else {
+        res.headers.Connection = 'close';
+      }
+      
+      clientData.keepAlive = keepAlive;
+      clientData.httpVersion = httpVersion;
+
+      const startUs = sockets.now_us();
+      let result;
+      if (req.path === this.metricsPath && (req.method === 'GET' || req.method === 'HEAD')) {
+        res.set('Content-Type', 'text/plain; version=0.0.4');
+        res.send(sockets.metrics_text());
+      } else {
+        result = this._handleRequest(req, res);
+      }
+      // A streamed body's handler may answer from its 'end' listener
+      if (streamed !== null && !res.sent && !(result && typeof result.then === 'function')) {
+        result = req._stream.finished();
+      }
+
+      // Async handler: hold the connection until its promise settles
+      if (!res.sent && result && typeof result.then === 'function') {
+        clientData.pending = true;
+        result.then(
+          () => this._finishAsync(fd, clientData, res, startUs),
+          (e) => this._failAsync(fd, clientData, e)
+        );
+        return false;
+      }
+
+      return this._writeResponse(fd, clientData, res, startUs);
+    } catch (e) {
+      console.error('Error processing request on fd=' + fd + ':', e.message || e);
+      this._sendInternalError(fd);
+      return false;
+    }
+  }
+
+  // Longest body() rule for path, or the app's defaults
+  _bodyRule(path) {
+    for (const rule of this.bodyRules) {
+      if (path.startsWith(rule.prefix)) return rule;
+    }
+    return { limit: this.maxBody, spill: this.bodySpill, stream: false };
+  }
+
+  // Header-time handling of a request body: over its route's limit it gets a
+  // 413 before any of it is read, Expect: 100-continue is answered while it
+  // has not arrived, and bodies that are chunked, stream, multipart or
+  // outgrow the spill size leave the buffer for sockets.body_open(). Returns
+  // true when the request is no longer the buffer's to process.
+  _checkBody(fd, clientData, head, bodyStart, contentLength, chunked) {
+    const eol = head.search(/\r?\n/);
+    const line = eol < 0 ? head : head.substring(0, eol);
+    const target = line.split(' ')[1] || '';
+    const query = target.indexOf('?');
+    const rule = this._bodyRule(query < 0 ? target : target.substring(0, query));
+    const type = (head.match(/^content-type:[ \t]*([^\r\n]*)/im) || [])[1] || '';
+
+    // Both framings at once is how requests get smuggled past proxies
+    if (chunked && contentLength > 0) {
+      this._refuseBody(fd, 400);
+      return true;
+    }
+    if (contentLength > rule.limit) {
+      this._refuseBody(fd, 413);
+      return true;
+    }
+    const arrived = clientData.buffer.length - bodyStart;
+    if (!clientData.expected && (chunked ? arrived === 0 : arrived < contentLength) &&
+        line.endsWith('HTTP/1.1') && /^expect:[ \t]*100-continue/im.test(head)) {
+      clientData.expected = true;
+      sockets.send(fd, 'HTTP/1.1 100 Continue\r\n\r\n', 0);
+    }
+    if (!chunked && !rule.stream && contentLength <= rule.spill && !/^multipart\/form-data/i.test(type)) {
+      return false;
+    }
+
+    const data = clientData.buffer.subarray(bodyStart);
+    const requestData = clientData.buffer.subarray(0, bodyStart);
+    this.buffered -= clientData.buffer.length;
+    clientData.buffer = NO_BYTES;
+    clientData.budget--;
+    clientData.expected = false;
+    const body = { head: requestData, req: null, res: null };
+    clientData.body = body;
+    let r;
+    try {
+      r = sockets.body_open(fd, data, {
+        length: contentLength,
+        chunked,
+        limit: rule.limit,
+        spill: rule.spill,
+        stream: rule.stream,
+        maxFiles: rule.maxFiles,
+        type
+      });
+    } catch (e) {
+      this._closeClient(fd);
+      return true;
+    }
+
+    // A streamed body's handler runs now and gets the bytes as they come
+    if (rule.stream) {
+      this._dispatch(fd, clientData, requestData, null, body);
+      if (this.clients.get(fd) !== clientData || clientData.body !== body) return true;
+    }
+    if (this._bodyProgress(fd, clientData, r)) {
+      this._readBody(fd, clientData);
+    }
+    return true;
+  }
+
+  // Reads more of the body that _checkBody() handed to the native side. A
+  // streamed body whose handler has fallen behind waits until it catches up.
+  _readBody(fd, clientData) {
+    const body = clientData.body;
+    if (body.req !== null && body.req._stream.queued > 4 * this.readBudget) {
+      body.req._stream.paused = true;
+      return;
+    }
+    let r;
+    try {
+      r = sockets.body_read(fd, this.readBudget);
+    } catch (e) {
+      this._closeClient(fd);
+      return;
+    }
+    clientData.lastActivity = Date.now();
+    if (this._bodyProgress(fd, clientData, r) && r.more) {
+      this._schedule(fd, clientData);
+    }
+  }
+
+  _resumeBody(fd, clientData) {
+    if (this.clients.get(fd) === clientData && clientData.body !== null) {
+      this._schedule(fd, clientData);
+    }
+  }
+
+  // Acts on a body_open()/body_read() result; true while the body goes on
+  _bodyProgress(fd, clientData, r) {
+    const body = clientData.body;
+    if (r.data && body.req !== null) body.req._stream.push(r.data);
+    if (r.parts && body.req !== null) {
+      for (const part of r.parts) {
+        if (part.fd !== undefined) body.req._native = true;
+        body.req._stream.push(part);
+      }
+    }
+    if (r.status || r.closed) {
+      clientData.body = null;
+      if (body.req !== null) body.req._stream.end(r.status || 0);
+      if (r.status && (body.res === null || !body.res.sent)) {
+        this._refuseBody(fd, r.status);
+      } else if (this.clients.get(fd) === clientData) {
+        this._closeClient(fd);
+      }
+      return false;
+    }
+    if (!r.done) return true;
+
+    clientData.body = null;
+    if (r.rest) {
+      clientData.buffer = joinBytes(new Uint8Array(r.rest), clientData.buffer);
+      this.buffered += r.rest.byteLength;
+    }
+    // Spilled bodies and uploaded files keep their native state until the
+    // response is out, unless it already is
+    const kept = r.file !== undefined || (r.files !== undefined && r.files.length > 0) ||
+      (body.req !== null && body.req._native);
+    if (!kept || (body.res !== null && body.res.sent)) sockets.body_close(fd);
+    if (body.req !== null) {
+      body.req._stream.end(null);
+      if (this.clients.get(fd) === clientData && !clientData.pending) this._schedule(fd, clientData);
+      return false;
+    }
+    if (this._dispatch(fd, clientData, body.head, r, null)) {
+      this._schedule(fd, clientData);
+    }
+    return false;
+  }
+
+  // Answers a request whose body will not be read, and closes the connection
+  _refuseBody(fd, status) {
+    const text = status === 413 ? 'Payload Too Large' : status === 400 ? 'Bad Request' : 'Internal Server Error';
+    try {
+      sockets.send(fd, `HTTP/1.1 ${status} ${text}\r\n` +
+        `Content-Type: text/plain\r\n` +
+        `Connection: close\r\n` +
+        `Content-Length: ${text.length}\r\n\r\n` +
+        text, 0);
+      sockets.metrics_request(status);
+    } catch (e) {
+      // Ignore send errors; the connection goes anyway
+    }
+    this._closeClient(fd);
+  }
+
+  // Pool for a request line whose target is under a proxied prefix, or -1
+  _proxyPool(line) {
+    const start = line.indexOf(' ') + 1;
+    const end = line.indexOf(' ', start);
+    if (start === 0 || end < 0) return -1;
+    const target = line.substring(start, end);
+    for (const route of this.proxyRoutes) {
+      if (!target.startsWith(route.prefix)) continue;
+      const next = target[route.prefix.length];
+      if (next === undefined || next === '/' || next === '?' || route.prefix.endsWith('/')) return route.pool;
+    }
+    return -1;
+  }
+
+  // Hands the connection to sockets.http_forward() until the response is out.
+  // The native side owns the socket meanwhile, so it leaves this epoll set.
+  // Rate limits and the response cache do not apply to proxied requests.
+  _forward(fd, clientData, line, data) {
+    if (this.overloadOptions !== null && sockets.overload_check(fd) < 0) {
+      this._closeClient(fd);
+      return;
+    }
+    clientData.pending = true;
+    clientData.forwarding = true;
+    sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_DEL, fd, 0);
+    const startUs = sockets.now_us();
+    const last = clientData.requestCount + 1 >= 1000;
+    sockets.http_forward(fd, this._proxyPool(line), data, clientData.info.address || '', last).then((r) => {
+      if (this.clients.get(fd) !== clientData) return;
+      clientData.forwarding = false;
+      clientData.pending = false;
+      clientData.lastActivity = Date.now();
+      clientData.requestCount++;
+      if (r.status > 0) sockets.metrics_request(r.status, startUs, sockets.now_us());
+      if (this.accessLogPath !== null && r.status > 0) {
+        const [method, url] = line.split(' ');
+        sockets.log_access(clientData.info.address || '-', method, url, r.status, r.received, startUs);
+      }
+      if (r.rest) {
+        clientData.buffer = new Uint8Array(r.rest);
+        this.buffered += r.rest.byteLength;
+      }
+      sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_ADD, fd,
+        sockets.EPOLLIN | sockets.EPOLLET | sockets.EPOLLRDHUP | (clientData.tls ? sockets.EPOLLOUT : 0));
+      if (!r.keepAlive) {
+        if (clientData.tls && sockets.tls_flush(fd) > 0) {
+          clientData.closing = true;
         } else {
-          res.headers.Connection = 'close';
+          this._closeClient(fd);
         }
+        return;
+      }
+      this._schedule(fd, clientData);
+    });
+  }
+
+  // Returns false once the connection has been closed. startUs is when the
+  // handler was called (sockets.now_us()), for the latency metrics.
+  _writeResponse(fd, clientData, res, startUs) {
+    if (res.upgrade !== null) {
+      this._adoptStream(fd, clientData, res, startUs);
+      return false;
+    }
+    if (!res.sent || !res._buffer) {
+      this._closeClient(fd);
+      return false;
+    }
+
+    const readyUs = sockets.now_us();
+    let sent = 0;
+    const data = res._buffer;
+    let attempts = 0;
+    const maxAttempts = 5;
+    
+    while (sent < data.length && attempts < maxAttempts) {
+      try {
+        const chunkToSend = data.slice(sent);
+        const n = sockets.send(fd, chunkToSend, 0);
         
-        clientData.keepAlive = keepAlive;
-        clientData.httpVersion = httpVersion;
-        
-        this._handleRequest(req, res);
-        
-        if (res.sent && res._buffer) {
-          let sent = 0;
-          const data = res._buffer;
-          let attempts = 0;
-          const maxAttempts = 5;
-          
-          while (sent < data.length && attempts < maxAttempts) {
-            try {
-              const chunkToSend = data.slice(sent);
-              const n = sockets.send(fd, chunkToSend, 0);
-              
-              if (n > 0) {
-                sent += n;
-                attempts = 0; // Reset attempts on successful send
-                clientData.lastActivity = Date.now();
-              } else if (n === 0) {
-                // EAGAIN/EWOULDBLOCK - wait and retry
-                attempts++;
-                
-                const start = Date.now();
-                while (Date.now() - start < 2) {} // 2ms
-                
-                if (attempts >= maxAttempts) {
-                  console.log(`Failed to send complete response to fd=${fd} after ${maxAttempts} attempts`);
-                  this._closeClient(fd);
-                  return;
-                }
-              } else {
-                throw new Error('Send failed');
-              }
-            } catch (e) {
-              console.log(`Error sending to fd=${fd}:`, e.message);
-              this._closeClient(fd);
-              return;
-            }
-          }
-          
-          if (sent < data.length) {
-            console.log(`Partial send to fd=${fd}: sent ${sent}/${data.length} bytes`);
-            this._closeClient(fd);
-            return;
-          }
-          
-          clientData.requestCount++;
+        if (n > 0) {
+          sent += n;
+          attempts = 0; // Reset attempts on successful send
           clientData.lastActivity = Date.now();
+        } else if (n === 0) {
+          // EAGAIN/EWOULDBLOCK - wait and retry
+          attempts++;
           
-          const shouldClose = 
-            !keepAlive || 
-            connectionHeader.toLowerCase() === 'close' ||
-            clientData.requestCount >= 1000;
+          const start = Date.now();
+          while (Date.now() - start < 2) {} // 2ms
           
-          if (shouldClose) {
+          if (attempts >= maxAttempts) {
+            console.log(`Failed to send complete response to fd=${fd} after ${maxAttempts} attempts`);
             this._closeClient(fd);
-            return; 
+            return false;
           }
-          
         } else {
-          this._closeClient(fd);
-          return;
+          throw new Error('Send failed');
         }
       } catch (e) {
-        console.error('Error processing request on fd=' + fd + ':', e.message || e);
-        
-        try {
-          const errorResponse = `HTTP/1.1 500 Internal Server Error\r\n` +
-            `Content-Type: text/plain\r\n` +
-            `Connection: close\r\n` +
-            `Content-Length: 21\r\n\r\n` +
-            `Internal Server Error`;
-          
-          sockets.send(fd, errorResponse, 0);
-        } catch (sendError) {
-          // Ignore send errors during error handling
-        }
-        
+        console.log(`Error sending to fd=${fd}:`, e.message);
         this._closeClient(fd);
-        return;
+        return false;
       }
     }
+    
+    if (sent < data.length) {
+      console.log(`Partial send to fd=${fd}: sent ${sent}/${data.length} bytes`);
+      this._closeClient(fd);
+      return false;
+    }
+
+    sockets.metrics_request(res.statusCode, startUs, readyUs);
+    if (tracing) sockets.trace_request(fd, res.statusCode, startUs, res.routedUs || startUs, readyUs);
+    if (this.accessLogPath !== null) {
+      sockets.log_access(clientData.info.address || '-', res.req.method, res.req.url, res.statusCode, sent, startUs);
+    }
+    if (res._cache !== null && clientData.keepAlive && res.statusCode < 500 && !res.headers['Set-Cookie']) {
+      const c = res._cache;
+      if (sockets.cache_store(res.rawRequest, data, c.ttl, c.stale, c.vary)) this.cacheActive = true;
+    }
+    // A spilled body's file and uploaded files last until the response is out
+    if (res.req._native && clientData.body === null) sockets.body_close(fd);
+    clientData.requestCount++;
+    clientData.lastActivity = Date.now();
+    
+    const shouldClose = 
+      !clientData.keepAlive || 
+      clientData.requestCount >= 1000;
+    
+    if (shouldClose) {
+      // Closing now would cut off what the TLS connection still holds
+      if (clientData.tls && sockets.tls_flush(fd) > 0) {
+        clientData.closing = true;
+      } else {
+        this._closeClient(fd);
+      }
+      return false;
+    }
+
+    return true;
+  }
+
+  _finishAsync(fd, clientData, res, startUs) {
+    // The client may have timed out or hung up while the handler was busy
+    if (this.clients.get(fd) !== clientData) return;
+
+    clientData.pending = false;
+    if (this._writeResponse(fd, clientData, res, startUs)) {
+      // Reading stopped while the handler ran
+      this._schedule(fd, clientData);
+    }
+  }
+
+  _failAsync(fd, clientData, e) {
+    if (this.clients.get(fd) !== clientData) return;
+
+    console.error('Error processing request on fd=' + fd + ':', (e && e.message) || e);
+    this._sendInternalError(fd);
+  }
+
+  _sendInternalError(fd) {
+    try {
+      const errorResponse = `HTTP/1.1 500 Internal Server Error\r\n` +
+        `Content-Type: text/plain\r\n` +
+        `Connection: close\r\n` +
+        `Content-Length: 21\r\n\r\n` +
+        `Internal Server Error`;
+      
+      sockets.send(fd, errorResponse, 0);
+      sockets.metrics_request(500);
+    } catch (sendError) {
+      // Ignore send errors during error handling
+    }
+    
+    this._closeClient(fd);
   }
 
   _checkTimeouts() {
@@ -630,15 +1953,43 @@ class Express extends Router {
     }
     
     this.lastTimeoutCheck = now;
+
+    // Retransmit or expire DNS queries that got no answer
+    sockets.dns_poll();
     
+    // Event streams are kept alive natively, oldest first, and never time
+    // out; those the heartbeat could not be written to are dropped
+    if (this.sseHeartbeat > 0) {
+      for (const fd of sockets.sse_heartbeat(this.sseHeartbeat).failed) this._closeClient(fd);
+    }
+
     const fdsToClose = [];
     
+    // Forwarded requests time out natively, by their pool's timeout
+    if (this.proxyRoutes.length > 0) sockets.proxy_poll();
+
     for (const [fd, clientData] of this.clients.entries()) {
+      if (clientData.sse || clientData.forwarding) continue;
       const idleTime = now - clientData.lastActivity;
+
+      if (clientData.ws) {
+        const ws = clientData.ws;
+        if (ws.readyState === WebSocket.CLOSING && idleTime > this.keepAliveTimeout) {
+          fdsToClose.push(fd);
+        } else if (this.wsPingInterval > 0 && idleTime > 2 * this.wsPingInterval) {
+          fdsToClose.push(fd);
+        } else if (this.wsPingInterval > 0 && idleTime > this.wsPingInterval && !ws._pinged) {
+          // Any frame, the pong included, counts as activity
+          ws._pinged = true;
+          ws.ping();
+        }
+        continue;
+      }
       
       if (clientData.keepAlive) {
         // Keep-alive connections: 5s timeout
         if (idleTime > this.keepAliveTimeout) {
+          if (clientData.h2) sockets.h2_close(fd); // GOAWAY, so the client knows nothing was lost
           fdsToClose.push(fd);
         }
       } else {
@@ -659,7 +2010,10 @@ class Express extends Router {
     }
   }
 
-  _closeClient(fd) {
+  // code and reason are reported to a WebSocket's onclose
+  _closeClient(fd, code = 1006, reason = '') {
+    const clientData = this.clients.get(fd);
+    if (clientData) this.buffered -= clientData.buffer.length;
     try {
       try {
         sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_DEL, fd, 0);
@@ -674,12 +2028,38 @@ class Express extends Router {
     } catch (e) {
       // Ignore closing errors
     }
+
+    if (clientData && clientData.ws) {
+      try {
+        clientData.ws._closed(code, reason);
+      } catch (e) {
+        console.error('Error in WebSocket close handler on fd=' + fd + ':', e.message || e);
+      }
+    } else if (clientData && clientData.sse) {
+      try {
+        clientData.sse._closed();
+      } catch (e) {
+        console.error('Error in event stream close handler on fd=' + fd + ':', e.message || e);
+      }
+    } else if (clientData && clientData.body !== null && clientData.body.req !== null) {
+      clientData.body.req._stream.end(0);
+    }
   }
 
   close() {
     this.running = false;
+
+    if (this.overloadOptions !== null) {
+      sockets.overload_disable();
+    }
+
+    if (this.accessLogPath !== null) {
+      sockets.log_close();
+      this.accessLogPath = null;
+    }
     
-    for (const [fd] of this.clients) {
+    for (const [fd, clientData] of this.clients) {
+      if (clientData.h2) sockets.h2_close(fd);
       this._closeClient(fd);
     }
     
@@ -701,5 +2081,5 @@ function express() {
   return new Express();
 }
 
-export { express, Express, Router };
+export { express, Express, Router, WebSocket, EventStream };
 export default express;
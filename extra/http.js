@@ -0,0 +1,612 @@
+import sockets from '../dist/network_sockets.so';
+
+// Requests that may be replayed on a fresh connection when a reused
+// keep-alive socket turns out to be dead, and that may share a pipeline.
+const IDEMPOTENT = new Set(['GET', 'HEAD', 'OPTIONS', 'PUT', 'DELETE', 'TRACE']);
+const PIPELINABLE = new Set(['GET', 'HEAD']);
+
+const BINARY = { binary: true };
+const NO_BYTES = new Uint8Array(0);
+
+function clientError(code, message) {
+  const err = new Error(message);
+  err.code = code;
+  return err;
+}
+
+// The byte arrays in parts, one after the other
+function concatBytes(parts) {
+  parts = parts.filter(part => part.length > 0);
+  if (parts.length <= 1) return parts[0] || NO_BYTES;
+  const out = new Uint8Array(parts.reduce((n, part) => n + part.length, 0));
+  let offset = 0;
+  for (const part of parts) {
+    out.set(part, offset);
+    offset += part.length;
+  }
+  return out;
+}
+
+class ClientResponse {
+  constructor(parsed) {
+    this.statusCode = parsed.statusCode;
+    this.statusText = parsed.statusText;
+    this.httpVersion = parsed.httpVersion;
+    this.headers = parsed.headers;
+    this.body = parsed.body;
+  }
+
+  get ok() {
+    return this.statusCode >= 200 && this.statusCode < 300;
+  }
+
+  get(header) {
+    return this.headers[header.toLowerCase()];
+  }
+
+  json() {
+    return JSON.parse(this.body);
+  }
+}
+
+// One epoll set for every client socket (and the resolver), so a server
+// loop only has to watch clientLoop.fd and call poll() when it fires.
+class ClientLoop {
+  constructor() {
+    this._fd = null;
+    this.conns = new Map();
+    this.agents = new Set();
+    this.dnsFd = null;
+    this.lastTick = 0;
+    this.tickInterval = 50;
+  }
+
+  get fd() {
+    if (this._fd === null) {
+      this._fd = sockets.epoll_create1(0);
+    }
+    return this._fd;
+  }
+
+  watchDns() {
+    if (this.dnsFd !== null) return;
+    this.dnsFd = sockets.dns_fd();
+    sockets.epoll_ctl(this.fd, sockets.EPOLL_CTL_ADD, this.dnsFd, sockets.EPOLLIN);
+  }
+
+  // Requests queued or in flight across all agents
+  get pending() {
+    let n = 0;
+    for (const agent of this.agents) n += agent.pending;
+    return n;
+  }
+
+  poll(timeout = 0) {
+    const events = sockets.epoll_wait(this.fd, 256, timeout);
+
+    for (const event of events) {
+      if (event.fd === this.dnsFd) {
+        sockets.dns_poll();
+        continue;
+      }
+      const conn = this.conns.get(event.fd);
+      if (conn) {
+        conn.agent._handleEvent(conn, event.events);
+      }
+    }
+
+    this.tick();
+    sockets.run_pending_jobs();
+    return events.length;
+  }
+
+  // Expire request timeouts and idle sockets; cheap enough to call every loop turn
+  tick(now = Date.now()) {
+    if (now - this.lastTick < this.tickInterval) return;
+    this.lastTick = now;
+    if (this.dnsFd !== null) sockets.dns_poll();
+    for (const agent of this.agents) {
+      agent._checkTimeouts(now);
+    }
+  }
+}
+
+const clientLoop = new ClientLoop();
+
+class Agent {
+  constructor(options = {}) {
+    this.maxSockets = options.maxSockets || 8;          // per host
+    this.keepAliveTimeout = options.keepAliveTimeout ?? 5000; // idle socket lifetime
+    this.pipelining = options.pipelining || 1;          // requests in flight per socket
+    this.timeout = options.timeout || 30000;            // per request
+    this.maxRequestsPerSocket = options.maxRequestsPerSocket || 0;
+    this.maxResponseSize = options.maxResponseSize || 64 << 20; // body bytes
+    this.pools = new Map();
+    this.stats = { connects: 0, reused: 0, retries: 0, idleClosed: 0 };
+    clientLoop.agents.add(this);
+  }
+
+  get pending() {
+    let n = 0;
+    for (const pool of this.pools.values()) {
+      n += pool.queue.length;
+      for (const conn of pool.conns) n += conn.inflight.length;
+    }
+    return n;
+  }
+
+  request(input, options = {}) {
+    return new Promise((resolve, reject) => {
+      let opts;
+      try {
+        opts = normalizeOptions(input, options);
+      } catch (e) {
+        reject(e);
+        return;
+      }
+
+      const pool = this._pool(opts);
+      const req = {
+        method: opts.method,
+        payload: serializeRequest(opts),
+        noBody: opts.method === 'HEAD',
+        deadline: Date.now() + (opts.timeout || this.timeout),
+        retried: false,
+        resolve,
+        reject
+      };
+      pool.queue.push(req);
+      this._dispatch(pool);
+    });
+  }
+
+  get(url, options = {}) {
+    return this.request(url, Object.assign({}, options, { method: 'GET' }));
+  }
+
+  post(url, body, options = {}) {
+    return this.request(url, Object.assign({}, options, { method: 'POST', body }));
+  }
+
+  // Close idle sockets; in-flight requests are left alone
+  closeIdle() {
+    for (const pool of this.pools.values()) {
+      for (const conn of [...pool.conns]) {
+        if (conn.inflight.length === 0) this._close(conn);
+      }
+    }
+  }
+
+  destroy() {
+    for (const pool of this.pools.values()) {
+      for (const req of pool.queue) req.reject(clientError('ECANCELED', 'Agent destroyed'));
+      pool.queue = [];
+      for (const conn of [...pool.conns]) this._destroy(conn, clientError('ECANCELED', 'Agent destroyed'), false);
+    }
+    clientLoop.agents.delete(this);
+  }
+
+  _pool(opts) {
+    const key = opts.socketPath || `${opts.host}:${opts.port}`;
+    let pool = this.pools.get(key);
+    if (!pool) {
+      pool = { key, host: opts.host, port: opts.port, socketPath: opts.socketPath, conns: new Set(), queue: [] };
+      this.pools.set(key, pool);
+    }
+    return pool;
+  }
+
+  // Hand queued requests to sockets, opening new ones up to maxSockets
+  _dispatch(pool) {
+    while (pool.queue.length > 0) {
+      const req = pool.queue[0];
+      let conn = this._pick(pool, req);
+      if (conn === null) {
+        if (pool.conns.size >= this.maxSockets) return;
+        conn = this._connect(pool);
+        if (conn.state === 'closed') return; // failed synchronously; the queue was rejected
+      }
+      pool.queue.shift();
+      if (conn.responses > 0 && conn.inflight.length === 0) this.stats.reused++;
+      conn.inflight.push(req);
+      conn.sent++;
+      conn.out += req.payload;
+      if (conn.state === 'open') this._flush(conn);
+    }
+  }
+
+  _pick(pool, req) {
+    let best = null;
+    for (const conn of pool.conns) {
+      if (!conn.keepAlive || conn.state === 'closing') continue;
+      if (this.maxRequestsPerSocket && conn.sent >= this.maxRequestsPerSocket) continue;
+      if (conn.inflight.length === 0) {
+        // Prefer the most recently used idle socket so the others can expire
+        if (best === null || best.inflight.length > 0 || conn.lastUsed > best.lastUsed) best = conn;
+      } else if (best === null && this.pipelining > 1 && conn.state === 'open' &&
+                 conn.inflight.length < this.pipelining && PIPELINABLE.has(req.method) &&
+                 conn.inflight.every(r => PIPELINABLE.has(r.method))) {
+        best = conn;
+      }
+    }
+    return best;
+  }
+
+  _connect(pool) {
+    const conn = {
+      agent: this,
+      pool,
+      fd: -1,
+      state: 'resolving',
+      buffer: NO_BYTES,
+      chunks: [],
+      framed: 0,
+      unframed: NO_BYTES,
+      out: '',
+      outBytes: null,
+      events: 0,
+      inflight: [],
+      sent: 0,
+      responses: 0,
+      keepAlive: true,
+      lastUsed: Date.now()
+    };
+    pool.conns.add(conn);
+    this.stats.connects++;
+
+    if (pool.socketPath) {
+      this._open(conn, sockets.AF_UNIX, pool.socketPath, 0);
+      return conn;
+    }
+
+    clientLoop.watchDns();
+    sockets.resolve(pool.host).then(
+      (addrs) => {
+        if (conn.state !== 'resolving') return;
+        const addr = addrs[0];
+        this._open(conn, addr.family === 6 ? sockets.AF_INET6 : sockets.AF_INET, addr.address, pool.port);
+      },
+      (e) => {
+        if (conn.state === 'resolving') this._destroy(conn, e, false);
+      }
+    );
+    return conn;
+  }
+
+  _open(conn, family, address, port) {
+    try {
+      conn.fd = sockets.socket(family, sockets.SOCK_STREAM, 0);
+      sockets.setnonblocking(conn.fd);
+      if (family !== sockets.AF_UNIX) {
+        sockets.setsockopt(conn.fd, sockets.IPPROTO_TCP, sockets.TCP_NODELAY, 1);
+      }
+      sockets.connect(conn.fd, address, port);
+      conn.state = 'connecting';
+      conn.events = sockets.EPOLLIN | sockets.EPOLLOUT | sockets.EPOLLRDHUP;
+      sockets.epoll_ctl(clientLoop.fd, sockets.EPOLL_CTL_ADD, conn.fd, conn.events);
+      clientLoop.conns.set(conn.fd, conn);
+    } catch (e) {
+      this._destroy(conn, clientError('ECONNREFUSED', e.message), false);
+    }
+  }
+
+  _handleEvent(conn, events) {
+    if (conn.state === 'connecting') {
+      const err = sockets.getsockopt(conn.fd, sockets.SOL_SOCKET, sockets.SO_ERROR);
+      if (err !== 0) {
+        this._destroy(conn, clientError('ECONNREFUSED', `connect() failed (errno ${err})`), false);
+        return;
+      }
+      if (!(events & (sockets.EPOLLOUT | sockets.EPOLLIN))) return;
+      conn.state = 'open';
+    }
+
+    if (events & sockets.EPOLLIN) {
+      this._read(conn);
+      if (conn.state === 'closed') return;
+    }
+
+    if (events & (sockets.EPOLLERR | sockets.EPOLLHUP | sockets.EPOLLRDHUP)) {
+      // Finish a close-delimited response, then retire the socket
+      conn.state = 'closing';
+      this._parse(conn, true);
+      if (conn.state !== 'closed') {
+        this._destroy(conn, clientError('ECONNRESET', 'socket hang up'), true);
+      }
+      return;
+    }
+
+    if (conn.state === 'open') {
+      this._flush(conn);
+    }
+  }
+
+  _read(conn) {
+    const chunks = [];
+    try {
+      while (true) {
+        const chunk = sockets.recv(conn.fd, 65536, 0, BINARY);
+        if (chunk.byteLength === 0) break;
+        chunks.push(new Uint8Array(chunk));
+      }
+    } catch (e) {
+      this._destroy(conn, clientError('ECONNRESET', e.message), true);
+      return;
+    }
+    for (const chunk of chunks) {
+      conn.chunks.push(chunk);
+      try {
+        this._frame(conn, chunk);
+      } catch (e) {
+        this._destroy(conn, e.code ? e : clientError('EPROTO', e.message), false);
+        return;
+      }
+    }
+    this._parse(conn, false);
+  }
+
+  // Follows the framing of the responses in flight through each chunk as it
+  // is read, with the native http_frame(), so that the bytes read are
+  // parsed once per response rather than once per read. conn.framed counts
+  // the responses known to be complete. Throws EMSGSIZE for a body over
+  // maxResponseSize.
+  _frame(conn, chunk) {
+    let s = concatBytes([conn.unframed, chunk]);
+    conn.unframed = NO_BYTES;
+    while (s.length > 0) {
+      if (conn.framed >= conn.inflight.length) {
+        conn.unframed = s; // nothing asked for it yet
+        return;
+      }
+      let end;
+      try {
+        end = sockets.http_frame(conn.fd, s, conn.inflight[conn.framed].noBody, this.maxResponseSize);
+      } catch (e) {
+        throw e instanceof RangeError
+          ? clientError('EMSGSIZE', 'Response larger than maxResponseSize')
+          : clientError('EPROTO', e.message);
+      }
+      if (end < 0) return;
+      conn.framed++;
+      s = s.subarray(end);
+    }
+  }
+
+  // Match complete responses to the oldest in-flight requests
+  _parse(conn, eof) {
+    while (conn.inflight.length > 0 && (conn.framed > 0 || (eof && (conn.buffer.length > 0 || conn.chunks.length > 0)))) {
+      const req = conn.inflight[0];
+      if (conn.chunks.length > 0) {
+        conn.buffer = concatBytes([conn.buffer, ...conn.chunks]);
+        conn.chunks = [];
+      }
+      let parsed;
+      try {
+        parsed = sockets.parse_http_response(conn.buffer, req.noBody, eof);
+      } catch (e) {
+        this._destroy(conn, clientError('EPROTO', e.message), false);
+        return;
+      }
+      if (parsed === null) return;
+
+      conn.buffer = new Uint8Array(parsed.rest);
+      if (conn.framed > 0) conn.framed--;
+      conn.inflight.shift();
+      conn.responses++;
+      conn.lastUsed = Date.now();
+
+      const connection = (parsed.headers.connection || '').toLowerCase();
+      if (connection === 'close' || (parsed.httpVersion === 'HTTP/1.0' && connection !== 'keep-alive')) {
+        conn.keepAlive = false;
+      }
+
+      req.resolve(new ClientResponse(parsed));
+    }
+
+    if (!conn.keepAlive && conn.state !== 'closed') {
+      // Anything pipelined behind a closing response goes to another socket
+      this._destroy(conn, clientError('ECONNRESET', 'Server closed the connection'), true);
+      return;
+    }
+
+    this._dispatch(conn.pool);
+  }
+
+  _flush(conn) {
+    try {
+      while (conn.outBytes !== null || conn.out.length > 0) {
+        if (conn.outBytes !== null) {
+          const n = sockets.send(conn.fd, conn.outBytes, 0);
+          if (n < conn.outBytes.length) {
+            conn.outBytes = conn.outBytes.subarray(n);
+            break;
+          }
+          conn.outBytes = null;
+        } else {
+          const data = conn.out;
+          conn.out = '';
+          const total = sockets.byte_length(data);
+          const n = sockets.send(conn.fd, data, 0);
+          if (n < total) {
+            // Keep the unsent tail as bytes; send() counts bytes, not characters
+            const bytes = new Uint8Array(total);
+            sockets.buffer_write(bytes, 0, data);
+            conn.outBytes = bytes.subarray(n);
+            break;
+          }
+        }
+      }
+    } catch (e) {
+      this._destroy(conn, clientError('EPIPE', e.message), true);
+      return;
+    }
+
+    // Only wait for writability while output is queued
+    const events = sockets.EPOLLIN | sockets.EPOLLRDHUP |
+      (conn.outBytes !== null || conn.out.length > 0 ? sockets.EPOLLOUT : 0);
+    if (events !== conn.events) {
+      conn.events = events;
+      sockets.epoll_ctl(clientLoop.fd, sockets.EPOLL_CTL_MOD, conn.fd, events);
+    }
+  }
+
+  _checkTimeouts(now) {
+    for (const pool of this.pools.values()) {
+      if (pool.queue.length > 0) {
+        const expired = pool.queue.filter(req => req.deadline <= now);
+        if (expired.length > 0) {
+          pool.queue = pool.queue.filter(req => req.deadline > now);
+          for (const req of expired) req.reject(clientError('ETIMEDOUT', 'Request timed out'));
+        }
+      }
+
+      for (const conn of [...pool.conns]) {
+        if (conn.inflight.length === 0) {
+          if (conn.state === 'open' && now - conn.lastUsed >= this.keepAliveTimeout) {
+            this.stats.idleClosed++;
+            this._close(conn);
+          }
+          continue;
+        }
+
+        const expired = conn.inflight.filter(req => req.deadline <= now);
+        if (expired.length > 0) {
+          // Responses on this socket can no longer be matched up; drop it
+          conn.inflight = conn.inflight.filter(req => req.deadline > now);
+          for (const req of expired) req.reject(clientError('ETIMEDOUT', 'Request timed out'));
+          this._destroy(conn, conn.state === 'open'
+            ? clientError('ECONNRESET', 'Socket closed after a timeout')
+            : clientError('ETIMEDOUT', 'Connect timed out'), true);
+        }
+      }
+
+      this._dispatch(pool);
+    }
+  }
+
+  _close(conn) {
+    conn.state = 'closed';
+    conn.pool.conns.delete(conn);
+    if (conn.fd >= 0) {
+      clientLoop.conns.delete(conn.fd);
+      try {
+        sockets.epoll_ctl(clientLoop.fd, sockets.EPOLL_CTL_DEL, conn.fd, 0);
+      } catch (e) {
+        // Not registered yet
+      }
+      try {
+        sockets.close(conn.fd);
+      } catch (e) {
+        // Ignore close errors
+      }
+      conn.fd = -1;
+    }
+  }
+
+  // Close conn and settle what it still carried. With retry set, idempotent
+  // requests on a socket that had already served a response are replayed once:
+  // that is the stale keep-alive race, not a server failure.
+  _destroy(conn, err, retry) {
+    if (conn.state === 'closed') return;
+    const pool = conn.pool;
+    const neverConnected = conn.state === 'resolving' || conn.state === 'connecting';
+    this._close(conn);
+
+    const requeue = [];
+    for (const req of conn.inflight) {
+      if (retry && conn.responses > 0 && !req.retried && IDEMPOTENT.has(req.method)) {
+        req.retried = true;
+        this.stats.retries++;
+        requeue.push(req);
+      } else {
+        req.reject(err);
+      }
+    }
+    conn.inflight = [];
+    pool.queue.unshift(...requeue);
+
+    // The host is unreachable: fail everything waiting for it rather than reconnect in a loop
+    if (neverConnected) {
+      const waiting = pool.queue;
+      pool.queue = [];
+      for (const req of waiting) req.reject(err);
+      return;
+    }
+
+    this._dispatch(pool);
+  }
+}
+
+function normalizeOptions(input, options) {
+  let opts = {};
+  if (typeof input === 'string') {
+    const m = input.match(/^(https?):\/\/(\[[^\]]+\]|[^:/?#]+)(?::(\d+))?([^#]*)/i);
+    if (!m) throw clientError('EINVAL', `Invalid URL: ${input}`);
+    if (m[1].toLowerCase() === 'https') throw clientError('EPROTONOSUPPORT', 'https is not supported');
+    opts.host = m[2].replace(/^\[|\]$/g, '');
+    opts.port = m[3] ? Number(m[3]) : 80;
+    opts.path = m[4] || '/';
+    Object.assign(opts, options);
+  } else {
+    opts = Object.assign({}, input || {}, options);
+  }
+
+  opts.method = (opts.method || 'GET').toUpperCase();
+  opts.host = opts.host || opts.hostname || 'localhost';
+  opts.port = opts.port || 80;
+  opts.path = opts.path || '/';
+  opts.headers = opts.headers || {};
+  return opts;
+}
+
+function serializeRequest(opts) {
+  let body = opts.body;
+  const headers = {};
+  for (const [key, value] of Object.entries(opts.headers)) {
+    headers[key.toLowerCase()] = value;
+  }
+
+  if (body !== undefined && body !== null && typeof body !== 'string') {
+    body = JSON.stringify(body);
+    if (!headers['content-type']) headers['content-type'] = 'application/json; charset=utf-8';
+  }
+
+  if (!headers.host) {
+    const host = opts.host.includes(':') ? `[${opts.host}]` : opts.host;
+    headers.host = opts.socketPath ? 'localhost' : (opts.port === 80 ? host : `${host}:${opts.port}`);
+  }
+  if (!headers.connection) headers.connection = 'keep-alive';
+  if (body !== undefined && body !== null) {
+    headers['content-length'] = sockets.byte_length(body);
+  } else if (opts.method === 'POST' || opts.method === 'PUT' || opts.method === 'PATCH') {
+    headers['content-length'] = 0;
+  }
+
+  let head = `${opts.method} ${opts.path} HTTP/1.1\r\n`;
+  for (const [key, value] of Object.entries(headers)) {
+    if (Array.isArray(value)) {
+      for (const v of value) head += `${key}: ${v}\r\n`;
+    } else {
+      head += `${key}: ${value}\r\n`;
+    }
+  }
+  head += '\r\n';
+  return body !== undefined && body !== null ? head + body : head;
+}
+
+const globalAgent = new Agent();
+
+function request(input, options) {
+  return ((options && options.agent) || globalAgent).request(input, options);
+}
+
+function get(url, options = {}) {
+  return request(url, Object.assign({}, options, { method: 'GET' }));
+}
+
+function post(url, body, options = {}) {
+  return request(url, Object.assign({}, options, { method: 'POST', body }));
+}
+
+export { Agent, ClientResponse, clientLoop, globalAgent, request, get, post };
+export default { Agent, ClientResponse, clientLoop, globalAgent, request, get, post };
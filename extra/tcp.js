@@ -1,15 +1,24 @@
 import sockets from '../dist/network_sockets.so';
 
+const BINARY = { binary: true };
+const NO_BYTES = new Uint8Array(0);
+
 class TCPConnection {
-  constructor(fd, remoteAddr, remotePort) {
+  // With binary set, reads are Uint8Arrays of the bytes as sent rather than text
+  constructor(fd, remoteAddr, remotePort, binary = false) {
     this.fd = fd;
     this.remoteAddr = remoteAddr;
     this.remotePort = remotePort;
-    this.buffer = '';
+    this.binary = binary;
+    this.buffer = binary ? NO_BYTES : '';
   }
 
   read(maxBytes = 8192) {
     try {
+      if (this.binary) {
+        const data = sockets.recv(this.fd, maxBytes, 0, BINARY);
+        return data.byteLength > 0 ? new Uint8Array(data) : null;
+      }
       const data = sockets.recv(this.fd, maxBytes, 0);
       return data || null;
     } catch (e) {
@@ -19,7 +28,8 @@ class TCPConnection {
 
   write(data) {
     try {
-      const bytesToSend = typeof data === 'string' ? data : String(data);
+      const bytesToSend = typeof data === 'string' || ArrayBuffer.isView(data) || data instanceof ArrayBuffer
+        ? data : String(data);
       return sockets.send(this.fd, bytesToSend, 0);
     } catch (e) {
       return -1;
@@ -40,8 +50,12 @@ class TCPServer {
   constructor() {
     this.serverFd = null;
     this.epollFd = null;
+    this.proxyFd = null;
     this.connections = new Map();
     this.running = false;
+    this.ipv6Only = false;
+    this.binary = false; // conn.buffer as bytes; set it to proxy() after reading
+    this.family = sockets.AF_INET;
     
     this.onConnection = null;
     this.onData = null;
@@ -49,13 +63,30 @@ class TCPServer {
     this.onError = null;
   }
 
+  // listen(port, host) for TCP ('::' for dual-stack), or listen(path) for a Unix socket
   listen(port, host = '0.0.0.0') {
-    this.serverFd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+    const unixPath = typeof port === 'string' && !/^\d+$/.test(port) ? port : null;
+    if (unixPath !== null) {
+      this.family = sockets.AF_UNIX;
+    } else {
+      this.family = host.includes(':') ? sockets.AF_INET6 : sockets.AF_INET;
+    }
+
+    this.serverFd = sockets.socket(this.family, sockets.SOCK_STREAM, 0);
     
-    sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
-    sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_REUSEPORT, 1);
+    if (this.family !== sockets.AF_UNIX) {
+      sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+      sockets.setsockopt(this.serverFd, sockets.SOL_SOCKET, sockets.SO_REUSEPORT, 1);
+    }
+    if (this.family === sockets.AF_INET6) {
+      sockets.setsockopt(this.serverFd, sockets.IPPROTO_IPV6, sockets.IPV6_V6ONLY, this.ipv6Only ? 1 : 0);
+    }
     
-    sockets.bind(this.serverFd, host, port);
+    if (unixPath !== null) {
+      sockets.bind(this.serverFd, unixPath, 0);
+    } else {
+      sockets.bind(this.serverFd, host, Number(port));
+    }
     sockets.listen(this.serverFd, 1024);
     sockets.setnonblocking(this.serverFd);
 
@@ -67,8 +98,12 @@ class TCPServer {
       sockets.EPOLLIN | sockets.EPOLLET
     );
 
+    // Proxied connections are pumped natively, in an epoll set nested in this one
+    this.proxyFd = sockets.proxy_fd();
+    sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_ADD, this.proxyFd, sockets.EPOLLIN);
+
     this.running = true;
-    console.log(`TCP Server listening on ${host}:${port}`);
+    console.log(`TCP Server listening on ${unixPath !== null ? unixPath : `${host}:${port}`}`);
 
     while (this.running) {
       try {
@@ -77,6 +112,8 @@ class TCPServer {
         for (const event of events) {
           if (event.fd === this.serverFd) {
             this._acceptConnections();
+          } else if (event.fd === this.proxyFd) {
+            if (sockets.proxy_poll() > 0) sockets.run_pending_jobs();
           } else {
             this._handleEvent(event);
           }
@@ -96,7 +133,9 @@ class TCPServer {
         if (!client) break;
 
         sockets.setnonblocking(client.fd);
-        sockets.setsockopt(client.fd, sockets.IPPROTO_TCP, sockets.TCP_NODELAY, 1);
+        if (this.family !== sockets.AF_UNIX) {
+          sockets.setsockopt(client.fd, sockets.IPPROTO_TCP, sockets.TCP_NODELAY, 1);
+        }
 
         sockets.epoll_ctl(
           this.epollFd,
@@ -108,7 +147,7 @@ class TCPServer {
         const peerAddr = client.address || 'unknown';
         const peerPort = client.port || 0;
 
-        const conn = new TCPConnection(client.fd, peerAddr, peerPort);
+        const conn = new TCPConnection(client.fd, peerAddr, peerPort, this.binary);
         this.connections.set(client.fd, conn);
 
         if (this.onConnection) {
@@ -138,7 +177,14 @@ class TCPServer {
           const chunk = conn.read(8192);
           if (!chunk || chunk.length === 0) break;
 
-          conn.buffer += chunk;
+          if (conn.binary) {
+            const buffer = new Uint8Array(conn.buffer.length + chunk.length);
+            buffer.set(conn.buffer, 0);
+            buffer.set(chunk, conn.buffer.length);
+            conn.buffer = buffer;
+          } else {
+            conn.buffer += chunk;
+          }
           totalRead += chunk.length;
         }
 
@@ -172,6 +218,30 @@ class TCPServer {
     this._closeConnection(conn.fd);
   }
 
+  // Forward conn to upstreamFd, a socket connected or still connecting, and
+  // back with splice(2); onData sees nothing more from conn. Bytes already in
+  // conn.buffer go first, queued natively until the upstream takes them.
+  // Both sockets are closed once the pair is done, and the promise resolves
+  // with {sent, received, error} (see sockets.proxy). Text read from conn
+  // may not be the bytes that were sent, so a connection that has been read
+  // must come from a server with binary set.
+  proxy(conn, upstreamFd) {
+    if (!conn.binary && conn.buffer.length > 0) {
+      return Promise.reject(new TypeError('proxy() after reading text; set server.binary to keep the bytes read'));
+    }
+    try {
+      sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_DEL, conn.fd, 0);
+    } catch (e) {
+    }
+    const early = conn.buffer;
+    conn.buffer = conn.binary ? NO_BYTES : '';
+    return sockets.proxy(conn.fd, upstreamFd, early).then((result) => {
+      sockets.close(upstreamFd);
+      this._closeConnection(conn.fd);
+      return result;
+    });
+  }
+
   close() {
     this.running = false;
 
@@ -0,0 +1,195 @@
+import sockets from '../dist/network_sockets.so';
+
+// Preallocated buffers for one recvmmsg/sendmmsg batch.
+// Datagram i occupies bytes [i * slotSize, i * slotSize + lengths[i]).
+class UDPBatch {
+  constructor(size = 256, slotSize = 2048) {
+    this.size = Math.min(size, sockets.UDP_BATCH_MAX);
+    this.slotSize = slotSize;
+    this.buffer = new ArrayBuffer(this.size * slotSize);
+    this.bytes = new Uint8Array(this.buffer);
+    this.lengths = new Int32Array(this.size);
+    this.addrs = new ArrayBuffer(this.size * sockets.UDP_ADDR_SIZE);
+    this.segments = new Int32Array(this.size);
+    this.count = 0;
+  }
+
+  // Payload of datagram i as a view (no copy)
+  message(i) {
+    const start = i * this.slotSize;
+    return this.bytes.subarray(start, start + this.lengths[i]);
+  }
+
+  text(i) {
+    return sockets.buffer_string(this.buffer, i * this.slotSize, this.lengths[i]);
+  }
+
+  // {address, port, family} of the peer of datagram i
+  peer(i) {
+    return sockets.udp_addr(this.addrs, i);
+  }
+
+  // Queue a datagram at slot this.count; returns false when the batch is full
+  push(data, fd = null, address = null, port = 0) {
+    if (this.count >= this.size) return false;
+    const i = this.count;
+    const start = i * this.slotSize;
+    if (typeof data === 'string') {
+      this.lengths[i] = sockets.buffer_write(this.bytes.subarray(start, start + this.slotSize), 0, data);
+    } else {
+      const bytes = data instanceof Uint8Array ? data : new Uint8Array(data);
+      const n = Math.min(bytes.length, this.slotSize);
+      this.bytes.set(n === bytes.length ? bytes : bytes.subarray(0, n), start);
+      this.lengths[i] = n;
+    }
+    if (address !== null) {
+      sockets.udp_set_addr(fd, this.addrs, i, address, port);
+    }
+    this.count++;
+    return true;
+  }
+}
+
+class UDPSocket {
+  constructor(options = {}) {
+    this.fd = null;
+    this.epollFd = null;
+    this.running = false;
+    this.ipv6Only = false;
+    this.family = sockets.AF_INET;
+    this.batchSize = options.batchSize || 256;
+    this.slotSize = options.slotSize || 2048;
+    this.gro = options.gro || false;
+    this.recvBufferSize = options.recvBufferSize || 0;
+    this.maxBatchesPerEvent = options.maxBatchesPerEvent || 64;
+
+    this.onMessages = null;
+    this.onError = null;
+  }
+
+  // bind(port, host) for UDP ('::' for dual-stack), or bind(path) for a Unix datagram socket
+  bind(port, host = '0.0.0.0') {
+    const unixPath = typeof port === 'string' && !/^\d+$/.test(port) ? port : null;
+    if (unixPath !== null) {
+      this.family = sockets.AF_UNIX;
+    } else {
+      this.family = host.includes(':') ? sockets.AF_INET6 : sockets.AF_INET;
+    }
+
+    this.fd = sockets.socket(this.family, sockets.SOCK_DGRAM, 0);
+
+    if (this.family !== sockets.AF_UNIX) {
+      sockets.setsockopt(this.fd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+      sockets.setsockopt(this.fd, sockets.SOL_SOCKET, sockets.SO_REUSEPORT, 1);
+    }
+    if (this.family === sockets.AF_INET6) {
+      sockets.setsockopt(this.fd, sockets.IPPROTO_IPV6, sockets.IPV6_V6ONLY, this.ipv6Only ? 1 : 0);
+    }
+    if (this.recvBufferSize > 0) {
+      sockets.setsockopt(this.fd, sockets.SOL_SOCKET, sockets.SO_RCVBUF, this.recvBufferSize);
+    }
+    if (this.gro) {
+      // Coalesced datagrams need room for up to 64 KB per slot
+      sockets.setsockopt(this.fd, sockets.SOL_UDP, sockets.UDP_GRO, 1);
+      this.slotSize = Math.max(this.slotSize, 65536);
+    }
+
+    if (unixPath !== null) {
+      sockets.bind(this.fd, unixPath, 0);
+    } else {
+      sockets.bind(this.fd, host, Number(port));
+    }
+    sockets.setnonblocking(this.fd);
+
+    this.batch = new UDPBatch(this.batchSize, this.slotSize);
+    return this;
+  }
+
+  // Receive one batch into this.batch; returns the number of datagrams
+  receive() {
+    const b = this.batch;
+    b.count = sockets.recvmmsg(this.fd, b.buffer, b.slotSize, b.lengths, b.addrs, this.gro ? b.segments : null);
+    return b.count;
+  }
+
+  // Send the datagrams queued in batch (see UDPBatch.push); returns the number sent.
+  // Whatever did not fit in the socket buffer stays queued at the front of batch.
+  send(batch, gsoSize = 0) {
+    let total = 0;
+    while (batch.count > 0) {
+      const n = sockets.sendmmsg(this.fd, batch.buffer, batch.slotSize, batch.lengths, batch.count, batch.addrs, gsoSize);
+      if (n === 0) break;
+      total += n;
+      if (n < batch.count) {
+        batch.bytes.copyWithin(0, n * batch.slotSize, batch.count * batch.slotSize);
+        batch.lengths.copyWithin(0, n, batch.count);
+        new Uint8Array(batch.addrs).copyWithin(0, n * sockets.UDP_ADDR_SIZE, batch.count * sockets.UDP_ADDR_SIZE);
+      }
+      batch.count -= n;
+    }
+    return total;
+  }
+
+  sendTo(data, address, port = 0) {
+    const b = this._outBatch || (this._outBatch = new UDPBatch(1, 65507));
+    b.count = 0;
+    b.push(data, this.fd, address, port);
+    return sockets.sendmmsg(this.fd, b.buffer, b.slotSize, b.lengths, 1, b.addrs, 0);
+  }
+
+  // Run an epoll loop, calling onMessages(batch, count) for every received batch
+  listen(port, host = '0.0.0.0', callback) {
+    if (typeof host === 'function') {
+      callback = host;
+      host = '0.0.0.0';
+    }
+    if (callback) this.onMessages = callback;
+    if (this.fd === null) this.bind(port, host);
+
+    // Level-triggered, so a socket left non-empty after maxBatchesPerEvent is reported again
+    this.epollFd = sockets.epoll_create1(0);
+    sockets.epoll_ctl(this.epollFd, sockets.EPOLL_CTL_ADD, this.fd, sockets.EPOLLIN);
+
+    this.running = true;
+    const label = this.family === sockets.AF_UNIX ? port : `${host}:${port}`;
+    console.log(`UDP socket bound to ${label} (batch ${this.batch.size} x ${this.batch.slotSize} bytes)`);
+
+    while (this.running) {
+      try {
+        const events = sockets.epoll_wait(this.epollFd, 16, 10);
+        if (events.length === 0) continue;
+
+        for (let i = 0; i < this.maxBatchesPerEvent && this.running; i++) {
+          const n = this.receive();
+          if (n === 0) break;
+          if (this.onMessages) this.onMessages(this.batch, n);
+        }
+      } catch (e) {
+        if (this.onError) {
+          this.onError(e);
+        }
+      }
+    }
+  }
+
+  close() {
+    this.running = false;
+
+    if (this.epollFd !== null) {
+      sockets.close(this.epollFd);
+      this.epollFd = null;
+    }
+
+    if (this.fd !== null) {
+      sockets.close(this.fd);
+      this.fd = null;
+    }
+  }
+}
+
+function createSocket(options) {
+  return new UDPSocket(options);
+}
+
+export { createSocket, UDPSocket, UDPBatch };
+export default createSocket;
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // recvmmsg/sendmmsg
 #include "quickjs.h"
 #include <string.h>
 #include <errno.h>
@@ -8,31 +9,81 @@
 #include <sys/epoll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <sys/un.h>
+#include <net/if.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <stdio.h>
+#include <strings.h>
+#include <time.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef QJS_TLS
+#include <limits.h>
+#include <linux/tls.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#endif
 
 #define countof(x) (sizeof(x) / sizeof((x)[0]))
 #define MAX_EVENTS 1024
 #define MAX_HEADERS 64
 #define MAX_HEADER_SIZE 8192
+#define MAX_RESPONSE_HEAD 65536
+#define OFFLOAD_MAX_THREADS 64
+#define OFFLOAD_FN_CACHE 16
+#define UDP_BATCH_MAX 1024
+#define UDP_ADDR_SIZE 128 // per-message address slot: sockaddr, then its length
+#define UDP_ADDR_LEN_OFF (UDP_ADDR_SIZE - sizeof(uint32_t))
+#define DNS_MAX_SERVERS 3
+#define DNS_MAX_ADDRS 16
+#define DNS_MAX_NAME 253
+#define DNS_MAX_PACKET 1232
+#define DNS_CACHE_BUCKETS 256
+#define DNS_CACHE_MAX 4096
 
 // Socket constants
 static const JSCFunctionListEntry js_socket_constants[] = {
   JS_PROP_INT32_DEF("AF_INET", AF_INET, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("AF_INET6", AF_INET6, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("AF_UNIX", AF_UNIX, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SOCK_STREAM", SOCK_STREAM, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SOCK_DGRAM", SOCK_DGRAM, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SOCK_RAW", SOCK_RAW, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("IPPROTO_TCP", IPPROTO_TCP, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("IPPROTO_UDP", IPPROTO_UDP, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("IPPROTO_IPV6", IPPROTO_IPV6, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("SOL_UDP", SOL_UDP, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("UDP_SEGMENT", UDP_SEGMENT, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("UDP_GRO", UDP_GRO, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("UDP_ADDR_SIZE", UDP_ADDR_SIZE, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("UDP_BATCH_MAX", UDP_BATCH_MAX, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("IPV6_V6ONLY", IPV6_V6ONLY, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SOL_SOCKET", SOL_SOCKET, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SO_REUSEADDR", SO_REUSEADDR, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SO_REUSEPORT", SO_REUSEPORT, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SO_KEEPALIVE", SO_KEEPALIVE, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SO_RCVBUF", SO_RCVBUF, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SO_SNDBUF", SO_SNDBUF, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("SO_ERROR", SO_ERROR, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("TCP_NODELAY", TCP_NODELAY, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SHUT_RD", SHUT_RD, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("SHUT_WR", SHUT_WR, JS_PROP_CONFIGURABLE),
@@ -46,609 +97,8402 @@ static const JSCFunctionListEntry js_socket_constants[] = {
   JS_PROP_INT32_DEF("EPOLLET", EPOLLET, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("EPOLLONESHOT", EPOLLONESHOT, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("MSG_NOSIGNAL", MSG_NOSIGNAL, JS_PROP_CONFIGURABLE),
+  JS_PROP_INT32_DEF("MSG_PEEK", MSG_PEEK, JS_PROP_CONFIGURABLE),
 };
 
-// setnonblocking(fd)
-static JSValue js_setnonblocking(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int fd;
+// Metrics
+//
+// Counters and latency histograms recorded on the hot path (accept, recv,
+// send, epoll_wait, parse_http_request) and by extra/express.js through
+// metrics_request(). Every update is a relaxed atomic add on static
+// storage: no locks, no allocation and no JS values per event. Only the
+// loop thread records; relaxed atomics keep reads from other threads sane.
+//
+// Histograms are log-linear (HDR style): values below 256 have a bucket each,
+// above that every power of two is split into 128 buckets, so a reported
+// percentile is within 1% of the recorded value (two significant digits).
+// Latencies are kept in nanoseconds and capped at 2^40 ns (about 18 minutes).
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (2 * HIST_SUB_COUNT)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+#define METRICS_STATUS_MAX 600
+#define METRICS_TEXT_MAX 65536
 
-  if (JS_ToInt32(ctx, &fd, argv[0]))
-    return JS_EXCEPTION;
+#define METRIC_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define METRIC_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
 
-  int flags = fcntl(fd, F_GETFL, 0);
-  if (flags < 0)
-    return JS_ThrowInternalError(ctx, "fcntl(F_GETFL) failed: %s", strerror(errno));
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t min_inv; // ~min, so a zeroed histogram needs no initialisation
+  uint64_t buckets[HIST_BUCKETS];
+} metrics_hist_t;
 
-  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
-    return JS_ThrowInternalError(ctx, "fcntl(F_SETFL) failed: %s", strerror(errno));
+static struct {
+  int enabled;
+  uint64_t accepts;
+  uint64_t active;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t requests;
+  uint64_t status[METRICS_STATUS_MAX]; // [0] counts codes outside 100-599
+  metrics_hist_t parse;
+  metrics_hist_t handler;
+  metrics_hist_t send;
+  metrics_hist_t loop_lag;
+  metrics_hist_t queue;  // request wait within a turn, while overload protection is on
+  metrics_hist_t epoll_batch;
+  metrics_hist_t gc;
+  uint64_t gc_idle;    // collections run by the idle scheduler
+  uint64_t loop_mark;  // when the server loop's last epoll_wait() returned
+  int loop_epfd;       // the epoll set the last blocking wait was on
+  uint64_t started;
+  uint8_t *conns;      // bitmap of fds returned by accept()
+  size_t conns_cap;
+} metrics = { .enabled = 1, .loop_epfd = -1 };
 
-  return JS_NewInt32(ctx, 0);
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
 }
 
-// epoll_create1(flags)
-static JSValue js_epoll_create1(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int flags = 0;
+static inline int hist_index(uint64_t v) {
+  if (v < HIST_LINEAR)
+    return (int)v;
+  if (v >> HIST_MAX_BITS)
+    v = ((uint64_t)1 << HIST_MAX_BITS) - 1;
+  int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+  return shift * HIST_SUB_COUNT + (int)(v >> shift);
+}
 
-  if (argc > 0 && JS_ToInt32(ctx, &flags, argv[0]))
-    return JS_EXCEPTION;
+// Largest value that lands in bucket i
+static uint64_t hist_bucket_max(int i) {
+  if (i < HIST_LINEAR)
+    return (uint64_t)i;
+  int shift = i / HIST_SUB_COUNT - 1;
+  uint64_t lower = (uint64_t)(i % HIST_SUB_COUNT + HIST_SUB_COUNT) << shift;
+  return lower + ((uint64_t)1 << shift) - 1;
+}
 
-  int epfd = epoll_create1(flags);
-  if (epfd < 0)
-    return JS_ThrowInternalError(ctx, "epoll_create1() failed: %s", strerror(errno));
+static inline void hist_record(metrics_hist_t *h, uint64_t v) {
+  METRIC_ADD(h->buckets[hist_index(v)], 1);
+  METRIC_ADD(h->count, 1);
+  METRIC_ADD(h->sum, v);
+  // Single writer, so load-compare-store is enough for the extremes
+  if (v > METRIC_LOAD(h->max))
+    __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+  if (~v > METRIC_LOAD(h->min_inv))
+    __atomic_store_n(&h->min_inv, ~v, __ATOMIC_RELAXED);
+}
 
-  return JS_NewInt32(ctx, epfd);
+static uint64_t hist_percentile(const metrics_hist_t *h, uint64_t count, double q) {
+  uint64_t rank = (uint64_t)(q * (double)count + 0.5), seen = 0;
+  uint64_t min = ~METRIC_LOAD(h->min_inv), max = METRIC_LOAD(h->max);
+  if (rank < 1)
+    rank = 1;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += METRIC_LOAD(h->buckets[i]);
+    if (seen >= rank) {
+      uint64_t v = hist_bucket_max(i);
+      return v < min ? min : v > max ? max : v;
+    }
+  }
+  return max;
 }
 
-// epoll_ctl(epfd, op, fd, events)
-static JSValue js_epoll_ctl(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int epfd, op, fd, events;
+static void metrics_conn_open(int fd) {
+  METRIC_ADD(metrics.accepts, 1);
+  size_t byte = (size_t)fd >> 3;
+  if (byte >= metrics.conns_cap) {
+    size_t cap = metrics.conns_cap ? metrics.conns_cap : 1024;
+    while (cap <= byte) cap *= 2;
+    uint8_t *conns = realloc(metrics.conns, cap);
+    if (!conns)
+      return; // not tracked; active stays a lower bound
+    memset(conns + metrics.conns_cap, 0, cap - metrics.conns_cap);
+    metrics.conns = conns;
+    metrics.conns_cap = cap;
+  }
+  uint8_t bit = (uint8_t)(1 << (fd & 7));
+  if (!(metrics.conns[byte] & bit)) {
+    metrics.conns[byte] |= bit;
+    METRIC_ADD(metrics.active, 1);
+  }
+}
 
-  if (JS_ToInt32(ctx, &epfd, argv[0]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &op, argv[1]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &fd, argv[2]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &events, argv[3]))
-    return JS_EXCEPTION;
+static void metrics_conn_close(int fd) {
+  size_t byte = (size_t)fd >> 3;
+  uint8_t bit = (uint8_t)(1 << (fd & 7));
+  if (fd >= 0 && byte < metrics.conns_cap && (metrics.conns[byte] & bit)) {
+    metrics.conns[byte] &= (uint8_t)~bit;
+    METRIC_ADD(metrics.active, (uint64_t)-1);
+  }
+}
 
-  struct epoll_event ev;
-  ev.events = events;
-  ev.data.fd = fd;
+// Tracing
+//
+// USDT probes (provider "qjs_sockets") mark every phase of a request and
+// cost a single nop when nobody is attached, e.g.
+//   bpftrace -e 'usdt:./dist/network_sockets.so:qjs_sockets:parse { @[arg1 / 1000] = count(); }'
+// They need <sys/sdt.h> (systemtap-sdt-dev) at build time and compile to
+// nothing without it.
+//
+// The trace ring is opt-in (trace_enable() or QJS_TRACE=<records> in the
+// environment) and keeps the last N phase spans of this worker, written by
+// the loop thread only. trace_dump() renders it as Chrome trace JSON, one
+// row per fd; with QJS_TRACE set, SIGUSR2 dumps it to QJS_TRACE_FILE
+// (default /tmp/qjs-trace-<pid>.json) from the next epoll_wait().
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(qjs_sockets, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(qjs_sockets, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(qjs_sockets, name, a, b, c)
+#endif
+#endif
+#ifndef PROBE1
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
 
-  if (epoll_ctl(epfd, op, fd, &ev) < 0)
-    return JS_ThrowInternalError(ctx, "epoll_ctl() failed: %s", strerror(errno));
+#define TRACE_MAX_RECORDS (1 << 24)
 
-  return JS_NewInt32(ctx, 0);
+enum {
+  TRACE_ACCEPT,
+  TRACE_RECV,
+  TRACE_PARSE,
+  TRACE_ROUTE,
+  TRACE_HANDLER,
+  TRACE_WRITE,
+  TRACE_SEND,
+  TRACE_EPOLL,
+};
+
+static const char *const trace_phase_names[] = {
+  "accept", "recv", "parse", "route", "handler", "write", "send", "epoll_wait",
+};
+
+// What trace_record_t.arg holds for each phase
+static const char *const trace_arg_names[] = {
+  "fd", "bytes", "bytes", "status", "status", "status", "bytes", "events",
+};
+
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+  int32_t fd;
+  int32_t arg; // bytes, status or event count, depending on the phase
+  int32_t phase;
+} trace_record_t;
+
+static struct {
+  trace_record_t *ring; // NULL while tracing is off
+  uint64_t mask;
+  uint64_t head;
+  uint64_t origin;
+  volatile sig_atomic_t dump_requested;
+} trace;
+
+static inline uint64_t trace_start(void) {
+  return trace.ring ? now_ns() : 0;
 }
 
-// epoll_wait(epfd, maxevents, timeout) -> array of {fd, events}
-static JSValue js_epoll_wait(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int epfd, maxevents, timeout = -1;
+static inline void trace_add(int phase, int fd, uint64_t start, uint64_t end, int32_t arg) {
+  trace_record_t *r = &trace.ring[trace.head++ & trace.mask];
+  r->start = start;
+  r->end = end;
+  r->fd = fd;
+  r->arg = arg;
+  r->phase = phase;
+}
 
-  if (JS_ToInt32(ctx, &epfd, argv[0]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &maxevents, argv[1]))
-    return JS_EXCEPTION;
-  if (argc > 2 && JS_ToInt32(ctx, &timeout, argv[2]))
-    return JS_EXCEPTION;
+// Records a span begun with trace_start(); a no-op while tracing is off
+static inline void trace_end(int phase, int fd, uint64_t start, int32_t arg) {
+  if (start && trace.ring)
+    trace_add(phase, fd, start, now_ns(), arg);
+}
 
-  if (maxevents > MAX_EVENTS)
-    maxevents = MAX_EVENTS;
+static int trace_set_capacity(uint64_t records) {
+  free(trace.ring);
+  trace.ring = NULL;
+  trace.mask = 0;
+  trace.head = 0;
+  if (records == 0)
+    return 0;
 
-  struct epoll_event events[MAX_EVENTS];
-  int nfds = epoll_wait(epfd, events, maxevents, timeout);
+  uint64_t cap = 1;
+  while (cap < records && cap < TRACE_MAX_RECORDS) cap <<= 1;
+  trace.ring = calloc(cap, sizeof(trace_record_t));
+  if (!trace.ring)
+    return -1;
+  trace.mask = cap - 1;
+  trace.origin = now_ns();
+  return 0;
+}
 
-  if (nfds < 0)
-    return JS_ThrowInternalError(ctx, "epoll_wait() failed: %s", strerror(errno));
+// Writes the ring, oldest span first; returns the number of spans
+static uint64_t trace_write_json(FILE *f) {
+  uint64_t count = trace.head < trace.mask + 1 ? trace.head : trace.mask + 1;
+  int pid = (int)getpid();
 
-  JSValue result = JS_NewArray(ctx);
-  for (int i = 0; i < nfds; i++) {
-    JSValue obj = JS_NewObject(ctx);
-    JS_SetPropertyStr(ctx, obj, "fd", JS_NewInt32(ctx, events[i].data.fd));
-    JS_SetPropertyStr(ctx, obj, "events", JS_NewUint32(ctx, events[i].events));
-    JS_SetPropertyUint32(ctx, result, i, obj);
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+  for (uint64_t i = trace.head - count; i < trace.head; i++) {
+    const trace_record_t *r = &trace.ring[i & trace.mask];
+    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%d}}",
+            i == trace.head - count ? "" : ",", trace_phase_names[r->phase], pid, r->fd,
+            (double)(int64_t)(r->start - trace.origin) / 1000.0,
+            (double)(r->end - r->start) / 1000.0, trace_arg_names[r->phase], r->arg);
   }
+  fputs("\n]}\n", f);
+  return count;
+}
 
-  return result;
+static void trace_dump_file(void) {
+  char path[256];
+  const char *env = getenv("QJS_TRACE_FILE");
+  if (env && *env)
+    snprintf(path, sizeof(path), "%s", env);
+  else
+    snprintf(path, sizeof(path), "/tmp/qjs-trace-%d.json", (int)getpid());
+
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return;
+  trace_write_json(f);
+  fclose(f);
 }
 
-// socket(domain, type, protocol)
-static JSValue js_socket(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int domain, type, protocol = 0;
+static void trace_on_signal(int sig) {
+  trace.dump_requested = 1;
+}
 
-  if (JS_ToInt32(ctx, &domain, argv[0]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &type, argv[1]))
-    return JS_EXCEPTION;
-  if (argc > 2 && JS_ToInt32(ctx, &protocol, argv[2]))
-    return JS_EXCEPTION;
+// QJS_TRACE=<records> turns the ring on at load time and arms SIGUSR2
+static void trace_init_from_env(void) {
+  const char *env = getenv("QJS_TRACE");
+  if (!env || !*env || trace.ring)
+    return;
+  long records = strtol(env, NULL, 10);
+  if (trace_set_capacity(records > 0 ? (uint64_t)records : 65536) < 0)
+    return;
 
-  int fd = socket(domain, type, protocol);
-  if (fd < 0)
-    return JS_ThrowInternalError(ctx, "socket() failed: %s", strerror(errno));
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = trace_on_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &sa, NULL);
+}
 
-  return JS_NewInt32(ctx, fd);
+// Garbage collection
+//
+// QuickJS frees most garbage by reference counting; JS_RunGC() collects
+// cycles and its pause grows with the heap. With gc_idle() set, epoll_wait()
+// checks for ready events before blocking and, when there are none and
+// there has been traffic since the last run, collects first, so the pause
+// lands in idle time instead of the next request. Collections started
+// here are timed into metrics().gcUs; the runtime's own threshold-driven
+// collections are not visible to the module.
+static struct {
+  int64_t idle_interval_ms; // 0: no idle collections
+  uint64_t last;            // ns of the last collection started here
+  uint64_t last_traffic;    // bytes in + out at that point
+  int64_t threshold;        // last gc_threshold(), -1 if never set
+} gc_sched = { .threshold = -1 };
+
+static void gc_collect(JSRuntime *rt, int idle) {
+  uint64_t start = now_ns();
+  JS_RunGC(rt);
+  uint64_t end = now_ns();
+  hist_record(&metrics.gc, end - start);
+  if (idle)
+    METRIC_ADD(metrics.gc_idle, 1);
+  gc_sched.last = end;
+  gc_sched.last_traffic = METRIC_LOAD(metrics.bytes_in) + METRIC_LOAD(metrics.bytes_out);
+  PROBE2(gc, idle, end - start);
 }
 
-// bind(sockfd, address, port)
-static JSValue js_bind(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int sockfd, port;
-  const char *addr;
-  struct sockaddr_in sa;
+static int gc_idle_due(void) {
+  if (gc_sched.idle_interval_ms <= 0)
+    return 0;
+  uint64_t traffic = METRIC_LOAD(metrics.bytes_in) + METRIC_LOAD(metrics.bytes_out);
+  return traffic != gc_sched.last_traffic &&
+         now_ns() - gc_sched.last >= (uint64_t)gc_sched.idle_interval_ms * 1000000u;
+}
 
-  if (JS_ToInt32(ctx, &sockfd, argv[0]))
-    return JS_EXCEPTION;
-  addr = JS_ToCString(ctx, argv[1]);
-  if (!addr)
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &port, argv[2])) {
-    JS_FreeCString(ctx, addr);
-    return JS_EXCEPTION;
-  }
+// Rate limiting
+//
+// Token buckets per client (peer address, or a header such as an API key)
+// and rule, kept in a fixed open-addressing table. A key that finds no
+// free slot within LIMIT_PROBE takes over the bucket idle the longest;
+// one idle for more than burst / rate seconds was full anyway, so under
+// normal load nothing is lost. Request rules match the longest path
+// prefix and answer with a 429 built when the rule was added. Rules with
+// accept set take one token per connection inside accept(), which closes
+// refused connections before JS ever sees them.
+#define LIMIT_MAX_RULES 32
+#define LIMIT_MAX_PREFIX 128
+#define LIMIT_MAX_HEADER 64
+#define LIMIT_PROBE 8
+#define LIMIT_SLOTS 65536 // power of two
 
-  memset(&sa, 0, sizeof(sa));
-  sa.sin_family = AF_INET;
-  sa.sin_port = htons(port);
+typedef struct {
+  uint64_t hash;      // 0: free
+  uint64_t last;      // now_ns() of the last refill
+  double tokens;
+} limit_bucket_t;
 
-  if (strcmp(addr, "0.0.0.0") == 0 || strcmp(addr, "") == 0) {
-    sa.sin_addr.s_addr = INADDR_ANY;
-  } else {
-    if (inet_pton(AF_INET, addr, &sa.sin_addr) <= 0) {
-      JS_FreeCString(ctx, addr);
-      return JS_ThrowInternalError(ctx, "Invalid address: %s", addr);
+typedef struct {
+  char prefix[LIMIT_MAX_PREFIX];
+  size_t prefix_len;
+  char header[LIMIT_MAX_HEADER]; // "": key by peer address
+  size_t header_len;
+  double rate;        // tokens per second
+  double burst;
+  int accept;         // per connection in accept() rather than per request
+  int close;          // close the connection after the 429
+  char *response[2];  // 429 with Connection: keep-alive, close
+  size_t response_len[2];
+  uint64_t limited;
+} limit_rule_t;
+
+static struct {
+  limit_rule_t rules[LIMIT_MAX_RULES]; // longest prefix first
+  int nrules;
+  int accept_rules;
+  limit_bucket_t *buckets;
+  uint64_t allowed;
+  uint64_t limited;
+  uint64_t refused;   // connections closed by accept()
+} limiter;
+
+// Takes a token from key's bucket for rule; 0 if there is none left
+static int limit_take(int rule, const char *key, size_t key_len, uint64_t now) {
+  const limit_rule_t *r = &limiter.rules[rule];
+  uint64_t h = 14695981039346656037ull ^ (uint64_t)(rule + 1);
+  for (size_t i = 0; i < key_len; i++)
+    h = (h ^ (unsigned char)key[i]) * 1099511628211ull;
+  if (h == 0)
+    h = 1;
+
+  limit_bucket_t *b = NULL, *victim = NULL;
+  for (int probe = 0; probe < LIMIT_PROBE; probe++) {
+    limit_bucket_t *s = &limiter.buckets[(h + (uint64_t)probe) & (LIMIT_SLOTS - 1)];
+    if (s->hash == h) {
+      b = s;
+      break;
     }
+    if (s->hash == 0 || !victim || s->last < victim->last)
+      victim = s;
+    if (s->hash == 0)
+      break;
+  }
+  if (!b) {
+    b = victim;
+    b->hash = h;
+    b->tokens = r->burst;
+    b->last = now;
   }
-  JS_FreeCString(ctx, addr);
-
-  if (bind(sockfd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
-    return JS_ThrowInternalError(ctx, "bind() failed: %s", strerror(errno));
 
-  return JS_NewInt32(ctx, 0);
+  b->tokens += (double)(now - b->last) * r->rate / 1e9;
+  if (b->tokens > r->burst)
+    b->tokens = r->burst;
+  b->last = now;
+  if (b->tokens < 1.0)
+    return 0;
+  b->tokens -= 1.0;
+  return 1;
 }
 
-// listen(sockfd, backlog)
-static JSValue js_listen(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int sockfd, backlog;
+// 0 if a connection from ss should be closed right away
+static int limit_accept(const struct sockaddr_storage *ss) {
+  char addr[INET6_ADDRSTRLEN];
+  if (ss->ss_family == AF_INET)
+    inet_ntop(AF_INET, &((const struct sockaddr_in *)ss)->sin_addr, addr, sizeof(addr));
+  else if (ss->ss_family == AF_INET6)
+    inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)ss)->sin6_addr, addr, sizeof(addr));
+  else
+    return 1;
 
-  if (JS_ToInt32(ctx, &sockfd, argv[0]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &backlog, argv[1]))
-    return JS_EXCEPTION;
+  uint64_t now = now_ns();
+  for (int i = 0; i < limiter.nrules; i++) {
+    limit_rule_t *r = &limiter.rules[i];
+    if (r->accept && !limit_take(i, addr, strlen(addr), now)) {
+      r->limited++;
+      limiter.refused++;
+      return 0;
+    }
+  }
+  return 1;
+}
 
-  if (listen(sockfd, backlog) < 0)
-    return JS_ThrowInternalError(ctx, "listen() failed: %s", strerror(errno));
+// Overload protection
+//
+// Past saturation every accepted connection makes all the others slower,
+// so throughput collapses instead of levelling off. Two signals detect it:
+// event-loop lag (how long a turn kept the loop away from epoll_wait())
+// and queueing delay (how long a request waited in this turn before JS
+// got to it). Lag above lag_target for a whole OVERLOAD_INTERVAL_NS turns
+// shedding on, and it stays on until lag has been below target for as
+// long. While shedding, or while max_conns connections are open, the
+// listen fd is taken out of epoll so new connections wait in the kernel
+// backlog, or go to another SO_REUSEPORT worker, instead of joining the
+// queue. Requests that waited longer than queue_target, or arrive while
+// shedding, get a prebuilt 503 and their connection is closed.
+#define OVERLOAD_INTERVAL_NS 100000000ull
 
-  return JS_NewInt32(ctx, 0);
+static struct {
+  int enabled;
+  int epfd;           // the server loop's epoll set
+  int listen_fd;
+  uint32_t listen_events;
+  int paused;         // listen_fd is out of epfd
+  int shedding;
+  uint64_t lag_target;   // ns
+  uint64_t queue_target; // ns
+  uint64_t max_conns;    // 0: no cap
+  uint64_t above_since;  // first turn of the current run over/under lag_target
+  uint64_t below_since;
+  uint64_t lag;          // last turn
+  uint64_t paused_at;
+  uint64_t paused_ns;
+  uint64_t pauses;
+  uint64_t shed;
+  char response[192];
+  size_t response_len;
+} overload = { .epfd = -1, .listen_fd = -1 };
+
+// Takes the listen fd out of epoll, or puts it back, to match the load
+static void overload_listen_update(void) {
+  if (overload.listen_fd < 0)
+    return;
+  int pause = overload.shedding ||
+              (overload.max_conns && METRIC_LOAD(metrics.active) >= overload.max_conns);
+  if (pause == overload.paused)
+    return;
+  // Re-adding an edge-triggered fd reports connections that queued meanwhile
+  struct epoll_event ev = { .events = overload.listen_events, .data.fd = overload.listen_fd };
+  if (epoll_ctl(overload.epfd, pause ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, overload.listen_fd, &ev) < 0 &&
+      errno != (pause ? ENOENT : EEXIST))
+    return;
+  uint64_t now = now_ns();
+  overload.paused = pause;
+  if (pause) {
+    overload.pauses++;
+    overload.paused_at = now;
+  } else {
+    overload.paused_ns += now - overload.paused_at;
+  }
+  PROBE1(overload, pause);
 }
 
-// accept(sockfd) -> {fd, address, port}
-static JSValue js_accept(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int sockfd;
-  struct sockaddr_in sa;
-  socklen_t len = sizeof(sa);
+// Called once per turn of the server loop with the turn's lag
+static void overload_turn(uint64_t lag, uint64_t now) {
+  overload.lag = lag;
+  if (lag > overload.lag_target) {
+    overload.below_since = 0;
+    if (!overload.above_since)
+      overload.above_since = now;
+    if (now - overload.above_since >= OVERLOAD_INTERVAL_NS)
+      overload.shedding = 1;
+  } else {
+    overload.above_since = 0;
+    if (!overload.below_since)
+      overload.below_since = now;
+    if (now - overload.below_since >= OVERLOAD_INTERVAL_NS)
+      overload.shedding = 0;
+  }
+  overload_listen_update();
+}
 
-  if (JS_ToInt32(ctx, &sockfd, argv[0]))
-    return JS_EXCEPTION;
+// TLS
+//
+// Built with -DQJS_TLS, which compileSockets.sh adds when the OpenSSL
+// headers are installed. A TLS connection is an ordinary non-blocking
+// socket with a tls_conn_t beside it, found by fd. conn_recv(), conn_send()
+// and conn_sendv() stand in for the socket calls wherever the module reads
+// or writes a connection, so HTTP/1.x, WebSockets, event streams and
+// HTTP/2 all run over TLS unchanged. The handshake runs inside the first
+// reads.
+//
+// OpenSSL works on memory BIOs. Ciphertext read from the socket is fed to
+// the SSL's input. What it writes is sent straight from its output, and
+// only the part the socket refused is copied to a backlog. Nothing new is
+// encrypted while the backlog is not empty, so it stays below one
+// TLS_SEND_CHUNK and callers see EAGAIN as they would on a full socket.
+//
+// After a TLS 1.3 AES-GCM handshake on the server side, writes are handed
+// to the kernel (kTLS) as soon as all handshake output has gone out. The
+// traffic secret comes from the keylog callback, and the record sequence
+// number from counting the records sent since the handshake. From then on
+// a send is a plain send() that the kernel encrypts, and sendfile() works
+// on the socket. Reads stay in OpenSSL, because records the client sent
+// along with its Finished are already buffered here.
+#define TLS_RECV_BUF 65536
+#define TLS_SEND_CHUNK (64 << 10) // plaintext encrypted per send
+#define TLS_SECRET_MAX 48
 
-  int client_fd = accept(sockfd, (struct sockaddr *)&sa, &len);
-  if (client_fd < 0) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
-      return JS_NULL;
-    return JS_ThrowInternalError(ctx, "accept() failed: %s", strerror(errno));
-  }
+#ifdef QJS_TLS
+typedef struct {
+  SSL *ssl;
+  BIO *in;              // ciphertext read from the socket
+  BIO *out;             // ciphertext for the socket
+  uint8_t *backlog;     // what the socket did not take
+  size_t backlog_len;
+  size_t backlog_off;
+  uint8_t server;
+  uint8_t established;
+  uint8_t counting;     // records sent are counted for kTLS
+  uint8_t ktls_due;     // hand writes to the kernel once the output is out
+  uint8_t ktls;         // writes go through the kernel
+  uint8_t secret_len;
+  uint64_t records;     // sent since the handshake
+  uint8_t secret[TLS_SECRET_MAX]; // server application traffic secret
+} tls_conn_t;
 
-  char addr_str[INET_ADDRSTRLEN];
-  inet_ntop(AF_INET, &sa.sin_addr, addr_str, sizeof(addr_str));
+static struct {
+  tls_conn_t **conns; // by fd
+  size_t cap;
+  uint8_t *buf;       // TLS_RECV_BUF bytes of ciphertext, shared
+  uint8_t *gather;    // TLS_SEND_CHUNK bytes for conn_sendv()
+  SSL_CTX *server;
+  SSL_CTX *client[2]; // without and with peer verification
+  SSL_CTX *client_ca; // verifying against client_ca_path
+  char *client_ca_path;
+  int cache;          // handle of the shm table holding sessions, or -1
+  uint8_t ktls;       // try kTLS on new connections
+  uint8_t no_ulp;     // the kernel has no "tls" ULP
+  uint8_t alpn[256];  // server preference, in wire format
+  size_t alpn_len;
+  uint64_t open;
+  uint64_t handshakes;
+  uint64_t resumed;
+  uint64_t failures;
+  uint64_t ktls_conns;
+} tls = { .cache = -1 };
 
-  JSValue obj = JS_NewObject(ctx);
-  JS_SetPropertyStr(ctx, obj, "fd", JS_NewInt32(ctx, client_fd));
-  JS_SetPropertyStr(ctx, obj, "address", JS_NewString(ctx, addr_str));
-  JS_SetPropertyStr(ctx, obj, "port", JS_NewInt32(ctx, ntohs(sa.sin_port)));
+static tls_conn_t *tls_get(int fd) {
+  return fd >= 0 && (size_t)fd < tls.cap ? tls.conns[fd] : NULL;
+}
 
-  return obj;
+// Number of whole records in p[0..len); BIO output always ends on one
+static uint64_t tls_records(const uint8_t *p, size_t len) {
+  uint64_t n = 0;
+  for (size_t off = 0; off + 5 <= len; off += 5 + ((size_t)p[off + 3] << 8 | p[off + 4]))
+    n++;
+  return n;
 }
 
-// connect(sockfd, address, port)
-static JSValue js_connect(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int sockfd, port;
-  const char *addr;
-  struct sockaddr_in sa;
+// HKDF-Expand-Label(secret, label, "", out_len) from RFC 8446 7.1
+static int tls_expand_label(const EVP_MD *md, const uint8_t *secret, size_t secret_len, const char *label,
+                            uint8_t *out, size_t out_len) {
+  uint8_t info[64];
+  size_t label_len = strlen(label), info_len = 0;
+  info[info_len++] = (uint8_t)(out_len >> 8);
+  info[info_len++] = (uint8_t)out_len;
+  info[info_len++] = (uint8_t)(6 + label_len);
+  memcpy(info + info_len, "tls13 ", 6);
+  memcpy(info + info_len + 6, label, label_len);
+  info_len += 6 + label_len;
+  info[info_len++] = 0;
 
-  if (JS_ToInt32(ctx, &sockfd, argv[0]))
-    return JS_EXCEPTION;
-  addr = JS_ToCString(ctx, argv[1]);
-  if (!addr)
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &port, argv[2])) {
-    JS_FreeCString(ctx, addr);
-    return JS_EXCEPTION;
-  }
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+  int ok = pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+           EVP_PKEY_CTX_set_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+           EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+           EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, (int)secret_len) > 0 &&
+           EVP_PKEY_CTX_add1_hkdf_info(pctx, info, (int)info_len) > 0 &&
+           EVP_PKEY_derive(pctx, out, &out_len) > 0;
+  EVP_PKEY_CTX_free(pctx);
+  return ok ? 0 : -1;
+}
 
-  memset(&sa, 0, sizeof(sa));
-  sa.sin_family = AF_INET;
-  sa.sin_port = htons(port);
+// Hands t's writes to the kernel. Nothing changes if it cannot; the
+// secret is wiped either way.
+static void tls_ktls_start(tls_conn_t *t, int fd) {
+  const SSL_CIPHER *cipher = SSL_get_current_cipher(t->ssl);
+  uint32_t id = cipher ? SSL_CIPHER_get_id(cipher) & 0xffff : 0;
+  size_t key_len = id == 0x1301 ? 16 : id == 0x1302 ? 32 : 0; // TLS_AES_128_GCM_SHA256, TLS_AES_256_GCM_SHA384
+  union {
+    struct tls12_crypto_info_aes_gcm_128 gcm128;
+    struct tls12_crypto_info_aes_gcm_256 gcm256;
+  } info;
+  uint8_t key[32], iv[12], seq[8];
+  memset(&info, 0, sizeof(info));
 
-  if (inet_pton(AF_INET, addr, &sa.sin_addr) <= 0) {
-    JS_FreeCString(ctx, addr);
-    return JS_ThrowInternalError(ctx, "Invalid address: %s", addr);
+  t->ktls_due = 0;
+  if (!key_len || tls.no_ulp ||
+      tls_expand_label(SSL_CIPHER_get_handshake_digest(cipher), t->secret, t->secret_len, "key", key, key_len) ||
+      tls_expand_label(SSL_CIPHER_get_handshake_digest(cipher), t->secret, t->secret_len, "iv", iv, sizeof(iv)))
+    goto done;
+  for (int i = 0; i < 8; i++)
+    seq[i] = (uint8_t)(t->records >> (56 - 8 * i));
+  // The kernel builds each nonce from salt (the first 4 bytes of the IV),
+  // the other 8 and the sequence number, as TLS 1.3 does
+  if (key_len == 16) {
+    info.gcm128.info.version = TLS_1_3_VERSION;
+    info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    memcpy(info.gcm128.salt, iv, 4);
+    memcpy(info.gcm128.iv, iv + 4, 8);
+    memcpy(info.gcm128.key, key, 16);
+    memcpy(info.gcm128.rec_seq, seq, 8);
+  } else {
+    info.gcm256.info.version = TLS_1_3_VERSION;
+    info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    memcpy(info.gcm256.salt, iv, 4);
+    memcpy(info.gcm256.iv, iv + 4, 8);
+    memcpy(info.gcm256.key, key, 32);
+    memcpy(info.gcm256.rec_seq, seq, 8);
   }
-  JS_FreeCString(ctx, addr);
-
-  if (connect(sockfd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
-    if (errno != EINPROGRESS)
-      return JS_ThrowInternalError(ctx, "connect() failed: %s", strerror(errno));
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+    if (errno == ENOENT)
+      tls.no_ulp = 1; // no tls module: stop asking
+    goto done;
+  }
+  // Without TLS_TX the ULP passes data through, so a failure here is harmless
+  if (setsockopt(fd, SOL_TLS, TLS_TX, &info, key_len == 16 ? sizeof(info.gcm128) : sizeof(info.gcm256)) == 0) {
+    t->ktls = 1;
+    tls.ktls_conns++;
   }
+done:
+  OPENSSL_cleanse(&info, sizeof(info));
+  OPENSSL_cleanse(key, sizeof(key));
+  OPENSSL_cleanse(iv, sizeof(iv));
+  OPENSSL_cleanse(t->secret, sizeof(t->secret));
+  t->secret_len = 0;
+}
 
-  return JS_NewInt32(ctx, 0);
+// Sends an alert through the kernel, as an alert record
+static void tls_ktls_alert(int fd, uint8_t level, uint8_t description) {
+  uint8_t alert[2] = { level, description };
+  char control[CMSG_SPACE(sizeof(uint8_t))] = { 0 };
+  struct iovec iov = { alert, sizeof(alert) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint8_t));
+  *CMSG_DATA(cmsg) = 21; // alert
+  sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
 }
 
-// send(sockfd, data, flags)
-static JSValue js_send(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int sockfd, flags = 0;
-  size_t len;
-  const char *data;
+// Sends the backlog, then what OpenSSL wrote since. Returns the bytes still
+// waiting, or -1 if the connection is gone.
+static ssize_t tls_flush(tls_conn_t *t, int fd) {
+  while (t->backlog_off < t->backlog_len) {
+    ssize_t n = send(fd, t->backlog + t->backlog_off, t->backlog_len - t->backlog_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return (ssize_t)(t->backlog_len - t->backlog_off + BIO_ctrl_pending(t->out));
+    if (n < 0)
+      return -1;
+    t->backlog_off += (size_t)n;
+  }
+  if (t->backlog) {
+    free(t->backlog);
+    t->backlog = NULL;
+    t->backlog_len = t->backlog_off = 0;
+  }
 
-  if (JS_ToInt32(ctx, &sockfd, argv[0]))
-    return JS_EXCEPTION;
+  char *p;
+  long len = BIO_get_mem_data(t->out, &p);
+  if (t->ktls && (len > 0 || SSL_get_key_update_type(t->ssl) != SSL_KEY_UPDATE_NONE)) {
+    // A KeyUpdate from the client asked for the server's, which OpenSSL
+    // would write with keys the kernel has taken over. It cannot be sent,
+    // so the connection ends with an alert the kernel can encrypt.
+    (void)BIO_reset(t->out);
+    tls_ktls_alert(fd, 2, 80); // fatal, internal_error
+    SSL_set_shutdown(t->ssl, SSL_SENT_SHUTDOWN);
+    errno = EPROTO;
+    return -1;
+  }
+  if (len > 0) {
+    if (t->counting)
+      t->records += tls_records((const uint8_t *)p, (size_t)len);
+    ssize_t n;
+    do
+      n = send(fd, p, (size_t)len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    while (n < 0 && errno == EINTR);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (n < 0)
+      n = 0;
+    if (n < len) {
+      if (!(t->backlog = malloc((size_t)(len - n))))
+        return -1;
+      memcpy(t->backlog, p + n, (size_t)(len - n));
+      t->backlog_len = (size_t)(len - n);
+    }
+    (void)BIO_reset(t->out);
+    if (n < len)
+      return len - n;
+  }
+  if (t->ktls_due)
+    tls_ktls_start(t, fd);
+  return 0;
+}
 
-  if (JS_IsString(argv[1])) {
-    data = JS_ToCStringLen(ctx, &len, argv[1]);
-    if (!data)
-      return JS_EXCEPTION;
+static void tls_established(tls_conn_t *t) {
+  t->established = 1;
+  tls.handshakes++;
+  if (SSL_session_reused(t->ssl))
+    tls.resumed++;
+  if (t->server && t->secret_len && SSL_version(t->ssl) == TLS1_3_VERSION) {
+    t->counting = 1;
+    t->ktls_due = 1;
   } else {
-    return JS_ThrowTypeError(ctx, "Data must be a string");
+    OPENSSL_cleanse(t->secret, sizeof(t->secret));
+    t->secret_len = 0;
   }
+}
 
-  if (argc > 2 && JS_ToInt32(ctx, &flags, argv[2])) {
-    JS_FreeCString(ctx, data);
-    return JS_EXCEPTION;
+static ssize_t tls_error(tls_conn_t *t) {
+  if (!t->established)
+    tls.failures++;
+  ERR_clear_error();
+  errno = EPROTO;
+  return -1;
+}
+
+// recv() through t: plaintext bytes, 0 at the end, or -1 with errno set
+// (EAGAIN until a whole record has arrived, EPROTO if the peer broke TLS)
+static ssize_t tls_recv(tls_conn_t *t, int fd, void *buf, size_t len, int flags) {
+  if (!tls.buf && !(tls.buf = malloc(TLS_RECV_BUF))) {
+    errno = ENOMEM;
+    return -1;
   }
+  if (len > INT_MAX)
+    len = INT_MAX;
+  for (;;) {
+    int n;
+    if (!t->established) {
+      n = SSL_do_handshake(t->ssl);
+      if (n == 1)
+        tls_established(t);
+      if (tls_flush(t, fd) < 0)
+        return -1;
+    } else {
+      n = flags & MSG_PEEK ? SSL_peek(t->ssl, buf, (int)len) : SSL_read(t->ssl, buf, (int)len);
+      if ((t->ktls || BIO_ctrl_pending(t->out)) && tls_flush(t, fd) < 0)
+        return -1;
+      if (n > 0)
+        return n;
+    }
+    if (n == 1)
+      continue;
+    int err = SSL_get_error(t->ssl, n);
+    if (err == SSL_ERROR_ZERO_RETURN)
+      return 0; // close_notify
+    if (err != SSL_ERROR_WANT_READ)
+      return tls_error(t);
 
-  ssize_t sent = send(sockfd, data, len, flags | MSG_NOSIGNAL);
-  JS_FreeCString(ctx, data);
+    ssize_t r;
+    do
+      r = recv(fd, tls.buf, TLS_RECV_BUF, flags & ~MSG_PEEK);
+    while (r < 0 && errno == EINTR);
+    if (r <= 0)
+      return r;
+    if (BIO_write(t->in, tls.buf, (int)r) != (int)r) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+}
 
-  if (sent < 0) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
-      return JS_NewInt32(ctx, 0);
-    return JS_ThrowInternalError(ctx, "send() failed: %s", strerror(errno));
+// send() through t: plaintext bytes taken, or -1 with errno set (EAGAIN
+// while earlier output is still waiting or the handshake is not done)
+static ssize_t tls_send(tls_conn_t *t, int fd, const void *buf, size_t len, int flags) {
+  if (t->ktls)
+    return send(fd, buf, len, flags);
+  ssize_t waiting = tls_flush(t, fd);
+  if (waiting < 0)
+    return -1;
+  if (waiting > 0 || !t->established) {
+    errno = EAGAIN;
+    return -1;
   }
+  if (len == 0)
+    return 0;
+  if (len > TLS_SEND_CHUNK)
+    len = TLS_SEND_CHUNK;
+  int n = SSL_write(t->ssl, buf, (int)len);
+  if (n <= 0) {
+    ERR_clear_error();
+    errno = EPIPE;
+    return -1;
+  }
+  if (tls_flush(t, fd) < 0)
+    return -1;
+  return n;
+}
 
-  return JS_NewInt32(ctx, sent);
+// recv() for any connection
+static ssize_t conn_recv(int fd, void *buf, size_t len, int flags) {
+  tls_conn_t *t = tls_get(fd);
+  return t ? tls_recv(t, fd, buf, len, flags) : recv(fd, buf, len, flags);
 }
 
-// recv(sockfd, bufsize, flags)
-static JSValue js_recv(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int sockfd, bufsize, flags = 0;
+// send() for any connection
+static ssize_t conn_send(int fd, const void *buf, size_t len, int flags) {
+  tls_conn_t *t = tls_get(fd);
+  return t ? tls_send(t, fd, buf, len, flags) : send(fd, buf, len, flags);
+}
 
-  if (JS_ToInt32(ctx, &sockfd, argv[0]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &bufsize, argv[1]))
-    return JS_EXCEPTION;
-  if (argc > 2 && JS_ToInt32(ctx, &flags, argv[2]))
-    return JS_EXCEPTION;
+// sendmsg() of n buffers for any connection. Over userspace TLS they are
+// gathered into one record of up to TLS_SEND_CHUNK bytes.
+static ssize_t conn_sendv(int fd, struct iovec *iov, int n, int flags) {
+  tls_conn_t *t = tls_get(fd);
+  if (!t || t->ktls) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)n };
+    return sendmsg(fd, &msg, flags);
+  }
+  if (n == 1)
+    return tls_send(t, fd, iov[0].iov_base, iov[0].iov_len, flags);
+  if (!tls.gather && !(tls.gather = malloc(TLS_SEND_CHUNK))) {
+    errno = ENOMEM;
+    return -1;
+  }
+  size_t len = 0;
+  for (int i = 0; i < n && len < TLS_SEND_CHUNK; i++) {
+    size_t k = iov[i].iov_len < TLS_SEND_CHUNK - len ? iov[i].iov_len : TLS_SEND_CHUNK - len;
+    memcpy(tls.gather + len, iov[i].iov_base, k);
+    len += k;
+  }
+  return tls_send(t, fd, tls.gather, len, flags);
+}
 
-  if (bufsize > 65536) bufsize = 65536; // Limit to 64KB
+// Bytes of ciphertext fd still has to send; -1 if it is gone
+static ssize_t conn_flush(int fd) {
+  tls_conn_t *t = tls_get(fd);
+  return t ? tls_flush(t, fd) : 0;
+}
 
-  char *buf = malloc(bufsize);
-  if (!buf)
-    return JS_ThrowOutOfMemory(ctx);
+// Sends close_notify if it can and frees fd's TLS state. A connection
+// freed without it would take its session out of the cache.
+static void tls_conn_free(int fd) {
+  tls_conn_t *t = tls_get(fd);
+  if (!t)
+    return;
+  if (t->ktls) {
+    if (!(SSL_get_shutdown(t->ssl) & SSL_SENT_SHUTDOWN))
+      tls_ktls_alert(fd, 1, 0); // warning, close_notify
+    SSL_set_shutdown(t->ssl, SSL_SENT_SHUTDOWN);
+  } else if (t->established && SSL_shutdown(t->ssl) >= 0) {
+    tls_flush(t, fd);
+  }
+  ERR_clear_error();
+  SSL_free(t->ssl); // and both BIOs
+  OPENSSL_cleanse(t->secret, sizeof(t->secret));
+  free(t->backlog);
+  free(t);
+  tls.conns[fd] = NULL;
+  tls.open--;
+}
 
-  ssize_t received = recv(sockfd, buf, bufsize, flags);
+// Keeps the server's application traffic secret for kTLS
+static void tls_keylog(const SSL *ssl, const char *line) {
+  static const char label[] = "SERVER_TRAFFIC_SECRET_0 ";
+  tls_conn_t *t = SSL_get_app_data(ssl);
+  if (!t || strncmp(line, label, sizeof(label) - 1))
+    return;
+  const char *hex = strchr(line + sizeof(label) - 1, ' ');
+  size_t len = hex ? strlen(++hex) / 2 : 0;
+  if (len > TLS_SECRET_MAX)
+    return;
+  for (size_t i = 0; i < len; i++) {
+    int hi = OPENSSL_hexchar2int((unsigned char)hex[2 * i]), lo = OPENSSL_hexchar2int((unsigned char)hex[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+      return;
+    t->secret[i] = (uint8_t)(hi << 4 | lo);
+  }
+  t->secret_len = (uint8_t)len;
+}
 
-  if (received < 0) {
-    free(buf);
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
-      return JS_NewStringLen(ctx, "", 0);
-    return JS_ThrowInternalError(ctx, "recv() failed: %s", strerror(errno));
+// Attaches a TLS endpoint made from ctx to fd; NULL if out of memory
+static tls_conn_t *tls_conn_new(int fd, SSL_CTX *ctx, int server) {
+  if ((size_t)fd >= tls.cap) {
+    size_t cap = tls.cap ? tls.cap : 1024;
+    while (cap <= (size_t)fd)
+      cap *= 2;
+    tls_conn_t **conns = realloc(tls.conns, cap * sizeof(*conns));
+    if (!conns)
+      return NULL;
+    memset(conns + tls.cap, 0, (cap - tls.cap) * sizeof(*conns));
+    tls.conns = conns;
+    tls.cap = cap;
+  }
+  tls_conn_free(fd); // left over from an earlier connection on this fd
+  tls_conn_t *t = calloc(1, sizeof(tls_conn_t));
+  if (!t)
+    return NULL;
+  t->ssl = SSL_new(ctx);
+  t->in = BIO_new(BIO_s_mem());
+  t->out = BIO_new(BIO_s_mem());
+  if (!t->ssl || !t->in || !t->out) {
+    BIO_free(t->in);
+    BIO_free(t->out);
+    SSL_free(t->ssl);
+    free(t);
+    ERR_clear_error();
+    return NULL;
   }
+  // An empty input BIO reports "retry" instead of EOF
+  BIO_set_mem_eof_return(t->in, -1);
+  SSL_set_bio(t->ssl, t->in, t->out);
+  SSL_set_app_data(t->ssl, t);
+  t->server = (uint8_t)server;
+  if (server)
+    SSL_set_accept_state(t->ssl);
+  else
+    SSL_set_connect_state(t->ssl);
+  tls.conns[fd] = t;
+  tls.open++;
+  return t;
+}
+#else
+static inline ssize_t conn_recv(int fd, void *buf, size_t len, int flags) {
+  return recv(fd, buf, len, flags);
+}
 
-  JSValue result = JS_NewStringLen(ctx, buf, received);
-  free(buf);
-  return result;
+static inline ssize_t conn_send(int fd, const void *buf, size_t len, int flags) {
+  return send(fd, buf, len, flags);
 }
 
-// close(fd)
-static JSValue js_close(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int fd;
+static inline ssize_t conn_sendv(int fd, struct iovec *iov, int n, int flags) {
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)n };
+  return sendmsg(fd, &msg, flags);
+}
 
-  if (JS_ToInt32(ctx, &fd, argv[0]))
-    return JS_EXCEPTION;
+static inline ssize_t conn_flush(int fd) {
+  return 0;
+}
 
-  if (close(fd) < 0)
-    return JS_ThrowInternalError(ctx, "close() failed: %s", strerror(errno));
+static inline void tls_conn_free(int fd) {}
+#endif
 
-  return JS_NewInt32(ctx, 0);
-}
+// WebSocket
+//
+// RFC 6455 framing for connections upgraded from HTTP. An idle connection
+// costs one ws_conn_t; message and output buffers exist only while a
+// message is arriving in pieces or the socket is not keeping up. Frames are
+// parsed out of one shared receive buffer and unmasked in place, 16 bytes
+// per step with GCC vector extensions (SSE2 on x86-64, NEON on arm64), and
+// a message that arrived whole becomes a JS value straight from there.
+// Pings are answered and close frames echoed here, so JS only sees
+// complete text and binary messages.
+//
+// Topics fan one message out to many connections: the frame is built once
+// in a refcounted ws_frame_t, written straight to each subscriber's socket
+// and queued by reference where the socket is full. A subscriber whose queue
+// is past the topic's high-water mark misses messages (drop) or keeps only
+// the newest, sent as soon as its queue drains (coalesce).
+//
+// Server-sent event streams are ws_conn_t too, sharing the output queue and
+// topics; only the encoding differs. They sit on a list ordered by last
+// write, so a heartbeat sweep touches just the streams that are due.
+#define WS_RECV_BUF 65536
+#define WS_MAX_MESSAGE (1 << 20)
+#define WS_MAX_OUT (4 << 20) // per connection, before sends fail
+#define WS_HIGH_WATER (256 << 10)
+#define WS_TOPIC_BUCKETS 1024
 
-// setsockopt(sockfd, level, optname, optval)
-static JSValue js_setsockopt(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int sockfd, level, optname, optval;
+enum { WS_CONT = 0, WS_TEXT = 1, WS_BINARY = 2, WS_CLOSE = 8, WS_PING = 9, WS_PONG = 10 };
 
-  if (JS_ToInt32(ctx, &sockfd, argv[0]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &level, argv[1]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &optname, argv[2]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &optval, argv[3]))
-    return JS_EXCEPTION;
+typedef struct {
+  uint32_t refs;
+  size_t len;
+  uint8_t data[];
+} ws_frame_t;
 
-  if (setsockopt(sockfd, level, optname, &optval, sizeof(optval)) < 0)
-    return JS_ThrowInternalError(ctx, "setsockopt() failed: %s", strerror(errno));
+typedef struct ws_out {
+  struct ws_out *next;
+  ws_frame_t *shared; // published frame, or NULL for data in own[]
+  const uint8_t *data;
+  size_t len;
+  size_t off;         // bytes already written
+  uint8_t own[];
+} ws_out_t;
 
-  return JS_NewInt32(ctx, 0);
+typedef struct ws_conn {
+  uint8_t head[14];   // frame header while it arrives
+  uint8_t head_len;
+  uint8_t in_payload;
+  uint8_t opcode;     // of the current frame
+  uint8_t fin;
+  uint8_t mask[4];
+  uint8_t msg_opcode; // WS_TEXT or WS_BINARY while a message is being assembled
+  uint8_t close_sent;
+  uint8_t ctl_len;
+  uint8_t ctl[125];   // control frame payload
+  uint64_t remaining; // payload bytes of the current frame still to come
+  uint64_t frame_off; // payload bytes of the current frame seen so far
+  uint8_t *msg;       // message assembled from fragments or partial reads
+  size_t msg_len;
+  size_t msg_cap;
+  size_t max_message;
+  ws_out_t *out;      // unsent frames, oldest first
+  ws_out_t *out_tail;
+  size_t out_bytes;
+  struct ws_sub *subs;
+  uint32_t held;      // subscriptions holding back a coalesced message
+  int fd;
+  uint8_t sse;        // an event stream, not a WebSocket
+  struct h2_conn *h2; // an HTTP/2 connection if set
+  struct ws_conn *older; // event streams by last write
+  struct ws_conn *newer;
+  uint64_t written_ns;
+} ws_conn_t;
+
+typedef struct ws_topic {
+  struct ws_topic *next; // hash chain
+  struct ws_sub **subs;
+  uint32_t count;
+  uint32_t cap;
+  uint32_t hash;
+  size_t len;
+  uint8_t coalesce;
+  uint8_t configured;    // kept without subscribers
+  size_t high_water;
+  uint64_t published;
+  uint64_t dropped;
+  char name[];
+} ws_topic_t;
+
+typedef struct ws_sub {
+  ws_topic_t *topic;
+  ws_conn_t *conn;
+  struct ws_sub *next;   // the connection's other subscriptions
+  ws_frame_t *latest;    // coalesced message waiting for the queue to drain
+  int fd;
+  uint32_t index;        // in topic->subs
+} ws_sub_t;
+
+static struct {
+  ws_conn_t **conns;  // by fd
+  size_t cap;
+  uint8_t *buf;       // WS_RECV_BUF bytes, shared by every connection
+  uint64_t open;
+  uint64_t messages_in;
+  uint64_t messages_out;
+  uint64_t pings;
+  ws_topic_t *topics[WS_TOPIC_BUCKETS];
+  uint64_t topic_count;
+  uint64_t subscriptions;
+  uint64_t published;
+  uint64_t delivered;
+  uint64_t dropped;
+  uint64_t coalesced;
+  ws_conn_t *oldest;  // event stream written longest ago
+  ws_conn_t *newest;
+  uint64_t streams;
+  uint64_t events;
+  uint64_t heartbeats;
+} ws;
+
+static ws_conn_t *ws_get(int fd) {
+  return fd >= 0 && (size_t)fd < ws.cap ? ws.conns[fd] : NULL;
 }
 
-// shutdown(sockfd, how)
-static JSValue js_shutdown(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int sockfd, how;
+static void sse_unlink(ws_conn_t *c) {
+  if (c->older)
+    c->older->newer = c->newer;
+  else
+    ws.oldest = c->newer;
+  if (c->newer)
+    c->newer->older = c->older;
+  else
+    ws.newest = c->older;
+  c->older = c->newer = NULL;
+}
 
-  if (JS_ToInt32(ctx, &sockfd, argv[0]))
-    return JS_EXCEPTION;
-  if (JS_ToInt32(ctx, &how, argv[1]))
-    return JS_EXCEPTION;
+// Marks an event stream as just written, moving it to the end of the list
+static void sse_touch(ws_conn_t *c) {
+  c->written_ns = now_ns();
+  if (ws.newest == c)
+    return;
+  if (ws.oldest == c || c->older)
+    sse_unlink(c);
+  c->older = ws.newest;
+  if (ws.newest)
+    ws.newest->newer = c;
+  else
+    ws.oldest = c;
+  ws.newest = c;
+}
 
-  if (shutdown(sockfd, how) < 0)
-    return JS_ThrowInternalError(ctx, "shutdown() failed: %s", strerror(errno));
+static void ws_frame_unref(ws_frame_t *f) {
+  if (f && --f->refs == 0)
+    free(f);
+}
 
-  return JS_NewInt32(ctx, 0);
+static void ws_out_free(ws_out_t *o) {
+  ws_frame_unref(o->shared);
+  free(o);
 }
 
-// gethostbyname(hostname) -> address
-static JSValue js_gethostbyname(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  const char *hostname = JS_ToCString(ctx, argv[0]);
-  if (!hostname)
-    return JS_EXCEPTION;
+static uint32_t ws_topic_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)name[i]) * 16777619u;
+  return h;
+}
 
-  struct hostent *he = gethostbyname(hostname);
-  JS_FreeCString(ctx, hostname);
+// The topic called name, created if create is set; NULL if there is none
+static ws_topic_t *ws_topic_get(const char *name, size_t len, int create) {
+  uint32_t h = ws_topic_hash(name, len);
+  ws_topic_t **pp = &ws.topics[h % WS_TOPIC_BUCKETS];
+  for (ws_topic_t *t = *pp; t; t = t->next)
+    if (t->hash == h && t->len == len && memcmp(t->name, name, len) == 0)
+      return t;
+  if (!create)
+    return NULL;
+  ws_topic_t *t = calloc(1, sizeof(ws_topic_t) + len + 1);
+  if (!t)
+    return NULL;
+  memcpy(t->name, name, len);
+  t->len = len;
+  t->hash = h;
+  t->high_water = WS_HIGH_WATER;
+  t->next = *pp;
+  *pp = t;
+  ws.topic_count++;
+  return t;
+}
 
-  if (!he)
-    return JS_ThrowInternalError(ctx, "gethostbyname() failed");
+// Frees t once it has no subscribers, unless it was configured
+static void ws_topic_release(ws_topic_t *t) {
+  if (t->count || t->configured)
+    return;
+  ws_topic_t **pp = &ws.topics[t->hash % WS_TOPIC_BUCKETS];
+  while (*pp != t)
+    pp = &(*pp)->next;
+  *pp = t->next;
+  free(t->subs);
+  free(t);
+  ws.topic_count--;
+}
 
-  char *addr = inet_ntoa(*(struct in_addr *)he->h_addr);
-  return JS_NewString(ctx, addr);
+// Takes s out of its topic; the caller unlinks it from the connection
+static void ws_sub_free(ws_sub_t *s) {
+  ws_topic_t *t = s->topic;
+  ws_sub_t *last = t->subs[--t->count];
+  t->subs[s->index] = last;
+  last->index = s->index;
+  if (s->latest) {
+    ws_frame_unref(s->latest);
+    s->conn->held--;
+  }
+  free(s);
+  ws.subscriptions--;
+  ws_topic_release(t);
 }
 
-// HTTP Parser helpers
-static inline char *skip_whitespace(char *p) {
-  while (*p == ' ' || *p == '\t') p++;
-  return p;
+static void ws_conn_free(int fd) {
+  ws_conn_t *c = ws_get(fd);
+  if (!c)
+    return;
+  while (c->subs) {
+    ws_sub_t *s = c->subs;
+    c->subs = s->next;
+    ws_sub_free(s);
+  }
+  while (c->out) {
+    ws_out_t *o = c->out;
+    c->out = o->next;
+    ws_out_free(o);
+  }
+  if (c->sse) {
+    sse_unlink(c);
+    ws.streams--;
+  } else if (!c->h2) {
+    ws.open--;
+  }
+  free(c->msg);
+  free(c);
+  ws.conns[fd] = NULL;
 }
 
-static inline char *find_eol(char *p) {
-  while (*p && *p != '\r' && *p != '\n') p++;
-  return p;
+// XORs p[0..n) with mask, starting at byte off of the masking key
+static void ws_unmask(uint8_t *p, size_t n, const uint8_t mask[4], uint64_t off) {
+  typedef uint8_t v16 __attribute__((vector_size(16)));
+  uint8_t m[16];
+  for (int i = 0; i < 16; i++)
+    m[i] = mask[(off + (uint64_t)i) & 3];
+  v16 mv;
+  memcpy(&mv, m, 16);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    v16 x;
+    memcpy(&x, p + i, 16);
+    x ^= mv;
+    memcpy(p + i, &x, 16);
+  }
+  for (; i < n; i++)
+    p[i] ^= m[i & 15];
 }
 
-static void url_decode(char *dst, const char *src) {
-  while (*src) {
-    if (*src == '%' && isxdigit(src[1]) && isxdigit(src[2])) {
-      int c1 = tolower(src[1]);
-      int c2 = tolower(src[2]);
-      c1 = c1 <= '9' ? c1 - '0' : c1 - 'a' + 10;
-      c2 = c2 <= '9' ? c2 - '0' : c2 - 'a' + 10;
-      *dst++ = (c1 << 4) | c2;
-      src += 3;
-    } else if (*src == '+') {
-      *dst++ = ' ';
-      src++;
-    } else {
-      *dst++ = *src++;
+static int utf8_valid(const uint8_t *p, size_t n) {
+  size_t i = 0;
+  while (i < n) {
+    if (i + 8 <= n) {
+      uint64_t w;
+      memcpy(&w, p + i, 8);
+      if (!(w & 0x8080808080808080ull)) {
+        i += 8;
+        continue;
+      }
+    }
+    uint8_t b = p[i];
+    if (b < 0x80) {
+      i++;
+      continue;
     }
+    int extra;
+    uint32_t cp;
+    if (b >= 0xc2 && b <= 0xdf)
+      extra = 1, cp = b & 0x1f;
+    else if (b >= 0xe0 && b <= 0xef)
+      extra = 2, cp = b & 0x0f;
+    else if (b >= 0xf0 && b <= 0xf4)
+      extra = 3, cp = b & 0x07;
+    else
+      return 0;
+    if (i + (size_t)extra >= n)
+      return 0;
+    for (int k = 1; k <= extra; k++) {
+      if ((p[i + k] & 0xc0) != 0x80)
+        return 0;
+      cp = cp << 6 | (p[i + k] & 0x3f);
+    }
+    // Overlong forms, UTF-16 surrogates and values past U+10FFFF
+    if ((extra == 2 && cp < 0x800) || (extra == 3 && (cp < 0x10000 || cp > 0x10ffff)) ||
+        (cp >= 0xd800 && cp <= 0xdfff))
+      return 0;
+    i += (size_t)extra + 1;
   }
-  *dst = '\0';
+  return 1;
 }
 
-// parse_http_request(data) -> {method, url, path, query, headers, body, httpVersion}
-static JSValue js_parse_http_request(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  size_t data_len;
-  const char *data = JS_ToCStringLen(ctx, &data_len, argv[0]);
-  if (!data)
-    return JS_EXCEPTION;
+static void ws_out_push(ws_conn_t *c, ws_out_t *o) {
+  o->next = NULL;
+  if (c->out_tail)
+    c->out_tail->next = o;
+  else
+    c->out = o;
+  c->out_tail = o;
+  c->out_bytes += o->len - o->off;
+}
 
-  if (data_len == 0) {
-    JS_FreeCString(ctx, data);
-    return JS_ThrowInternalError(ctx, "Empty request data");
+// Writes head + payload, queueing what the socket does not take. -1 if the
+// connection is gone or its queue would exceed WS_MAX_OUT.
+static int ws_write(ws_conn_t *c, int fd, const uint8_t *head, size_t head_len,
+                    const uint8_t *payload, size_t len) {
+  size_t total = head_len + len, done = 0;
+  if (c->sse)
+    sse_touch(c);
+  if (!c->out) {
+    struct iovec iov[2] = { { (void *)head, head_len }, { (void *)payload, len } };
+    ssize_t n = conn_sendv(fd, iov, len ? 2 : 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (n > 0) {
+      METRIC_ADD(metrics.bytes_out, (uint64_t)n);
+      done = (size_t)n;
+    }
+    if (done >= total)
+      return 0;
+  }
+  size_t rest = total - done;
+  if (c->out_bytes + rest > WS_MAX_OUT)
+    return -1;
+  ws_out_t *o = malloc(sizeof(ws_out_t) + rest);
+  if (!o)
+    return -1;
+  o->shared = NULL;
+  o->data = o->own;
+  o->len = rest;
+  o->off = 0;
+  if (done < head_len) {
+    memcpy(o->own, head + done, head_len - done);
+    if (len)
+      memcpy(o->own + head_len - done, payload, len);
+  } else {
+    size_t sent = done - head_len; // of the payload, < len here
+    memcpy(o->own, payload + sent, len - sent);
   }
+  ws_out_push(c, o);
+  return 0;
+}
 
-  JSValue result = JS_NewObject(ctx);
-  JSValue headers = JS_NewObject(ctx);
-  JSValue query = JS_NewObject(ctx);
-  
-  const char *p = data;
-  const char *end = data + data_len;
+// Like ws_write for a published frame: what the socket does not take is
+// queued as a reference to f, not a copy
+static int ws_write_shared(ws_conn_t *c, int fd, ws_frame_t *f) {
+  size_t done = 0;
+  if (c->sse)
+    sse_touch(c);
+  if (!c->out) {
+    ssize_t n = conn_send(fd, f->data, f->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (n > 0) {
+      METRIC_ADD(metrics.bytes_out, (uint64_t)n);
+      done = (size_t)n;
+    }
+    if (done == f->len)
+      return 0;
+  }
+  if (c->out_bytes + f->len - done > WS_MAX_OUT)
+    return -1;
+  ws_out_t *o = malloc(sizeof(ws_out_t));
+  if (!o)
+    return -1;
+  f->refs++;
+  o->shared = f;
+  o->data = f->data;
+  o->len = f->len;
+  o->off = done;
+  ws_out_push(c, o);
+  return 0;
+}
 
-  // Parse request line: METHOD URL HTTP/VERSION
-  const char *method_start = p;
-  while (p < end && *p != ' ') p++;
-  if (p >= end) goto error;
-  
-  JS_SetPropertyStr(ctx, result, "method", JS_NewStringLen(ctx, method_start, p - method_start));
-  p++; // skip space
+// Sends as much of the queue as the socket takes; -1 if the connection is gone.
+// Once it is empty, coalesced messages held back for this connection follow.
+static int ws_flush(ws_conn_t *c, int fd) {
+  if (conn_flush(fd) < 0)
+    return -1;
+  while (c->out) {
+    ws_out_t *o = c->out;
+    ssize_t n = conn_send(fd, o->data + o->off, o->len - o->off, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    METRIC_ADD(metrics.bytes_out, (uint64_t)n);
+    c->out_bytes -= (size_t)n;
+    o->off += (size_t)n;
+    if (o->off < o->len)
+      return 0;
+    c->out = o->next;
+    if (!c->out)
+      c->out_tail = NULL;
+    ws_out_free(o);
+  }
+  for (ws_sub_t *s = c->subs; s && c->held; s = s->next) {
+    ws_frame_t *f = s->latest;
+    if (!f)
+      continue;
+    s->latest = NULL;
+    c->held--;
+    int rc = c->close_sent ? 0 : ws_write_shared(c, fd, f);
+    ws_frame_unref(f);
+    if (rc < 0)
+      return -1;
+    ws.delivered++;
+  }
+  return 0;
+}
 
-  // Parse URL
-  const char *url_start = p;
-  while (p < end && *p != ' ') p++;
-  if (p >= end) goto error;
-  
-  size_t url_len = p - url_start;
-  char *url_copy = malloc(url_len + 1);
-  if (!url_copy) goto error;
-  memcpy(url_copy, url_start, url_len);
-  url_copy[url_len] = '\0';
+// Writes the header of an unmasked frame; returns its length
+static size_t ws_frame_head(uint8_t head[10], int opcode, size_t len) {
+  head[0] = (uint8_t)(0x80 | opcode);
+  if (len < 126) {
+    head[1] = (uint8_t)len;
+    return 2;
+  }
+  if (len < 65536) {
+    head[1] = 126;
+    head[2] = (uint8_t)(len >> 8);
+    head[3] = (uint8_t)len;
+    return 4;
+  }
+  head[1] = 127;
+  for (int i = 0; i < 8; i++)
+    head[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+  return 10;
+}
 
-  // Parse HTTP version
-  p++; // skip space
-  const char *version_start = p;
-  while (p < end && *p != '\r' && *p != '\n') p++;
-  size_t version_len = p - version_start;
-  
-  // Extract HTTP version (e.g., "HTTP/1.0" or "HTTP/1.1")
-  char *http_version = malloc(version_len + 1);
-  if (!http_version) {
-    free(url_copy);
-    goto error;
+// Encodes an event as id, event and one data field per line of data
+// (split at CRLF, CR or LF) into out, which may be NULL; returns its length
+static size_t sse_encode(uint8_t *out, const char *id, size_t id_len, const char *type, size_t type_len,
+                         const uint8_t *data, size_t len) {
+  size_t n = 0;
+#define SSE_PUT(p, k) do { if (out) memcpy(out + n, p, k); n += (k); } while (0)
+  if (id) {
+    SSE_PUT("id: ", 4);
+    SSE_PUT(id, id_len);
+    SSE_PUT("\n", 1);
   }
-  memcpy(http_version, version_start, version_len);
-  http_version[version_len] = '\0';
-  JS_SetPropertyStr(ctx, result, "httpVersion", JS_NewString(ctx, http_version));
-  free(http_version);
-  
-  // Skip to end of request line
-  while (p < end && *p != '\n') p++;
-  if (p < end && *p == '\n') p++;
-  
-  // Split URL into path and query
-  char *query_sep = strchr(url_copy, '?');
-  if (query_sep) {
-    *query_sep = '\0';
-    char *query_str = query_sep + 1;
-
-    // Parse query string
-    char *q = query_str;
-    while (*q) {
-      char *key_start = q;
-      char *eq = strchr(q, '=');
-      char *amp = strchr(q, '&');
-      
-      if (!amp) amp = q + strlen(q);
-
-      if (eq && eq < amp) {
-        *eq = '\0';
-        if (*amp) *amp = '\0';
-
-        char decoded_key[256] = {0}, decoded_value[2048] = {0};
-        url_decode(decoded_key, key_start);
-        url_decode(decoded_value, eq + 1);
-
-        JS_SetPropertyStr(ctx, query, decoded_key, JS_NewString(ctx, decoded_value));
-        q = *amp ? amp + 1 : amp;
-      } else {
-        if (*amp) *amp = '\0';
+  if (type) {
+    SSE_PUT("event: ", 7);
+    SSE_PUT(type, type_len);
+    SSE_PUT("\n", 1);
+  }
+  size_t start = 0;
+  for (size_t i = 0; i <= len; i++) {
+    if (i < len && data[i] != '\n' && data[i] != '\r')
+      continue;
+    SSE_PUT("data: ", 6);
+    SSE_PUT(data + start, i - start);
+    SSE_PUT("\n", 1);
+    if (i + 1 < len && data[i] == '\r' && data[i + 1] == '\n')
+      i++;
+    start = i + 1;
+  }
+  SSE_PUT("\n", 1);
+#undef SSE_PUT
+  return n;
+}
 
-        char decoded_key[256] = {0};
-        url_decode(decoded_key, key_start);
-        JS_SetPropertyStr(ctx, query, decoded_key, JS_NewString(ctx, ""));
-        q = *amp ? amp + 1 : amp;
-      }
-    }
+static ws_frame_t *ws_frame_new(size_t len) {
+  ws_frame_t *f = malloc(sizeof(ws_frame_t) + len);
+  if (f) {
+    f->refs = 1;
+    f->len = len;
   }
+  return f;
+}
 
-  JS_SetPropertyStr(ctx, result, "url", JS_NewString(ctx, url_copy));
-  JS_SetPropertyStr(ctx, result, "path", JS_NewString(ctx, url_copy));
-  JS_SetPropertyStr(ctx, result, "query", query);
-  free(url_copy);
-  
-  // Parse headers
-  int content_length = 0;
-  char content_type[128] = {0};
-  char connection_header[64] = {0};
+static int ws_send_frame(ws_conn_t *c, int fd, int opcode, const uint8_t *payload, size_t len) {
+  uint8_t head[10];
+  size_t head_len = ws_frame_head(head, opcode, len);
+  return ws_write(c, fd, head, head_len, payload, len);
+}
 
-  while (p < end) {
-    // Check for empty line (end of headers)
-    if (*p == '\r' && p + 1 < end && *(p + 1) == '\n') {
-      p += 2; // skip \r\n
-      break;
-    }
-    if (*p == '\n') {
-      p++;
-      break;
-    }
+// Sends a close frame once; code 0 sends one without a status
+static int ws_send_close(ws_conn_t *c, int fd, int code, const char *reason, size_t reason_len) {
+  uint8_t payload[125] = { 0 };
+  size_t len = 0;
+  if (c->close_sent)
+    return 0;
+  c->close_sent = 1;
+  if (code) {
+    if (reason_len > 123)
+      reason_len = 123;
+    payload[0] = (uint8_t)(code >> 8);
+    payload[1] = (uint8_t)code;
+    if (reason_len)
+      memcpy(payload + 2, reason, reason_len);
+    len = 2 + reason_len;
+  }
+  return ws_send_frame(c, fd, WS_CLOSE, payload, len);
+}
 
-    // Parse header name
-    const char *header_name_start = p;
-    while (p < end && *p != ':') p++;
-    if (p >= end) break;
-    
-    size_t header_name_len = p - header_name_start;
-    char header_name[256];
-    if (header_name_len >= sizeof(header_name)) header_name_len = sizeof(header_name) - 1;
-    
-    // Copy and lowercase header name
-    for (size_t i = 0; i < header_name_len; i++) {
-      header_name[i] = tolower(header_name_start[i]);
-    }
-    header_name[header_name_len] = '\0';
+// Fails the connection: sends close with code and returns it
+static int ws_fail(ws_conn_t *c, int fd, int code) {
+  ws_send_close(c, fd, code, NULL, 0);
+  return code;
+}
 
-    p++; // skip ':'
-    while (p < end && (*p == ' ' || *p == '\t')) p++; // skip whitespace
-    
-    const char *value_start = p;
-    while (p < end && *p != '\r' && *p != '\n') p++;
-    
-    size_t value_len = p - value_start;
+static int ws_close_code_valid(int code) {
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+}
 
-    // Track special headers
-    if (strcmp(header_name, "content-length") == 0) {
-      char len_str[32];
-      if (value_len < sizeof(len_str)) {
-        memcpy(len_str, value_start, value_len);
-        len_str[value_len] = '\0';
-        content_length = atoi(len_str);
+// Appends a complete message to messages; a close code if it is invalid text
+static int ws_deliver(JSContext *ctx, ws_conn_t *c, int fd, const uint8_t *p, size_t len,
+                      JSValue messages, uint32_t *count) {
+  int opcode = c->msg_opcode;
+  c->msg_opcode = 0;
+  if (opcode == WS_TEXT && !utf8_valid(p, len))
+    return ws_fail(c, fd, 1007);
+  JSValue v = opcode == WS_TEXT ? JS_NewStringLen(ctx, (const char *)p, len) : JS_NewArrayBufferCopy(ctx, p, len);
+  JS_SetPropertyUint32(ctx, messages, (*count)++, v);
+  ws.messages_in++;
+  return 0;
+}
+
+// Answers a ping, or echoes a close and returns its status code
+static int ws_control(ws_conn_t *c, int fd) {
+  if (c->opcode == WS_PING) {
+    ws.pings++;
+    return ws_send_frame(c, fd, WS_PONG, c->ctl, c->ctl_len) < 0 ? 1006 : 0;
+  }
+  if (c->opcode == WS_PONG)
+    return 0;
+  if (c->ctl_len == 0) {
+    ws_send_close(c, fd, 0, NULL, 0);
+    return 1005; // no status received
+  }
+  int code = c->ctl[0] << 8 | c->ctl[1];
+  if (c->ctl_len == 1 || !ws_close_code_valid(code) || !utf8_valid(c->ctl + 2, c->ctl_len - 2))
+    return ws_fail(c, fd, 1002);
+  ws_send_close(c, fd, code, NULL, 0);
+  return code;
+}
+
+static int ws_frame_done(JSContext *ctx, ws_conn_t *c, int fd, JSValue messages, uint32_t *count) {
+  c->in_payload = 0;
+  if (c->opcode >= WS_CLOSE)
+    return ws_control(c, fd);
+  if (!c->fin)
+    return 0;
+  int rc = ws_deliver(ctx, c, fd, c->msg ? c->msg : (const uint8_t *)"", c->msg_len, messages, count);
+  free(c->msg); // idle connections keep no buffer
+  c->msg = NULL;
+  c->msg_len = c->msg_cap = 0;
+  return rc;
+}
+
+// Feeds n received bytes through the frame parser. 0 to keep reading, or
+// the close code once the connection is closing.
+static int ws_consume(JSContext *ctx, ws_conn_t *c, int fd, uint8_t *p, size_t n,
+                      JSValue messages, uint32_t *count) {
+  while (n > 0) {
+    if (!c->in_payload) {
+      size_t need = 2;
+      for (;;) {
+        if (c->head_len >= 2) {
+          if (!(c->head[1] & 0x80))
+            return ws_fail(c, fd, 1002); // clients must mask
+          uint8_t len7 = c->head[1] & 0x7f;
+          need = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + 4;
+        }
+        if (c->head_len == need || n == 0)
+          break;
+        c->head[c->head_len++] = *p++;
+        n--;
       }
-    } else if (strcmp(header_name, "content-type") == 0) {
-      if (value_len < sizeof(content_type)) {
-        memcpy(content_type, value_start, value_len);
-        content_type[value_len] = '\0';
+      if (c->head_len < need)
+        return 0;
+
+      uint8_t b0 = c->head[0], len7 = c->head[1] & 0x7f;
+      uint64_t len = len7;
+      size_t at = 2;
+      if (len7 == 126) {
+        len = (uint64_t)c->head[2] << 8 | c->head[3];
+        at = 4;
+      } else if (len7 == 127) {
+        len = 0;
+        for (int i = 0; i < 8; i++)
+          len = len << 8 | c->head[2 + i];
+        at = 10;
       }
-    } else if (strcmp(header_name, "connection") == 0) {
-      if (value_len < sizeof(connection_header)) {
-        memcpy(connection_header, value_start, value_len);
-        connection_header[value_len] = '\0';
+      memcpy(c->mask, c->head + at, 4);
+      c->head_len = 0;
+      c->fin = b0 >> 7;
+      c->opcode = b0 & 0x0f;
+      if (b0 & 0x70)
+        return ws_fail(c, fd, 1002); // no extensions were negotiated
+      if (c->opcode >= WS_CLOSE) {
+        if (!c->fin || len > 125 || c->opcode > WS_PONG)
+          return ws_fail(c, fd, 1002);
+        c->ctl_len = 0;
+      } else if (c->opcode == WS_CONT ? !c->msg_opcode : c->opcode > WS_BINARY || c->msg_opcode) {
+        return ws_fail(c, fd, 1002);
+      } else {
+        if (len > c->max_message - c->msg_len)
+          return ws_fail(c, fd, 1009);
+        if (c->opcode != WS_CONT)
+          c->msg_opcode = c->opcode;
       }
+      c->remaining = len;
+      c->frame_off = 0;
+      c->in_payload = 1;
+      if (len == 0) {
+        int rc = ws_frame_done(ctx, c, fd, messages, count);
+        if (rc)
+          return rc;
+      }
+      continue;
     }
-    
-    JS_SetPropertyStr(ctx, headers, header_name, JS_NewStringLen(ctx, value_start, value_len));
 
-    // Skip to next line
-    if (p < end && *p == '\r') p++;
-    if (p < end && *p == '\n') p++;
+    size_t take = n < c->remaining ? n : (size_t)c->remaining;
+    if (c->opcode >= WS_CLOSE) {
+      memcpy(c->ctl + c->ctl_len, p, take);
+      ws_unmask(c->ctl + c->ctl_len, take, c->mask, c->frame_off);
+      c->ctl_len += (uint8_t)take;
+    } else if (c->fin && c->msg_len == 0 && c->frame_off == 0 && take == c->remaining) {
+      // Whole message in this read: unmask and hand it over in place
+      ws_unmask(p, take, c->mask, 0);
+      c->in_payload = 0;
+      int rc = ws_deliver(ctx, c, fd, p, take, messages, count);
+      if (rc)
+        return rc;
+      p += take;
+      n -= take;
+      continue;
+    } else {
+      if (c->msg_len + take > c->msg_cap) {
+        size_t cap = c->msg_cap ? c->msg_cap * 2 : 4096;
+        while (cap < c->msg_len + take)
+          cap *= 2;
+        if (cap > c->max_message)
+          cap = c->max_message;
+        uint8_t *msg = realloc(c->msg, cap);
+        if (!msg)
+          return ws_fail(c, fd, 1011);
+        c->msg = msg;
+        c->msg_cap = cap;
+      }
+      memcpy(c->msg + c->msg_len, p, take);
+      ws_unmask(c->msg + c->msg_len, take, c->mask, c->frame_off);
+      c->msg_len += take;
+    }
+    p += take;
+    n -= take;
+    c->frame_off += take;
+    c->remaining -= take;
+    if (c->remaining == 0) {
+      int rc = ws_frame_done(ctx, c, fd, messages, count);
+      if (rc)
+        return rc;
+    }
   }
+  return 0;
+}
 
-  JS_SetPropertyStr(ctx, result, "headers", headers);
+static void sha1(const uint8_t *data, size_t len, uint8_t out[20]) {
+  uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  uint8_t block[64];
+  uint64_t bits = (uint64_t)len * 8;
+  size_t blocks = (len + 8) / 64 + 1;
+  for (size_t b = 0; b < blocks; b++) {
+    // Message, then 0x80, zero padding and the 64-bit big-endian bit length
+    for (size_t i = 0; i < 64; i++) {
+      size_t k = b * 64 + i;
+      block[i] = k < len ? data[k] : k == len ? 0x80 : 0;
+    }
+    if (b == blocks - 1)
+      for (int i = 0; i < 8; i++)
+        block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
 
-  // Parse body (p now points to start of body)
-  if (content_length > 0 && p < end) {
-    size_t available = end - p;
-    size_t body_len = content_length < available ? content_length : available;
-
-    if (body_len > 0) {
-      // Check if it's JSON
-      if (strstr(content_type, "application/json")) {
-        // Try to parse as JSON
-        JSValue json_val = JS_ParseJSON(ctx, p, body_len, "<body>");
-        if (!JS_IsException(json_val)) {
-          JS_SetPropertyStr(ctx, result, "body", json_val);
-        } else {
-          // Fall back to string if JSON parsing fails
-          JS_FreeValue(ctx, json_val);
-          JS_SetPropertyStr(ctx, result, "body", JS_NewStringLen(ctx, p, body_len));
-        }
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+      w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+             (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 80; i++) {
+      uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+      w[i] = x << 1 | x >> 31;
+    }
+    uint32_t a = h[0], bb = h[1], cc = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20)
+        f = (bb & cc) | (~bb & d), k = 0x5a827999;
+      else if (i < 40)
+        f = bb ^ cc ^ d, k = 0x6ed9eba1;
+      else if (i < 60)
+        f = (bb & cc) | (bb & d) | (cc & d), k = 0x8f1bbcdc;
+      else
+        f = bb ^ cc ^ d, k = 0xca62c1d6;
+      uint32_t t = (a << 5 | a >> 27) + f + e + k + w[i];
+      e = d;
+      d = cc;
+      cc = bb << 30 | bb >> 2;
+      bb = a;
+      a = t;
+    }
+    h[0] += a;
+    h[1] += bb;
+    h[2] += cc;
+    h[3] += d;
+    h[4] += e;
+  }
+  for (int i = 0; i < 20; i++)
+    out[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+// NUL-terminated base64 of data into out (4 * ceil(len / 3) + 1 bytes)
+static void base64_encode(const uint8_t *data, size_t len, char *out) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t i = 0;
+  for (; i + 2 < len; i += 3) {
+    uint32_t v = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 | data[i + 2];
+    *out++ = alphabet[v >> 18];
+    *out++ = alphabet[(v >> 12) & 63];
+    *out++ = alphabet[(v >> 6) & 63];
+    *out++ = alphabet[v & 63];
+  }
+  if (i < len) {
+    uint32_t v = (uint32_t)data[i] << 16 | (i + 1 < len ? (uint32_t)data[i + 1] << 8 : 0);
+    *out++ = alphabet[v >> 18];
+    *out++ = alphabet[(v >> 12) & 63];
+    *out++ = i + 1 < len ? alphabet[(v >> 6) & 63] : '=';
+    *out++ = '=';
+  }
+  *out = '\0';
+}
+
+// HTTP/2
+//
+// Cleartext HTTP/2 (h2c, RFC 9113) for connections that open with the
+// client preface or upgrade from HTTP/1.1. Such a connection is a ws_conn_t
+// whose h2 member holds the HPACK tables (RFC 7541), the flow-control
+// windows and the open streams: frames are parsed out of the WebSocket
+// receive buffer and leave through its output queue. A stream is assembled
+// here until its request is complete, so JS gets one request per stream and
+// never sees a frame. Responses are framed here too. A field the connection
+// has sent before costs one byte from the dynamic table, and DATA is cut to
+// the peer's frame size and windows; the rest waits on its stream until a
+// WINDOW_UPDATE arrives or the socket takes more.
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_MAX 16384        // largest frame accepted, the protocol default
+#define H2_WINDOW (1 << 20)       // receive window of a stream
+#define H2_CONN_WINDOW (16 << 20) // receive window of a connection
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_MAX_STREAMS 100        // concurrent streams per connection
+#define H2_MAX_HEADERS (64 << 10) // header block, and decoded fields of a request
+#define H2_MAX_BODY (1 << 20)     // request body, past which the stream is answered 413
+#define H2_TABLE_SIZE 4096        // HPACK dynamic tables, both directions
+#define H2_TABLE_ENTRIES 128      // H2_TABLE_SIZE / 32, the overhead of an entry
+#define H2_OUT_HIGH (256 << 10)   // queued output past which DATA waits
+
+enum { H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS, H2_PUSH_PROMISE, H2_PING, H2_GOAWAY,
+       H2_WINDOW_UPDATE, H2_CONTINUATION };
+enum { H2_END_STREAM = 0x1, H2_ACK = 0x1, H2_END_HEADERS = 0x4, H2_PADDED = 0x8, H2_PRIO = 0x20 };
+enum { H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_STREAM_CLOSED = 5,
+       H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_COMPRESSION_ERROR = 9, H2_ENHANCE_YOUR_CALM = 11 };
+enum { H2_METHOD = 1, H2_SCHEME = 2, H2_PATH = 4, H2_AUTHORITY = 8 }; // pseudo-header fields seen
+
+typedef struct {
+  uint32_t name_len;
+  uint32_t value_len;
+  char data[];        // name, then value
+} h2_entry_t;
+
+typedef struct {
+  h2_entry_t *entries[H2_TABLE_ENTRIES]; // ring, newest at head
+  uint32_t head;
+  uint32_t count;
+  size_t size;        // names and values plus 32 per entry
+  size_t max;
+} h2_table_t;
+
+typedef struct h2_stream {
+  struct h2_stream *next;
+  uint32_t id;
+  uint8_t ended;      // END_STREAM received: the request is complete
+  uint8_t ready;      // complete, waiting for h2_read() to hand it to JS
+  uint8_t pseudo;     // H2_METHOD... seen
+  uint8_t regular;    // a regular field was seen; pseudo-header fields must come first
+  uint8_t *fields;    // name length, value length (uint32_t each), name, NUL, value, NUL
+  size_t fields_len;
+  size_t fields_cap;
+  uint8_t *body;
+  size_t body_len;
+  size_t body_cap;
+  int64_t content_length; // declared, -1 if not
+  int64_t send_window;
+  int64_t recv_window;
+  uint8_t *out;       // response body not framed yet
+  size_t out_len;
+  size_t out_off;
+} h2_stream_t;
+
+typedef struct h2_conn {
+  uint8_t preface;      // bytes of the client preface seen
+  uint8_t settings;     // the client's first SETTINGS arrived
+  uint8_t goaway;       // sent or received: no new streams
+  uint8_t goaway_sent;
+  uint8_t size_update;  // enc.max changed since the last header block
+  uint8_t hdr_flags;    // of the HEADERS frame being continued
+  uint32_t hdr_stream;  // stream whose header block is arriving, 0 if none
+  uint8_t *hdr;         // its fragments so far
+  size_t hdr_len;
+  uint8_t *in;          // partial frame carried over to the next read
+  size_t in_len;
+  size_t size_min;      // smallest enc.max since the last header block
+  h2_table_t dec;       // fields the client sent
+  h2_table_t enc;       // fields sent to the client
+  uint32_t last_stream; // highest stream id the client opened
+  uint32_t streams;     // open
+  uint32_t max_streams;
+  uint32_t peer_frame;  // the client's SETTINGS_MAX_FRAME_SIZE
+  int64_t peer_window;  // the client's SETTINGS_INITIAL_WINDOW_SIZE
+  int64_t send_window;
+  int64_t recv_window;
+  size_t max_body;
+  h2_stream_t *list;    // open streams, oldest first
+} h2_conn_t;
+
+static struct {
+  int16_t huff[256][2]; // Huffman decoding tree: child node, or -1 - symbol at a leaf
+  uint8_t *scratch;     // strings of the field being decoded
+  uint64_t open;
+  uint64_t streams;
+  uint64_t requests;
+  uint64_t resets;
+} h2;
+
+static const struct { const char *name, *value; } h2_static[61] = {
+  { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+  { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+  { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+  { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" }, { "accept-language", "" }, { "accept-ranges", "" },
+  { "accept", "" }, { "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+  { "authorization", "" }, { "cache-control", "" }, { "content-disposition", "" },
+  { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+  { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+  { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" }, { "from", "" },
+  { "host", "" }, { "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+  { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" }, { "link", "" },
+  { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+  { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+  { "retry-after", "" }, { "server", "" }, { "set-cookie", "" },
+  { "strict-transport-security", "" }, { "transfer-encoding", "" }, { "user-agent", "" },
+  { "vary", "" }, { "via", "" }, { "www-authenticate", "" },
+};
+
+// RFC 7541 Appendix B, without EOS
+static const uint32_t h2_huff_code[256] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+  0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+  0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+  0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+  0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+  0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+  0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+  0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+  0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+  0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+  0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+  0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+  0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+  0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+  0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+  0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+  0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+  0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+  0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+  0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+  0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+  0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+static const uint8_t h2_huff_len[256] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+static uint32_t h2_u32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void h2_put_u32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+// Builds the decoding tree from the code table, once
+static void h2_huff_init(void) {
+  int nodes = 1;
+  for (int sym = 0; sym < 256; sym++) {
+    int node = 0;
+    for (int bit = h2_huff_len[sym] - 1; bit > 0; bit--) {
+      int b = (h2_huff_code[sym] >> bit) & 1;
+      if (!h2.huff[node][b])
+        h2.huff[node][b] = (int16_t)nodes++;
+      node = h2.huff[node][b];
+    }
+    h2.huff[node][h2_huff_code[sym] & 1] = (int16_t)(-1 - sym);
+  }
+}
+
+// Huffman-decodes p[0..n) into out, which has room for 8 * n / 5 bytes (the
+// shortest code is 5 bits); -1 if a code or the padding is invalid
+static ssize_t h2_huff_decode(const uint8_t *p, size_t n, uint8_t *out) {
+  size_t len = 0;
+  int node = 0, depth = 0, ones = 1;
+  if (!h2.huff[0][0])
+    h2_huff_init();
+  for (size_t i = 0; i < n; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      int b = (p[i] >> bit) & 1;
+      int next = h2.huff[node][b];
+      if (!next)
+        return -1;
+      ones &= b;
+      depth++;
+      if (next < 0) {
+        out[len++] = (uint8_t)(-1 - next);
+        node = depth = 0;
+        ones = 1;
       } else {
-        JS_SetPropertyStr(ctx, result, "body", JS_NewStringLen(ctx, p, body_len));
+        node = next;
       }
-    } else {
-      JS_SetPropertyStr(ctx, result, "body", JS_NewString(ctx, ""));
     }
-  } else {
-    JS_SetPropertyStr(ctx, result, "body", JS_NewString(ctx, ""));
   }
+  // What is left must be a prefix of EOS: fewer than 8 bits, all ones
+  return depth < 8 && ones ? (ssize_t)len : -1;
+}
 
-  JS_FreeCString(ctx, data);
-  return result;
+// Reads an integer with an n-bit prefix; -1 if it is truncated or too large
+static int64_t h2_int(const uint8_t **pp, const uint8_t *end, int n) {
+  const uint8_t *p = *pp;
+  uint32_t max = (1u << n) - 1;
+  if (p >= end)
+    return -1;
+  int64_t v = *p++ & max;
+  if (v == max) {
+    for (int shift = 0;; shift += 7) {
+      if (p >= end || shift > 28)
+        return -1;
+      uint8_t b = *p++;
+      v += (int64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        break;
+    }
+    if (v > 0x7fffffff)
+      return -1;
+  }
+  *pp = p;
+  return v;
+}
 
-error:
-  JS_FreeCString(ctx, data);
-  JS_FreeValue(ctx, headers);
-  JS_FreeValue(ctx, query);
-  JS_FreeValue(ctx, result);
-  return JS_ThrowInternalError(ctx, "Invalid HTTP request");
+// Writes v with an n-bit prefix after flags in the first byte; returns its length
+static size_t h2_put_int(uint8_t *out, uint8_t flags, int n, size_t v) {
+  size_t max = (1u << n) - 1, len = 1;
+  if (v < max) {
+    out[0] = flags | (uint8_t)v;
+    return 1;
+  }
+  out[0] = flags | (uint8_t)max;
+  for (v -= max; v >= 128; v >>= 7)
+    out[len++] = (uint8_t)(v | 0x80);
+  out[len++] = (uint8_t)v;
+  return len;
 }
 
-// get_error() -> returns current errno string
-static JSValue js_get_error(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  return JS_NewString(ctx, strerror(errno));
+// Reads a string literal into out; -1 if it is malformed
+static ssize_t h2_string(const uint8_t **pp, const uint8_t *end, uint8_t *out) {
+  int huffman = *pp < end && (**pp & 0x80);
+  int64_t len = h2_int(pp, end, 7);
+  if (len < 0 || len > end - *pp)
+    return -1;
+  const uint8_t *p = *pp;
+  *pp += len;
+  if (huffman)
+    return h2_huff_decode(p, (size_t)len, out);
+  memcpy(out, p, (size_t)len);
+  return (ssize_t)len;
 }
 
-// is_connected(fd) -> returns boolean
-static JSValue js_is_connected(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-  int fd;
-  if (JS_ToInt32(ctx, &fd, argv[0]))
-    return JS_EXCEPTION;
+static h2_entry_t *h2_entry_new(const char *name, size_t name_len, const char *value, size_t value_len) {
+  h2_entry_t *e = malloc(sizeof(h2_entry_t) + name_len + value_len);
+  if (!e)
+    return NULL;
+  e->name_len = (uint32_t)name_len;
+  e->value_len = (uint32_t)value_len;
+  memcpy(e->data, name, name_len);
+  memcpy(e->data + name_len, value, value_len);
+  return e;
+}
 
-  struct sockaddr_in sa;
-  socklen_t len = sizeof(sa);
-  
-  // Get peer address
-  if (getpeername(fd, (struct sockaddr *)&sa, &len) < 0) {
-    return JS_NewBool(ctx, 0);
+// Drops the oldest entries until room more bytes fit
+static void h2_table_evict(h2_table_t *t, size_t room) {
+  while (t->count && t->size + room > t->max) {
+    uint32_t oldest = (t->head + H2_TABLE_ENTRIES + 1 - t->count) % H2_TABLE_ENTRIES;
+    h2_entry_t *e = t->entries[oldest];
+    t->size -= e->name_len + e->value_len + 32;
+    t->entries[oldest] = NULL;
+    t->count--;
+    free(e);
   }
-  
-  // Check if socket is ready for writing (connected)
-  fd_set wfds;
-  struct timeval tv = {0, 0};
+}
+
+// Adds e as the newest entry. It is made before the eviction, which may
+// free the entry its name was taken from.
+static void h2_table_insert(h2_table_t *t, h2_entry_t *e) {
+  size_t size = e->name_len + e->value_len + 32;
+  h2_table_evict(t, size);
+  if (size > t->max) {
+    free(e);
+    return;
+  }
+  t->head = (t->head + 1) % H2_TABLE_ENTRIES;
+  t->entries[t->head] = e;
+  t->count++;
+  t->size += size;
+}
+
+// Field index in the static then the dynamic table; -1 if there is none
+static int h2_lookup(h2_table_t *t, int64_t index, const char **name, size_t *name_len,
+                     const char **value, size_t *value_len) {
+  if (index <= 0)
+    return -1;
+  if (index <= 61) {
+    *name = h2_static[index - 1].name;
+    *name_len = strlen(*name);
+    *value = h2_static[index - 1].value;
+    *value_len = strlen(*value);
+    return 0;
+  }
+  if (index - 62 >= t->count)
+    return -1;
+  h2_entry_t *e = t->entries[(t->head + H2_TABLE_ENTRIES - (uint32_t)(index - 62)) % H2_TABLE_ENTRIES];
+  *name = e->data;
+  *name_len = e->name_len;
+  *value = e->data + e->name_len;
+  *value_len = e->value_len;
+  return 0;
+}
+
+// Checks a decoded request field and appends it to s: 0, or 1 if the
+// request is malformed, 2 if its fields are too large
+static int h2_field(h2_stream_t *s, const char *name, size_t name_len, const char *value, size_t value_len) {
+  static const char *const connection[] = { "connection", "keep-alive", "proxy-connection",
+                                            "transfer-encoding", "upgrade" };
+  if (!name_len)
+    return 1;
+  for (size_t i = name[0] == ':'; i < name_len; i++)
+    if ((name[i] >= 'A' && name[i] <= 'Z') || name[i] <= ' ' || name[i] == ':' || name[i] == 0x7f)
+      return 1;
+  for (size_t i = 0; i < value_len; i++)
+    if (value[i] == '\0' || value[i] == '\r' || value[i] == '\n')
+      return 1;
+  if (name[0] == ':') {
+    int bit = name_len == 7 && !memcmp(name, ":method", 7)      ? H2_METHOD
+              : name_len == 7 && !memcmp(name, ":scheme", 7)    ? H2_SCHEME
+              : name_len == 5 && !memcmp(name, ":path", 5)      ? H2_PATH
+              : name_len == 10 && !memcmp(name, ":authority", 10) ? H2_AUTHORITY
+                                                                : 0;
+    if (!bit || s->regular || (s->pseudo & bit) || (bit == H2_PATH && !value_len))
+      return 1;
+    s->pseudo |= (uint8_t)bit;
+  } else {
+    s->regular = 1;
+    for (size_t i = 0; i < sizeof(connection) / sizeof(connection[0]); i++)
+      if (strlen(connection[i]) == name_len && !memcmp(name, connection[i], name_len))
+        return 1;
+    if (name_len == 2 && !memcmp(name, "te", 2) && (value_len != 8 || memcmp(value, "trailers", 8)))
+      return 1;
+    if (name_len == 14 && !memcmp(name, "content-length", 14)) {
+      int64_t n = 0;
+      if (!value_len || value_len > 15 || s->content_length >= 0)
+        return 1;
+      for (size_t i = 0; i < value_len; i++) {
+        if (value[i] < '0' || value[i] > '9')
+          return 1;
+        n = n * 10 + (value[i] - '0');
+      }
+      s->content_length = n;
+    }
+  }
+  size_t need = s->fields_len + 10 + name_len + value_len;
+  if (need > H2_MAX_HEADERS)
+    return 2;
+  if (need > s->fields_cap) {
+    size_t cap = s->fields_cap ? s->fields_cap * 2 : 512;
+    while (cap < need)
+      cap *= 2;
+    uint8_t *fields = realloc(s->fields, cap);
+    if (!fields)
+      return 2;
+    s->fields = fields;
+    s->fields_cap = cap;
+  }
+  uint8_t *p = s->fields + s->fields_len;
+  uint32_t lens[2] = { (uint32_t)name_len, (uint32_t)value_len };
+  memcpy(p, lens, 8);
+  memcpy(p + 8, name, name_len);
+  p[8 + name_len] = '\0';
+  memcpy(p + 9 + name_len, value, value_len);
+  p[9 + name_len + value_len] = '\0';
+  s->fields_len = need;
+  return 0;
+}
+
+// Decodes a header block into s, or only into the dynamic table if s is
+// NULL. -1 on a compression error, which fails the connection; otherwise
+// what h2_field() found.
+static int h2_decode(h2_conn_t *h, h2_stream_t *s, const uint8_t *p, size_t len) {
+  const uint8_t *end = p + len;
+  int rc = 0, fields = 0;
+  // A string decodes to at most 8/5 of its bytes, and the block is at most H2_MAX_HEADERS
+  if (!h2.scratch && !(h2.scratch = malloc(H2_MAX_HEADERS / 5 * 8 + 16)))
+    return -1;
+  while (p < end) {
+    const char *name, *value;
+    size_t name_len, value_len;
+    h2_entry_t *e = NULL;
+    uint8_t b = *p;
+    if (b & 0x80) {
+      if (h2_lookup(&h->dec, h2_int(&p, end, 7), &name, &name_len, &value, &value_len) < 0)
+        return -1;
+    } else if ((b & 0xe0) == 0x20) {
+      int64_t max = h2_int(&p, end, 5);
+      if (fields || max < 0 || max > H2_TABLE_SIZE)
+        return -1;
+      h->dec.max = (size_t)max;
+      h2_table_evict(&h->dec, 0);
+      continue;
+    } else {
+      int indexing = (b & 0xc0) == 0x40;
+      int64_t index = h2_int(&p, end, indexing ? 6 : 4);
+      uint8_t *out = h2.scratch;
+      ssize_t n;
+      if (index < 0)
+        return -1;
+      if (index) {
+        if (h2_lookup(&h->dec, index, &name, &name_len, &value, &value_len) < 0)
+          return -1;
+      } else {
+        if ((n = h2_string(&p, end, out)) < 0)
+          return -1;
+        name = (const char *)out;
+        name_len = (size_t)n;
+        out += n;
+      }
+      if ((n = h2_string(&p, end, out)) < 0)
+        return -1;
+      value = (const char *)out;
+      value_len = (size_t)n;
+      if (indexing && !(e = h2_entry_new(name, name_len, value, value_len)))
+        return -1;
+    }
+    fields++;
+    if (s && !rc)
+      rc = h2_field(s, name, name_len, value, value_len);
+    if (e)
+      h2_table_insert(&h->dec, e);
+  }
+  return rc;
+}
+
+// Index of name and value in the static or dynamic table, minus the index
+// of an entry with just that name, or 0
+static int64_t h2_find(h2_table_t *t, const char *name, size_t name_len, const char *value, size_t value_len) {
+  int64_t found = 0;
+  for (int i = 0; i < 61; i++) {
+    if (strlen(h2_static[i].name) != name_len || memcmp(h2_static[i].name, name, name_len))
+      continue;
+    if (strlen(h2_static[i].value) == value_len && !memcmp(h2_static[i].value, value, value_len))
+      return i + 1;
+    if (!found)
+      found = -(i + 1);
+  }
+  for (uint32_t i = 0; i < t->count; i++) {
+    h2_entry_t *e = t->entries[(t->head + H2_TABLE_ENTRIES - i) % H2_TABLE_ENTRIES];
+    if (e->name_len != name_len || memcmp(e->data, name, name_len))
+      continue;
+    if (e->value_len == value_len && !memcmp(e->data + name_len, value, value_len))
+      return 62 + i;
+    if (!found)
+      found = -(62 + (int64_t)i);
+  }
+  return found;
+}
+
+// Appends a field to a header block, which needs name_len + value_len + 16
+// bytes at most. Fields likely to repeat go into the dynamic table, so the
+// next response sends them as one index; values that change with every
+// response do not, and cookies are never indexed by intermediaries either.
+static size_t h2_encode(h2_conn_t *h, uint8_t *out, const char *name, size_t name_len, const char *value,
+                        size_t value_len) {
+  static const char *const volatile_names[] = { "content-length", "date", "etag", "last-modified",
+                                                "expires", "age", "location", "set-cookie" };
+  int64_t index = h2_find(&h->enc, name, name_len, value, value_len);
+  if (index > 0)
+    return h2_put_int(out, 0x80, 7, (size_t)index);
+  int keep = name_len + value_len + 32 <= h->enc.max / 2, never = 0;
+  for (size_t i = 0; keep && i < sizeof(volatile_names) / sizeof(volatile_names[0]); i++)
+    if (strlen(volatile_names[i]) == name_len && !memcmp(volatile_names[i], name, name_len))
+      keep = 0, never = i == 7;
+  h2_entry_t *e = keep ? h2_entry_new(name, name_len, value, value_len) : NULL;
+  size_t n = e ? h2_put_int(out, 0x40, 6, (size_t)-index) : h2_put_int(out, never ? 0x10 : 0, 4, (size_t)-index);
+  if (!index) {
+    n += h2_put_int(out + n, 0, 7, name_len);
+    memcpy(out + n, name, name_len);
+    n += name_len;
+  }
+  n += h2_put_int(out + n, 0, 7, value_len);
+  memcpy(out + n, value, value_len);
+  n += value_len;
+  if (e)
+    h2_table_insert(&h->enc, e);
+  return n;
+}
+
+// Starts a header block with the table size changes the client has not
+// heard of yet: the smallest since the last block, then the current one
+static size_t h2_block_start(h2_conn_t *h, uint8_t *out) {
+  size_t n = 0;
+  if (h->size_update) {
+    if (h->size_min < h->enc.max)
+      n += h2_put_int(out, 0x20, 5, h->size_min);
+    n += h2_put_int(out + n, 0x20, 5, h->enc.max);
+    h->size_update = 0;
+  }
+  return n;
+}
+
+static h2_stream_t *h2_stream_get(h2_conn_t *h, uint32_t id) {
+  for (h2_stream_t *s = h->list; s; s = s->next)
+    if (s->id == id)
+      return s;
+  return NULL;
+}
+
+static h2_stream_t *h2_stream_new(h2_conn_t *h, uint32_t id) {
+  h2_stream_t *s = calloc(1, sizeof(h2_stream_t)), **pp = &h->list;
+  if (!s)
+    return NULL;
+  s->id = id;
+  s->content_length = -1;
+  s->send_window = h->peer_window;
+  s->recv_window = H2_WINDOW;
+  while (*pp)
+    pp = &(*pp)->next;
+  *pp = s;
+  h->streams++;
+  h2.streams++;
+  return s;
+}
+
+static void h2_stream_free(h2_conn_t *h, h2_stream_t *s) {
+  h2_stream_t **pp = &h->list;
+  while (*pp != s)
+    pp = &(*pp)->next;
+  *pp = s->next;
+  free(s->fields);
+  free(s->body);
+  free(s->out);
+  free(s);
+  h->streams--;
+}
+
+static int h2_send(ws_conn_t *c, int fd, int type, int flags, uint32_t stream, const uint8_t *payload,
+                   size_t len) {
+  uint8_t head[9] = { (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len, (uint8_t)type, (uint8_t)flags };
+  h2_put_u32(head + 5, stream);
+  return ws_write(c, fd, head, 9, payload, len);
+}
+
+static int h2_send_u32(ws_conn_t *c, int fd, int type, uint32_t stream, uint32_t v) {
+  uint8_t p[4];
+  h2_put_u32(p, v);
+  return h2_send(c, fd, type, 0, stream, p, 4);
+}
+
+// Sends GOAWAY once and returns 1: the connection closes after it
+static int h2_goaway(ws_conn_t *c, int fd, int code) {
+  h2_conn_t *h = c->h2;
+  if (!h->goaway_sent) {
+    uint8_t p[8];
+    h2_put_u32(p, h->last_stream);
+    h2_put_u32(p + 4, (uint32_t)code);
+    h2_send(c, fd, H2_GOAWAY, 0, 0, p, 8);
+    h->goaway_sent = 1;
+  }
+  h->goaway = 1;
+  return 1;
+}
+
+// Ends stream id with RST_STREAM; nonzero if the connection is gone
+static int h2_reset(ws_conn_t *c, int fd, uint32_t id, int code) {
+  h2_stream_t *s = h2_stream_get(c->h2, id);
+  if (s)
+    h2_stream_free(c->h2, s);
+  h2.resets++;
+  return h2_send_u32(c, fd, H2_RST_STREAM, id, (uint32_t)code) < 0;
+}
+
+// Sends a header block as HEADERS and CONTINUATION frames no larger than the
+// peer accepts
+static int h2_send_block(ws_conn_t *c, int fd, uint32_t id, const uint8_t *block, size_t len, int end_stream) {
+  size_t max = c->h2->peer_frame, off = 0;
+  int type = H2_HEADERS;
+  do {
+    size_t k = len - off < max ? len - off : max;
+    int flags = (off + k == len ? H2_END_HEADERS : 0) | (type == H2_HEADERS && end_stream ? H2_END_STREAM : 0);
+    if (h2_send(c, fd, type, flags, id, block + off, k) < 0)
+      return -1;
+    off += k;
+    type = H2_CONTINUATION;
+  } while (off < len);
+  return 0;
+}
+
+// Answers the request on s here with an empty response; the client is told
+// to stop sending if the request is not complete. Nonzero if the connection
+// is gone.
+static int h2_answer(ws_conn_t *c, int fd, h2_stream_t *s, int status) {
+  h2_conn_t *h = c->h2;
+  uint8_t block[32];
+  char value[4];
+  uint32_t id = s->id;
+  int ended = s->ended;
+  snprintf(value, sizeof(value), "%d", status);
+  size_t n = h2_block_start(h, block);
+  n += h2_encode(h, block + n, ":status", 7, value, 3);
+  h2_stream_free(h, s);
+  if (h2_send_block(c, fd, id, block, n, 1) < 0)
+    return 1;
+  return !ended && h2_send_u32(c, fd, H2_RST_STREAM, id, H2_NO_ERROR) < 0;
+}
+
+// Frames up to len bytes of the response body on s as the windows and the
+// socket allow; the frame with the last byte ends the stream. Returns the
+// bytes framed, or -1 if the connection is gone.
+static ssize_t h2_data(ws_conn_t *c, int fd, h2_stream_t *s, const uint8_t *p, size_t len) {
+  h2_conn_t *h = c->h2;
+  size_t done = 0;
+  while (done < len && c->out_bytes < H2_OUT_HIGH) {
+    int64_t k = (int64_t)(len - done);
+    if (k > h->peer_frame)
+      k = h->peer_frame;
+    if (k > s->send_window)
+      k = s->send_window;
+    if (k > h->send_window)
+      k = h->send_window;
+    if (k <= 0)
+      break;
+    int end = done + (size_t)k == len;
+    if (h2_send(c, fd, H2_DATA, end ? H2_END_STREAM : 0, s->id, p + done, (size_t)k) < 0)
+      return -1;
+    done += (size_t)k;
+    s->send_window -= k;
+    h->send_window -= k;
+  }
+  return (ssize_t)done;
+}
+
+// Frames the response bodies that were waiting, oldest stream first, and
+// drops the streams that are done; -1 if the connection is gone
+static int h2_pump(ws_conn_t *c, int fd) {
+  h2_conn_t *h = c->h2;
+  h2_stream_t *next;
+  for (h2_stream_t *s = h->list; s && h->send_window > 0 && c->out_bytes < H2_OUT_HIGH; s = next) {
+    next = s->next;
+    if (!s->out)
+      continue;
+    ssize_t n = h2_data(c, fd, s, s->out + s->out_off, s->out_len - s->out_off);
+    if (n < 0)
+      return -1;
+    s->out_off += (size_t)n;
+    if (s->out_off == s->out_len)
+      h2_stream_free(h, s);
+  }
+  return 0;
+}
+
+// Applies a SETTINGS payload from the client: 0, or the error code
+static int h2_settings(h2_conn_t *h, const uint8_t *p, size_t len) {
+  for (size_t i = 0; i + 6 <= len; i += 6) {
+    uint32_t v = h2_u32(p + i + 2);
+    switch (p[i] << 8 | p[i + 1]) {
+    case 1: { // HEADER_TABLE_SIZE: how much of it the encoder may use
+      size_t max = v < H2_TABLE_SIZE ? v : H2_TABLE_SIZE;
+      if (max == h->enc.max)
+        break;
+      if (!h->size_update || max < h->size_min)
+        h->size_min = max;
+      h->size_update = 1;
+      h->enc.max = max;
+      h2_table_evict(&h->enc, 0);
+      break;
+    }
+    case 2: // ENABLE_PUSH, never used
+      if (v > 1)
+        return H2_PROTOCOL_ERROR;
+      break;
+    case 4: // INITIAL_WINDOW_SIZE, which moves the windows of open streams too
+      if (v > H2_WINDOW_MAX)
+        return H2_FLOW_CONTROL_ERROR;
+      for (h2_stream_t *s = h->list; s; s = s->next)
+        if ((s->send_window += (int64_t)v - h->peer_window) > H2_WINDOW_MAX)
+          return H2_FLOW_CONTROL_ERROR;
+      h->peer_window = v;
+      break;
+    case 5: // MAX_FRAME_SIZE
+      if (v < 16384 || v > 16777215)
+        return H2_PROTOCOL_ERROR;
+      h->peer_frame = v;
+      break;
+    }
+  }
+  return 0;
+}
+
+// The request on s is complete; it waits for h2_read() unless its body
+// does not match the declared length
+static int h2_ended(ws_conn_t *c, int fd, h2_stream_t *s) {
+  s->ended = 1;
+  if (s->content_length >= 0 && (size_t)s->content_length != s->body_len)
+    return h2_reset(c, fd, s->id, H2_PROTOCOL_ERROR);
+  s->ready = 1;
+  return 0;
+}
+
+// An id the client has not opened yet, or one it never could (even ids are
+// the server's)
+static int h2_idle(h2_conn_t *h, uint32_t id) {
+  return !(id & 1) || id > h->last_stream;
+}
+
+static int h2_on_data(ws_conn_t *c, int fd, uint32_t id, int flags, const uint8_t *p, size_t len) {
+  h2_conn_t *h = c->h2;
+  size_t off = 0, pad = 0;
+  if (!id)
+    return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+  if (flags & H2_PADDED) {
+    if (len < 1 || p[0] >= len)
+      return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+    off = 1;
+    pad = p[0];
+  }
+  // Padding counts against the windows too
+  h->recv_window -= (int64_t)len;
+  if (h->recv_window < 0)
+    return h2_goaway(c, fd, H2_FLOW_CONTROL_ERROR);
+  if (h->recv_window < H2_CONN_WINDOW / 2) {
+    if (h2_send_u32(c, fd, H2_WINDOW_UPDATE, 0, (uint32_t)(H2_CONN_WINDOW - h->recv_window)) < 0)
+      return 1;
+    h->recv_window = H2_CONN_WINDOW;
+  }
+  h2_stream_t *s = h2_stream_get(h, id);
+  if (!s)
+    return h2_idle(h, id) ? h2_goaway(c, fd, H2_PROTOCOL_ERROR) : 0;
+  if (s->ended)
+    return h2_reset(c, fd, id, H2_STREAM_CLOSED);
+  if ((s->recv_window -= (int64_t)len) < 0)
+    return h2_reset(c, fd, id, H2_FLOW_CONTROL_ERROR);
+  size_t n = len - off - pad;
+  if (s->body_len + n > h->max_body)
+    return h2_answer(c, fd, s, 413);
+  if (s->body_len + n > s->body_cap) {
+    size_t cap = s->body_cap ? s->body_cap * 2 : 16384;
+    while (cap < s->body_len + n)
+      cap *= 2;
+    uint8_t *body = realloc(s->body, cap);
+    if (!body)
+      return h2_reset(c, fd, id, H2_INTERNAL_ERROR);
+    s->body = body;
+    s->body_cap = cap;
+  }
+  memcpy(s->body + s->body_len, p + off, n);
+  s->body_len += n;
+  if (flags & H2_END_STREAM)
+    return h2_ended(c, fd, s);
+  if (s->recv_window < H2_WINDOW / 2) {
+    if (h2_send_u32(c, fd, H2_WINDOW_UPDATE, id, (uint32_t)(H2_WINDOW - s->recv_window)) < 0)
+      return 1;
+    s->recv_window = H2_WINDOW;
+  }
+  return 0;
+}
+
+// A complete header block on stream id: a new request, or trailers. Blocks
+// are decoded even for streams that are refused or gone, since the dynamic
+// table must stay in step with the client's.
+static int h2_on_block(ws_conn_t *c, int fd, uint32_t id, int flags, const uint8_t *block, size_t len) {
+  h2_conn_t *h = c->h2;
+  h2_stream_t *s = h2_stream_get(h, id);
+  if (s || id <= h->last_stream || h->goaway) {
+    if (h2_decode(h, NULL, block, len) < 0)
+      return h2_goaway(c, fd, H2_COMPRESSION_ERROR);
+    if (!s)
+      return 0;
+    // Trailers, which are dropped; they must end the stream
+    if (s->ended || !(flags & H2_END_STREAM))
+      return h2_reset(c, fd, id, s->ended ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+    return h2_ended(c, fd, s);
+  }
+  h->last_stream = id;
+  if (h->streams >= h->max_streams || !(s = h2_stream_new(h, id))) {
+    if (h2_decode(h, NULL, block, len) < 0)
+      return h2_goaway(c, fd, H2_COMPRESSION_ERROR);
+    return h2_reset(c, fd, id, H2_REFUSED_STREAM);
+  }
+  int rc = h2_decode(h, s, block, len);
+  if (rc < 0)
+    return h2_goaway(c, fd, H2_COMPRESSION_ERROR);
+  if (rc == 2)
+    return h2_answer(c, fd, s, 431);
+  if (rc == 1 || (s->pseudo & (H2_METHOD | H2_SCHEME | H2_PATH)) != (H2_METHOD | H2_SCHEME | H2_PATH))
+    return h2_reset(c, fd, id, H2_PROTOCOL_ERROR);
+  if (s->content_length > (int64_t)h->max_body)
+    return h2_answer(c, fd, s, 413);
+  return flags & H2_END_STREAM ? h2_ended(c, fd, s) : 0;
+}
+
+static int h2_on_headers(ws_conn_t *c, int fd, uint32_t id, int flags, const uint8_t *p, size_t len) {
+  h2_conn_t *h = c->h2;
+  size_t off = 0, pad = 0;
+  if (h2_idle(h, id) && !(id & 1))
+    return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+  if (flags & H2_PADDED) {
+    if (len < 1)
+      return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+    pad = p[0];
+    off = 1;
+  }
+  if (flags & H2_PRIO)
+    off += 5;
+  if (off + pad > len)
+    return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+  if (flags & H2_END_HEADERS)
+    return h2_on_block(c, fd, id, flags, p + off, len - off - pad);
+  if (!(h->hdr = malloc(len - off - pad + 1)))
+    return h2_goaway(c, fd, H2_INTERNAL_ERROR);
+  memcpy(h->hdr, p + off, len - off - pad);
+  h->hdr_len = len - off - pad;
+  h->hdr_stream = id;
+  h->hdr_flags = (uint8_t)flags;
+  return 0;
+}
+
+static int h2_on_continuation(ws_conn_t *c, int fd, int flags, const uint8_t *p, size_t len) {
+  h2_conn_t *h = c->h2;
+  if (!h->hdr_stream)
+    return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+  if (h->hdr_len + len > H2_MAX_HEADERS)
+    return h2_goaway(c, fd, H2_ENHANCE_YOUR_CALM);
+  uint8_t *hdr = realloc(h->hdr, h->hdr_len + len + 1);
+  if (!hdr)
+    return h2_goaway(c, fd, H2_INTERNAL_ERROR);
+  memcpy(hdr + h->hdr_len, p, len);
+  h->hdr = hdr;
+  h->hdr_len += len;
+  if (!(flags & H2_END_HEADERS))
+    return 0;
+  uint32_t id = h->hdr_stream;
+  h->hdr_stream = 0;
+  int rc = h2_on_block(c, fd, id, h->hdr_flags, h->hdr, h->hdr_len);
+  free(h->hdr);
+  h->hdr = NULL;
+  h->hdr_len = 0;
+  return rc;
+}
+
+static int h2_on_window(ws_conn_t *c, int fd, uint32_t id, const uint8_t *p, size_t len) {
+  h2_conn_t *h = c->h2;
+  uint32_t inc = h2_u32(p) & 0x7fffffff;
+  if (len != 4)
+    return h2_goaway(c, fd, H2_FRAME_SIZE_ERROR);
+  if (!id) {
+    if (!inc)
+      return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+    if ((h->send_window += inc) > H2_WINDOW_MAX)
+      return h2_goaway(c, fd, H2_FLOW_CONTROL_ERROR);
+    return h2_pump(c, fd) < 0;
+  }
+  h2_stream_t *s = h2_stream_get(h, id);
+  if (!s)
+    return h2_idle(h, id) ? h2_goaway(c, fd, H2_PROTOCOL_ERROR) : 0;
+  if (!inc)
+    return h2_reset(c, fd, id, H2_PROTOCOL_ERROR);
+  if ((s->send_window += inc) > H2_WINDOW_MAX)
+    return h2_reset(c, fd, id, H2_FLOW_CONTROL_ERROR);
+  return h2_pump(c, fd) < 0;
+}
+
+// Handles one complete frame; nonzero once the connection should close
+static int h2_frame(ws_conn_t *c, int fd, const uint8_t *f, size_t len) {
+  h2_conn_t *h = c->h2;
+  int type = f[3], flags = f[4], rc;
+  uint32_t id = h2_u32(f + 5) & 0x7fffffff;
+  const uint8_t *p = f + 9;
+  if (!h->settings && (type != H2_SETTINGS || (flags & H2_ACK)))
+    return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+  if (h->hdr_stream && (type != H2_CONTINUATION || id != h->hdr_stream))
+    return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+  switch (type) {
+  case H2_DATA:
+    return h2_on_data(c, fd, id, flags, p, len);
+  case H2_HEADERS:
+    return h2_on_headers(c, fd, id, flags, p, len);
+  case H2_CONTINUATION:
+    return h2_on_continuation(c, fd, flags, p, len);
+  case H2_PRIORITY:
+    if (!id)
+      return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+    return len != 5 ? h2_reset(c, fd, id, H2_FRAME_SIZE_ERROR) : 0;
+  case H2_RST_STREAM: {
+    if (!id || h2_idle(h, id))
+      return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+    if (len != 4)
+      return h2_goaway(c, fd, H2_FRAME_SIZE_ERROR);
+    h2_stream_t *s = h2_stream_get(h, id);
+    if (s) {
+      h2_stream_free(h, s);
+      h2.resets++;
+    }
+    return 0;
+  }
+  case H2_SETTINGS:
+    if (id)
+      return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+    if (flags & H2_ACK)
+      return len ? h2_goaway(c, fd, H2_FRAME_SIZE_ERROR) : 0;
+    if (len % 6)
+      return h2_goaway(c, fd, H2_FRAME_SIZE_ERROR);
+    if ((rc = h2_settings(h, p, len)))
+      return h2_goaway(c, fd, rc);
+    h->settings = 1;
+    if (h2_send(c, fd, H2_SETTINGS, H2_ACK, 0, NULL, 0) < 0)
+      return 1;
+    return h2_pump(c, fd) < 0;
+  case H2_PUSH_PROMISE:
+    return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+  case H2_PING:
+    if (id)
+      return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+    if (len != 8)
+      return h2_goaway(c, fd, H2_FRAME_SIZE_ERROR);
+    return !(flags & H2_ACK) && h2_send(c, fd, H2_PING, H2_ACK, 0, p, 8) < 0;
+  case H2_GOAWAY:
+    if (id)
+      return h2_goaway(c, fd, H2_PROTOCOL_ERROR);
+    if (len < 8)
+      return h2_goaway(c, fd, H2_FRAME_SIZE_ERROR);
+    h->goaway = 1;
+    return 0;
+  case H2_WINDOW_UPDATE:
+    return h2_on_window(c, fd, id, p, len);
+  default: // unknown types are ignored
+    return 0;
+  }
+}
+
+static size_t h2_frame_len(const uint8_t *f) {
+  return (size_t)f[0] << 16 | (size_t)f[1] << 8 | f[2];
+}
+
+// Feeds n received bytes to the connection: the rest of the client preface,
+// then frames, one carried over to the next read when it is cut short.
+// Nonzero once the connection should close.
+static int h2_consume(ws_conn_t *c, int fd, const uint8_t *p, size_t n) {
+  h2_conn_t *h = c->h2;
+  while (n && h->preface < H2_PREFACE_LEN) {
+    if (*p != (uint8_t)H2_PREFACE[h->preface])
+      return 1;
+    h->preface++;
+    p++;
+    n--;
+  }
+  while (n) {
+    const uint8_t *f = p;
+    if (h->in_len) {
+      size_t want = h->in_len < 9 ? 9 : 9 + h2_frame_len(h->in);
+      if (want > 9 + H2_FRAME_MAX)
+        return h2_goaway(c, fd, H2_FRAME_SIZE_ERROR);
+      size_t k = want - h->in_len < n ? want - h->in_len : n;
+      memcpy(h->in + h->in_len, p, k);
+      h->in_len += k;
+      p += k;
+      n -= k;
+      if (h->in_len < 9 || h->in_len < 9 + h2_frame_len(h->in))
+        continue;
+      f = h->in;
+    } else if (n < 9 || n < 9 + h2_frame_len(p)) {
+      if (n >= 3 && h2_frame_len(p) > H2_FRAME_MAX)
+        return h2_goaway(c, fd, H2_FRAME_SIZE_ERROR);
+      if (!h->in && !(h->in = malloc(9 + H2_FRAME_MAX)))
+        return 1;
+      memcpy(h->in, p, n);
+      h->in_len = n;
+      return 0;
+    }
+    size_t len = h2_frame_len(f);
+    if (len > H2_FRAME_MAX)
+      return h2_goaway(c, fd, H2_FRAME_SIZE_ERROR);
+    int rc = h2_frame(c, fd, f, len);
+    if (f == h->in) {
+      free(h->in);
+      h->in = NULL;
+      h->in_len = 0;
+    } else {
+      p += 9 + len;
+      n -= 9 + len;
+    }
+    if (rc)
+      return 1;
+  }
+  return 0;
+}
+
+// Frees what fd holds as a WebSocket, event stream or HTTP/2 connection
+static void h2_conn_free(int fd) {
+  ws_conn_t *c = ws_get(fd);
+  h2_conn_t *h = c ? c->h2 : NULL;
+  ws_conn_free(fd);
+  if (!h)
+    return;
+  while (h->list)
+    h2_stream_free(h, h->list);
+  h->dec.max = h->enc.max = 0;
+  h2_table_evict(&h->dec, 0);
+  h2_table_evict(&h->enc, 0);
+  free(h->hdr);
+  free(h->in);
+  free(h);
+  h2.open--;
+}
+
+// Decodes unpadded base64url, as in HTTP2-Settings; -1 if it is malformed
+static ssize_t base64url_decode(const char *in, size_t len, uint8_t *out) {
+  uint32_t acc = 0;
+  size_t n = 0;
+  int bits = 0;
+  for (size_t i = 0; i < len; i++) {
+    char ch = in[i];
+    int v = ch >= 'A' && ch <= 'Z'   ? ch - 'A'
+            : ch >= 'a' && ch <= 'z' ? ch - 'a' + 26
+            : ch >= '0' && ch <= '9' ? ch - '0' + 52
+            : ch == '-'              ? 62
+            : ch == '_'              ? 63
+            : ch == '='              ? -2
+                                     : -1;
+    if (v == -2)
+      break;
+    if (v < 0)
+      return -1;
+    acc = acc << 6 | (uint32_t)v;
+    if ((bits += 6) >= 8) {
+      bits -= 8;
+      out[n++] = (uint8_t)(acc >> bits);
+    }
+  }
+  return (ssize_t)n;
+}
+
+// Sampling profiler
+//
+// ITIMER_PROF raises SIGPROF every 1/hz seconds of CPU time; the handler
+// only sets a flag. The runtime's interrupt handler, which QuickJS polls
+// on calls and loop back-edges, sees the flag and captures the current JS
+// stack through the Error constructor's backtrace. Stacks are folded
+// ("outer;inner count" lines, frames as "name (file:line)") and counted in
+// a hash table, ready for flamegraph.pl. Time spent in C is charged to the
+// next JS frame that polls, i.e. usually its caller.
+//
+// QuickJS has no getter for the interrupt handler, so an embedder that wants
+// its own to survive profiling installs it with
+// js_sockets_set_interrupt_handler(); the sampler calls it on every poll and
+// puts it back on stop.
+//
+// QJS_PROFILE=<hz> arms SIGUSR1 at load time: the first signal starts
+// sampling, the next writes QJS_PROFILE_FILE (default
+// /tmp/qjs-profile-<pid>.folded) and stops. The toggle runs from
+// epoll_wait(), like the trace dump.
+#define PROFILE_BUCKETS 4096
+#define PROFILE_MAX_STACKS 65536
+#define PROFILE_MAX_FRAMES 64
+#define PROFILE_DEFAULT_HZ 99
+
+typedef struct profile_stack {
+  struct profile_stack *next;
+  uint64_t count;
+  uint32_t hash;
+  char folded[];
+} profile_stack_t;
+
+static struct {
+  JSContext *ctx;      // context whose stack is sampled
+  JSValue error_ctor;
+  int running;
+  int hz;
+  int in_sample;
+  volatile sig_atomic_t pending;
+  volatile sig_atomic_t toggle;
+  int signal_hz;       // QJS_PROFILE, 0 when SIGUSR1 is not armed
+  struct sigaction old_sigprof;
+  JSInterruptHandler *prev_handler; // the embedder's, restored on stop
+  void *prev_opaque;
+  profile_stack_t *buckets[PROFILE_BUCKETS];
+  size_t stacks;
+  uint64_t samples;
+  uint64_t dropped;
+} profile;
+
+static void profile_on_sigprof(int sig) {
+  profile.pending = 1;
+}
+
+static void profile_on_sigusr1(int sig) {
+  profile.toggle = 1;
+}
+
+static void profile_clear(void) {
+  for (int i = 0; i < PROFILE_BUCKETS; i++) {
+    profile_stack_t *s = profile.buckets[i];
+    while (s) {
+      profile_stack_t *next = s->next;
+      free(s);
+      s = next;
+    }
+    profile.buckets[i] = NULL;
+  }
+  profile.stacks = 0;
+  profile.samples = 0;
+  profile.dropped = 0;
+}
+
+static void profile_count(const char *folded, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (uint8_t)folded[i]) * 16777619u;
+
+  profile_stack_t **slot = &profile.buckets[hash % PROFILE_BUCKETS];
+  for (profile_stack_t *s = *slot; s; s = s->next) {
+    if (s->hash == hash && strncmp(s->folded, folded, len) == 0 && s->folded[len] == '\0') {
+      s->count++;
+      profile.samples++;
+      return;
+    }
+  }
+
+  profile_stack_t *s = profile.stacks < PROFILE_MAX_STACKS ? malloc(sizeof(*s) + len + 1) : NULL;
+  if (!s) {
+    profile.dropped++;
+    return;
+  }
+  s->hash = hash;
+  s->count = 1;
+  memcpy(s->folded, folded, len);
+  s->folded[len] = '\0';
+  s->next = *slot;
+  *slot = s;
+  profile.stacks++;
+  profile.samples++;
+}
+
+// Folds a backtrace ("    at name (file:line:col)\n" per frame, innermost
+// first) into "outer;...;inner" with the columns dropped
+static void profile_fold(const char *stack, char *out, size_t cap, size_t *out_len) {
+  const char *frames[PROFILE_MAX_FRAMES];
+  size_t lens[PROFILE_MAX_FRAMES];
+  int parens[PROFILE_MAX_FRAMES];
+  int n = 0;
+
+  for (const char *p = stack; *p && n < PROFILE_MAX_FRAMES;) {
+    const char *eol = strchr(p, '\n');
+    size_t len = eol ? (size_t)(eol - p) : strlen(p);
+    const char *line = p;
+    p = eol ? eol + 1 : p + len;
+
+    while (len > 0 && *line == ' ') line++, len--;
+    if (len > 3 && memcmp(line, "at ", 3) == 0)
+      line += 3, len -= 3;
+    if (len == 0)
+      continue;
+
+    int paren = line[len - 1] == ')';
+    if (paren)
+      len--;
+    // Drop ":col" when the location ends in ":line:col"
+    size_t i = len;
+    while (i > 0 && isdigit((unsigned char)line[i - 1])) i--;
+    if (i < len && i > 1 && line[i - 1] == ':') {
+      size_t j = i - 1;
+      while (j > 0 && isdigit((unsigned char)line[j - 1])) j--;
+      if (j < i - 1 && j > 0 && line[j - 1] == ':')
+        len = i - 1;
+    }
+    frames[n] = line;
+    lens[n] = len;
+    parens[n] = paren;
+    n++;
+  }
+
+  size_t pos = 0;
+  for (int i = n - 1; i >= 0 && pos + lens[i] + 3 < cap; i--) {
+    if (pos > 0)
+      out[pos++] = ';';
+    for (size_t j = 0; j < lens[i]; j++)
+      out[pos++] = frames[i][j] == ';' ? ',' : frames[i][j];
+    if (parens[i])
+      out[pos++] = ')';
+  }
+  *out_len = pos;
+}
+
+static int profile_interrupt(JSRuntime *rt, void *opaque) {
+  if (!profile.pending || profile.in_sample)
+    return profile.prev_handler ? profile.prev_handler(rt, profile.prev_opaque) : 0;
+  profile.pending = 0;
+  profile.in_sample = 1;
+
+  JSContext *ctx = profile.ctx;
+  JSValue err = JS_CallConstructor(ctx, profile.error_ctor, 0, NULL);
+  if (JS_IsException(err)) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+  } else {
+    JSValue stack = JS_GetPropertyStr(ctx, err, "stack");
+    const char *text = JS_ToCString(ctx, stack);
+    if (text) {
+      char folded[4096];
+      size_t len;
+      profile_fold(text, folded, sizeof(folded), &len);
+      if (len > 0)
+        profile_count(folded, len);
+      JS_FreeCString(ctx, text);
+    }
+    JS_FreeValue(ctx, stack);
+    JS_FreeValue(ctx, err);
+  }
+
+  profile.in_sample = 0;
+  return profile.prev_handler ? profile.prev_handler(rt, profile.prev_opaque) : 0;
+}
+
+static int profile_start(JSContext *ctx, int hz) {
+  if (profile.running)
+    return 0;
+
+  JSValue global = JS_GetGlobalObject(ctx);
+  profile.error_ctor = JS_GetPropertyStr(ctx, global, "Error");
+  JS_FreeValue(ctx, global);
+  profile.ctx = ctx;
+  profile.hz = hz;
+  profile.pending = 0;
+  profile_clear();
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = profile_on_sigprof;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, &profile.old_sigprof);
+
+  JS_SetInterruptHandler(JS_GetRuntime(ctx), profile_interrupt, NULL);
+
+  long usec = 1000000L / hz;
+  struct itimerval it = { { usec / 1000000, usec % 1000000 }, { usec / 1000000, usec % 1000000 } };
+  if (setitimer(ITIMER_PROF, &it, NULL) < 0) {
+    JS_SetInterruptHandler(JS_GetRuntime(ctx), profile.prev_handler, profile.prev_opaque);
+    sigaction(SIGPROF, &profile.old_sigprof, NULL);
+    JS_FreeValue(ctx, profile.error_ctor);
+    return -1;
+  }
+  profile.running = 1;
+  return 0;
+}
+
+static void profile_stop(void) {
+  if (!profile.running)
+    return;
+
+  struct itimerval off;
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_PROF, &off, NULL);
+  sigaction(SIGPROF, &profile.old_sigprof, NULL);
+  JS_SetInterruptHandler(JS_GetRuntime(profile.ctx), profile.prev_handler, profile.prev_opaque);
+  JS_FreeValue(profile.ctx, profile.error_ctor);
+  profile.error_ctor = JS_UNDEFINED;
+  profile.running = 0;
+  profile.pending = 0;
+}
+
+// For embedders: JS_SetInterruptHandler() that the profiler keeps calling
+// while it samples and restores when it stops
+void js_sockets_set_interrupt_handler(JSRuntime *rt, JSInterruptHandler *cb, void *opaque) {
+  profile.prev_handler = cb;
+  profile.prev_opaque = opaque;
+  if (!profile.running)
+    JS_SetInterruptHandler(rt, cb, opaque);
+}
+
+static void profile_write(FILE *f) {
+  for (int i = 0; i < PROFILE_BUCKETS; i++) {
+    for (profile_stack_t *s = profile.buckets[i]; s; s = s->next)
+      fprintf(f, "%s %llu\n", s->folded, (unsigned long long)s->count);
+  }
+}
+
+// SIGUSR1 under QJS_PROFILE: start, or stop and write the profile
+static void profile_toggle(JSContext *ctx) {
+  if (!profile.running) {
+    profile_start(ctx, profile.signal_hz);
+    return;
+  }
+
+  profile_stop();
+  char path[256];
+  const char *env = getenv("QJS_PROFILE_FILE");
+  if (env && *env)
+    snprintf(path, sizeof(path), "%s", env);
+  else
+    snprintf(path, sizeof(path), "/tmp/qjs-profile-%d.folded", (int)getpid());
+
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return;
+  profile_write(f);
+  fclose(f);
+}
+
+static void profile_init_from_env(void) {
+  const char *env = getenv("QJS_PROFILE");
+  if (!env || !*env)
+    return;
+  long hz = strtol(env, NULL, 10);
+  profile.signal_hz = hz > 0 && hz <= 10000 ? (int)hz : PROFILE_DEFAULT_HZ;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = profile_on_sigusr1;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+}
+
+// setnonblocking(fd)
+static JSValue js_setnonblocking(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0)
+    return JS_ThrowInternalError(ctx, "fcntl(F_GETFL) failed: %s", strerror(errno));
+
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return JS_ThrowInternalError(ctx, "fcntl(F_SETFL) failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// epoll_create1(flags)
+static JSValue js_epoll_create1(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int flags = 0;
+
+  if (argc > 0 && JS_ToInt32(ctx, &flags, argv[0]))
+    return JS_EXCEPTION;
+
+  int epfd = epoll_create1(flags);
+  if (epfd < 0)
+    return JS_ThrowInternalError(ctx, "epoll_create1() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, epfd);
+}
+
+// epoll_ctl(epfd, op, fd, events)
+static JSValue js_epoll_ctl(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int epfd, op, fd, events;
+
+  if (JS_ToInt32(ctx, &epfd, argv[0]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &op, argv[1]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &fd, argv[2]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &events, argv[3]))
+    return JS_EXCEPTION;
+
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+
+  if (epoll_ctl(epfd, op, fd, &ev) < 0)
+    return JS_ThrowInternalError(ctx, "epoll_ctl() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// epoll_wait(epfd, maxevents, timeout) -> array of {fd, events}
+static JSValue js_epoll_wait(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int epfd, maxevents, timeout = -1;
+
+  if (JS_ToInt32(ctx, &epfd, argv[0]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &maxevents, argv[1]))
+    return JS_EXCEPTION;
+  if (argc > 2 && JS_ToInt32(ctx, &timeout, argv[2]))
+    return JS_EXCEPTION;
+
+  if (maxevents > MAX_EVENTS)
+    maxevents = MAX_EVENTS;
+
+  // Time from the previous wait returning to this one is how long a newly
+  // ready event could have waited for the loop. The loop's epoll set is the
+  // one it blocks on; it may poll it without blocking while it has queued
+  // work, but zero-timeout polls of other sets are nested inside a turn.
+  int turn = timeout != 0 || epfd == metrics.loop_epfd;
+  if (turn && metrics.loop_mark) {
+    uint64_t now = now_ns();
+    if (metrics.enabled)
+      hist_record(&metrics.loop_lag, now - metrics.loop_mark);
+    if (overload.enabled && epfd == overload.epfd)
+      overload_turn(now - metrics.loop_mark, now);
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t traced = trace_start();
+  int nfds = 0;
+  if (timeout != 0 && gc_idle_due()) {
+    nfds = epoll_wait(epfd, events, maxevents, 0);
+    if (nfds == 0)
+      gc_collect(JS_GetRuntime(ctx), 1);
+  }
+  if (nfds == 0)
+    nfds = epoll_wait(epfd, events, maxevents, timeout);
+
+  if (nfds < 0 && errno == EINTR)
+    nfds = 0; // a signal such as the SIGUSR2 trace dump
+  if (nfds < 0)
+    return JS_ThrowInternalError(ctx, "epoll_wait() failed: %s", strerror(errno));
+
+  if (timeout != 0)
+    metrics.loop_epfd = epfd;
+  if (turn && (metrics.enabled || overload.enabled))
+    metrics.loop_mark = now_ns();
+  if (nfds > 0) {
+    hist_record(&metrics.epoll_batch, (uint64_t)nfds);
+    trace_end(TRACE_EPOLL, epfd, traced, nfds);
+  }
+  PROBE2(epoll_wait, epfd, nfds);
+  if (trace.dump_requested) {
+    trace.dump_requested = 0;
+    trace_dump_file();
+  }
+  if (profile.toggle) {
+    profile.toggle = 0;
+    profile_toggle(ctx);
+  }
+
+  JSValue result = JS_NewArray(ctx);
+  for (int i = 0; i < nfds; i++) {
+    JSValue obj = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, obj, "fd", JS_NewInt32(ctx, events[i].data.fd));
+    JS_SetPropertyStr(ctx, obj, "events", JS_NewUint32(ctx, events[i].events));
+    JS_SetPropertyUint32(ctx, result, i, obj);
+  }
+
+  return result;
+}
+
+// socket(domain, type, protocol)
+static JSValue js_socket(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int domain, type, protocol = 0;
+
+  if (JS_ToInt32(ctx, &domain, argv[0]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &type, argv[1]))
+    return JS_EXCEPTION;
+  if (argc > 2 && JS_ToInt32(ctx, &protocol, argv[2]))
+    return JS_EXCEPTION;
+
+  int fd = socket(domain, type, protocol);
+  if (fd < 0)
+    return JS_ThrowInternalError(ctx, "socket() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, fd);
+}
+
+// Request heads
+//
+// The native fast paths (response cache, rate limiter, WebSocket
+// handshake, HTTP proxy) look at a request before parse_http_request()
+// turns it into JS values. They only need the request line, a header or
+// two and the framing, located in place.
+typedef struct {
+  const char *method;
+  size_t method_len;
+  const char *target;
+  size_t target_len;
+  const char *headers;           // header lines after the request line
+  size_t headers_len;
+  size_t length;                 // bytes up to and including the blank line
+  int keep_alive;                // from the version and Connection
+  int has_body;                  // non-zero Content-Length or any Transfer-Encoding
+} http_head_t;
+
+static int http_token(const char *s, size_t len, const char *token) {
+  size_t n = strlen(token);
+  for (size_t i = 0; i + n <= len; i++)
+    if (strncasecmp(s + i, token, n) == 0)
+      return 1;
+  return 0;
+}
+
+// Locates the first request head in buf; -1 if incomplete or malformed
+static int http_head_parse(const char *buf, size_t len, http_head_t *r) {
+  const char *end = memmem(buf, len, "\r\n\r\n", 4);
+  if (!end)
+    return -1;
+  r->length = (size_t)(end - buf) + 4;
+
+  const char *p = buf, *line_end = memchr(buf, '\r', r->length);
+  const char *sp = memchr(p, ' ', line_end - p);
+  if (!sp)
+    return -1;
+  r->method = p;
+  r->method_len = (size_t)(sp - p);
+  r->target = sp + 1;
+  sp = memchr(r->target, ' ', line_end - r->target);
+  if (!sp || sp == r->target || line_end - sp != 9 || memcmp(sp + 1, "HTTP/1.", 7) != 0)
+    return -1;
+  r->target_len = (size_t)(sp - r->target);
+
+  r->headers = line_end + 2;
+  r->headers_len = (size_t)(end + 2 - r->headers);
+  r->keep_alive = sp[8] == '1';
+  r->has_body = 0;
+  for (p = r->headers; p < end; p = line_end + 2) {
+    line_end = memchr(p, '\r', end + 2 - p);
+    const char *colon = memchr(p, ':', line_end - p);
+    if (!colon)
+      continue;
+    size_t name_len = (size_t)(colon - p), value_len = (size_t)(line_end - colon - 1);
+    if (name_len == 14 && strncasecmp(p, "content-length", 14) == 0) {
+      for (const char *v = colon + 1; v < line_end; v++)
+        if (*v != ' ' && *v != '\t' && *v != '0')
+          r->has_body = 1;
+    } else if (name_len == 17 && strncasecmp(p, "transfer-encoding", 17) == 0) {
+      r->has_body = 1;
+    } else if (name_len == 10 && strncasecmp(p, "connection", 10) == 0) {
+      if (http_token(colon + 1, value_len, "close"))
+        r->keep_alive = 0;
+      else if (http_token(colon + 1, value_len, "keep-alive"))
+        r->keep_alive = 1;
+    }
+  }
+  return 0;
+}
+
+// Value of header name in r, trimmed; NULL if absent
+static const char *http_head_header(const http_head_t *r, const char *name, size_t name_len, size_t *value_len) {
+  const char *end = r->headers + r->headers_len;
+  for (const char *p = r->headers; p < end;) {
+    const char *line_end = memchr(p, '\r', end - p);
+    if (!line_end)
+      break;
+    if ((size_t)(line_end - p) > name_len && p[name_len] == ':' && strncasecmp(p, name, name_len) == 0) {
+      const char *v = p + name_len + 1;
+      while (v < line_end && (*v == ' ' || *v == '\t'))
+        v++;
+      const char *e = line_end;
+      while (e > v && (e[-1] == ' ' || e[-1] == '\t'))
+        e--;
+      *value_len = (size_t)(e - v);
+      return v;
+    }
+    p = line_end + 2;
+  }
+  return NULL;
+}
+
+static int js_is_present(int argc, JSValueConst *argv, int i) {
+  return argc > i && !JS_IsUndefined(argv[i]) && !JS_IsNull(argv[i]);
+}
+
+// Byte view of an ArrayBuffer or typed array
+static uint8_t *js_get_bytes(JSContext *ctx, JSValueConst val, size_t *len) {
+  size_t offset, size, elem, ab_len;
+  JSValue ab = JS_GetTypedArrayBuffer(ctx, val, &offset, &size, &elem);
+  if (JS_IsException(ab)) {
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    return JS_GetArrayBuffer(ctx, len, val);
+  }
+  uint8_t *base = JS_GetArrayBuffer(ctx, &ab_len, ab);
+  JS_FreeValue(ctx, ab);
+  if (!base)
+    return NULL;
+  *len = size;
+  return base + offset;
+}
+
+// Bytes of a string (its UTF-8), an ArrayBuffer or a typed array, for
+// arguments that take text or the bytes it was read as; js_free_data()
+// gives back what a string took
+static const char *js_get_data(JSContext *ctx, JSValueConst val, size_t *len) {
+  if (JS_IsString(val))
+    return JS_ToCStringLen(ctx, len, val);
+  return (const char *)js_get_bytes(ctx, val, len);
+}
+
+static void js_free_data(JSContext *ctx, JSValueConst val, const char *data) {
+  if (JS_IsString(val))
+    JS_FreeCString(ctx, data);
+}
+
+// Proxy
+//
+// proxy() joins two sockets and moves bytes between them with splice(2)
+// through one pipe per direction, so payloads never enter userspace. The
+// sockets sit edge-triggered in an epoll set of the module's own
+// (proxy_fd()), which the caller's loop watches like the offload eventfd;
+// proxy_poll() pumps whatever became ready and settles the promises of
+// pairs that are done. An EOF is passed on as shutdown(SHUT_WR) once its
+// pipe has drained, so either side can half-close and keep reading.
+// Drained pipes are kept for the next pair. Bytes the caller read before
+// handing the client over are written upstream ahead of anything spliced,
+// whenever the upstream can take them (it may still be connecting).
+#define PROXY_CHUNK (64 << 10) // bytes spliced into a pipe at a time
+#define PROXY_PIPE_POOL 64
+#define PROXY_EVENTS 256
+
+typedef struct {
+  int pipe[2];
+  size_t queued; // in the pipe, not yet written out
+  uint8_t *early; // read before the pair started, written first
+  size_t early_len, early_off;
+  uint64_t bytes;
+  uint8_t eof, done;
+} proxy_dir_t;
+
+typedef struct {
+  int fd[2];          // client, upstream
+  proxy_dir_t dir[2]; // dir[i] carries fd[i] -> fd[!i]
+  int error;
+  JSValue resolving_funcs[2];
+} proxy_pair_t;
+
+static struct {
+  int epfd;
+  proxy_pair_t **pairs; // by fd, both ends
+  size_t cap;
+  int pipes[PROXY_PIPE_POOL][2];
+  int npipes;
+  uint64_t active, completed, bytes;
+} proxy = { .epfd = -1 };
+
+static proxy_pair_t *proxy_get(int fd) {
+  return fd >= 0 && (size_t)fd < proxy.cap ? proxy.pairs[fd] : NULL;
+}
+
+static int proxy_pipe_get(int p[2]) {
+  if (proxy.npipes > 0) {
+    proxy.npipes--;
+    p[0] = proxy.pipes[proxy.npipes][0];
+    p[1] = proxy.pipes[proxy.npipes][1];
+    return 0;
+  }
+  return pipe2(p, O_NONBLOCK | O_CLOEXEC);
+}
+
+// Keeps p for reuse if nothing is left in it, else closes it
+static void proxy_pipe_put(int p[2], size_t queued) {
+  if (p[0] < 0)
+    return;
+  if (queued == 0 && proxy.npipes < PROXY_PIPE_POOL) {
+    proxy.pipes[proxy.npipes][0] = p[0];
+    proxy.pipes[proxy.npipes][1] = p[1];
+    proxy.npipes++;
+  } else {
+    close(p[0]);
+    close(p[1]);
+  }
+  p[0] = p[1] = -1;
+}
+
+// The epoll set, made on first use. splice(2) into a socket whose peer
+// has gone raises SIGPIPE, which would end the process, so it is ignored
+// from then on unless the program has a handler of its own.
+static int proxy_open(void) {
+  if (proxy.epfd >= 0)
+    return 0;
+  struct sigaction sa;
+  if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL)
+    signal(SIGPIPE, SIG_IGN);
+  proxy.epfd = epoll_create1(EPOLL_CLOEXEC);
+  return proxy.epfd < 0 ? -1 : 0;
+}
+
+// Moves what fd[i] has for fd[!i] until one of them would block. Returns -1
+// with errno set when either socket failed.
+static int proxy_pump(proxy_pair_t *p, int i) {
+  proxy_dir_t *d = &p->dir[i];
+  int src = p->fd[i], dst = p->fd[!i];
+
+  while (!d->done) {
+    if (d->early_off < d->early_len) {
+      ssize_t n = send(dst, d->early + d->early_off, d->early_len - d->early_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0)
+        return errno == EAGAIN ? 0 : -1;
+      d->early_off += (size_t)n;
+      continue;
+    }
+    if (d->queued > 0) {
+      ssize_t n = splice(d->pipe[0], NULL, dst, NULL, d->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0)
+        return errno == EAGAIN ? 0 : -1;
+      d->queued -= (size_t)n;
+      continue;
+    }
+    if (d->eof) {
+      shutdown(dst, SHUT_WR);
+      d->done = 1;
+      break;
+    }
+    ssize_t n = splice(src, NULL, d->pipe[1], NULL, PROXY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0)
+      return errno == EAGAIN ? 0 : -1;
+    if (n == 0)
+      d->eof = 1;
+    d->queued += (size_t)n;
+    d->bytes += (uint64_t)n;
+    proxy.bytes += (uint64_t)n;
+  }
+  return 0;
+}
+
+// Lets go of both sockets and resolves the pair's promise with its counts
+static void proxy_finish(JSContext *ctx, proxy_pair_t *p) {
+  for (int i = 0; i < 2; i++) {
+    epoll_ctl(proxy.epfd, EPOLL_CTL_DEL, p->fd[i], NULL);
+    proxy.pairs[p->fd[i]] = NULL;
+    proxy_pipe_put(p->dir[i].pipe, p->dir[i].queued);
+    free(p->dir[i].early);
+  }
+  proxy.active--;
+  proxy.completed++;
+
+  JSValue result = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, result, "sent", JS_NewInt64(ctx, (int64_t)p->dir[0].bytes));
+  JS_SetPropertyStr(ctx, result, "received", JS_NewInt64(ctx, (int64_t)p->dir[1].bytes));
+  if (p->error) {
+    const char *name = strerrorname_np(p->error);
+    JS_SetPropertyStr(ctx, result, "error", JS_NewString(ctx, name ? name : strerror(p->error)));
+  }
+  JSValue ret = JS_Call(ctx, p->resolving_funcs[0], JS_UNDEFINED, 1, (JSValueConst *)&result);
+  JS_FreeValue(ctx, ret);
+  JS_FreeValue(ctx, result);
+  JS_FreeValue(ctx, p->resolving_funcs[0]);
+  JS_FreeValue(ctx, p->resolving_funcs[1]);
+  free(p);
+}
+
+// Ends the pair fd belongs to, for a socket closed while proxied
+static void proxy_conn_free(JSContext *ctx, int fd) {
+  proxy_pair_t *p = proxy_get(fd);
+  if (p)
+    proxy_finish(ctx, p);
+}
+
+// proxy(clientFd, upstreamFd, data) -> Promise<{sent, received, error}>
+// Forwards bytes both ways natively until each side has sent EOF and it has
+// been passed on, or until either socket fails (error is then its errno
+// name, e.g. "ECONNRESET"). sent counts client -> upstream bytes, received
+// upstream -> client. Nothing is closed: the caller closes both sockets
+// once the promise settles. data (a string or bytes, optional) is what the
+// caller already read from the client; it goes upstream first, and the
+// upstream socket may still be connecting.
+static JSValue js_proxy(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd[2];
+  const uint8_t *data = NULL;
+  size_t data_len = 0;
+
+  if (JS_ToInt32(ctx, &fd[0], argv[0]) || JS_ToInt32(ctx, &fd[1], argv[1]))
+    return JS_EXCEPTION;
+  if (fd[0] < 0 || fd[1] < 0 || fd[0] == fd[1])
+    return JS_ThrowRangeError(ctx, "proxy(): invalid fds %d, %d", fd[0], fd[1]);
+  if (proxy_get(fd[0]) || proxy_get(fd[1]))
+    return JS_ThrowTypeError(ctx, "proxy(): fd is already proxied");
+#ifdef QJS_TLS
+  if (tls_get(fd[0]) || tls_get(fd[1]))
+    return JS_ThrowTypeError(ctx, "proxy(): fd speaks TLS");
+#endif
+  if (proxy_open() < 0)
+    return JS_ThrowInternalError(ctx, "epoll_create1() failed: %s", strerror(errno));
+
+  size_t need = (size_t)(fd[0] > fd[1] ? fd[0] : fd[1]);
+  if (need >= proxy.cap) {
+    size_t cap = proxy.cap ? proxy.cap : 1024;
+    while (cap <= need)
+      cap *= 2;
+    proxy_pair_t **pairs = realloc(proxy.pairs, cap * sizeof(*pairs));
+    if (!pairs)
+      return JS_ThrowOutOfMemory(ctx);
+    memset(pairs + proxy.cap, 0, (cap - proxy.cap) * sizeof(*pairs));
+    proxy.pairs = pairs;
+    proxy.cap = cap;
+  }
+
+  proxy_pair_t *p = calloc(1, sizeof(*p));
+  if (!p)
+    return JS_ThrowOutOfMemory(ctx);
+  if (js_is_present(argc, argv, 2)) {
+    const char *str = NULL;
+    if (JS_IsString(argv[2])) {
+      str = JS_ToCStringLen(ctx, &data_len, argv[2]);
+      data = (const uint8_t *)str;
+    } else if (!(data = js_get_bytes(ctx, argv[2], &data_len))) {
+      JS_ThrowTypeError(ctx, "proxy(): data must be a string, ArrayBuffer or typed array");
+    }
+    if (data && data_len > 0 && (p->dir[0].early = malloc(data_len)))
+      memcpy(p->dir[0].early, data, data_len);
+    if (str)
+      JS_FreeCString(ctx, str);
+    if (!data || (data_len > 0 && !p->dir[0].early)) {
+      free(p);
+      return data ? JS_ThrowOutOfMemory(ctx) : JS_EXCEPTION;
+    }
+    p->dir[0].early_len = data_len;
+    p->dir[0].bytes = data_len;
+    proxy.bytes += data_len;
+  }
+  p->dir[0].pipe[0] = p->dir[0].pipe[1] = p->dir[1].pipe[0] = p->dir[1].pipe[1] = -1;
+  if (proxy_pipe_get(p->dir[0].pipe) < 0 || proxy_pipe_get(p->dir[1].pipe) < 0) {
+    int err = errno;
+    proxy_pipe_put(p->dir[0].pipe, 0);
+    free(p->dir[0].early);
+    free(p);
+    return JS_ThrowInternalError(ctx, "pipe2() failed: %s", strerror(err));
+  }
+
+  for (int i = 0; i < 2; i++) {
+    p->fd[i] = fd[i];
+    int flags = fcntl(fd[i], F_GETFL);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd[i] };
+    if (flags < 0 || fcntl(fd[i], F_SETFL, flags | O_NONBLOCK) < 0 ||
+        epoll_ctl(proxy.epfd, EPOLL_CTL_ADD, fd[i], &ev) < 0) {
+      int err = errno;
+      if (i == 1)
+        epoll_ctl(proxy.epfd, EPOLL_CTL_DEL, fd[0], NULL);
+      proxy_pipe_put(p->dir[0].pipe, 0);
+      proxy_pipe_put(p->dir[1].pipe, 0);
+      free(p->dir[0].early);
+      free(p);
+      return JS_ThrowInternalError(ctx, "proxy(): fd %d: %s", fd[i], strerror(err));
+    }
+  }
+
+  JSValue promise = JS_NewPromiseCapability(ctx, p->resolving_funcs);
+  if (JS_IsException(promise)) {
+    epoll_ctl(proxy.epfd, EPOLL_CTL_DEL, fd[0], NULL);
+    epoll_ctl(proxy.epfd, EPOLL_CTL_DEL, fd[1], NULL);
+    proxy_pipe_put(p->dir[0].pipe, 0);
+    proxy_pipe_put(p->dir[1].pipe, 0);
+    free(p->dir[0].early);
+    free(p);
+    return promise;
+  }
+  proxy.pairs[fd[0]] = proxy.pairs[fd[1]] = p;
+  proxy.active++;
+  return promise;
+}
+
+// HTTP proxy
+//
+// http_forward() hands one request on a client connection to a pool of
+// upstream servers made by http_upstream() and streams the response back,
+// all natively and on proxy_fd() beside the proxy() pairs. Only heads are
+// parsed: hop-by-hop fields are dropped, X-Forwarded-For and
+// X-Forwarded-Proto are set, and the framing (Content-Length, chunked, or
+// for a response the end of the connection) says where a message ends.
+// Bodies of known length are spliced from socket to socket unless the
+// client speaks TLS; chunked ones are peeked at and copied through a small
+// buffer, so nothing past their end is taken from the socket and whatever
+// follows stays for the next request.
+//
+// Each server keeps a stack of idle keep-alive connections. Requests go
+// round-robin, to the server with the fewest in flight, or by a consistent
+// hash of the client address, path or a header (HP_VNODES points per
+// server on a ring, so adding a server moves about 1/n of the keys).
+// Health is passive: maxFails failures in a row (refused, reset or timed
+// out connections, malformed responses) take a server out for failTimeout
+// ms, after which the next request it is picked for decides. A request
+// that failed before any response byte arrived is sent again, unless some
+// of its body had been read from the client or, for POST and PATCH, some
+// of it had gone to the server: on a fresh connection to the same server
+// when a reused one had gone stale, else to the next server.
+#define HP_POOLS_MAX 64
+#define HP_SERVERS_MAX 64
+#define HP_VNODES 64
+#define HP_HEAD_MAX (32 << 10) // longer request heads get 431, longer response heads 502
+#define HP_COPY_BUF (16 << 10)
+
+enum { HP_ROUND_ROBIN, HP_LEAST_CONN, HP_HASH };
+enum { HP_KEY_IP, HP_KEY_PATH, HP_KEY_HEADER };
+enum { HP_CLIENT, HP_UPSTREAM };
+enum { HP_CLIENT_HEAD, HP_REQUEST, HP_RESPONSE_HEAD, HP_RESPONSE };
+enum { HP_BODY_NONE, HP_BODY_LENGTH, HP_BODY_CHUNKED, HP_BODY_EOF };
+enum { HP_CHUNK_SIZE, HP_CHUNK_EXT, HP_CHUNK_SIZE_LF, HP_CHUNK_DATA, HP_CHUNK_DATA_CR, HP_CHUNK_DATA_LF,
+       HP_CHUNK_TRAILER, HP_CHUNK_TRAILER_LF };
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  char name[128];     // as configured
+  int *idle;          // keep-alive connections, most recently used last
+  int idle_count;
+  uint32_t fails;     // in a row
+  uint32_t active;    // requests in flight
+  int64_t down_until; // ms; out of rotation until then once fails reaches maxFails
+  uint64_t requests;
+  uint64_t failures;
+} hp_server_t;
+
+typedef struct {
+  uint32_t point;
+  int server;
+} hp_vnode_t;
+
+typedef struct {
+  hp_server_t servers[HP_SERVERS_MAX];
+  int count;
+  int balance;
+  int key;
+  char header[64];    // HP_KEY_HEADER
+  size_t header_len;
+  char strip[256];    // prefix taken off the target
+  size_t strip_len;
+  int max_idle;
+  uint32_t max_fails; // 0: never out of rotation
+  int64_t fail_timeout;
+  int64_t timeout;
+  uint32_t next;      // round-robin position
+  hp_vnode_t *ring;   // by point
+  int ring_len;
+} hp_pool_t;
+
+typedef struct {
+  int mode;
+  int state;          // chunked: where in the framing
+  uint64_t left;      // length: bytes to go; chunked: of this chunk
+  int count;          // chunked: size digits, or bytes of the trailer line
+  int done;
+} hp_body_t;
+
+typedef struct hp_xchg {
+  struct hp_xchg *prev, *next; // in flight, for the deadline sweep
+  hp_pool_t *pool;
+  int fd[2];                   // client, upstream
+  int server;                  // -1 until one is picked
+  int state;
+  int tries;                   // servers tried
+  int stale_retry;             // sent again after a reused connection failed
+  int reused;                  // upstream came from the idle stack
+  int got_response;            // the upstream has answered this attempt
+  int body_read;               // body bytes were taken from the client socket
+  int responded;               // bytes went to the client
+  int keep_alive;              // the client connection stays open after
+  int upstream_keep;           // the upstream connection can be reused
+  int head_only;
+  int idempotent;              // not POST or PATCH, so it may reach a server twice
+  int last;
+  int status;
+  int error;
+  uint32_t key;                // hash for HP_HASH
+  char address[64];            // client, for X-Forwarded-For
+  uint8_t *head;               // the head being read, request then response
+  size_t head_len, head_cap;
+  uint8_t *request;            // for the upstream: rewritten head and buffered body
+  size_t request_len, request_off;
+  uint8_t *reply;              // for the client: response heads and the body after them
+  size_t reply_len, reply_off;
+  uint8_t *buf;                // body bytes being copied
+  size_t buf_len, buf_off;
+  uint8_t *rest;               // bytes after the request, handed back
+  size_t rest_len;
+  int pipe[2];
+  size_t piped;
+  hp_body_t req, res;
+  uint64_t sent, received;
+  int64_t deadline;
+  JSValue resolving_funcs[2];
+} hp_xchg_t;
+
+static struct {
+  hp_pool_t *pools[HP_POOLS_MAX];
+  int npools;
+  hp_xchg_t **xchg;            // by fd, client and upstream
+  size_t cap;
+  hp_xchg_t *active;
+  uint64_t forwarded, failed, retried, reused;
+} hp;
+
+static int hp_client_tls(const hp_xchg_t *x) {
+#ifdef QJS_TLS
+  return tls_get(x->fd[HP_CLIENT]) != NULL;
+#else
+  return 0;
+#endif
+}
+
+static hp_xchg_t *hp_get(int fd) {
+  return fd >= 0 && (size_t)fd < hp.cap ? hp.xchg[fd] : NULL;
+}
+
+static int hp_track(int fd, hp_xchg_t *x) {
+  if ((size_t)fd >= hp.cap) {
+    size_t cap = hp.cap ? hp.cap : 1024;
+    while (cap <= (size_t)fd)
+      cap *= 2;
+    hp_xchg_t **xchg = realloc(hp.xchg, cap * sizeof(*xchg));
+    if (!xchg)
+      return -1;
+    memset(xchg + hp.cap, 0, (cap - hp.cap) * sizeof(*xchg));
+    hp.xchg = xchg;
+    hp.cap = cap;
+  }
+  hp.xchg[fd] = x;
+  return 0;
+}
+
+static int64_t hp_now(void) {
+  return (int64_t)(now_ns() / 1000000);
+}
+
+// FNV-1a, then the murmur3 finalizer so that similar keys spread over the ring
+static uint32_t hp_hash(const char *p, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)p[i]) * 16777619u;
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  return h ^ (h >> 16);
+}
+
+static int hp_vnode_cmp(const void *a, const void *b) {
+  uint32_t x = ((const hp_vnode_t *)a)->point, y = ((const hp_vnode_t *)b)->point;
+  return x < y ? -1 : x > y;
+}
+
+static int hp_server_up(const hp_pool_t *p, int s, int64_t now) {
+  const hp_server_t *sv = &p->servers[s];
+  return p->max_fails == 0 || sv->fails < p->max_fails || now >= sv->down_until;
+}
+
+// The server for the next request, other than avoid if there is a choice.
+// When none is in rotation, the one due back first is tried anyway.
+static int hp_pick(hp_pool_t *p, uint32_t key, int avoid) {
+  int64_t now = hp_now();
+  int best = -1;
+
+  if (p->balance == HP_HASH) {
+    int lo = 0, hi = p->ring_len;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (p->ring[mid].point < key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    for (int i = 0; i < p->ring_len; i++) {
+      int s = p->ring[(lo + i) % p->ring_len].server;
+      if (s != avoid && hp_server_up(p, s, now))
+        return s;
+    }
+  } else {
+    for (int i = 0; i < p->count; i++) {
+      int s = (int)((p->next + (uint32_t)i) % (uint32_t)p->count);
+      if (s == avoid || !hp_server_up(p, s, now))
+        continue;
+      if (best < 0 || p->servers[s].active < p->servers[best].active)
+        best = s;
+      if (p->balance == HP_ROUND_ROBIN)
+        break;
+    }
+    if (best >= 0) {
+      p->next = (uint32_t)best + 1;
+      return best;
+    }
+  }
+
+  for (int s = 0; s < p->count; s++)
+    if ((s != avoid || p->count == 1) && (best < 0 || p->servers[s].down_until < p->servers[best].down_until))
+      best = s;
+  return best;
+}
+
+static void hp_server_failed(hp_pool_t *p, hp_server_t *s) {
+  s->failures++;
+  if (++s->fails >= p->max_fails && p->max_fails > 0)
+    s->down_until = hp_now() + p->fail_timeout;
+}
+
+// How many of p[0..n) belong to body b, which ends within them or later;
+// -1 if chunked framing is malformed. p may be NULL unless b is chunked.
+static ssize_t hp_body_take(hp_body_t *b, const uint8_t *p, size_t n) {
+  if (b->done)
+    return 0;
+  switch (b->mode) {
+  case HP_BODY_NONE:
+    b->done = 1;
+    return 0;
+  case HP_BODY_EOF:
+    return (ssize_t)n;
+  case HP_BODY_LENGTH:
+    if (n > b->left)
+      n = (size_t)b->left;
+    b->left -= n;
+    b->done = b->left == 0;
+    return (ssize_t)n;
+  }
+
+  size_t i = 0;
+  while (i < n && !b->done) {
+    uint8_t c = p[i];
+    switch (b->state) {
+    case HP_CHUNK_SIZE: {
+      int v = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+      if (v >= 0) {
+        if (b->left >> 56)
+          return -1;
+        b->left = b->left << 4 | (uint64_t)v;
+        b->count++;
+      } else if (b->count == 0) {
+        return -1;
+      } else if (c == ';' || c == ' ' || c == '\t') {
+        b->state = HP_CHUNK_EXT;
+      } else if (c == '\r') {
+        b->state = HP_CHUNK_SIZE_LF;
+      } else {
+        return -1;
+      }
+      break;
+    }
+    case HP_CHUNK_EXT:
+      if (c == '\r')
+        b->state = HP_CHUNK_SIZE_LF;
+      break;
+    case HP_CHUNK_SIZE_LF:
+      if (c != '\n')
+        return -1;
+      b->state = b->left ? HP_CHUNK_DATA : HP_CHUNK_TRAILER;
+      b->count = 0;
+      break;
+    case HP_CHUNK_DATA: {
+      size_t k = n - i < b->left ? n - i : (size_t)b->left;
+      b->left -= k;
+      i += k;
+      if (b->left == 0)
+        b->state = HP_CHUNK_DATA_CR;
+      continue;
+    }
+    case HP_CHUNK_DATA_CR:
+      if (c != '\r')
+        return -1;
+      b->state = HP_CHUNK_DATA_LF;
+      break;
+    case HP_CHUNK_DATA_LF:
+      if (c != '\n')
+        return -1;
+      b->state = HP_CHUNK_SIZE;
+      break;
+    case HP_CHUNK_TRAILER:
+      if (c == '\r')
+        b->state = HP_CHUNK_TRAILER_LF;
+      else
+        b->count++;
+      break;
+    case HP_CHUNK_TRAILER_LF:
+      if (c != '\n')
+        return -1;
+      b->done = b->count == 0; // the empty line after the trailer fields
+      b->count = 0;
+      b->state = HP_CHUNK_TRAILER;
+      break;
+    }
+    i++;
+  }
+  return (ssize_t)i;
+}
+
+static void hp_body_init(hp_body_t *b, int mode, uint64_t length) {
+  memset(b, 0, sizeof(*b));
+  b->mode = mode;
+  b->left = mode == HP_BODY_LENGTH ? length : 0;
+  b->done = mode == HP_BODY_NONE || (mode == HP_BODY_LENGTH && length == 0);
+}
+
+static int hp_name_is(const char *p, size_t len, const char *name) {
+  return len == strlen(name) && strncasecmp(p, name, len) == 0;
+}
+
+// Content-Length value; -1 unless it is all digits
+static int64_t hp_length(const char *v, size_t len) {
+  int64_t n = 0;
+  if (len == 0 || len > 18)
+    return -1;
+  for (size_t i = 0; i < len; i++) {
+    if (v[i] < '0' || v[i] > '9')
+      return -1;
+    n = n * 10 + (v[i] - '0');
+  }
+  return n;
+}
+
+static int hp_append(uint8_t **buf, size_t *len, const void *p, size_t n) {
+  uint8_t *b = realloc(*buf, *len + n);
+  if (!b)
+    return -1;
+  memcpy(b + *len, p, n);
+  *buf = b;
+  *len += n;
+  return 0;
+}
+
+// Folds the codings of a Transfer-Encoding value v into *chunked, the
+// fields of a head in order; -1 if chunked is not the final coding (RFC
+// 9112 6.1), e.g. "chunked, gzip" or chunked given twice.
+static int hp_codings(const char *v, size_t len, int *chunked) {
+  for (const char *c = v, *end = v + len, *comma; c < end; c = comma + 1) {
+    if (!(comma = memchr(c, ',', (size_t)(end - c))))
+      comma = end;
+    const char *c_end = comma;
+    while (c < c_end && (*c == ' ' || *c == '\t'))
+      c++;
+    while (c_end > c && (c_end[-1] == ' ' || c_end[-1] == '\t'))
+      c_end--;
+    if (c == c_end)
+      continue; // empty list element
+    if (*chunked)
+      return -1;
+    *chunked = hp_name_is(c, (size_t)(c_end - c), "chunked");
+  }
+  return 0;
+}
+
+// Writes request head r into x->request for the upstream: the prefix
+// stripped, hop-by-hop fields dropped, X-Forwarded-For and -Proto set and
+// the connection kept alive, with room for extra body bytes. Sets x->req
+// from the framing. 400 if that is malformed or ambiguous (both
+// Content-Length and Transfer-Encoding, as in request smuggling, or a
+// Transfer-Encoding that does not end in chunked), -1 if out of memory,
+// else 0.
+static int hp_request_build(hp_xchg_t *x, const http_head_t *r, size_t extra) {
+  const hp_pool_t *p = x->pool;
+  const char *xff = NULL, *end = r->headers + r->headers_len;
+  size_t xff_len = 0, n = 0;
+  int64_t length = -1;
+  int chunked = 0, encoded = 0;
+
+  char *out = malloc(r->length + strlen(x->address) + 128 + extra);
+  if (!out)
+    return -1;
+  memcpy(out, r->method, r->method_len + 1);
+  n = r->method_len + 1;
+  const char *t = r->target;
+  size_t t_len = r->target_len;
+  if (p->strip_len > 0 && t_len >= p->strip_len && memcmp(t, p->strip, p->strip_len) == 0 &&
+      (t_len == p->strip_len || t[p->strip_len] == '/' || t[p->strip_len] == '?')) {
+    t += p->strip_len;
+    t_len -= p->strip_len;
+    if (t_len == 0 || *t == '?')
+      out[n++] = '/';
+  }
+  memcpy(out + n, t, t_len);
+  n += t_len;
+  memcpy(out + n, r->target + r->target_len, 11); // " HTTP/1.x\r\n"
+  n += 11;
+
+  for (const char *q = r->headers, *line_end; q < end; q = line_end + 2) {
+    line_end = memchr(q, '\r', (size_t)(end - q));
+    const char *colon = line_end ? memchr(q, ':', (size_t)(line_end - q)) : NULL;
+    if (!colon) {
+      free(out);
+      return 400;
+    }
+    size_t name_len = (size_t)(colon - q);
+    const char *v = colon + 1, *v_end = line_end;
+    while (v < v_end && (*v == ' ' || *v == '\t'))
+      v++;
+    while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+      v_end--;
+    if (hp_name_is(q, name_len, "content-length")) {
+      int64_t len = hp_length(v, (size_t)(v_end - v));
+      if (len < 0 || (length >= 0 && len != length)) {
+        free(out);
+        return 400;
+      }
+      length = len;
+    } else if (hp_name_is(q, name_len, "transfer-encoding")) {
+      if (hp_codings(v, (size_t)(v_end - v), &chunked) < 0) {
+        free(out);
+        return 400;
+      }
+      encoded = 1;
+    } else if (hp_name_is(q, name_len, "x-forwarded-for")) {
+      xff = v;
+      xff_len = (size_t)(v_end - v);
+      continue;
+    } else if (hp_name_is(q, name_len, "connection") || hp_name_is(q, name_len, "keep-alive") ||
+               hp_name_is(q, name_len, "proxy-connection") || hp_name_is(q, name_len, "te") ||
+               hp_name_is(q, name_len, "upgrade") || hp_name_is(q, name_len, "x-forwarded-proto")) {
+      continue;
+    }
+    memcpy(out + n, q, (size_t)(line_end + 2 - q));
+    n += (size_t)(line_end + 2 - q);
+  }
+  if (encoded && (!chunked || length >= 0)) {
+    free(out);
+    return 400;
+  }
+
+  n += (size_t)sprintf(out + n, "X-Forwarded-For: %.*s%s%s\r\nX-Forwarded-Proto: %s\r\nConnection: keep-alive\r\n\r\n",
+                       (int)xff_len, xff ? xff : "", xff ? ", " : "", x->address,
+                       hp_client_tls(x) ? "https" : "http");
+  x->request = (uint8_t *)out;
+  x->request_len = n;
+  hp_body_init(&x->req, chunked ? HP_BODY_CHUNKED : length > 0 ? HP_BODY_LENGTH : HP_BODY_NONE,
+               length > 0 ? (uint64_t)length : 0);
+  return 0;
+}
+
+// Status and framing of the response head in x->head[0..len): an interim
+// (1xx) head is passed on as it is, a final one rewritten for the client.
+// Both go to x->reply. 1 for a final head, 0 for an interim one, -1 if it
+// is malformed or out of memory.
+static int hp_response_head(hp_xchg_t *x, size_t len) {
+  const char *h = (const char *)x->head, *end = h + len - 2;
+  if (len < 16 || memcmp(h, "HTTP/1.", 7) != 0 || h[8] != ' ' || !isdigit((uint8_t)h[9]) ||
+      !isdigit((uint8_t)h[10]) || !isdigit((uint8_t)h[11]) || (h[12] != ' ' && h[12] != '\r'))
+    return -1;
+  int status = (h[9] - '0') * 100 + (h[10] - '0') * 10 + (h[11] - '0');
+  if (status < 100 || status == 101)
+    return -1; // Upgrade is not forwarded, so nothing may switch protocols
+  if (status < 200)
+    return hp_append(&x->reply, &x->reply_len, h, len) < 0 ? -1 : 0;
+
+  // Rewritten, the head is at most as long: Connection: close replaces fields
+  uint8_t *out = realloc(x->reply, x->reply_len + len + 32);
+  if (!out)
+    return -1;
+  x->reply = out;
+  out += x->reply_len;
+  size_t n = 0;
+  const char *line_end = memchr(h, '\r', len);
+  memcpy(out, h, (size_t)(line_end + 2 - h));
+  n = (size_t)(line_end + 2 - h);
+
+  int keep = h[7] == '1', chunked = 0;
+  int64_t length = -1;
+  for (const char *q = line_end + 2; q < end; q = line_end + 2) {
+    line_end = memchr(q, '\r', (size_t)(end + 2 - q));
+    const char *colon = line_end ? memchr(q, ':', (size_t)(line_end - q)) : NULL;
+    if (!colon)
+      return -1;
+    size_t name_len = (size_t)(colon - q), value_len = (size_t)(line_end - colon - 1);
+    if (hp_name_is(q, name_len, "connection")) {
+      if (http_token(colon + 1, value_len, "close"))
+        keep = 0;
+      else if (http_token(colon + 1, value_len, "keep-alive"))
+        keep = 1;
+      continue;
+    }
+    if (hp_name_is(q, name_len, "keep-alive") || hp_name_is(q, name_len, "proxy-connection"))
+      continue;
+    if (hp_name_is(q, name_len, "transfer-encoding")) {
+      chunked = http_token(colon + 1, value_len, "chunked");
+    } else if (hp_name_is(q, name_len, "content-length")) {
+      const char *v = colon + 1, *v_end = line_end;
+      while (v < v_end && *v == ' ')
+        v++;
+      while (v_end > v && v_end[-1] == ' ')
+        v_end--;
+      if ((length = hp_length(v, (size_t)(v_end - v))) < 0)
+        return -1;
+    }
+    memcpy(out + n, q, (size_t)(line_end + 2 - q));
+    n += (size_t)(line_end + 2 - q);
+  }
+
+  int mode = x->head_only || status == 204 || status == 304 ? HP_BODY_NONE
+             : chunked                                      ? HP_BODY_CHUNKED
+             : length >= 0                                  ? HP_BODY_LENGTH
+                                                            : HP_BODY_EOF;
+  hp_body_init(&x->res, mode, length > 0 ? (uint64_t)length : 0);
+  x->status = status;
+  x->upstream_keep = keep && mode != HP_BODY_EOF;
+  // A client whose request was cut short, or that cannot tell where this
+  // response ends, is not kept
+  x->keep_alive = x->keep_alive && !x->last && mode != HP_BODY_EOF && x->req.done;
+  const char *connection = x->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  memcpy(out + n, connection, strlen(connection));
+  x->reply_len += n + strlen(connection);
+  return 1;
+}
+
+// Answers the client with status and closes, unless it has had bytes already
+static void hp_error(hp_xchg_t *x, int status) {
+  const char *reason = status == 400   ? "Bad Request"
+                       : status == 431 ? "Request Header Fields Too Large"
+                       : status == 504 ? "Gateway Timeout"
+                                       : "Bad Gateway";
+  x->keep_alive = 0;
+  if (x->responded)
+    return;
+  char buf[192];
+  int n = snprintf(buf, sizeof(buf),
+                   "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s",
+                   status, reason, strlen(reason), reason);
+  ssize_t sent = conn_send(x->fd[HP_CLIENT], buf, (size_t)n, MSG_NOSIGNAL);
+  x->status = status;
+  x->responded = 1;
+  if (sent > 0)
+    x->received += (uint64_t)sent;
+}
+
+static ssize_t hp_recv(hp_xchg_t *x, int side, void *buf, size_t len, int flags) {
+  return side == HP_CLIENT ? conn_recv(x->fd[side], buf, len, flags) : recv(x->fd[side], buf, len, flags);
+}
+
+static ssize_t hp_send(hp_xchg_t *x, int side, const void *buf, size_t len) {
+  return side == HP_CLIENT ? conn_send(x->fd[side], buf, len, MSG_NOSIGNAL) : send(x->fd[side], buf, len, MSG_NOSIGNAL);
+}
+
+// Sends what x->reply holds: 1 once it is out, 0 if the socket is full, -1 on error
+static int hp_flush_reply(hp_xchg_t *x) {
+  while (x->reply_off < x->reply_len) {
+    ssize_t n = hp_send(x, HP_CLIENT, x->reply + x->reply_off, x->reply_len - x->reply_off);
+    if (n < 0)
+      return errno == EAGAIN ? 0 : -1;
+    x->reply_off += (size_t)n;
+    x->received += (uint64_t)n;
+    x->responded = 1;
+  }
+  x->reply_off = x->reply_len = 0;
+  return 1;
+}
+
+// Moves body b from side `from` to the other one until it is complete (1)
+// or a socket would block (0). -1 with errno set and *failed set to the
+// side at fault.
+static int hp_pump(hp_xchg_t *x, hp_body_t *b, int from, int *failed) {
+  int to = !from;
+  uint64_t *count = from == HP_CLIENT ? &x->sent : &x->received;
+  int splice_ok = b->mode != HP_BODY_CHUNKED && !hp_client_tls(x);
+
+  for (;;) {
+    while (x->buf_off < x->buf_len) {
+      ssize_t n = hp_send(x, to, x->buf + x->buf_off, x->buf_len - x->buf_off);
+      if (n < 0) {
+        *failed = to;
+        return errno == EAGAIN ? 0 : -1;
+      }
+      x->buf_off += (size_t)n;
+      *count += (uint64_t)n;
+      x->responded |= to == HP_CLIENT;
+    }
+    x->buf_off = x->buf_len = 0;
+    if (x->piped > 0) {
+      ssize_t n = splice(x->pipe[0], NULL, x->fd[to], NULL, x->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0) {
+        *failed = to;
+        return errno == EAGAIN ? 0 : -1;
+      }
+      x->piped -= (size_t)n;
+      *count += (uint64_t)n;
+      x->responded |= to == HP_CLIENT;
+      continue;
+    }
+    if (b->done)
+      return 1;
+
+    size_t want = b->mode == HP_BODY_LENGTH && b->left < PROXY_CHUNK ? (size_t)b->left : PROXY_CHUNK;
+    ssize_t n;
+    if (splice_ok && (x->pipe[0] >= 0 || proxy_pipe_get(x->pipe) == 0)) {
+      n = splice(x->fd[from], NULL, x->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        x->body_read |= from == HP_CLIENT;
+        hp_body_take(b, NULL, (size_t)n);
+        x->piped += (size_t)n;
+        continue;
+      }
+    } else {
+      if (!x->buf && !(x->buf = malloc(HP_COPY_BUF))) {
+        *failed = from;
+        errno = ENOMEM;
+        return -1;
+      }
+      if (want > HP_COPY_BUF)
+        want = HP_COPY_BUF;
+      // Chunked: peek, so that nothing after the last chunk is consumed
+      n = hp_recv(x, from, x->buf, want, b->mode == HP_BODY_CHUNKED ? MSG_PEEK : 0);
+      if (n > 0) {
+        x->body_read |= from == HP_CLIENT;
+        ssize_t take = hp_body_take(b, x->buf, (size_t)n);
+        if (take < 0 || (b->mode == HP_BODY_CHUNKED && hp_recv(x, from, x->buf, (size_t)take, 0) != take)) {
+          *failed = from;
+          errno = EPROTO;
+          return -1;
+        }
+        x->buf_len = (size_t)take;
+        continue;
+      }
+    }
+    if (n == 0 && b->mode == HP_BODY_EOF) {
+      b->done = 1;
+      continue;
+    }
+    *failed = from;
+    if (n == 0)
+      errno = ECONNRESET; // ended before its framing did
+    return n < 0 && errno == EAGAIN ? 0 : -1;
+  }
+}
+
+// Reads response heads from the upstream: 1 once the final one is in
+// x->reply, with the body bytes that came along, 0 to wait, -1 with errno
+// set if the upstream failed
+static int hp_read_response(hp_xchg_t *x) {
+  for (;;) {
+    uint8_t *end = x->head_len ? memmem(x->head, x->head_len, "\r\n\r\n", 4) : NULL;
+    if (end) {
+      size_t len = (size_t)(end + 4 - x->head);
+      int r = hp_response_head(x, len);
+      if (r < 0) {
+        errno = EPROTO;
+        return -1;
+      }
+      x->head_len -= len;
+      memmove(x->head, x->head + len, x->head_len);
+      if (r == 0)
+        continue;
+      ssize_t take = hp_body_take(&x->res, x->head, x->head_len);
+      if (take < 0 || hp_append(&x->reply, &x->reply_len, x->head, (size_t)take) < 0) {
+        errno = EPROTO;
+        return -1;
+      }
+      if ((size_t)take < x->head_len)
+        x->upstream_keep = 0; // sent more than it framed
+      x->head_len = 0;
+      x->pool->servers[x->server].fails = 0;
+      return 1;
+    }
+    if (x->head_len == x->head_cap) {
+      size_t cap = x->head_cap ? x->head_cap * 2 : 4096;
+      uint8_t *head = x->head_cap < HP_HEAD_MAX ? realloc(x->head, cap) : NULL;
+      if (!head) {
+        errno = EPROTO;
+        return -1;
+      }
+      x->head = head;
+      x->head_cap = cap;
+    }
+    ssize_t n = recv(x->fd[HP_UPSTREAM], x->head + x->head_len, x->head_cap - x->head_len, 0);
+    if (n <= 0) {
+      if (n == 0)
+        errno = ECONNRESET;
+      return errno == EAGAIN ? 0 : -1;
+    }
+    x->head_len += (size_t)n;
+    x->got_response = 1;
+  }
+}
+
+// Puts the upstream connection back on its server's idle stack if it
+// carried a whole exchange and may carry another, else closes it
+static void hp_upstream_release(hp_xchg_t *x) {
+  int fd = x->fd[HP_UPSTREAM];
+  if (fd < 0)
+    return;
+  hp_server_t *s = &x->pool->servers[x->server];
+  epoll_ctl(proxy.epfd, EPOLL_CTL_DEL, fd, NULL);
+  hp.xchg[fd] = NULL;
+  s->active--;
+  if (x->upstream_keep && x->res.done && x->req.done && x->request_off == x->request_len && x->piped == 0 &&
+      x->buf_off == x->buf_len && s->idle_count < x->pool->max_idle) {
+    s->idle[s->idle_count++] = fd;
+  } else {
+    close(fd);
+  }
+  x->fd[HP_UPSTREAM] = -1;
+}
+
+// Opens, or takes from the idle stack, a connection to server s for x.
+// -1 with errno set if a new one cannot be started.
+static int hp_connect(hp_xchg_t *x, int s) {
+  hp_server_t *sv = &x->pool->servers[s];
+  int fd = -1;
+
+  x->reused = 0;
+  while (sv->idle_count > 0) {
+    fd = sv->idle[--sv->idle_count];
+    char c;
+    // An idle connection has nothing to say; EOF or data means the server let go
+    if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+      x->reused = 1;
+      hp.reused++;
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    fd = socket(sv->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return -1;
+    if (sv->addr.ss_family != AF_UNIX) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    // A Unix socket with a full backlog says EAGAIN; that counts as a failure
+    if (connect(fd, (struct sockaddr *)&sv->addr, sv->addr_len) < 0 && errno != EINPROGRESS) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+  }
+
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd };
+  if (hp_track(fd, x) < 0) {
+    close(fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  if (epoll_ctl(proxy.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    int err = errno;
+    hp.xchg[fd] = NULL;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  x->fd[HP_UPSTREAM] = fd;
+  x->server = s;
+  x->got_response = 0;
+  x->request_off = 0;
+  sv->active++;
+  sv->requests++;
+  return 0;
+}
+
+// Starts the request on a server, trying the others when connections
+// cannot even be opened; 0 or -1 with errno set
+static int hp_start(hp_xchg_t *x, int avoid) {
+  for (int s = hp_pick(x->pool, x->key, avoid); x->tries < x->pool->count; s = hp_pick(x->pool, x->key, s)) {
+    x->tries++;
+    if (hp_connect(x, s) == 0)
+      return 0;
+    hp_server_failed(x->pool, &x->pool->servers[s]);
+  }
+  return -1;
+}
+
+// The upstream side failed with err: the request goes out again if it can
+// have had no effect yet, else the client gets status (when nothing has
+// been sent to it) and the exchange ends. 1 once it has ended.
+static int hp_upstream_failed(hp_xchg_t *x, int err, int status) {
+  hp_server_t *s = &x->pool->servers[x->server];
+  int stale = x->reused && !x->got_response && err != ETIMEDOUT;
+  int again = !x->got_response && !x->responded && !x->body_read && x->request &&
+              (x->idempotent || x->request_off == 0);
+
+  if (!stale)
+    hp_server_failed(x->pool, s);
+  x->upstream_keep = 0;
+  hp_upstream_release(x);
+  if (again && stale && !x->stale_retry) {
+    x->stale_retry = 1;
+    hp.retried++;
+    if (hp_connect(x, x->server) == 0) {
+      x->state = HP_REQUEST;
+      return 0;
+    }
+    hp_server_failed(x->pool, s);
+  }
+  if (again && x->tries < x->pool->count) {
+    hp.retried++;
+    if (hp_start(x, x->server) == 0) {
+      x->state = HP_REQUEST;
+      return 0;
+    }
+  }
+  x->error = err;
+  hp_error(x, status);
+  return 1;
+}
+
+// The client side failed, or gave up: the exchange ends without a reply
+static int hp_client_failed(hp_xchg_t *x, int err) {
+  x->error = err;
+  x->keep_alive = 0;
+  x->upstream_keep = 0;
+  return 1;
+}
+
+// Reads the request head from the client, rewrites it and starts the
+// upstream connection: 1 once the request can go out, 0 to wait, -1 once
+// the exchange has ended
+static int hp_read_request(hp_xchg_t *x) {
+  http_head_t r;
+  while (http_head_parse((const char *)x->head, x->head_len, &r) < 0) {
+    if (x->head_len > 0 && memmem(x->head, x->head_len, "\r\n\r\n", 4)) {
+      hp_error(x, 400);
+      return -1;
+    }
+    if (x->head_len == x->head_cap) {
+      size_t cap = x->head_cap ? x->head_cap * 2 : 4096;
+      uint8_t *head = x->head_cap < HP_HEAD_MAX ? realloc(x->head, cap) : NULL;
+      if (!head) {
+        hp_error(x, 431);
+        return -1;
+      }
+      x->head = head;
+      x->head_cap = cap;
+    }
+    ssize_t n = conn_recv(x->fd[HP_CLIENT], x->head + x->head_len, x->head_cap - x->head_len, 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EAGAIN)
+        return 0;
+      hp_client_failed(x, n < 0 ? errno : ECONNRESET);
+      return -1;
+    }
+    x->head_len += (size_t)n;
+  }
+
+  x->head_only = r.method_len == 4 && memcmp(r.method, "HEAD", 4) == 0;
+  x->idempotent = !(r.method_len == 4 && memcmp(r.method, "POST", 4) == 0) &&
+                  !(r.method_len == 5 && memcmp(r.method, "PATCH", 5) == 0);
+  x->keep_alive = r.keep_alive;
+  const hp_pool_t *p = x->pool;
+  if (p->balance == HP_HASH) {
+    const char *k = x->address;
+    size_t k_len = strlen(x->address);
+    if (p->key == HP_KEY_PATH) {
+      const char *q = memchr(r.target, '?', r.target_len);
+      k = r.target;
+      k_len = q ? (size_t)(q - r.target) : r.target_len;
+    } else if (p->key == HP_KEY_HEADER && !(k = http_head_header(&r, p->header, p->header_len, &k_len))) {
+      k = "";
+    }
+    x->key = hp_hash(k, k_len);
+  }
+
+  // Body bytes read along with the head go out with it; what follows the
+  // body is handed back
+  size_t extra = x->head_len - r.length;
+  int status = hp_request_build(x, &r, extra);
+  if (status != 0) {
+    if (status < 0)
+      x->error = ENOMEM;
+    hp_error(x, status < 0 ? 502 : status);
+    return -1;
+  }
+  ssize_t take = hp_body_take(&x->req, x->head + r.length, extra);
+  if (take < 0) {
+    hp_error(x, 400);
+    return -1;
+  }
+  memcpy(x->request + x->request_len, x->head + r.length, (size_t)take);
+  x->request_len += (size_t)take;
+  if ((size_t)take < extra) {
+    x->rest_len = extra - (size_t)take;
+    if (!(x->rest = malloc(x->rest_len))) {
+      hp_client_failed(x, ENOMEM);
+      return -1;
+    }
+    memcpy(x->rest, x->head + r.length + take, x->rest_len);
+  }
+  x->head_len = 0;
+
+  if (hp_start(x, -1) < 0) {
+    x->error = errno;
+    hp_error(x, 502);
+    return -1;
+  }
+  return 1;
+}
+
+// Moves x along as far as its sockets allow; 1 once it is over
+static int hp_run(hp_xchg_t *x) {
+  int failed, r;
+  for (;;) {
+    switch (x->state) {
+    case HP_CLIENT_HEAD:
+      if ((r = hp_read_request(x)) <= 0)
+        return r < 0;
+      x->state = HP_REQUEST;
+      break;
+
+    case HP_REQUEST:
+      r = 0;
+      while (x->request_off < x->request_len) {
+        // Sends on a connection still being opened fail with EAGAIN, or with its error
+        ssize_t n = send(x->fd[HP_UPSTREAM], x->request + x->request_off, x->request_len - x->request_off,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+          if (errno != EAGAIN)
+            return hp_upstream_failed(x, errno, 502);
+          r = -1;
+          break;
+        }
+        x->request_off += (size_t)n;
+        x->sent += (uint64_t)n;
+      }
+      if (r == 0) {
+        r = hp_pump(x, &x->req, HP_CLIENT, &failed);
+        if (r < 0)
+          return failed == HP_UPSTREAM ? hp_upstream_failed(x, errno, 502) : hp_client_failed(x, errno);
+        if (r == 1) {
+          x->state = HP_RESPONSE_HEAD;
+          break;
+        }
+      }
+      // Waiting on a socket: the upstream may answer early, with 100
+      // Continue or with a final response that makes the rest moot
+      r = hp_read_response(x);
+      if (r < 0)
+        return hp_upstream_failed(x, errno, 502);
+      if (hp_flush_reply(x) < 0 && r == 0)
+        return hp_client_failed(x, errno);
+      if (r == 0)
+        return 0;
+      x->keep_alive = 0;
+      x->upstream_keep = 0;
+      if (x->piped > 0) {
+        close(x->pipe[0]); // request bytes; the pool only takes empty pipes
+        close(x->pipe[1]);
+        x->pipe[0] = x->pipe[1] = -1;
+        x->piped = 0;
+      }
+      x->buf_off = x->buf_len = 0;
+      x->state = HP_RESPONSE;
+      break;
+
+    case HP_RESPONSE_HEAD:
+      r = hp_read_response(x);
+      if (r < 0)
+        return hp_upstream_failed(x, errno, 502);
+      if (r == 0)
+        return hp_flush_reply(x) < 0 ? hp_client_failed(x, errno) : 0;
+      x->state = HP_RESPONSE;
+      break;
+
+    case HP_RESPONSE:
+      if ((r = hp_flush_reply(x)) <= 0)
+        return r < 0 ? hp_client_failed(x, errno) : 0;
+      r = hp_pump(x, &x->res, HP_UPSTREAM, &failed);
+      if (r < 0) {
+        x->keep_alive = 0; // the response is cut short
+        return failed == HP_UPSTREAM ? hp_upstream_failed(x, errno, 502) : hp_client_failed(x, errno);
+      }
+      return r;
+    }
+  }
+}
+
+// Lets go of both sockets and resolves x's promise
+static void hp_finish(JSContext *ctx, hp_xchg_t *x) {
+  hp_upstream_release(x);
+  epoll_ctl(proxy.epfd, EPOLL_CTL_DEL, x->fd[HP_CLIENT], NULL);
+  hp.xchg[x->fd[HP_CLIENT]] = NULL;
+  proxy_pipe_put(x->pipe, x->piped);
+  if (x->prev)
+    x->prev->next = x->next;
+  else
+    hp.active = x->next;
+  if (x->next)
+    x->next->prev = x->prev;
+  hp.forwarded++;
+  if (x->error)
+    hp.failed++;
+
+  JSValue result = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, result, "status", JS_NewInt32(ctx, x->status));
+  JS_SetPropertyStr(ctx, result, "upstream",
+                    x->server >= 0 ? JS_NewString(ctx, x->pool->servers[x->server].name) : JS_NULL);
+  JS_SetPropertyStr(ctx, result, "sent", JS_NewInt64(ctx, (int64_t)x->sent));
+  JS_SetPropertyStr(ctx, result, "received", JS_NewInt64(ctx, (int64_t)x->received));
+  JS_SetPropertyStr(ctx, result, "keepAlive", JS_NewBool(ctx, x->keep_alive && !x->error));
+  if (x->error) {
+    const char *name = strerrorname_np(x->error);
+    JS_SetPropertyStr(ctx, result, "error", JS_NewString(ctx, name ? name : strerror(x->error)));
+  }
+  if (x->rest_len > 0)
+    JS_SetPropertyStr(ctx, result, "rest", JS_NewArrayBufferCopy(ctx, x->rest, x->rest_len));
+  JSValue ret = JS_Call(ctx, x->resolving_funcs[0], JS_UNDEFINED, 1, (JSValueConst *)&result);
+  JS_FreeValue(ctx, ret);
+  JS_FreeValue(ctx, result);
+  JS_FreeValue(ctx, x->resolving_funcs[0]);
+  JS_FreeValue(ctx, x->resolving_funcs[1]);
+  free(x->head);
+  free(x->request);
+  free(x->reply);
+  free(x->buf);
+  free(x->rest);
+  free(x);
+}
+
+// Ends the exchange on client fd, for a socket closed while forwarding
+static void hp_conn_free(JSContext *ctx, int fd) {
+  hp_xchg_t *x = hp_get(fd);
+  if (x && x->fd[HP_CLIENT] == fd) {
+    hp_client_failed(x, ECONNABORTED);
+    hp_finish(ctx, x);
+  }
+}
+
+// Ends exchanges that made no progress for their pool's timeout. Waiting
+// on the upstream counts against it and the client gets a 504.
+static int hp_sweep(JSContext *ctx) {
+  int64_t now = hp_now();
+  int settled = 0;
+  for (hp_xchg_t *x = hp.active, *next; x; x = next) {
+    next = x->next;
+    if (now < x->deadline)
+      continue;
+    if (x->state == HP_RESPONSE_HEAD || (x->state == HP_REQUEST && x->request_off < x->request_len)) {
+      if (hp_upstream_failed(x, ETIMEDOUT, 504) == 0) {
+        x->deadline = now + x->pool->timeout; // sent to another server
+        continue;
+      }
+    } else {
+      hp_client_failed(x, ETIMEDOUT);
+    }
+    hp_finish(ctx, x);
+    settled++;
+  }
+  return settled;
+}
+
+// Runs x for an event on one of its sockets; 1 if it ended
+static int hp_event(JSContext *ctx, hp_xchg_t *x) {
+  uint64_t moved = x->sent + x->received + x->head_len;
+  int state = x->state;
+  if (!hp_run(x)) {
+    if (x->sent + x->received + x->head_len != moved || x->state != state)
+      x->deadline = hp_now() + x->pool->timeout;
+    return 0;
+  }
+  hp_finish(ctx, x);
+  return 1;
+}
+
+// http_upstream(servers, options) -> pool id
+// servers are "host:port", "[v6]:port", "/unix/path" or "@abstract";
+// names are resolved once, here. options: {balance: 'round-robin' |
+// 'least-conn' | 'hash', key: 'ip' | 'path' | header name (for hash),
+// maxIdle = 32 keep-alive connections per server, maxFails = 3 (0: never
+// out of rotation), failTimeout = 10000 ms, timeout = 30000 ms without
+// progress, strip: target prefix to remove}
+static JSValue js_http_upstream(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  uint32_t count = 0;
+  if (hp.npools == HP_POOLS_MAX)
+    return JS_ThrowRangeError(ctx, "http_upstream(): at most %d pools", HP_POOLS_MAX);
+  JSValue length = JS_GetPropertyStr(ctx, argv[0], "length");
+  int err = !JS_IsArray(ctx, argv[0]) || JS_ToUint32(ctx, &count, length);
+  JS_FreeValue(ctx, length);
+  if (err || count < 1 || count > HP_SERVERS_MAX)
+    return JS_ThrowRangeError(ctx, "http_upstream(): servers must be an array of 1 to %d", HP_SERVERS_MAX);
+
+  hp_pool_t *p = calloc(1, sizeof(*p));
+  if (!p)
+    return JS_ThrowOutOfMemory(ctx);
+  p->max_idle = 32;
+  p->max_fails = 3;
+  p->fail_timeout = 10000;
+  p->timeout = 30000;
+
+  static const char *const ints[] = { "maxIdle", "maxFails", "failTimeout", "timeout" };
+  for (int i = 0; i < 4; i++) {
+    JSValue v = JS_GetPropertyStr(ctx, argv[1], ints[i]);
+    int64_t n = 0;
+    if (JS_IsUndefined(v))
+      continue;
+    err = JS_ToInt64(ctx, &n, v);
+    JS_FreeValue(ctx, v);
+    if (err || n < 0) {
+      free(p);
+      return err ? JS_EXCEPTION : JS_ThrowRangeError(ctx, "http_upstream(): %s must be >= 0", ints[i]);
+    }
+    if (i == 0)
+      p->max_idle = n > 1024 ? 1024 : (int)n;
+    else if (i == 1)
+      p->max_fails = (uint32_t)n;
+    else if (i == 2)
+      p->fail_timeout = n;
+    else
+      p->timeout = n > 0 ? n : 30000;
+  }
+
+  static const char *const strs[] = { "balance", "key", "strip" };
+  for (int i = 0; i < 3; i++) {
+    JSValue v = JS_GetPropertyStr(ctx, argv[1], strs[i]);
+    if (JS_IsUndefined(v))
+      continue;
+    size_t len;
+    const char *s = JS_ToCStringLen(ctx, &len, v);
+    JS_FreeValue(ctx, v);
+    if (!s) {
+      free(p);
+      return JS_EXCEPTION;
+    }
+    int bad = 0;
+    if (i == 0) {
+      if (strcmp(s, "round-robin") == 0)
+        p->balance = HP_ROUND_ROBIN;
+      else if (strcmp(s, "least-conn") == 0)
+        p->balance = HP_LEAST_CONN;
+      else if (strcmp(s, "hash") == 0)
+        p->balance = HP_HASH;
+      else
+        bad = 1;
+    } else if (i == 1) {
+      if (strcmp(s, "ip") == 0) {
+        p->key = HP_KEY_IP;
+      } else if (strcmp(s, "path") == 0) {
+        p->key = HP_KEY_PATH;
+      } else if (len > 0 && len < sizeof(p->header)) {
+        p->key = HP_KEY_HEADER;
+        memcpy(p->header, s, len);
+        p->header_len = len;
+      } else {
+        bad = 1;
+      }
+    } else if (len < sizeof(p->strip)) {
+      memcpy(p->strip, s, len);
+      p->strip_len = len;
+    } else {
+      bad = 1;
+    }
+    JS_FreeCString(ctx, s);
+    if (bad) {
+      free(p);
+      return JS_ThrowTypeError(ctx, "http_upstream(): invalid %s", strs[i]);
+    }
+  }
+
+  for (int i = 0; i < (int)count; i++) {
+    hp_server_t *s = &p->servers[i];
+    JSValue v = JS_GetPropertyUint32(ctx, argv[0], (uint32_t)i);
+    const char *name = JS_ToCString(ctx, v);
+    JS_FreeValue(ctx, v);
+    if (!name)
+      goto fail;
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    JS_FreeCString(ctx, name);
+    name = s->name;
+    int ok = 0;
+    if (name[0] == '/' || name[0] == '@') {
+      struct sockaddr_un *sun = (struct sockaddr_un *)&s->addr;
+      size_t len = strlen(name);
+      if (len < sizeof(sun->sun_path)) {
+        sun->sun_family = AF_UNIX;
+        memcpy(sun->sun_path, name, len);
+        if (name[0] == '@')
+          sun->sun_path[0] = '\0';
+        s->addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len + (name[0] == '/'));
+        ok = 1;
+      }
+    } else {
+      char host[128];
+      const char *colon = strrchr(name, ':');
+      size_t host_len = colon ? (size_t)(colon - name) : 0;
+      if (host_len > 1 && name[0] == '[' && name[host_len - 1] == ']') {
+        name++;
+        host_len -= 2;
+      }
+      if (colon && host_len > 0 && host_len < sizeof(host)) {
+        memcpy(host, name, host_len);
+        host[host_len] = '\0';
+        struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICSERV }, *res;
+        if (getaddrinfo(host, colon + 1, &hints, &res) == 0) {
+          memcpy(&s->addr, res->ai_addr, res->ai_addrlen);
+          s->addr_len = res->ai_addrlen;
+          freeaddrinfo(res);
+          ok = 1;
+        }
+      }
+    }
+    if (!ok) {
+      JS_ThrowTypeError(ctx, "http_upstream(): cannot resolve %s", s->name);
+      goto fail;
+    }
+    if (p->max_idle > 0 && !(s->idle = malloc((size_t)p->max_idle * sizeof(int)))) {
+      JS_ThrowOutOfMemory(ctx);
+      goto fail;
+    }
+    p->count = i + 1;
+  }
+
+  if (p->balance == HP_HASH) {
+    if (!(p->ring = malloc((size_t)p->count * HP_VNODES * sizeof(hp_vnode_t)))) {
+      JS_ThrowOutOfMemory(ctx);
+      goto fail;
+    }
+    for (int s = 0; s < p->count; s++) {
+      for (int v = 0; v < HP_VNODES; v++) {
+        char point[160];
+        int n = snprintf(point, sizeof(point), "%s#%d", p->servers[s].name, v);
+        p->ring[p->ring_len++] = (hp_vnode_t){ hp_hash(point, (size_t)n), s };
+      }
+    }
+    qsort(p->ring, (size_t)p->ring_len, sizeof(hp_vnode_t), hp_vnode_cmp);
+  }
+
+  hp.pools[hp.npools] = p;
+  return JS_NewInt32(ctx, hp.npools++);
+
+fail:
+  for (int i = 0; i < HP_SERVERS_MAX; i++)
+    free(p->servers[i].idle);
+  free(p);
+  return JS_EXCEPTION;
+}
+
+// http_forward(fd, pool, data, address, last) -> Promise<{status, upstream,
+//   sent, received, keepAlive, error, rest}>
+// Forwards the request arriving on client fd through pool and writes the
+// response back. data holds what was already read of it, as a string or
+// bytes ('' if nothing was), address is the client's for X-Forwarded-For,
+// and last closes the connection after the response. The promise resolves
+// once the response is out: sent and received count upstream-bound and
+// client-bound bytes, keepAlive says whether the connection can take the
+// next request, and rest is an ArrayBuffer of the bytes of data past this
+// request. On failure error is the errno name; the client got a 502 (504
+// for a timeout) if nothing had been sent to it yet. fd is left open
+// either way.
+static JSValue js_http_forward(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, id;
+  size_t len, address_len;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]) || JS_ToInt32(ctx, &id, argv[1]))
+    return JS_EXCEPTION;
+  if (fd < 0)
+    return JS_ThrowRangeError(ctx, "http_forward(): invalid fd %d", fd);
+  if (id < 0 || id >= hp.npools)
+    return JS_ThrowRangeError(ctx, "http_forward(): no pool %d", id);
+  if (hp_get(fd) || proxy_get(fd))
+    return JS_ThrowTypeError(ctx, "http_forward(): fd is already proxied");
+  if (proxy_open() < 0)
+    return JS_ThrowInternalError(ctx, "epoll_create1() failed: %s", strerror(errno));
+
+  hp_xchg_t *x = calloc(1, sizeof(*x));
+  if (!x)
+    return JS_ThrowOutOfMemory(ctx);
+  x->pool = hp.pools[id];
+  x->fd[HP_CLIENT] = fd;
+  x->fd[HP_UPSTREAM] = x->pipe[0] = x->pipe[1] = -1;
+  x->server = -1;
+  x->last = argc > 4 && JS_ToBool(ctx, argv[4]) > 0;
+
+  const char *data = js_get_data(ctx, argv[2], &len);
+  const char *address = data ? JS_ToCStringLen(ctx, &address_len, argv[3]) : NULL;
+  if (!address) {
+    if (data)
+      js_free_data(ctx, argv[2], data);
+    free(x);
+    return JS_EXCEPTION;
+  }
+  snprintf(x->address, sizeof(x->address), "%s", address_len ? address : "unknown");
+  JS_FreeCString(ctx, address);
+  if (len > 0) {
+    x->head_cap = len < 4096 ? 4096 : len;
+    if ((x->head = malloc(x->head_cap)))
+      memcpy(x->head, data, len);
+    x->head_len = len;
+  }
+  js_free_data(ctx, argv[2], data);
+
+  int flags = fcntl(fd, F_GETFL);
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.fd = fd };
+  if ((len > 0 && !x->head) || hp_track(fd, x) < 0) {
+    free(x->head);
+    free(x);
+    return JS_ThrowOutOfMemory(ctx);
+  }
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || epoll_ctl(proxy.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    int err = errno;
+    hp.xchg[fd] = NULL;
+    free(x->head);
+    free(x);
+    return JS_ThrowInternalError(ctx, "http_forward(): fd %d: %s", fd, strerror(err));
+  }
+  JSValue promise = JS_NewPromiseCapability(ctx, x->resolving_funcs);
+  if (JS_IsException(promise)) {
+    epoll_ctl(proxy.epfd, EPOLL_CTL_DEL, fd, NULL);
+    hp.xchg[fd] = NULL;
+    free(x->head);
+    free(x);
+    return promise;
+  }
+  x->next = hp.active;
+  if (hp.active)
+    hp.active->prev = x;
+  hp.active = x;
+  x->deadline = hp_now() + x->pool->timeout;
+  if (hp_run(x))
+    hp_finish(ctx, x);
+  return promise;
+}
+
+// http_upstream_stats(pool) -> {forwarded, failed, retried, reused,
+//   servers: [{server, active, idle, requests, failures, down}]}
+// The first four count over all pools; down is true while a server is out
+// of rotation.
+static JSValue js_http_upstream_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int id;
+  if (JS_ToInt32(ctx, &id, argv[0]))
+    return JS_EXCEPTION;
+  if (id < 0 || id >= hp.npools)
+    return JS_ThrowRangeError(ctx, "http_upstream_stats(): no pool %d", id);
+
+  const hp_pool_t *p = hp.pools[id];
+  int64_t now = hp_now();
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "forwarded", JS_NewInt64(ctx, (int64_t)hp.forwarded));
+  JS_SetPropertyStr(ctx, obj, "failed", JS_NewInt64(ctx, (int64_t)hp.failed));
+  JS_SetPropertyStr(ctx, obj, "retried", JS_NewInt64(ctx, (int64_t)hp.retried));
+  JS_SetPropertyStr(ctx, obj, "reused", JS_NewInt64(ctx, (int64_t)hp.reused));
+  JSValue servers = JS_NewArray(ctx);
+  for (int i = 0; i < p->count; i++) {
+    const hp_server_t *s = &p->servers[i];
+    JSValue o = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, o, "server", JS_NewString(ctx, s->name));
+    JS_SetPropertyStr(ctx, o, "active", JS_NewInt32(ctx, (int32_t)s->active));
+    JS_SetPropertyStr(ctx, o, "idle", JS_NewInt32(ctx, s->idle_count));
+    JS_SetPropertyStr(ctx, o, "requests", JS_NewInt64(ctx, (int64_t)s->requests));
+    JS_SetPropertyStr(ctx, o, "failures", JS_NewInt64(ctx, (int64_t)s->failures));
+    JS_SetPropertyStr(ctx, o, "down", JS_NewBool(ctx, !hp_server_up(p, i, now)));
+    JS_SetPropertyUint32(ctx, servers, (uint32_t)i, o);
+  }
+  JS_SetPropertyStr(ctx, obj, "servers", servers);
+  return obj;
+}
+
+// proxy_fd() -> epoll fd that becomes readable when proxied sockets have bytes to move
+static JSValue js_proxy_fd(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  if (proxy_open() < 0)
+    return JS_ThrowInternalError(ctx, "epoll_create1() failed: %s", strerror(errno));
+  return JS_NewInt32(ctx, proxy.epfd);
+}
+
+// proxy_poll() -> number of pairs and forwarded requests that finished; call
+// when proxy_fd() is readable, and now and then for http_forward() timeouts
+static JSValue js_proxy_poll(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  struct epoll_event events[PROXY_EVENTS];
+  int settled = 0, n;
+
+  if (proxy.epfd < 0)
+    return JS_NewInt32(ctx, 0);
+
+  do {
+    n = epoll_wait(proxy.epfd, events, PROXY_EVENTS, 0);
+    for (int e = 0; e < n; e++) {
+      int fd = events[e].data.fd;
+      proxy_pair_t *p = proxy_get(fd);
+      if (!p) {
+        hp_xchg_t *x = hp_get(fd);
+        if (x)
+          settled += hp_event(ctx, x);
+        continue; // or finished earlier in this batch
+      }
+      int i = p->fd[1] == fd;
+      // Readable (or hung up): fd's own direction; writable: the one into it
+      if ((events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && proxy_pump(p, i) < 0)
+        p->error = errno;
+      if (!p->error && (events[e].events & EPOLLOUT) && proxy_pump(p, !i) < 0)
+        p->error = errno;
+      if (p->error || (p->dir[0].done && p->dir[1].done)) {
+        proxy_finish(ctx, p);
+        settled++;
+      }
+    }
+  } while (n == PROXY_EVENTS);
+  if (hp.active)
+    settled += hp_sweep(ctx);
+
+  return JS_NewInt32(ctx, settled);
+}
+
+// proxy_stats() -> {active, completed, bytes, pipes}
+static JSValue js_proxy_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "active", JS_NewInt64(ctx, (int64_t)proxy.active));
+  JS_SetPropertyStr(ctx, obj, "completed", JS_NewInt64(ctx, (int64_t)proxy.completed));
+  JS_SetPropertyStr(ctx, obj, "bytes", JS_NewInt64(ctx, (int64_t)proxy.bytes));
+  JS_SetPropertyStr(ctx, obj, "pipes", JS_NewInt32(ctx, proxy.npipes));
+  return obj;
+}
+
+// Request bodies
+//
+// body_open() takes over the body of a request whose head the caller has
+// read. The socket is then read natively and chunked framing is removed on
+// the way. The bytes either come back piece by piece (stream) or are
+// gathered: in memory up to spill bytes, then in an anonymous O_TMPFILE in
+// $TMPDIR (or /tmp), so a large upload costs disk and not heap. Only the
+// body is taken from the socket: a length bounds each read, and chunked
+// bodies are peeked at the way the HTTP proxy does it. limit is checked as
+// bytes arrive, which matters for chunked bodies; a Content-Length over it
+// is the caller's to refuse before any of the body is read.
+
+#define BODY_READ_MAX 65536
+#define BODY_SPILL 65536
+
+// An unnamed file for a spilled body or an uploaded file; filesystems
+// without O_TMPFILE get a named one that is unlinked at once
+static int rb_tmpfile(void) {
+  const char *dir = getenv("TMPDIR");
+  if (!dir || !*dir)
+    dir = "/tmp";
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+    return fd;
+  char path[512];
+  snprintf(path, sizeof(path), "%s/qjs-body-XXXXXX", dir);
+  fd = mkostemp(path, O_CLOEXEC);
+  if (fd >= 0)
+    unlink(path);
+  return fd;
+}
+
+static int rb_write(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += w;
+    n -= (size_t)w;
+  }
+  return 0;
+}
+
+// Forms. Bodies of application/x-www-form-urlencoded and multipart/form-data
+// are parsed as they arrive rather than kept. Fields are decoded into memory
+// (FORM_FIELD_MAX bytes each); each file part is written straight into an
+// unnamed file of its own, so an upload costs a read's worth of memory
+// whatever its size, and an fd until the body is closed: file parts have a
+// cap of their own (max_files, FORM_FILES_MAX by default), far below the
+// cap on parts. The multipart delimiter is searched for sixteen
+// positions at a time; the end of a read that could begin one is carried
+// over to the next.
+
+#define FORM_FIELD_MAX 1048576
+#define FORM_HEAD_MAX 8192      // headers of one part
+#define FORM_PARTS_MAX 1000
+#define FORM_FILES_MAX 16       // file parts, each holding an fd
+#define FORM_BOUNDARY_MAX 70    // RFC 2046
+
+enum { FORM_NONE, FORM_URLENCODED, FORM_MULTIPART };
+enum { FORM_PREAMBLE, FORM_BOUNDARY, FORM_HEAD, FORM_DATA, FORM_EPILOGUE };
+
+typedef struct {
+  char *p;
+  size_t len, cap;
+} form_buf_t;
+
+typedef struct {
+  char *name;
+  char *filename;     // NULL for a field
+  char *type;         // the part's Content-Type, if it had one
+  char *value;        // a field's bytes
+  size_t len;
+  int fd;             // a file's contents, -1 for a field
+  uint64_t size;
+} form_part_t;
+
+typedef struct {
+  int kind;
+  int state;          // multipart
+  int after;          // multipart: '-' or '\r' just past a delimiter
+  int pct;            // urlencoded: 1 after '%', 2 after its first hex digit
+  int in_value;       // urlencoded: past the pair's '='
+  uint8_t hex;
+  uint8_t delim[FORM_BOUNDARY_MAX + 4]; // "\r\n--" boundary
+  size_t delim_len;
+  uint8_t carry[FORM_BOUNDARY_MAX + 4]; // end of the last read that may begin a delimiter
+  size_t carry_len;
+  form_buf_t work;    // carry followed by the next read
+  form_buf_t head;    // headers of the part being read, from the CRLF before them
+  form_buf_t key, value;
+  form_part_t cur;
+  form_part_t *parts;
+  int nparts, cap;
+  int files, max_files;
+  int sent;           // parts already handed out while streaming
+} form_t;
+
+static struct {
+  uint64_t parsed, files;
+} forms;
+
+// 0, or the status to answer: 413 past max bytes, 500 out of memory
+static int form_buf_put(form_buf_t *b, const void *p, size_t n, size_t max) {
+  if (b->len + n > max)
+    return 413;
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + n)
+      cap *= 2;
+    char *q = realloc(b->p, cap);
+    if (!q)
+      return 500;
+    b->p = q;
+    b->cap = cap;
+  }
+  if (n > 0)
+    memcpy(b->p + b->len, p, n);
+  b->len += n;
+  return 0;
+}
+
+static void form_part_free(form_part_t *part) {
+  free(part->name);
+  free(part->filename);
+  free(part->type);
+  free(part->value);
+  if (part->fd >= 0)
+    close(part->fd);
+}
+
+static void form_free(form_t *f) {
+  for (int i = 0; i < f->nparts; i++)
+    form_part_free(&f->parts[i]);
+  form_part_free(&f->cur);
+  free(f->parts);
+  free(f->work.p);
+  free(f->head.p);
+  free(f->key.p);
+  free(f->value.p);
+}
+
+// The value of parameter key in a header value such as Content-Disposition,
+// unquoted; NULL if it has none
+static char *form_param(const char *p, const char *end, const char *key) {
+  size_t klen = strlen(key);
+  int quoted = 0;
+
+  for (; p < end; p++) {
+    if (*p == '"')
+      quoted = !quoted;
+    if (quoted || *p != ';')
+      continue;
+    const char *k = p + 1;
+    while (k < end && (*k == ' ' || *k == '\t'))
+      k++;
+    if ((size_t)(end - k) <= klen || strncasecmp(k, key, klen) != 0 || k[klen] != '=')
+      continue;
+    const char *v = k + klen + 1;
+    char *out = malloc((size_t)(end - v) + 1), *o = out;
+    if (!out)
+      return NULL;
+    if (v < end && *v == '"') {
+      for (v++; v < end && *v != '"'; v++) {
+        if (*v == '\\' && v + 1 < end && (v[1] == '"' || v[1] == '\\'))
+          v++;
+        *o++ = *v;
+      }
+    } else {
+      for (; v < end && *v != ';' && *v != ' ' && *v != '\t'; v++)
+        *o++ = *v;
+    }
+    *o = '\0';
+    return out;
+  }
+  return NULL;
+}
+
+// Picks the parser for a Content-Type. 0, or 400 for multipart without a
+// usable boundary; other types leave kind FORM_NONE.
+static int form_init(form_t *f, const char *type, size_t len, int max_files) {
+  memset(f, 0, sizeof(*f));
+  f->cur.fd = -1;
+  f->max_files = max_files;
+  if (len >= 33 && strncasecmp(type, "application/x-www-form-urlencoded", 33) == 0) {
+    f->kind = FORM_URLENCODED;
+    return 0;
+  }
+  if (len < 19 || strncasecmp(type, "multipart/form-data", 19) != 0)
+    return 0;
+  char *boundary = form_param(type, type + len, "boundary");
+  size_t blen = boundary ? strlen(boundary) : 0;
+  if (blen == 0 || blen > FORM_BOUNDARY_MAX) {
+    free(boundary);
+    return 400;
+  }
+  memcpy(f->delim, "\r\n--", 4);
+  memcpy(f->delim + 4, boundary, blen);
+  f->delim_len = blen + 4;
+  free(boundary);
+  // The first delimiter may open the body, without the CRLF before it
+  memcpy(f->carry, "\r\n", 2);
+  f->carry_len = 2;
+  f->kind = FORM_MULTIPART;
+  return 0;
+}
+
+// Ends the part being read: a field takes the value gathered, a file goes
+// back to its start
+static int form_push(form_t *f) {
+  if (f->nparts == f->cap) {
+    int cap = f->cap ? f->cap * 2 : 8;
+    form_part_t *parts = realloc(f->parts, (size_t)cap * sizeof(*parts));
+    if (!parts)
+      return 500;
+    f->parts = parts;
+    f->cap = cap;
+  }
+  if (f->cur.fd >= 0) {
+    lseek(f->cur.fd, 0, SEEK_SET);
+  } else {
+    f->cur.value = f->value.p;
+    f->cur.len = f->value.len;
+    memset(&f->value, 0, sizeof(f->value));
+  }
+  f->parts[f->nparts++] = f->cur;
+  memset(&f->cur, 0, sizeof(f->cur));
+  f->cur.fd = -1;
+  return 0;
+}
+
+static int form_hex(uint8_t c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+static int form_url_put(form_t *f, const void *p, size_t n) {
+  return form_buf_put(f->in_value ? &f->value : &f->key, p, n, FORM_FIELD_MAX);
+}
+
+// A '%' not followed by two hex digits stands as it is
+static int form_url_literal(form_t *f) {
+  char text[2] = { '%', (char)f->hex };
+  size_t n = (size_t)f->pct;
+  f->pct = 0;
+  return form_url_put(f, text, n);
+}
+
+// Ends the pair being read at '&' or the end of the body; "&&" has none
+static int form_url_pair(form_t *f) {
+  int status = f->pct ? form_url_literal(f) : 0;
+  if (status || (f->key.len == 0 && !f->in_value))
+    return status;
+  if (f->nparts >= FORM_PARTS_MAX)
+    return 413;
+  if (!(f->cur.name = malloc(f->key.len + 1)))
+    return 500;
+  if (f->key.len > 0)
+    memcpy(f->cur.name, f->key.p, f->key.len);
+  f->cur.name[f->key.len] = '\0';
+  f->key.len = 0;
+  f->in_value = 0;
+  return form_push(f);
+}
+
+// Decodes name=value&... across reads: '+' is a space, %XX a byte
+static int form_urlencoded(form_t *f, const uint8_t *p, size_t n) {
+  const uint8_t *end = p + n;
+  int status = 0;
+
+  while (p < end && !status) {
+    if (f->pct) {
+      int v = form_hex(*p);
+      if (v < 0) {
+        status = form_url_literal(f);
+        continue;
+      }
+      if (f->pct == 1) {
+        f->hex = *p;
+        f->pct = 2;
+      } else {
+        uint8_t c = (uint8_t)(form_hex(f->hex) << 4 | v);
+        f->pct = 0;
+        status = form_url_put(f, &c, 1);
+      }
+      p++;
+      continue;
+    }
+    const uint8_t *q = p;
+    while (q < end && *q != '%' && *q != '+' && *q != '&' && (*q != '=' || f->in_value))
+      q++;
+    if (q > p && (status = form_url_put(f, p, (size_t)(q - p))))
+      break;
+    if ((p = q) == end)
+      break;
+    switch (*p++) {
+    case '%':
+      f->pct = 1;
+      break;
+    case '+':
+      status = form_url_put(f, " ", 1);
+      break;
+    case '=':
+      f->in_value = 1;
+      break;
+    default:
+      status = form_url_pair(f);
+      break;
+    }
+  }
+  return status;
+}
+
+// Cleared by simd_enable(false): the byte-wise fallbacks run instead
+static int simd_on = 1;
+
+// memmem() for the delimiter. With SIMD the candidates are the positions
+// where both its first and its last byte match, 32 (AVX2) or 16 (SSE2)
+// compared at once; only those get a full compare.
+static const uint8_t *form_find(const uint8_t *h, size_t n, const uint8_t *d, size_t k) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i first = _mm256_set1_epi8((char)d[0]);
+  const __m256i last = _mm256_set1_epi8((char)d[k - 1]);
+  for (; simd_on && i + k + 31 <= n; i += 32) {
+    __m256i a = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)(h + i)));
+    __m256i b = _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i *)(h + i + k - 1)));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+    while (mask) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (memcmp(h + at + 1, d + 1, k - 2) == 0)
+        return h + at;
+      mask &= mask - 1;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i first = _mm_set1_epi8((char)d[0]);
+  const __m128i last = _mm_set1_epi8((char)d[k - 1]);
+  for (; simd_on && i + k + 15 <= n; i += 16) {
+    __m128i a = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)(h + i)));
+    __m128i b = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)(h + i + k - 1)));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(a, b));
+    while (mask) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (memcmp(h + at + 1, d + 1, k - 2) == 0)
+        return h + at;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  return memmem(h + i, n - i, d, k);
+}
+
+// How many bytes at the end of p[0..n) could be the start of the delimiter
+static size_t form_partial(const form_t *f, const uint8_t *p, size_t n) {
+  const uint8_t *end = p + n, *c = p + (n >= f->delim_len ? n - f->delim_len + 1 : 0);
+  for (; (c = memchr(c, '\r', (size_t)(end - c))); c++) {
+    if (memcmp(c, f->delim, (size_t)(end - c)) == 0)
+      return (size_t)(end - c);
+  }
+  return 0;
+}
+
+// Starts a part from the headers in f->head ("\r\nName: value\r\n...")
+static int form_begin(form_t *f) {
+  const char *p = f->head.p, *end = p + f->head.len;
+
+  if (f->nparts >= FORM_PARTS_MAX)
+    return 413;
+  while (p < end) {
+    const char *eol = memchr(p, '\n', (size_t)(end - p));
+    const char *line = p, *stop = eol ? eol : end;
+    p = eol ? eol + 1 : end;
+    if (stop > line && stop[-1] == '\r')
+      stop--;
+    size_t len = (size_t)(stop - line);
+    if (len > 20 && strncasecmp(line, "content-disposition:", 20) == 0 && !f->cur.name) {
+      f->cur.name = form_param(line + 20, stop, "name");
+      f->cur.filename = form_param(line + 20, stop, "filename");
+    } else if (len > 13 && strncasecmp(line, "content-type:", 13) == 0 && !f->cur.type) {
+      line += 13;
+      while (line < stop && (*line == ' ' || *line == '\t'))
+        line++;
+      f->cur.type = strndup(line, (size_t)(stop - line));
+    }
+  }
+  if (!f->cur.name && !(f->cur.name = strdup("")))
+    return 500;
+  if (f->cur.filename) {
+    if (f->files >= f->max_files)
+      return 413;
+    if ((f->cur.fd = rb_tmpfile()) < 0)
+      return 500;
+    f->files++;
+    forms.files++;
+  }
+  return 0;
+}
+
+static int form_data(form_t *f, const uint8_t *p, size_t n) {
+  if (n == 0)
+    return 0;
+  if (f->cur.fd < 0)
+    return form_buf_put(&f->value, p, n, FORM_FIELD_MAX);
+  f->cur.size += n;
+  return rb_write(f->cur.fd, (const char *)p, n) < 0 ? 500 : 0;
+}
+
+static int form_multipart(form_t *f, const uint8_t *p, size_t n) {
+  int status;
+
+  if (f->carry_len > 0) {
+    f->work.len = 0;
+    if ((status = form_buf_put(&f->work, f->carry, f->carry_len, SIZE_MAX)) ||
+        (status = form_buf_put(&f->work, p, n, SIZE_MAX)))
+      return status;
+    f->carry_len = 0;
+    p = (const uint8_t *)f->work.p;
+    n = f->work.len;
+  }
+  while (n > 0) {
+    switch (f->state) {
+    case FORM_PREAMBLE:
+    case FORM_DATA: {
+      const uint8_t *d = form_find(p, n, f->delim, f->delim_len);
+      size_t len = d ? (size_t)(d - p) : n;
+      size_t hold = d ? 0 : form_partial(f, p, n);
+      if (f->state == FORM_DATA && (status = form_data(f, p, len - hold)))
+        return status;
+      if (!d) {
+        memcpy(f->carry, p + n - hold, hold);
+        f->carry_len = hold;
+        return 0;
+      }
+      if (f->state == FORM_DATA && (status = form_push(f)))
+        return status;
+      p = d + f->delim_len;
+      n -= len + f->delim_len;
+      f->state = FORM_BOUNDARY;
+      f->after = 0;
+      break;
+    }
+    case FORM_BOUNDARY: {
+      // "--" closes the body, CRLF opens a part; space may come first
+      uint8_t c = *p++;
+      n--;
+      if (f->after == '-') {
+        if (c != '-')
+          return 400;
+        f->state = FORM_EPILOGUE;
+      } else if (f->after == '\r') {
+        if (c != '\n')
+          return 400;
+        f->state = FORM_HEAD;
+        f->head.len = 0;
+        if ((status = form_buf_put(&f->head, "\r\n", 2, FORM_HEAD_MAX)))
+          return status;
+      } else if (c == '-' || c == '\r') {
+        f->after = c;
+      } else if (c != ' ' && c != '\t') {
+        return 400;
+      }
+      break;
+    }
+    case FORM_HEAD: {
+      size_t from = f->head.len >= 3 ? f->head.len - 3 : 0, room = FORM_HEAD_MAX - f->head.len;
+      size_t take = n < room ? n : room;
+      if (take == 0)
+        return 400;
+      if ((status = form_buf_put(&f->head, p, take, FORM_HEAD_MAX)))
+        return status;
+      const char *e = memmem(f->head.p + from, f->head.len - from, "\r\n\r\n", 4);
+      if (!e) {
+        p += take;
+        n -= take;
+        break;
+      }
+      size_t used = (size_t)(e + 4 - f->head.p) - (f->head.len - take);
+      f->head.len = (size_t)(e + 2 - f->head.p);
+      p += used;
+      n -= used;
+      if ((status = form_begin(f)))
+        return status;
+      f->state = FORM_DATA;
+      break;
+    }
+    default:
+      return 0; // the epilogue is ignored
+    }
+  }
+  return 0;
+}
+
+// Parses the next n bytes of the body; 0, or the status to answer
+static int form_feed(form_t *f, const uint8_t *p, size_t n) {
+  return f->kind == FORM_MULTIPART ? form_multipart(f, p, n) : form_urlencoded(f, p, n);
+}
+
+// The body is all in: 400 for multipart without its closing delimiter
+static int form_end(form_t *f) {
+  if (f->kind == FORM_URLENCODED)
+    return form_url_pair(f);
+  return f->state == FORM_EPILOGUE ? 0 : 400;
+}
+
+static JSValue form_value(JSContext *ctx, const form_part_t *part) {
+  return JS_NewStringLen(ctx, part->value ? part->value : "", part->len);
+}
+
+// A part as handlers see it: {name, value}, or {name, filename, type, fd,
+// size} for a file
+static JSValue form_part_js(JSContext *ctx, const form_part_t *part) {
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "name", JS_NewString(ctx, part->name));
+  if (part->fd < 0) {
+    JS_SetPropertyStr(ctx, obj, "value", form_value(ctx, part));
+    return obj;
+  }
+  JS_SetPropertyStr(ctx, obj, "filename", JS_NewString(ctx, part->filename));
+  JS_SetPropertyStr(ctx, obj, "type", JS_NewString(ctx, part->type ? part->type : "application/octet-stream"));
+  JS_SetPropertyStr(ctx, obj, "fd", JS_NewInt32(ctx, part->fd));
+  JS_SetPropertyStr(ctx, obj, "size", JS_NewInt64(ctx, (int64_t)part->size));
+  return obj;
+}
+
+// Adds name = value to obj; a name seen before gets an array of its
+// values. Names are defined, not assigned, so "__proto__" is only a name.
+static void form_add(JSContext *ctx, JSValueConst obj, const char *name, size_t len, JSValue value) {
+  JSAtom atom = JS_NewAtomLen(ctx, name, len);
+  if (atom == JS_ATOM_NULL) {
+    JS_FreeValue(ctx, value);
+    return;
+  }
+  if (JS_GetOwnProperty(ctx, NULL, obj, atom) == 1) {
+    JSValue old = JS_GetProperty(ctx, obj, atom);
+    if (JS_IsArray(ctx, old)) {
+      int64_t n = 0;
+      JSValue length = JS_GetPropertyStr(ctx, old, "length");
+      JS_ToInt64(ctx, &n, length);
+      JS_FreeValue(ctx, length);
+      JS_SetPropertyInt64(ctx, old, n, value);
+      JS_FreeValue(ctx, old);
+    } else {
+      JSValue values = JS_NewArray(ctx);
+      JS_SetPropertyUint32(ctx, values, 0, old);
+      JS_SetPropertyUint32(ctx, values, 1, value);
+      JS_DefinePropertyValue(ctx, obj, atom, values, JS_PROP_C_W_E);
+    }
+  } else {
+    JS_DefinePropertyValue(ctx, obj, atom, value, JS_PROP_C_W_E);
+  }
+  JS_FreeAtom(ctx, atom);
+}
+
+// {name: value} of the fields, through form_add()
+static JSValue form_fields(JSContext *ctx, const form_t *f) {
+  JSValue obj = JS_NewObject(ctx);
+  for (int i = 0; i < f->nparts; i++) {
+    if (f->parts[i].fd < 0)
+      form_add(ctx, obj, f->parts[i].name, strlen(f->parts[i].name), form_value(ctx, &f->parts[i]));
+  }
+  return obj;
+}
+
+typedef struct {
+  hp_body_t framing;
+  int stream;
+  int json;           // gathered bodies of application/json are parsed
+  form_t form;        // forms are parsed instead of kept
+  uint64_t limit;     // 0: none
+  uint64_t spill;
+  uint64_t size;      // body bytes so far, framing removed
+  char *mem;          // gathered body, or this call's bytes when streaming
+  size_t len, cap;
+  int file;           // -1 until spilled
+  char *rest;         // what the caller's data held past the body
+  size_t rest_len;
+} rb_t;
+
+static struct {
+  rb_t **conns;       // by fd
+  size_t cap;
+  uint8_t *scratch;
+  uint64_t opened, spilled, bytes, rejected;
+  int active;
+} rb;
+
+static rb_t *rb_get(int fd) {
+  return fd >= 0 && (size_t)fd < rb.cap ? rb.conns[fd] : NULL;
+}
+
+static void rb_conn_free(int fd) {
+  rb_t *b = rb_get(fd);
+  if (!b)
+    return;
+  rb.conns[fd] = NULL;
+  rb.active--;
+  if (b->file >= 0)
+    close(b->file);
+  form_free(&b->form);
+  free(b->mem);
+  free(b->rest);
+  free(b);
+}
+
+// A body that is not JSON or a form: text if it is UTF-8, else the bytes
+static JSValue http_body_value(JSContext *ctx, const char *p, size_t len) {
+  if (utf8_valid((const uint8_t *)p, len))
+    return JS_NewStringLen(ctx, p, len);
+  return JS_NewArrayBufferCopy(ctx, (const uint8_t *)p, len);
+}
+
+// Sets body on result: parsed JSON for application/json, the fields of
+// application/x-www-form-urlencoded, else the text or, for a body that is
+// not UTF-8, an ArrayBuffer
+static void http_set_body(JSContext *ctx, JSValue result, const char *p, size_t len, const char *content_type) {
+  JSValue body = JS_UNDEFINED;
+  form_t form;
+  if (len > 0 && strstr(content_type, "application/json")) {
+    body = JS_ParseJSON(ctx, p, len, "<body>");
+    if (JS_IsException(body)) {
+      // Fall back to string if JSON parsing fails
+      JS_FreeValue(ctx, JS_GetException(ctx));
+      body = JS_UNDEFINED;
+    }
+  } else if (form_init(&form, content_type, strlen(content_type), 0) == 0 && form.kind == FORM_URLENCODED) {
+    if (form_feed(&form, (const uint8_t *)p, len) == 0 && form_end(&form) == 0)
+      body = form_fields(ctx, &form);
+    form_free(&form);
+  }
+  if (JS_IsUndefined(body))
+    body = http_body_value(ctx, p, len);
+  JS_SetPropertyStr(ctx, result, "body", body);
+}
+
+// Keeps n body bytes: in memory, or in the file once spill is passed
+static int rb_store(rb_t *b, const uint8_t *p, size_t n) {
+  if (n == 0)
+    return 0;
+  if (b->file < 0 && !b->stream && b->len + n > b->spill) {
+    b->file = rb_tmpfile();
+    if (b->file < 0 || rb_write(b->file, b->mem, b->len) < 0)
+      return -1;
+    free(b->mem);
+    b->mem = NULL;
+    b->len = b->cap = 0;
+    rb.spilled++;
+  }
+  if (b->file >= 0)
+    return rb_write(b->file, (const char *)p, n);
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n)
+      cap *= 2;
+    char *mem = realloc(b->mem, cap);
+    if (!mem)
+      return -1;
+    b->mem = mem;
+    b->cap = cap;
+  }
+  memcpy(b->mem + b->len, p, n);
+  b->len += n;
+  return 0;
+}
+
+// Takes what of p[0..n) belongs to the body, removing chunk framing in place
+// and keeping the payload. The number of bytes used, or -1 with *status set.
+static ssize_t rb_take(rb_t *b, uint8_t *p, size_t n, int *status) {
+  hp_body_t *f = &b->framing;
+  size_t i = 0, out = 0;
+
+  while (i < n && !f->done) {
+    int data = f->mode != HP_BODY_CHUNKED || f->state == HP_CHUNK_DATA;
+    size_t k = data ? n - i : 1; // framing goes byte by byte
+    if (data && f->mode == HP_BODY_CHUNKED && k > f->left)
+      k = (size_t)f->left;
+    ssize_t t = hp_body_take(f, p + i, k);
+    if (t < 0) {
+      *status = 400;
+      return -1;
+    }
+    if (data) {
+      memmove(p + out, p + i, (size_t)t);
+      out += (size_t)t;
+    }
+    i += (size_t)t;
+  }
+  b->size += out;
+  if (b->limit && b->size > b->limit) {
+    *status = 413;
+    return -1;
+  }
+  if (b->form.kind) {
+    *status = form_feed(&b->form, p, out);
+    if (!*status && f->done)
+      *status = form_end(&b->form);
+  } else if (rb_store(b, p, out) < 0) {
+    *status = 500;
+  }
+  return *status ? -1 : (ssize_t)i;
+}
+
+// {size, done, more, data, parts, body, fields, files, file, rest, status,
+// closed}; see body_read()
+static JSValue rb_result(JSContext *ctx, rb_t *b, int status, int closed, int more) {
+  JSValue obj = JS_NewObject(ctx);
+  int done = b->framing.done && !status && !closed;
+
+  JS_SetPropertyStr(ctx, obj, "size", JS_NewInt64(ctx, (int64_t)b->size));
+  JS_SetPropertyStr(ctx, obj, "done", JS_NewBool(ctx, done));
+  JS_SetPropertyStr(ctx, obj, "more", JS_NewBool(ctx, more && !done && !status && !closed));
+  if (b->stream && b->len > 0) {
+    JS_SetPropertyStr(ctx, obj, "data", JS_NewArrayBufferCopy(ctx, (uint8_t *)b->mem, b->len));
+    b->len = 0;
+  }
+  if (b->stream && b->form.sent < b->form.nparts) {
+    JSValue parts = JS_NewArray(ctx);
+    for (uint32_t i = 0; b->form.sent < b->form.nparts; i++)
+      JS_SetPropertyUint32(ctx, parts, i, form_part_js(ctx, &b->form.parts[b->form.sent++]));
+    JS_SetPropertyStr(ctx, obj, "parts", parts);
+  }
+  if (status) {
+    rb.rejected += status == 413;
+    JS_SetPropertyStr(ctx, obj, "status", JS_NewInt32(ctx, status));
+  }
+  if (closed)
+    JS_SetPropertyStr(ctx, obj, "closed", JS_TRUE);
+  if (!done)
+    return obj;
+  if (!b->stream && b->form.kind) {
+    JSValue files = JS_NewArray(ctx);
+    for (int i = 0, n = 0; i < b->form.nparts; i++) {
+      if (b->form.parts[i].fd >= 0)
+        JS_SetPropertyUint32(ctx, files, (uint32_t)n++, form_part_js(ctx, &b->form.parts[i]));
+    }
+    JS_SetPropertyStr(ctx, obj, "fields", form_fields(ctx, &b->form));
+    JS_SetPropertyStr(ctx, obj, "files", files);
+  } else if (!b->stream && b->file >= 0) {
+    lseek(b->file, 0, SEEK_SET);
+    JS_SetPropertyStr(ctx, obj, "file", JS_NewInt32(ctx, b->file));
+  } else if (!b->stream) {
+    http_set_body(ctx, obj, b->mem ? b->mem : "", b->len, b->json ? "application/json" : "");
+  }
+  if (b->rest_len > 0) {
+    JS_SetPropertyStr(ctx, obj, "rest", JS_NewArrayBufferCopy(ctx, (uint8_t *)b->rest, b->rest_len));
+    free(b->rest);
+    b->rest = NULL;
+    b->rest_len = 0;
+  }
+  return obj;
+}
+
+// body_open(fd, data, {length, chunked, limit, spill, stream, type, maxFiles}) -> result
+// Starts reading the body of the request just parsed on fd. data holds the
+// bytes already read past its head, as a string or an ArrayBuffer or
+// typed array; any of them beyond the body come back in an ArrayBuffer as
+// rest once it is done. The body is chunked, or length bytes long.
+// Gathered bodies stay in memory up to spill bytes (65536); stream: true
+// hands them out as they come. type is the request's Content-Type: JSON is
+// parsed once gathered, and urlencoded and multipart forms are parsed as
+// they arrive, their files going to disk, at most maxFiles (16) of them.
+// Returns what body_read() does, without reading the socket. Replaces any
+// earlier body on fd.
+static JSValue js_body_open(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+  int64_t length = 0, limit = 0, spill = BODY_SPILL;
+  int chunked = 0, stream = 0, max_files = FORM_FILES_MAX;
+  const char *type = NULL;
+  size_t type_len = 0;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (fd < 0)
+    return JS_ThrowRangeError(ctx, "bad fd");
+  if (argc > 2 && JS_IsObject(argv[2])) {
+    JSValue v = JS_GetPropertyStr(ctx, argv[2], "length");
+    int r = !JS_IsUndefined(v) ? JS_ToInt64(ctx, &length, v) : 0;
+    JS_FreeValue(ctx, v);
+    v = JS_GetPropertyStr(ctx, argv[2], "limit");
+    r = r || (!JS_IsUndefined(v) ? JS_ToInt64(ctx, &limit, v) : 0);
+    JS_FreeValue(ctx, v);
+    v = JS_GetPropertyStr(ctx, argv[2], "spill");
+    r = r || (!JS_IsUndefined(v) ? JS_ToInt64(ctx, &spill, v) : 0);
+    JS_FreeValue(ctx, v);
+    v = JS_GetPropertyStr(ctx, argv[2], "maxFiles");
+    r = r || (!JS_IsUndefined(v) ? JS_ToInt32(ctx, &max_files, v) : 0);
+    JS_FreeValue(ctx, v);
+    if (r)
+      return JS_EXCEPTION;
+    v = JS_GetPropertyStr(ctx, argv[2], "chunked");
+    chunked = JS_ToBool(ctx, v);
+    JS_FreeValue(ctx, v);
+    v = JS_GetPropertyStr(ctx, argv[2], "stream");
+    stream = JS_ToBool(ctx, v);
+    JS_FreeValue(ctx, v);
+  }
+  if (length < 0 || limit < 0 || spill < 0 || max_files < 0)
+    return JS_ThrowRangeError(ctx, "length, limit, spill and maxFiles must not be negative");
+  if (argc > 2 && JS_IsObject(argv[2])) {
+    JSValue v = JS_GetPropertyStr(ctx, argv[2], "type");
+    int bad = JS_IsException(v);
+    if (JS_IsString(v) && !(type = JS_ToCStringLen(ctx, &type_len, v)))
+      bad = 1;
+    JS_FreeValue(ctx, v);
+    if (bad)
+      return JS_EXCEPTION;
+  }
+
+  size_t data_len = 0;
+  const char *data = js_is_present(argc, argv, 1) ? js_get_data(ctx, argv[1], &data_len) : NULL;
+  if (js_is_present(argc, argv, 1) && !data) {
+    JS_FreeCString(ctx, type);
+    return JS_EXCEPTION;
+  }
+
+  if ((size_t)fd >= rb.cap) {
+    size_t cap = rb.cap ? rb.cap : 1024;
+    while (cap <= (size_t)fd)
+      cap *= 2;
+    rb_t **conns = realloc(rb.conns, cap * sizeof(*conns));
+    if (!conns) {
+      JS_FreeCString(ctx, type);
+      if (data)
+        js_free_data(ctx, argv[1], data);
+      return JS_ThrowOutOfMemory(ctx);
+    }
+    memset(conns + rb.cap, 0, (cap - rb.cap) * sizeof(*conns));
+    rb.conns = conns;
+    rb.cap = cap;
+  }
+  rb_conn_free(fd);
+  rb_t *b = calloc(1, sizeof(*b));
+  if (!b) {
+    JS_FreeCString(ctx, type);
+    if (data)
+      js_free_data(ctx, argv[1], data);
+    return JS_ThrowOutOfMemory(ctx);
+  }
+  hp_body_init(&b->framing, chunked ? HP_BODY_CHUNKED : HP_BODY_LENGTH, (uint64_t)length);
+  b->stream = stream;
+  b->json = type && strstr(type, "application/json");
+  int status = form_init(&b->form, type ? type : "", type_len, max_files);
+  JS_FreeCString(ctx, type);
+  b->limit = (uint64_t)limit;
+  b->spill = (uint64_t)spill;
+  b->file = -1;
+  rb.conns[fd] = b;
+  rb.active++;
+  rb.opened++;
+  forms.parsed += b->form.kind != FORM_NONE;
+
+  if (data_len > 0 && !status) {
+    // Decoding works in place, so on a copy of data
+    uint8_t *copy = malloc(data_len);
+    ssize_t used = copy ? (memcpy(copy, data, data_len), rb_take(b, copy, data_len, &status)) : -1;
+    if (!copy)
+      status = 500;
+    if (used >= 0 && (size_t)used < data_len) {
+      b->rest = malloc(data_len - (size_t)used);
+      if (b->rest) {
+        memcpy(b->rest, data + used, data_len - (size_t)used);
+        b->rest_len = data_len - (size_t)used;
+      } else {
+        status = 500;
+      }
+    }
+    free(copy);
+  }
+  if (data)
+    js_free_data(ctx, argv[1], data);
+  return rb_result(ctx, b, status, 0, 0);
+}
+
+// body_read(fd, budget) -> {size, done, more, data, parts, body, fields, files, file, rest, status, closed}
+// Reads up to budget bytes of fd's body. size counts the body so far. more:
+// the budget ran out with bytes possibly waiting. data: an ArrayBuffer of
+// what this call read, when streaming. Once done, a gathered body is body
+// (parsed when its type is JSON), or, if it spilled, file: an fd at its
+// start that stays open until body_close(). A form is fields ({name: value},
+// arrays for repeated names) and files ([{name, filename, type, fd, size}],
+// each fd at its start and open until body_close()); streamed, parts lists
+// the fields and files completed by this call instead. status 400 (bad
+// framing or form), 413 (over limit, a field over 1 MB, more than 1000
+// parts or more than maxFiles files) or 500 (out of memory or disk) and closed (the client went away
+// first) end the body early.
+static JSValue js_body_read(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, budget;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]) || JS_ToInt32(ctx, &budget, argv[1]))
+    return JS_EXCEPTION;
+  rb_t *b = rb_get(fd);
+  if (!b)
+    return JS_ThrowTypeError(ctx, "no body is being read on fd %d", fd);
+  if (!rb.scratch && !(rb.scratch = malloc(BODY_READ_MAX)))
+    return JS_ThrowOutOfMemory(ctx);
+
+  hp_body_t *f = &b->framing;
+  int chunked = f->mode == HP_BODY_CHUNKED;
+  int status = 0, closed = 0;
+  size_t got = 0;
+  while (!f->done && got < (size_t)budget) {
+    size_t want = (size_t)budget - got;
+    if (want > BODY_READ_MAX)
+      want = BODY_READ_MAX;
+    if (!chunked && want > f->left)
+      want = (size_t)f->left;
+    ssize_t n = conn_recv(fd, rb.scratch, want, chunked ? MSG_PEEK : 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      closed = 1;
+      break;
+    }
+    ssize_t used = rb_take(b, rb.scratch, (size_t)n, &status);
+    if (used < 0)
+      break;
+    // What was only peeked at is taken now; the payload is already kept
+    if (chunked && conn_recv(fd, rb.scratch, (size_t)used, 0) != used) {
+      closed = 1;
+      break;
+    }
+    METRIC_ADD(metrics.bytes_in, (uint64_t)used);
+    rb.bytes += (uint64_t)used;
+    got += (size_t)used;
+  }
+  return rb_result(ctx, b, status, closed, got >= (size_t)budget);
+}
+
+// body_value(fd) -> the finished body on fd as body_read() gives it in
+// memory, read back from its file if it spilled; a form's fields
+static JSValue js_body_value(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  rb_t *b = rb_get(fd);
+  if (!b || !b->framing.done || b->stream)
+    return JS_ThrowTypeError(ctx, "no finished body on fd %d", fd);
+  if (b->form.kind)
+    return form_fields(ctx, &b->form);
+  if (b->file < 0)
+    return http_body_value(ctx, b->mem ? b->mem : "", b->len);
+
+  char *text = malloc(b->size ? b->size : 1);
+  if (!text)
+    return JS_ThrowOutOfMemory(ctx);
+  size_t off = 0;
+  while (off < b->size) {
+    ssize_t n = pread(b->file, text + off, b->size - off, (off_t)off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      free(text);
+      return JS_ThrowInternalError(ctx, "pread() failed: %s", n < 0 ? strerror(errno) : "short file");
+    }
+    off += (size_t)n;
+  }
+  JSValue obj = JS_NewObject(ctx);
+  http_set_body(ctx, obj, text, off, b->json ? "application/json" : "");
+  free(text);
+  JSValue body = JS_GetPropertyStr(ctx, obj, "body");
+  JS_FreeValue(ctx, obj);
+  return body;
+}
+
+// body_close(fd) -> undefined; drops fd's body and closes its files
+static JSValue js_body_close(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  rb_conn_free(fd);
+  return JS_UNDEFINED;
+}
+
+// body_stats() -> {active, opened, spilled, forms, files, bytes, rejected}
+// forms: bodies parsed as forms; files: file parts written to disk
+static JSValue js_body_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "active", JS_NewInt32(ctx, rb.active));
+  JS_SetPropertyStr(ctx, obj, "opened", JS_NewInt64(ctx, (int64_t)rb.opened));
+  JS_SetPropertyStr(ctx, obj, "spilled", JS_NewInt64(ctx, (int64_t)rb.spilled));
+  JS_SetPropertyStr(ctx, obj, "forms", JS_NewInt64(ctx, (int64_t)forms.parsed));
+  JS_SetPropertyStr(ctx, obj, "files", JS_NewInt64(ctx, (int64_t)forms.files));
+  JS_SetPropertyStr(ctx, obj, "bytes", JS_NewInt64(ctx, (int64_t)rb.bytes));
+  JS_SetPropertyStr(ctx, obj, "rejected", JS_NewInt64(ctx, (int64_t)rb.rejected));
+  return obj;
+}
+
+// Client responses
+//
+// http_frame() follows the responses read on a client socket, so that the
+// caller knows where each one ends without parsing it: the head is
+// collected up to MAX_RESPONSE_HEAD and the body is framed by
+// hp_body_take(), as the proxy frames upstream replies. Interim 1xx
+// responses are passed over.
+
+typedef struct {
+  uint8_t *head;      // the head so far, until its blank line is in
+  size_t head_len, head_cap;
+  int in_body;
+  hp_body_t body;
+  uint64_t size;      // body payload so far
+} hf_t;
+
+static struct {
+  hf_t **conns;       // by fd
+  size_t cap;
+} hf;
+
+static hf_t *hf_get(int fd) {
+  return fd >= 0 && (size_t)fd < hf.cap ? hf.conns[fd] : NULL;
+}
+
+static void hf_conn_free(int fd) {
+  hf_t *f = hf_get(fd);
+  if (!f)
+    return;
+  hf.conns[fd] = NULL;
+  free(f->head);
+  free(f);
+}
+
+// Length of the head in f once its blank line is in, else 0
+static size_t hf_head_end(const hf_t *f, size_t from) {
+  const uint8_t *h = f->head, *end = f->head + f->head_len;
+  for (const uint8_t *q = h + from; q < end; q++) {
+    if (!(q = memchr(q, '\n', (size_t)(end - q))))
+      break;
+    if (q + 1 < end && q[1] == '\n')
+      return (size_t)(q + 2 - h);
+    if (q + 2 < end && q[1] == '\r' && q[2] == '\n')
+      return (size_t)(q + 3 - h);
+  }
+  return 0;
+}
+
+// Status and body framing of the response head h[0..len), decided as
+// parse_http_response() decides them; -1 if the status line is malformed
+static int hf_head_framing(const uint8_t *h, size_t len, int no_body, int *status, uint64_t *length) {
+  const char *p = (const char *)h, *end = p + len;
+  if (len < 12 || memcmp(p, "HTTP/", 5) != 0 || p[8] != ' ' ||
+      !isdigit((unsigned char)p[9]) || !isdigit((unsigned char)p[10]) || !isdigit((unsigned char)p[11]))
+    return -1;
+  *status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+
+  int chunked = 0;
+  int64_t content_length = -1;
+  for (p = memchr(p, '\n', len) + 1; p < end;) {
+    const char *eol = memchr(p, '\n', (size_t)(end - p));
+    const char *line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+    const char *colon = memchr(p, ':', (size_t)(line_end - p));
+    if (colon) {
+      const char *v = colon + 1;
+      while (v < line_end && (*v == ' ' || *v == '\t'))
+        v++;
+      size_t name_len = (size_t)(colon - p), value_len = (size_t)(line_end - v);
+      if (hp_name_is(p, name_len, "transfer-encoding")) {
+        for (size_t i = 0; i + 7 <= value_len; i++)
+          chunked |= strncasecmp(v + i, "chunked", 7) == 0;
+      } else if (hp_name_is(p, name_len, "content-length") && value_len < 32) {
+        char digits[32];
+        memcpy(digits, v, value_len);
+        digits[value_len] = '\0';
+        content_length = strtoll(digits, NULL, 10);
+      }
+    }
+    p = eol + 1;
+  }
+
+  *length = content_length > 0 ? (uint64_t)content_length : 0;
+  if (no_body || *status == 204 || *status == 304 || *status == 101)
+    return HP_BODY_NONE;
+  if (chunked)
+    return HP_BODY_CHUNKED;
+  return content_length >= 0 ? HP_BODY_LENGTH : HP_BODY_EOF;
+}
+
+// http_frame(fd, data, noBody, limit) -> end
+// Feeds data, the next bytes read on client socket fd as an ArrayBuffer
+// or typed array, to the framing of the response being read there. end is
+// where in data that response ends, the next one starting afresh from
+// there, or -1 if it goes on past data; a body that runs until the server
+// closes always does. noBody is for replies to HEAD. Throws a RangeError
+// for a body over limit bytes (0: no limit) and an InternalError for a
+// head over 64 KB or broken framing.
+static JSValue js_http_frame(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, no_body;
+  int64_t limit = 0;
+  size_t len;
+  const char *error = NULL;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (fd < 0)
+    return JS_ThrowRangeError(ctx, "http_frame(): invalid fd %d", fd);
+  const uint8_t *p = js_get_bytes(ctx, argv[1], &len);
+  if (!p)
+    return JS_EXCEPTION;
+  if ((no_body = JS_ToBool(ctx, argv[2])) < 0)
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 3) && JS_ToInt64(ctx, &limit, argv[3]))
+    return JS_EXCEPTION;
+
+  if ((size_t)fd >= hf.cap) {
+    size_t cap = hf.cap ? hf.cap : 1024;
+    while (cap <= (size_t)fd)
+      cap *= 2;
+    hf_t **conns = realloc(hf.conns, cap * sizeof(*conns));
+    if (!conns)
+      return JS_ThrowOutOfMemory(ctx);
+    memset(conns + hf.cap, 0, (cap - hf.cap) * sizeof(*conns));
+    hf.conns = conns;
+    hf.cap = cap;
+  }
+  hf_t *f = hf.conns[fd];
+  if (!f && !(f = hf.conns[fd] = calloc(1, sizeof(*f))))
+    return JS_ThrowOutOfMemory(ctx);
+
+  size_t i = 0;
+  for (;;) {
+    while (!f->in_body) {
+      if (i == len)
+        return JS_NewInt32(ctx, -1);
+      size_t old = f->head_len, k = len - i;
+      if (k > MAX_RESPONSE_HEAD - old)
+        k = MAX_RESPONSE_HEAD - old;
+      if (old + k > f->head_cap) {
+        size_t cap = f->head_cap ? f->head_cap : 1024;
+        while (cap < old + k)
+          cap *= 2;
+        uint8_t *head = realloc(f->head, cap);
+        if (!head)
+          return JS_ThrowOutOfMemory(ctx);
+        f->head = head;
+        f->head_cap = cap;
+      }
+      memcpy(f->head + old, p + i, k);
+      f->head_len += k;
+      size_t end = hf_head_end(f, old > 2 ? old - 2 : 0);
+      if (!end) {
+        if (f->head_len >= MAX_RESPONSE_HEAD) {
+          error = "Response head too large";
+          goto fail;
+        }
+        return JS_NewInt32(ctx, -1);
+      }
+      i += end - old;
+      f->head_len = 0;
+
+      int status;
+      uint64_t length;
+      int mode = hf_head_framing(f->head, end, no_body, &status, &length);
+      if (mode < 0) {
+        error = "Invalid HTTP response";
+        goto fail;
+      }
+      if (status >= 100 && status < 200 && status != 101)
+        continue; // interim: the real response follows
+      if (limit > 0 && length > (uint64_t)limit)
+        goto too_large;
+      hp_body_init(&f->body, mode, length);
+      f->size = 0;
+      f->in_body = 1;
+    }
+
+    hp_body_t *b = &f->body;
+    while (i < len && !b->done) {
+      int data = b->mode != HP_BODY_CHUNKED || b->state == HP_CHUNK_DATA;
+      size_t k = data ? len - i : 1; // framing goes byte by byte
+      if (data && b->mode == HP_BODY_CHUNKED && k > b->left)
+        k = (size_t)b->left;
+      ssize_t t = hp_body_take(b, p + i, k);
+      if (t < 0) {
+        error = "Invalid chunked encoding";
+        goto fail;
+      }
+      if (data)
+        f->size += (uint64_t)t;
+      i += (size_t)t;
+    }
+    if (limit > 0 && f->size > (uint64_t)limit)
+      goto too_large;
+    if (!b->done)
+      return JS_NewInt32(ctx, -1);
+    f->in_body = 0;
+    return JS_NewInt64(ctx, (int64_t)i);
+  }
+
+too_large:
+  hf_conn_free(fd);
+  return JS_ThrowRangeError(ctx, "Response larger than %lld bytes", (long long)limit);
+fail:
+  hf_conn_free(fd);
+  return JS_ThrowInternalError(ctx, "%s", error);
+}
+
+// Address helpers shared by bind/connect/accept
+static int socket_family(int fd) {
+  int domain;
+  socklen_t len = sizeof(domain);
+  if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0)
+    return AF_INET;
+  return domain;
+}
+
+// Fill a sockaddr for a socket of the given family. AF_UNIX takes a path,
+// or "@name" for the abstract namespace; AF_INET6 also accepts IPv4
+// literals (as v4-mapped addresses) and "%iface" scope suffixes.
+static int sockaddr_from_string(int family, const char *addr, int port,
+                                struct sockaddr_storage *ss, socklen_t *len) {
+  memset(ss, 0, sizeof(*ss));
+
+  if (family == AF_UNIX) {
+    struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+    int abstract = addr[0] == '@';
+    size_t path_len = strlen(addr);
+    if (path_len == 0 || path_len >= sizeof(sun->sun_path))
+      return -1;
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, addr, path_len);
+    if (abstract) {
+      sun->sun_path[0] = '\0';
+      *len = offsetof(struct sockaddr_un, sun_path) + path_len;
+    } else {
+      *len = offsetof(struct sockaddr_un, sun_path) + path_len + 1;
+    }
+    return 0;
+  }
+
+  if (family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    char host[INET6_ADDRSTRLEN + IF_NAMESIZE + 1];
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    if (strlen(addr) >= sizeof(host))
+      return -1;
+    strcpy(host, addr);
+
+    char *scope = strchr(host, '%');
+    if (scope) {
+      *scope++ = '\0';
+      sin6->sin6_scope_id = if_nametoindex(scope);
+      if (sin6->sin6_scope_id == 0)
+        sin6->sin6_scope_id = atoi(scope);
+    }
+
+    struct in_addr v4;
+    if (host[0] == '\0' || strcmp(host, "::") == 0) {
+      sin6->sin6_addr = in6addr_any;
+    } else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+      // parsed
+    } else if (inet_pton(AF_INET, host, &v4) == 1) {
+      sin6->sin6_addr.s6_addr[10] = 0xff;
+      sin6->sin6_addr.s6_addr[11] = 0xff;
+      memcpy(&sin6->sin6_addr.s6_addr[12], &v4, 4);
+    } else {
+      return -1;
+    }
+    *len = sizeof(*sin6);
+    return 0;
+  }
+
+  struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons(port);
+  if (strcmp(addr, "0.0.0.0") == 0 || strcmp(addr, "") == 0) {
+    sin->sin_addr.s_addr = INADDR_ANY;
+  } else if (inet_pton(AF_INET, addr, &sin->sin_addr) <= 0) {
+    return -1;
+  }
+  *len = sizeof(*sin);
+  return 0;
+}
+
+// Set address/port/family on obj from a sockaddr
+static void sockaddr_to_js(JSContext *ctx, JSValue obj, const struct sockaddr_storage *ss, socklen_t len) {
+  char addr_str[INET6_ADDRSTRLEN] = "";
+  int port = 0;
+  const char *family = "unix";
+
+  if (ss->ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+    inet_ntop(AF_INET, &sin->sin_addr, addr_str, sizeof(addr_str));
+    port = ntohs(sin->sin_port);
+    family = "IPv4";
+  } else if (ss->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+    inet_ntop(AF_INET6, &sin6->sin6_addr, addr_str, sizeof(addr_str));
+    port = ntohs(sin6->sin6_port);
+    family = "IPv6";
+  } else if (ss->ss_family == AF_UNIX) {
+    const struct sockaddr_un *sun = (const struct sockaddr_un *)ss;
+    size_t path_len = len > offsetof(struct sockaddr_un, sun_path) ? len - offsetof(struct sockaddr_un, sun_path) : 0;
+    if (path_len > sizeof(sun->sun_path))
+      path_len = sizeof(sun->sun_path);
+    if (path_len > 0 && sun->sun_path[0] == '\0') {
+      // Abstract namespace: reported as "@name"
+      char name[sizeof(sun->sun_path)];
+      memcpy(name, sun->sun_path, path_len);
+      name[0] = '@';
+      JS_SetPropertyStr(ctx, obj, "address", JS_NewStringLen(ctx, name, path_len));
+    } else {
+      JS_SetPropertyStr(ctx, obj, "address", JS_NewStringLen(ctx, sun->sun_path, strnlen(sun->sun_path, path_len)));
+    }
+    JS_SetPropertyStr(ctx, obj, "port", JS_NewInt32(ctx, 0));
+    JS_SetPropertyStr(ctx, obj, "family", JS_NewString(ctx, family));
+    return;
+  }
+
+  JS_SetPropertyStr(ctx, obj, "address", JS_NewString(ctx, addr_str));
+  JS_SetPropertyStr(ctx, obj, "port", JS_NewInt32(ctx, port));
+  JS_SetPropertyStr(ctx, obj, "family", JS_NewString(ctx, family));
+}
+
+// bind(sockfd, address, port)
+static JSValue js_bind(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, port = 0;
+  const char *addr;
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  addr = JS_ToCString(ctx, argv[1]);
+  if (!addr)
+    return JS_EXCEPTION;
+  if (argc > 2 && JS_ToInt32(ctx, &port, argv[2])) {
+    JS_FreeCString(ctx, addr);
+    return JS_EXCEPTION;
+  }
+
+  int family = socket_family(sockfd);
+  if (sockaddr_from_string(family, addr, port, &sa, &sa_len) < 0) {
+    JSValue err = JS_ThrowInternalError(ctx, "Invalid address: %s", addr);
+    JS_FreeCString(ctx, addr);
+    return err;
+  }
+
+  int rc = bind(sockfd, (struct sockaddr *)&sa, sa_len);
+
+  // A leftover socket file with nobody listening on it is replaced
+  if (rc < 0 && errno == EADDRINUSE && family == AF_UNIX && addr[0] != '@') {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0) {
+      if (connect(probe, (struct sockaddr *)&sa, sa_len) < 0 && errno == ECONNREFUSED) {
+        unlink(addr);
+        rc = bind(sockfd, (struct sockaddr *)&sa, sa_len);
+      } else {
+        errno = EADDRINUSE;
+      }
+      close(probe);
+    }
+  }
+  JS_FreeCString(ctx, addr);
+
+  if (rc < 0)
+    return JS_ThrowInternalError(ctx, "bind() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// listen(sockfd, backlog)
+static JSValue js_listen(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, backlog;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &backlog, argv[1]))
+    return JS_EXCEPTION;
+
+  if (listen(sockfd, backlog) < 0)
+    return JS_ThrowInternalError(ctx, "listen() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// accept(sockfd) -> {fd, address, port, family}
+static JSValue js_accept(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd;
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+
+  // Paused listeners have left epoll; connections already queued wait too
+  if (overload.paused && sockfd == overload.listen_fd)
+    return JS_NULL;
+
+  uint64_t traced = trace_start();
+  int client_fd;
+  for (;;) {
+    client_fd = accept(sockfd, (struct sockaddr *)&sa, &len);
+    if (client_fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return JS_NULL;
+      return JS_ThrowInternalError(ctx, "accept() failed: %s", strerror(errno));
+    }
+    if (!limiter.accept_rules || limit_accept(&sa))
+      break;
+    close(client_fd); // over an accept rule's rate: refused before JS sees it
+    len = sizeof(sa);
+  }
+  metrics_conn_open(client_fd);
+  if (overload.max_conns && sockfd == overload.listen_fd)
+    overload_listen_update();
+  trace_end(TRACE_ACCEPT, sockfd, traced, client_fd);
+  PROBE2(accept, sockfd, client_fd);
+
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "fd", JS_NewInt32(ctx, client_fd));
+  sockaddr_to_js(ctx, obj, &sa, len);
+
+  return obj;
+}
+
+// connect(sockfd, address, port)
+static JSValue js_connect(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, port = 0;
+  const char *addr;
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  addr = JS_ToCString(ctx, argv[1]);
+  if (!addr)
+    return JS_EXCEPTION;
+  if (argc > 2 && JS_ToInt32(ctx, &port, argv[2])) {
+    JS_FreeCString(ctx, addr);
+    return JS_EXCEPTION;
+  }
+
+  if (sockaddr_from_string(socket_family(sockfd), addr, port, &sa, &sa_len) < 0) {
+    JSValue err = JS_ThrowInternalError(ctx, "Invalid address: %s", addr);
+    JS_FreeCString(ctx, addr);
+    return err;
+  }
+  JS_FreeCString(ctx, addr);
+
+  // Only EINPROGRESS completes later. A non-blocking Unix socket whose
+  // listener has a full backlog says EAGAIN, and that connect has failed.
+  if (connect(sockfd, (struct sockaddr *)&sa, sa_len) < 0 && errno != EINPROGRESS)
+    return JS_ThrowInternalError(ctx, "connect() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// getsockname(sockfd) -> {address, port, family}
+static JSValue js_getsockname(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd;
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+
+  if (getsockname(sockfd, (struct sockaddr *)&sa, &len) < 0)
+    return JS_ThrowInternalError(ctx, "getsockname() failed: %s", strerror(errno));
+
+  JSValue obj = JS_NewObject(ctx);
+  sockaddr_to_js(ctx, obj, &sa, len);
+  return obj;
+}
+
+// Element view of an Int32Array (or Uint32Array)
+static int32_t *js_get_int32_array(JSContext *ctx, JSValueConst val, size_t *count) {
+  size_t offset, size, elem, ab_len;
+  JSValue ab = JS_GetTypedArrayBuffer(ctx, val, &offset, &size, &elem);
+  if (JS_IsException(ab))
+    return NULL;
+  uint8_t *base = JS_GetArrayBuffer(ctx, &ab_len, ab);
+  JS_FreeValue(ctx, ab);
+  if (!base)
+    return NULL;
+  if (elem != sizeof(int32_t)) {
+    JS_ThrowTypeError(ctx, "Expected an Int32Array");
+    return NULL;
+  }
+  *count = size / sizeof(int32_t);
+  return (int32_t *)(base + offset);
+}
+
+// send(sockfd, data, flags)
+static JSValue js_send(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, flags = 0;
+  size_t len;
+  const char *data;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+
+  int is_string = JS_IsString(argv[1]);
+  if (is_string) {
+    data = JS_ToCStringLen(ctx, &len, argv[1]);
+  } else {
+    data = (const char *)js_get_bytes(ctx, argv[1], &len);
+    if (!data)
+      return JS_ThrowTypeError(ctx, "Data must be a string, ArrayBuffer or typed array");
+  }
+  if (!data)
+    return JS_EXCEPTION;
+
+  if (argc > 2 && JS_ToInt32(ctx, &flags, argv[2])) {
+    if (is_string)
+      JS_FreeCString(ctx, data);
+    return JS_EXCEPTION;
+  }
+
+  uint64_t traced = trace_start();
+  ssize_t sent = conn_send(sockfd, data, len, flags | MSG_NOSIGNAL);
+  if (is_string)
+    JS_FreeCString(ctx, data);
+
+  if (sent < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return JS_NewInt32(ctx, 0);
+    return JS_ThrowInternalError(ctx, "send() failed: %s", strerror(errno));
+  }
+
+  METRIC_ADD(metrics.bytes_out, (uint64_t)sent);
+  trace_end(TRACE_SEND, sockfd, traced, (int32_t)sent);
+  PROBE2(send, sockfd, sent);
+  return JS_NewInt32(ctx, sent);
+}
+
+// recv(sockfd, bufsize, flags, {binary}) -> string, or ArrayBuffer with
+// binary: true. Text is decoded as UTF-8, which loses bytes that are not.
+static JSValue js_recv(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, bufsize, flags = 0, binary = 0;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &bufsize, argv[1]))
+    return JS_EXCEPTION;
+  if (argc > 2 && JS_ToInt32(ctx, &flags, argv[2]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 3)) {
+    JSValue v = JS_GetPropertyStr(ctx, argv[3], "binary");
+    binary = JS_ToBool(ctx, v);
+    JS_FreeValue(ctx, v);
+    if (binary < 0)
+      return JS_EXCEPTION;
+  }
+
+  if (bufsize > 65536) bufsize = 65536; // Limit to 64KB
+
+  char *buf = malloc(bufsize);
+  if (!buf)
+    return JS_ThrowOutOfMemory(ctx);
+
+  uint64_t traced = trace_start();
+  ssize_t received = conn_recv(sockfd, buf, bufsize, flags);
+
+  if (received < 0) {
+    free(buf);
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return binary ? JS_NewArrayBufferCopy(ctx, (const uint8_t *)"", 0) : JS_NewStringLen(ctx, "", 0);
+    return JS_ThrowInternalError(ctx, "recv() failed: %s", strerror(errno));
+  }
+
+  METRIC_ADD(metrics.bytes_in, (uint64_t)received);
+  trace_end(TRACE_RECV, sockfd, traced, (int32_t)received);
+  PROBE2(recv, sockfd, received);
+  JSValue result = binary ? JS_NewArrayBufferCopy(ctx, (const uint8_t *)buf, received)
+                          : JS_NewStringLen(ctx, buf, received);
+  free(buf);
+  return result;
+}
+
+// close(fd)
+static JSValue js_close(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+
+  metrics_conn_close(fd);
+  h2_conn_free(fd);
+  tls_conn_free(fd);
+  proxy_conn_free(ctx, fd);
+  hp_conn_free(ctx, fd);
+  rb_conn_free(fd);
+  hf_conn_free(fd);
+  PROBE1(close, fd);
+  if (close(fd) < 0)
+    return JS_ThrowInternalError(ctx, "close() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// setsockopt(sockfd, level, optname, optval)
+static JSValue js_setsockopt(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, level, optname, optval;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &level, argv[1]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &optname, argv[2]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &optval, argv[3]))
+    return JS_EXCEPTION;
+
+  if (setsockopt(sockfd, level, optname, &optval, sizeof(optval)) < 0)
+    return JS_ThrowInternalError(ctx, "setsockopt() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// shutdown(sockfd, how)
+static JSValue js_shutdown(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, how;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &how, argv[1]))
+    return JS_EXCEPTION;
+
+  if (shutdown(sockfd, how) < 0)
+    return JS_ThrowInternalError(ctx, "shutdown() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// gethostbyname(hostname) -> address
+static JSValue js_gethostbyname(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  const char *hostname = JS_ToCString(ctx, argv[0]);
+  if (!hostname)
+    return JS_EXCEPTION;
+
+  struct hostent *he = gethostbyname(hostname);
+  JS_FreeCString(ctx, hostname);
+
+  if (!he)
+    return JS_ThrowInternalError(ctx, "gethostbyname() failed");
+
+  char *addr = inet_ntoa(*(struct in_addr *)he->h_addr);
+  return JS_NewString(ctx, addr);
+}
+
+// Batched UDP: recvmmsg/sendmmsg over caller-owned buffers.
+// Message i lives at i * slotSize in the data buffer with its length in
+// lengths[i]; its peer is the i-th UDP_ADDR_SIZE slot of addrs, a raw
+// sockaddr followed by its length. A batch costs one syscall and creates
+// no JS values per datagram.
+static struct {
+  struct mmsghdr msgs[UDP_BATCH_MAX];
+  struct iovec iov[UDP_BATCH_MAX];
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control[UDP_BATCH_MAX];
+} udp_batch;
+
+// Returns the number of datagrams received, 0 if none are queued, -1 on error.
+// segments (optional) receives the GRO segment size, 0 for plain datagrams.
+static int udp_recv_batch(int fd, uint8_t *data, size_t slot, int count,
+                          int32_t *lengths, uint8_t *addrs, int32_t *segments) {
+  for (int i = 0; i < count; i++) {
+    struct msghdr *h = &udp_batch.msgs[i].msg_hdr;
+    udp_batch.iov[i].iov_base = data + (size_t)i * slot;
+    udp_batch.iov[i].iov_len = slot;
+    h->msg_iov = &udp_batch.iov[i];
+    h->msg_iovlen = 1;
+    h->msg_name = addrs ? addrs + (size_t)i * UDP_ADDR_SIZE : NULL;
+    h->msg_namelen = addrs ? UDP_ADDR_LEN_OFF : 0;
+    h->msg_control = segments ? udp_batch.control[i].buf : NULL;
+    h->msg_controllen = segments ? sizeof(udp_batch.control[i].buf) : 0;
+    h->msg_flags = 0;
+  }
+
+  // MSG_WAITFORONE: block (on blocking sockets) only for the first datagram
+  int n = recvmmsg(fd, udp_batch.msgs, count, MSG_WAITFORONE, NULL);
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+  for (int i = 0; i < n; i++) {
+    struct msghdr *h = &udp_batch.msgs[i].msg_hdr;
+    lengths[i] = (int32_t)udp_batch.msgs[i].msg_len;
+    METRIC_ADD(metrics.bytes_in, udp_batch.msgs[i].msg_len);
+    if (addrs) {
+      uint32_t alen = h->msg_namelen;
+      memcpy(addrs + (size_t)i * UDP_ADDR_SIZE + UDP_ADDR_LEN_OFF, &alen, sizeof(alen));
+    }
+    if (segments) {
+      segments[i] = 0;
+      for (struct cmsghdr *c = CMSG_FIRSTHDR(h); c; c = CMSG_NXTHDR(h, c)) {
+        if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+          memcpy(&segments[i], CMSG_DATA(c), sizeof(int));
+      }
+    }
+  }
+  return n;
+}
+
+// Returns the number of datagrams queued, 0 if the socket buffer is full,
+// -1 on error. gso_size > 0 lets the kernel split each message into
+// gso_size-byte datagrams (UDP_SEGMENT).
+static int udp_send_batch(int fd, uint8_t *data, size_t slot, int count,
+                          const int32_t *lengths, uint8_t *addrs, int gso_size) {
+  for (int i = 0; i < count; i++) {
+    struct msghdr *h = &udp_batch.msgs[i].msg_hdr;
+    udp_batch.iov[i].iov_base = data + (size_t)i * slot;
+    udp_batch.iov[i].iov_len = (size_t)lengths[i];
+    h->msg_iov = &udp_batch.iov[i];
+    h->msg_iovlen = 1;
+    h->msg_name = NULL;
+    h->msg_namelen = 0;
+    if (addrs) {
+      uint32_t alen;
+      memcpy(&alen, addrs + (size_t)i * UDP_ADDR_SIZE + UDP_ADDR_LEN_OFF, sizeof(alen));
+      if (alen > 0 && alen <= UDP_ADDR_LEN_OFF) {
+        h->msg_name = addrs + (size_t)i * UDP_ADDR_SIZE;
+        h->msg_namelen = alen;
+      }
+    }
+    h->msg_control = NULL;
+    h->msg_controllen = 0;
+    h->msg_flags = 0;
+    if (gso_size > 0) {
+      uint16_t seg = (uint16_t)gso_size;
+      h->msg_control = udp_batch.control[i].buf;
+      h->msg_controllen = CMSG_SPACE(sizeof(seg));
+      struct cmsghdr *c = CMSG_FIRSTHDR(h);
+      c->cmsg_level = SOL_UDP;
+      c->cmsg_type = UDP_SEGMENT;
+      c->cmsg_len = CMSG_LEN(sizeof(seg));
+      memcpy(CMSG_DATA(c), &seg, sizeof(seg));
+    }
+  }
+
+  int n = sendmmsg(fd, udp_batch.msgs, count, MSG_NOSIGNAL);
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) ? 0 : -1;
+  for (int i = 0; i < n; i++)
+    METRIC_ADD(metrics.bytes_out, udp_batch.msgs[i].msg_len);
+  return n;
+}
+
+// recvmmsg(sockfd, buffer, slotSize, lengths, addrs, segments) -> count
+static JSValue js_recvmmsg(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, slot;
+  size_t buf_len, nlengths, addr_len = 0, nsegments = 0;
+  uint8_t *buf, *addrs = NULL;
+  int32_t *lengths, *segments = NULL;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  if (!(buf = js_get_bytes(ctx, argv[1], &buf_len)))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &slot, argv[2]))
+    return JS_EXCEPTION;
+  if (slot <= 0)
+    return JS_ThrowRangeError(ctx, "slotSize must be positive");
+  if (!(lengths = js_get_int32_array(ctx, argv[3], &nlengths)))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 4) && !(addrs = js_get_bytes(ctx, argv[4], &addr_len)))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 5) && !(segments = js_get_int32_array(ctx, argv[5], &nsegments)))
+    return JS_EXCEPTION;
+
+  size_t count = buf_len / (size_t)slot;
+  if (nlengths < count) count = nlengths;
+  if (addrs && addr_len / UDP_ADDR_SIZE < count) count = addr_len / UDP_ADDR_SIZE;
+  if (segments && nsegments < count) count = nsegments;
+  if (count > UDP_BATCH_MAX) count = UDP_BATCH_MAX;
+  if (count == 0)
+    return JS_NewInt32(ctx, 0);
+
+  int n = udp_recv_batch(sockfd, buf, slot, (int)count, lengths, addrs, segments);
+  if (n < 0)
+    return JS_ThrowInternalError(ctx, "recvmmsg() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, n);
+}
+
+// sendmmsg(sockfd, buffer, slotSize, lengths, count, addrs, gsoSize) -> sent
+static JSValue js_sendmmsg(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, slot, count, gso_size = 0;
+  size_t buf_len, nlengths, addr_len = 0;
+  uint8_t *buf, *addrs = NULL;
+  int32_t *lengths;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  if (!(buf = js_get_bytes(ctx, argv[1], &buf_len)))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &slot, argv[2]))
+    return JS_EXCEPTION;
+  if (slot <= 0)
+    return JS_ThrowRangeError(ctx, "slotSize must be positive");
+  if (!(lengths = js_get_int32_array(ctx, argv[3], &nlengths)))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &count, argv[4]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 5) && !(addrs = js_get_bytes(ctx, argv[5], &addr_len)))
+    return JS_EXCEPTION;
+  if (argc > 6 && JS_ToInt32(ctx, &gso_size, argv[6]))
+    return JS_EXCEPTION;
+
+  if (count < 0 || count > UDP_BATCH_MAX || (size_t)count > nlengths ||
+      (size_t)count > buf_len / (size_t)slot || (addrs && (size_t)count > addr_len / UDP_ADDR_SIZE))
+    return JS_ThrowRangeError(ctx, "count exceeds the batch buffers");
+  if (gso_size < 0 || gso_size > UINT16_MAX)
+    return JS_ThrowRangeError(ctx, "Invalid gsoSize");
+  for (int i = 0; i < count; i++) {
+    if (lengths[i] < 0 || lengths[i] > slot)
+      return JS_ThrowRangeError(ctx, "Message %d length exceeds slotSize", i);
+  }
+  if (count == 0)
+    return JS_NewInt32(ctx, 0);
+
+  int n = udp_send_batch(sockfd, buf, slot, count, lengths, addrs, gso_size);
+  if (n < 0)
+    return JS_ThrowInternalError(ctx, "sendmmsg() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, n);
+}
+
+// udp_addr(addrs, index) -> {address, port, family} | null
+static JSValue js_udp_addr(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  size_t addr_len;
+  int index;
+  uint8_t *addrs;
+  struct sockaddr_storage ss;
+  uint32_t alen;
+
+  if (!(addrs = js_get_bytes(ctx, argv[0], &addr_len)))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &index, argv[1]))
+    return JS_EXCEPTION;
+  if (index < 0 || (size_t)index >= addr_len / UDP_ADDR_SIZE)
+    return JS_ThrowRangeError(ctx, "Address index out of range");
+
+  uint8_t *slot = addrs + (size_t)index * UDP_ADDR_SIZE;
+  memcpy(&alen, slot + UDP_ADDR_LEN_OFF, sizeof(alen));
+  if (alen < sizeof(sa_family_t) || alen > UDP_ADDR_LEN_OFF)
+    return JS_NULL;
+
+  memset(&ss, 0, sizeof(ss));
+  memcpy(&ss, slot, alen);
+  JSValue obj = JS_NewObject(ctx);
+  sockaddr_to_js(ctx, obj, &ss, alen);
+  return obj;
+}
+
+// udp_set_addr(sockfd, addrs, index, address, port) -> 0
+static JSValue js_udp_set_addr(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, index, port = 0;
+  size_t addr_len;
+  uint8_t *addrs;
+  const char *addr;
+  struct sockaddr_storage ss;
+  socklen_t ss_len;
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  if (!(addrs = js_get_bytes(ctx, argv[1], &addr_len)))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &index, argv[2]))
+    return JS_EXCEPTION;
+  if (index < 0 || (size_t)index >= addr_len / UDP_ADDR_SIZE)
+    return JS_ThrowRangeError(ctx, "Address index out of range");
+  if (argc > 4 && JS_ToInt32(ctx, &port, argv[4]))
+    return JS_EXCEPTION;
+  addr = JS_ToCString(ctx, argv[3]);
+  if (!addr)
+    return JS_EXCEPTION;
+
+  if (sockaddr_from_string(socket_family(sockfd), addr, port, &ss, &ss_len) < 0 || ss_len > UDP_ADDR_LEN_OFF) {
+    JSValue err = JS_ThrowInternalError(ctx, "Invalid address: %s", addr);
+    JS_FreeCString(ctx, addr);
+    return err;
+  }
+  JS_FreeCString(ctx, addr);
+
+  uint8_t *slot = addrs + (size_t)index * UDP_ADDR_SIZE;
+  uint32_t alen = ss_len;
+  memcpy(slot, &ss, ss_len);
+  memcpy(slot + UDP_ADDR_LEN_OFF, &alen, sizeof(alen));
+  return JS_NewInt32(ctx, 0);
+}
+
+// buffer_string(buffer, offset, length) -> string (UTF-8)
+static JSValue js_buffer_string(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  size_t len;
+  int64_t offset = 0, length = -1;
+  uint8_t *buf = js_get_bytes(ctx, argv[0], &len);
+
+  if (!buf)
+    return JS_EXCEPTION;
+  if (argc > 1 && JS_ToInt64(ctx, &offset, argv[1]))
+    return JS_EXCEPTION;
+  if (argc > 2 && JS_ToInt64(ctx, &length, argv[2]))
+    return JS_EXCEPTION;
+  if (length < 0)
+    length = (int64_t)len - offset;
+  if (offset < 0 || length < 0 || (uint64_t)(offset + length) > len)
+    return JS_ThrowRangeError(ctx, "Range outside of buffer");
+
+  return JS_NewStringLen(ctx, (const char *)buf + offset, length);
+}
+
+// buffer_write(buffer, offset, string) -> bytes written (UTF-8, truncated to fit)
+static JSValue js_buffer_write(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  size_t len, str_len;
+  int64_t offset;
+  uint8_t *buf = js_get_bytes(ctx, argv[0], &len);
+
+  if (!buf)
+    return JS_EXCEPTION;
+  if (JS_ToInt64(ctx, &offset, argv[1]))
+    return JS_EXCEPTION;
+  if (offset < 0 || (uint64_t)offset > len)
+    return JS_ThrowRangeError(ctx, "Offset outside of buffer");
+
+  const char *str = JS_ToCStringLen(ctx, &str_len, argv[2]);
+  if (!str)
+    return JS_EXCEPTION;
+  if (str_len > len - offset)
+    str_len = len - offset;
+  memcpy(buf + offset, str, str_len);
+  JS_FreeCString(ctx, str);
+
+  return JS_NewInt64(ctx, str_len);
+}
+
+// Async DNS resolver: a minimal UDP client driven by the caller's epoll loop.
+// Lookups send A and/or AAAA queries, answers are cached for their TTL and
+// NXDOMAIN/NODATA results are cached using the SOA minimum. Each lookup has
+// a socket of its own on a random port, in an epoll set of the module's own
+// (dns_fd()), and takes answers only from the nameservers it asked: a
+// spoofed answer must guess the port and the query id (RFC 5452).
+typedef struct {
+  int family;
+  unsigned char addr[16];
+} dns_addr_t;
+
+typedef struct dns_cache_entry {
+  struct dns_cache_entry *next;
+  char name[DNS_MAX_NAME + 1];
+  int family;            // 0 = A + AAAA, AF_INET or AF_INET6
+  int negative;
+  int64_t expires;       // monotonic ms
+  int count;
+  dns_addr_t addrs[DNS_MAX_ADDRS];
+} dns_cache_entry_t;
+
+typedef struct dns_lookup {
+  struct dns_lookup *next;
+  char name[DNS_MAX_NAME + 1];
+  int family;
+  int fd;
+  uint16_t ids[2];       // query ids for A and AAAA
+  int waiting;           // bit 0 = A outstanding, bit 1 = AAAA outstanding
+  unsigned servers;      // bit i: dns.servers[i] was asked
+  int attempts;
+  int64_t deadline;
+  int nxdomain;
+  int servfail;
+  uint32_t ttl;
+  uint32_t negative_ttl;
+  int count;
+  dns_addr_t addrs[DNS_MAX_ADDRS];
+  JSValue resolving_funcs[2];
+} dns_lookup_t;
+
+static struct {
+  int fd;                // epoll set of the lookups' sockets
+  int configured;
+  int nservers;
+  int skipped; // resolv.conf nameservers of the other address family
+  struct sockaddr_storage servers[DNS_MAX_SERVERS];
+  socklen_t server_lens[DNS_MAX_SERVERS];
+  int timeout_ms;
+  int attempts;
+  uint32_t max_ttl;
+  uint32_t negative_ttl;
+  uint32_t rng;
+  dns_lookup_t *pending;
+  dns_cache_entry_t *cache[DNS_CACHE_BUCKETS];
+  int cache_count;
+} dns = { .fd = -1, .timeout_ms = 1000, .attempts = 3, .max_ttl = 3600, .negative_ttl = 30 };
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Random bytes from getrandom(); xorshift32, seeded from /dev/urandom on
+// first use, only if that fails
+static void dns_random(void *buf, size_t n) {
+  if (getrandom(buf, n, GRND_NONBLOCK) == (ssize_t)n)
+    return;
+  for (unsigned char *p = buf; n > 0; n--) {
+    uint32_t x = dns.rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    dns.rng = x;
+    *p++ = (unsigned char)(x >> 8);
+  }
+}
+
+static uint16_t dns_random_id(void) {
+  uint16_t id;
+  dns_random(&id, sizeof(id));
+  return id;
+}
+
+// "1.2.3.4", "1.2.3.4:5353", "::1" or "[::1]:5353"
+static int dns_parse_server(const char *spec, struct sockaddr_storage *ss, socklen_t *len) {
+  char host[INET6_ADDRSTRLEN + 1];
+  int port = 53;
+  const char *colon = strrchr(spec, ':');
+
+  if (spec[0] == '[') {
+    const char *close_br = strchr(spec, ']');
+    if (!close_br || (size_t)(close_br - spec - 1) >= sizeof(host))
+      return -1;
+    memcpy(host, spec + 1, close_br - spec - 1);
+    host[close_br - spec - 1] = '\0';
+    if (close_br[1] == ':')
+      port = atoi(close_br + 2);
+  } else if (colon && strchr(spec, ':') == colon) {
+    if ((size_t)(colon - spec) >= sizeof(host))
+      return -1;
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    port = atoi(colon + 1);
+  } else {
+    if (strlen(spec) >= sizeof(host))
+      return -1;
+    strcpy(host, spec);
+  }
+
+  if (port <= 0 || port > 65535)
+    return -1;
+
+  memset(ss, 0, sizeof(*ss));
+  struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+  if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    *len = sizeof(*sin);
+  } else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    *len = sizeof(*sin6);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// A lookup's socket speaks the first nameserver's family, so later ones of
+// the other family are skipped (and counted) rather than failing every
+// sendto() on failover.
+static void dns_load_resolv_conf(void) {
+  FILE *f = fopen("/etc/resolv.conf", "r");
+  char line[256];
+
+  dns.nservers = 0;
+  dns.skipped = 0;
+  while (f && fgets(line, sizeof(line), f) && dns.nservers < DNS_MAX_SERVERS) {
+    char server[INET6_ADDRSTRLEN + 1];
+    if (sscanf(line, " nameserver %46s", server) != 1)
+      continue;
+    if (dns_parse_server(server, &dns.servers[dns.nservers], &dns.server_lens[dns.nservers]) < 0)
+      continue;
+    if (dns.nservers > 0 && dns.servers[dns.nservers].ss_family != dns.servers[0].ss_family)
+      dns.skipped++;
+    else
+      dns.nservers++;
+  }
+  if (f)
+    fclose(f);
+
+  if (dns.nservers == 0)
+    dns_parse_server("127.0.0.1", &dns.servers[0], &dns.server_lens[dns.nservers++]);
+}
+
+static void dns_configure_defaults(void) {
+  if (dns.configured)
+    return;
+  dns.configured = 1;
+  dns_load_resolv_conf();
+
+  int rfd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if (rfd >= 0) {
+    ssize_t r = read(rfd, &dns.rng, sizeof(dns.rng));
+    (void)r;
+    close(rfd);
+  }
+  if (dns.rng == 0)
+    dns.rng = (uint32_t)now_ms() ^ ((uint32_t)getpid() << 16) ^ 0x9e3779b9u;
+}
+
+static int dns_open(JSContext *ctx) {
+  if (dns.fd >= 0)
+    return 0;
+  dns_configure_defaults();
+  dns.fd = epoll_create1(EPOLL_CLOEXEC);
+  if (dns.fd < 0) {
+    JS_ThrowInternalError(ctx, "epoll_create1() failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Opens l's socket on a random port above 1023, leaving the choice to the
+// kernel if a few tries find none free, and adds it to dns.fd
+static int dns_lookup_socket(dns_lookup_t *l) {
+  int family = dns.servers[0].ss_family;
+  l->fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (l->fd < 0)
+    return -1;
+
+  for (int i = 0; i < 8; i++) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    uint16_t port;
+    dns_random(&port, sizeof(port));
+    port = (uint16_t)(1024 + port % (65536 - 1024));
+    memset(&ss, 0, sizeof(ss));
+    if (family == AF_INET6) {
+      struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(port);
+      len = sizeof(*sin6);
+    } else {
+      struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(port);
+      len = sizeof(*sin);
+    }
+    if (bind(l->fd, (struct sockaddr *)&ss, len) == 0 || errno != EADDRINUSE)
+      break;
+  }
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = l };
+  if (epoll_ctl(dns.fd, EPOLL_CTL_ADD, l->fd, &ev) < 0) {
+    close(l->fd);
+    l->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// Whether from is a nameserver that l asked
+static int dns_from_asked(const dns_lookup_t *l, const struct sockaddr_storage *from) {
+  for (int i = 0; i < dns.nservers; i++) {
+    const struct sockaddr_storage *ss = &dns.servers[i];
+    if (!(l->servers & (1u << i)) || ss->ss_family != from->ss_family)
+      continue;
+    if (ss->ss_family == AF_INET6) {
+      const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)ss, *b = (const struct sockaddr_in6 *)from;
+      if (a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0)
+        return 1;
+    } else {
+      const struct sockaddr_in *a = (const struct sockaddr_in *)ss, *b = (const struct sockaddr_in *)from;
+      if (a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+static unsigned dns_hash(const char *name, int family) {
+  unsigned h = 2166136261u ^ (unsigned)family;
+  for (; *name; name++)
+    h = (h ^ (unsigned char)tolower(*name)) * 16777619u;
+  return h % DNS_CACHE_BUCKETS;
+}
+
+static dns_cache_entry_t *dns_cache_get(const char *name, int family, int64_t now) {
+  dns_cache_entry_t **pp = &dns.cache[dns_hash(name, family)];
+  while (*pp) {
+    dns_cache_entry_t *e = *pp;
+    if (e->expires <= now) {
+      *pp = e->next;
+      free(e);
+      dns.cache_count--;
+      continue;
+    }
+    if (e->family == family && strcasecmp(e->name, name) == 0)
+      return e;
+    pp = &e->next;
+  }
+  return NULL;
+}
+
+// Makes room for one more entry: drops the expired ones, else the one
+// closest to expiring
+static void dns_cache_evict(int64_t now) {
+  dns_cache_entry_t **victim = NULL;
+  for (unsigned h = 0; h < DNS_CACHE_BUCKETS; h++) {
+    for (dns_cache_entry_t **pp = &dns.cache[h]; *pp;) {
+      dns_cache_entry_t *e = *pp;
+      if (e->expires <= now) {
+        *pp = e->next;
+        free(e);
+        dns.cache_count--;
+        continue;
+      }
+      if (!victim || e->expires < (*victim)->expires)
+        victim = pp;
+      pp = &e->next;
+    }
+  }
+  if (dns.cache_count >= DNS_CACHE_MAX && victim) {
+    dns_cache_entry_t *e = *victim;
+    *victim = e->next;
+    free(e);
+    dns.cache_count--;
+  }
+}
+
+static void dns_cache_put(const dns_lookup_t *l, uint32_t ttl, int negative) {
+  if (ttl == 0)
+    return;
+  if (dns.cache_count >= DNS_CACHE_MAX)
+    dns_cache_evict(now_ms());
+
+  dns_cache_entry_t *e = calloc(1, sizeof(*e));
+  if (!e)
+    return;
+  strcpy(e->name, l->name);
+  e->family = l->family;
+  e->negative = negative;
+  e->expires = now_ms() + (int64_t)ttl * 1000;
+  e->count = l->count;
+  memcpy(e->addrs, l->addrs, sizeof(dns_addr_t) * l->count);
+
+  unsigned h = dns_hash(l->name, l->family);
+  e->next = dns.cache[h];
+  dns.cache[h] = e;
+  dns.cache_count++;
+}
+
+// Encode a standard recursive query; returns the packet length or -1
+static int dns_build_query(unsigned char *buf, size_t cap, uint16_t id, const char *name, uint16_t qtype) {
+  size_t off = 12;
+  memset(buf, 0, 12);
+  buf[0] = id >> 8;
+  buf[1] = id & 0xff;
+  buf[2] = 0x01;  // RD
+  buf[5] = 1;     // QDCOUNT
+
+  const char *label = name;
+  while (*label) {
+    const char *dot = strchr(label, '.');
+    size_t label_len = dot ? (size_t)(dot - label) : strlen(label);
+    if (label_len == 0 || label_len > 63 || off + label_len + 1 + 5 > cap)
+      return -1;
+    buf[off++] = (unsigned char)label_len;
+    memcpy(buf + off, label, label_len);
+    off += label_len;
+    if (!dot)
+      break;
+    label = dot + 1;
+  }
+  buf[off++] = 0;
+  buf[off++] = qtype >> 8;
+  buf[off++] = qtype & 0xff;
+  buf[off++] = 0;
+  buf[off++] = 1; // IN
+  return (int)off;
+}
+
+static int dns_skip_name(const unsigned char *msg, size_t len, size_t off) {
+  while (off < len) {
+    unsigned char c = msg[off];
+    if (c == 0)
+      return (int)off + 1;
+    if ((c & 0xc0) == 0xc0)
+      return off + 1 < len ? (int)off + 2 : -1;
+    if (c & 0xc0)
+      return -1;
+    off += c + 1;
+  }
+  return -1;
+}
+
+// Compare the (uncompressed) question name against the lookup name
+static int dns_question_matches(const unsigned char *msg, size_t len, const char *name) {
+  size_t off = 12;
+  const char *p = name;
+  while (off < len && msg[off] != 0) {
+    unsigned char c = msg[off++];
+    if (c & 0xc0 || off + c > len)
+      return 0;
+    if (p != name) {
+      if (*p != '.')
+        return 0;
+      p++;
+    }
+    if (strncasecmp(p, (const char *)msg + off, c) != 0)
+      return 0;
+    p += c;
+    off += c;
+  }
+  return *p == '\0' || (p[0] == '.' && p[1] == '\0');
+}
+
+static void dns_send_queries(dns_lookup_t *l) {
+  unsigned char buf[DNS_MAX_PACKET];
+  static const uint16_t qtypes[2] = { 1, 28 };
+  int server = l->attempts % dns.nservers;
+
+  for (int i = 0; i < 2; i++) {
+    if (!(l->waiting & (1 << i)))
+      continue;
+    int n = dns_build_query(buf, sizeof(buf), l->ids[i], l->name, qtypes[i]);
+    if (n > 0)
+      sendto(l->fd, buf, n, 0, (struct sockaddr *)&dns.servers[server], dns.server_lens[server]);
+  }
+  l->servers |= 1u << server;
+  l->attempts++;
+  l->deadline = now_ms() + dns.timeout_ms;
+}
+
+static void dns_parse_response(dns_lookup_t *l, const unsigned char *msg, size_t len) {
+  int rcode = msg[3] & 0x0f;
+  int qdcount = (msg[4] << 8) | msg[5];
+  int ancount = (msg[6] << 8) | msg[7];
+  int nscount = (msg[8] << 8) | msg[9];
+  int off = 12;
+  int answers = 0;
+
+  if (rcode == 3)
+    l->nxdomain = 1;
+  else if (rcode != 0)
+    l->servfail = 1;
+
+  for (int i = 0; i < qdcount && off >= 0; i++) {
+    off = dns_skip_name(msg, len, off);
+    if (off >= 0)
+      off += 4;
+  }
+
+  for (int i = 0; i < ancount + nscount && off >= 0 && (size_t)off + 10 <= len; i++) {
+    off = dns_skip_name(msg, len, off);
+    if (off < 0 || (size_t)off + 10 > len)
+      break;
+    const unsigned char *rr = msg + off;
+    uint16_t type = (rr[0] << 8) | rr[1];
+    uint16_t klass = (rr[2] << 8) | rr[3];
+    uint32_t ttl = ((uint32_t)rr[4] << 24) | (rr[5] << 16) | (rr[6] << 8) | rr[7];
+    uint16_t rdlen = (rr[8] << 8) | rr[9];
+    off += 10;
+    if ((size_t)off + rdlen > len)
+      break;
+
+    if (i < ancount && klass == 1 && ((type == 1 && rdlen == 4) || (type == 28 && rdlen == 16))) {
+      if (l->count < DNS_MAX_ADDRS) {
+        dns_addr_t *a = &l->addrs[l->count++];
+        a->family = type == 1 ? AF_INET : AF_INET6;
+        memcpy(a->addr, msg + off, rdlen);
+      }
+      if (answers++ == 0 || ttl < l->ttl)
+        l->ttl = ttl;
+    } else if (i >= ancount && type == 6) {
+      // SOA: mname, rname, serial, refresh, retry, expire, minimum
+      int p = dns_skip_name(msg, len, off);
+      if (p >= 0)
+        p = dns_skip_name(msg, len, p);
+      if (p >= 0 && (size_t)p + 20 <= (size_t)off + rdlen) {
+        const unsigned char *m = msg + p + 16;
+        uint32_t minimum = ((uint32_t)m[0] << 24) | (m[1] << 16) | (m[2] << 8) | m[3];
+        l->negative_ttl = minimum < ttl ? minimum : ttl;
+      }
+    }
+    off += rdlen;
+  }
+}
+
+static JSValue dns_addresses_to_js(JSContext *ctx, const dns_addr_t *addrs, int count, uint32_t ttl) {
+  JSValue arr = JS_NewArray(ctx);
+  for (int i = 0; i < count; i++) {
+    char str[INET6_ADDRSTRLEN];
+    inet_ntop(addrs[i].family, addrs[i].addr, str, sizeof(str));
+    JSValue obj = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, obj, "address", JS_NewString(ctx, str));
+    JS_SetPropertyStr(ctx, obj, "family", JS_NewInt32(ctx, addrs[i].family == AF_INET ? 4 : 6));
+    JS_SetPropertyStr(ctx, obj, "ttl", JS_NewUint32(ctx, ttl));
+    JS_SetPropertyUint32(ctx, arr, i, obj);
+  }
+  return arr;
+}
+
+static JSValue dns_error(JSContext *ctx, const char *code, const char *name) {
+  JSValue err = JS_NewError(ctx);
+  char msg[DNS_MAX_NAME + 64];
+  snprintf(msg, sizeof(msg), "resolve %s %s", code, name);
+  JS_SetPropertyStr(ctx, err, "message", JS_NewString(ctx, msg));
+  JS_SetPropertyStr(ctx, err, "code", JS_NewString(ctx, code));
+  return err;
+}
+
+static void dns_settle(JSContext *ctx, JSValue *resolving_funcs, int ok, JSValue value) {
+  JSValue ret = JS_Call(ctx, resolving_funcs[ok ? 0 : 1], JS_UNDEFINED, 1, (JSValueConst *)&value);
+  JS_FreeValue(ctx, ret);
+  JS_FreeValue(ctx, value);
+  JS_FreeValue(ctx, resolving_funcs[0]);
+  JS_FreeValue(ctx, resolving_funcs[1]);
+}
+
+static void dns_complete(JSContext *ctx, dns_lookup_t *l, int timed_out) {
+  if (l->count > 0) {
+    uint32_t ttl = l->ttl < dns.max_ttl ? l->ttl : dns.max_ttl;
+    if (!timed_out)
+      dns_cache_put(l, ttl, 0);
+    dns_settle(ctx, l->resolving_funcs, 1, dns_addresses_to_js(ctx, l->addrs, l->count, ttl));
+  } else if (timed_out) {
+    dns_settle(ctx, l->resolving_funcs, 0, dns_error(ctx, "ETIMEOUT", l->name));
+  } else if (l->servfail && !l->nxdomain) {
+    dns_settle(ctx, l->resolving_funcs, 0, dns_error(ctx, "ESERVFAIL", l->name));
+  } else {
+    uint32_t ttl = l->negative_ttl < dns.negative_ttl ? l->negative_ttl : dns.negative_ttl;
+    dns_cache_put(l, ttl, 1);
+    dns_settle(ctx, l->resolving_funcs, 0, dns_error(ctx, "ENOTFOUND", l->name));
+  }
+  close(l->fd);
+  free(l);
+}
+
+// Look the name up in /etc/hosts; returns the number of addresses found
+static int dns_hosts_lookup(const char *name, int family, dns_addr_t *out) {
+  FILE *f = fopen("/etc/hosts", "r");
+  char line[512];
+  int count = 0;
+
+  while (f && fgets(line, sizeof(line), f) && count < DNS_MAX_ADDRS) {
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = '\0';
+    char *save;
+    char *addr = strtok_r(line, " \t\r\n", &save);
+    if (!addr)
+      continue;
+    dns_addr_t a;
+    if (inet_pton(AF_INET, addr, a.addr) == 1)
+      a.family = AF_INET;
+    else if (inet_pton(AF_INET6, addr, a.addr) == 1)
+      a.family = AF_INET6;
+    else
+      continue;
+    if (family && family != a.family)
+      continue;
+    for (char *alias = strtok_r(NULL, " \t\r\n", &save); alias; alias = strtok_r(NULL, " \t\r\n", &save)) {
+      if (strcasecmp(alias, name) == 0) {
+        out[count++] = a;
+        break;
+      }
+    }
+  }
+  if (f)
+    fclose(f);
+  return count;
+}
+
+// resolve(hostname, family = 0) -> Promise<[{address, family, ttl}]>
+static JSValue js_resolve(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int family = 0;
+  size_t name_len;
+  const char *hostname = JS_ToCStringLen(ctx, &name_len, argv[0]);
+  if (!hostname)
+    return JS_EXCEPTION;
+  if (argc > 1 && JS_ToInt32(ctx, &family, argv[1])) {
+    JS_FreeCString(ctx, hostname);
+    return JS_EXCEPTION;
+  }
+  if (name_len == 0 || name_len > DNS_MAX_NAME || (family != 0 && family != 4 && family != 6)) {
+    JS_FreeCString(ctx, hostname);
+    return JS_ThrowRangeError(ctx, "resolve(): invalid hostname or family");
+  }
+  family = family == 4 ? AF_INET : family == 6 ? AF_INET6 : 0;
+
+  char name[DNS_MAX_NAME + 1];
+  memcpy(name, hostname, name_len + 1);
+  JS_FreeCString(ctx, hostname);
+  if (name[name_len - 1] == '.')
+    name[--name_len] = '\0';
+
+  JSValue resolving_funcs[2];
+  JSValue promise = JS_NewPromiseCapability(ctx, resolving_funcs);
+  if (JS_IsException(promise))
+    return promise;
+
+  // Literal addresses and /etc/hosts entries never touch the network
+  dns_addr_t addrs[DNS_MAX_ADDRS];
+  int count = 0;
+  if (inet_pton(AF_INET, name, addrs[0].addr) == 1) {
+    addrs[0].family = AF_INET;
+    count = 1;
+  } else if (inet_pton(AF_INET6, name, addrs[0].addr) == 1) {
+    addrs[0].family = AF_INET6;
+    count = 1;
+  } else {
+    count = dns_hosts_lookup(name, family, addrs);
+  }
+  if (count > 0) {
+    dns_settle(ctx, resolving_funcs, 1, dns_addresses_to_js(ctx, addrs, count, 0));
+    return promise;
+  }
+
+  int64_t now = now_ms();
+  dns_cache_entry_t *e = dns_cache_get(name, family, now);
+  if (e) {
+    if (e->negative)
+      dns_settle(ctx, resolving_funcs, 0, dns_error(ctx, "ENOTFOUND", name));
+    else
+      dns_settle(ctx, resolving_funcs, 1, dns_addresses_to_js(ctx, e->addrs, e->count, (uint32_t)((e->expires - now) / 1000)));
+    return promise;
+  }
+
+  if (dns_open(ctx) < 0) {
+    dns_settle(ctx, resolving_funcs, 0, JS_GetException(ctx));
+    return promise;
+  }
+
+  dns_lookup_t *l = calloc(1, sizeof(*l));
+  if (!l) {
+    dns_settle(ctx, resolving_funcs, 0, dns_error(ctx, "ENOMEM", name));
+    return promise;
+  }
+
+  if (dns_lookup_socket(l) < 0) {
+    const char *code = strerrorname_np(errno);
+    free(l);
+    dns_settle(ctx, resolving_funcs, 0, dns_error(ctx, code ? code : "EIO", name));
+    return promise;
+  }
+  strcpy(l->name, name);
+  l->family = family;
+  l->waiting = family == AF_INET ? 1 : family == AF_INET6 ? 2 : 3;
+  l->ids[0] = dns_random_id();
+  l->ids[1] = dns_random_id();
+  l->negative_ttl = dns.negative_ttl;
+  l->resolving_funcs[0] = resolving_funcs[0];
+  l->resolving_funcs[1] = resolving_funcs[1];
+  l->next = dns.pending;
+  dns.pending = l;
+  dns_send_queries(l);
+
+  return promise;
+}
+
+// dns_poll() -> number of settled lookups; call when dns_fd() is readable
+// and periodically so lost queries are retried
+static JSValue js_dns_poll(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  unsigned char msg[DNS_MAX_PACKET];
+  struct sockaddr_storage from;
+  struct epoll_event events[64];
+  int settled = 0;
+
+  if (dns.fd < 0)
+    return JS_NewInt32(ctx, 0);
+
+  int ready = epoll_wait(dns.fd, events, 64, 0);
+  for (int i = 0; i < ready; i++) {
+    dns_lookup_t *l = events[i].data.ptr;
+    while (l->waiting) {
+      socklen_t from_len = sizeof(from);
+      ssize_t n = recvfrom(l->fd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &from_len);
+      if (n < 0)
+        break;
+      if (n < 12 || !(msg[2] & 0x80) || !dns_from_asked(l, &from))
+        continue;
+
+      uint16_t id = (msg[0] << 8) | msg[1];
+      int bit = (l->waiting & 1) && l->ids[0] == id ? 1 : (l->waiting & 2) && l->ids[1] == id ? 2 : 0;
+      if (!bit || !dns_question_matches(msg, n, l->name))
+        continue;
+      l->waiting &= ~bit;
+      dns_parse_response(l, msg, n);
+    }
+    if (l->waiting)
+      continue;
+
+    dns_lookup_t **pp = &dns.pending;
+    while (*pp != l)
+      pp = &(*pp)->next;
+    *pp = l->next;
+    dns_complete(ctx, l, 0);
+    settled++;
+  }
+
+  int64_t now = now_ms();
+  dns_lookup_t **pp = &dns.pending;
+  while (*pp) {
+    dns_lookup_t *l = *pp;
+    if (l->deadline > now) {
+      pp = &l->next;
+      continue;
+    }
+    if (l->attempts < dns.attempts) {
+      dns_send_queries(l);
+      pp = &l->next;
+      continue;
+    }
+    *pp = l->next;
+    dns_complete(ctx, l, 1);
+    settled++;
+  }
+
+  return JS_NewInt32(ctx, settled);
+}
+
+// dns_fd() -> UDP socket used by resolve(); add it to your epoll set
+static JSValue js_dns_fd(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  if (dns_open(ctx) < 0)
+    return JS_EXCEPTION;
+  return JS_NewInt32(ctx, dns.fd);
+}
+
+// dns_config({servers, timeout, attempts, maxTtl, negativeTtl}) -> {servers, skipped}
+// The nameservers in use, and how many resolv.conf ones were skipped for
+// their address family. dns_config({}) changes nothing.
+static JSValue js_dns_config(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue opts = argv[0];
+  JSValue v;
+  int32_t n;
+
+  dns_configure_defaults();
+
+  v = JS_GetPropertyStr(ctx, opts, "servers");
+  if (JS_IsArray(ctx, v) > 0) {
+    uint32_t len;
+    JSValue jlen = JS_GetPropertyStr(ctx, v, "length");
+    JS_ToUint32(ctx, &len, jlen);
+    JS_FreeValue(ctx, jlen);
+
+    struct sockaddr_storage servers[DNS_MAX_SERVERS];
+    socklen_t lens[DNS_MAX_SERVERS];
+    int count = 0;
+    for (uint32_t i = 0; i < len && count < DNS_MAX_SERVERS; i++) {
+      JSValue item = JS_GetPropertyUint32(ctx, v, i);
+      const char *spec = JS_ToCString(ctx, item);
+      JS_FreeValue(ctx, item);
+      if (!spec) {
+        JS_FreeValue(ctx, v);
+        return JS_EXCEPTION;
+      }
+      int rc = dns_parse_server(spec, &servers[count], &lens[count]);
+      JS_FreeCString(ctx, spec);
+      if (rc < 0) {
+        JS_FreeValue(ctx, v);
+        return JS_ThrowRangeError(ctx, "dns_config(): invalid server address");
+      }
+      if (count > 0 && servers[count].ss_family != servers[0].ss_family) {
+        JS_FreeValue(ctx, v);
+        return JS_ThrowRangeError(ctx, "dns_config(): servers must share one address family");
+      }
+      count++;
+    }
+
+    if (count > 0) {
+      memcpy(dns.servers, servers, sizeof(servers[0]) * count);
+      memcpy(dns.server_lens, lens, sizeof(lens[0]) * count);
+      dns.nservers = count;
+      dns.skipped = 0;
+    }
+  }
+  JS_FreeValue(ctx, v);
+
+  v = JS_GetPropertyStr(ctx, opts, "timeout");
+  if (!JS_IsUndefined(v) && JS_ToInt32(ctx, &n, v) == 0 && n > 0)
+    dns.timeout_ms = n;
+  JS_FreeValue(ctx, v);
+
+  v = JS_GetPropertyStr(ctx, opts, "attempts");
+  if (!JS_IsUndefined(v) && JS_ToInt32(ctx, &n, v) == 0 && n > 0)
+    dns.attempts = n;
+  JS_FreeValue(ctx, v);
+
+  v = JS_GetPropertyStr(ctx, opts, "maxTtl");
+  if (!JS_IsUndefined(v) && JS_ToInt32(ctx, &n, v) == 0 && n >= 0)
+    dns.max_ttl = n;
+  JS_FreeValue(ctx, v);
+
+  v = JS_GetPropertyStr(ctx, opts, "negativeTtl");
+  if (!JS_IsUndefined(v) && JS_ToInt32(ctx, &n, v) == 0 && n >= 0)
+    dns.negative_ttl = n;
+  JS_FreeValue(ctx, v);
+
+  JSValue result = JS_NewObject(ctx);
+  JSValue list = JS_NewArray(ctx);
+  for (int i = 0; i < dns.nservers; i++) {
+    char host[INET6_ADDRSTRLEN], spec[INET6_ADDRSTRLEN + 9];
+    const struct sockaddr_storage *ss = &dns.servers[i];
+    if (ss->ss_family == AF_INET6) {
+      const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+      inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+      snprintf(spec, sizeof(spec), "[%s]:%d", host, ntohs(sin6->sin6_port));
+    } else {
+      const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+      inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+      snprintf(spec, sizeof(spec), "%s:%d", host, ntohs(sin->sin_port));
+    }
+    JS_SetPropertyUint32(ctx, list, (uint32_t)i, JS_NewString(ctx, spec));
+  }
+  JS_SetPropertyStr(ctx, result, "servers", list);
+  JS_SetPropertyStr(ctx, result, "skipped", JS_NewInt32(ctx, dns.skipped));
+  return result;
+}
+
+// dns_cache_clear() -> number of entries dropped
+static JSValue js_dns_cache_clear(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int dropped = dns.cache_count;
+  for (int i = 0; i < DNS_CACHE_BUCKETS; i++) {
+    while (dns.cache[i]) {
+      dns_cache_entry_t *e = dns.cache[i];
+      dns.cache[i] = e->next;
+      free(e);
+    }
+  }
+  dns.cache_count = 0;
+  return JS_NewInt32(ctx, dropped);
+}
+
+// HTTP Parser helpers
+static inline char *skip_whitespace(char *p) {
+  while (*p == ' ' || *p == '\t') p++;
+  return p;
+}
+
+static inline char *find_eol(char *p) {
+  while (*p && *p != '\r' && *p != '\n') p++;
+  return p;
+}
+
+typedef struct {
+  int64_t content_length; // -1 when absent
+  int chunked;
+  char content_type[128];
+  char connection[64];
+} http_head_info_t;
+
+// Parse header lines up to the blank line ending the head, storing
+// lowercased names on headers. Repeated fields are joined with ", "
+// (set-cookie collects an array). Returns the first byte after the head.
+static const char *http_parse_headers(JSContext *ctx, const char *p, const char *end,
+                                      JSValue headers, http_head_info_t *info) {
+  struct { const char *name; size_t len; } seen[MAX_HEADERS];
+  int nseen = 0;
+
+  info->content_length = -1;
+  info->chunked = 0;
+  info->content_type[0] = '\0';
+  info->connection[0] = '\0';
+
+  while (p < end) {
+    // Check for empty line (end of headers)
+    if (*p == '\r' && p + 1 < end && *(p + 1) == '\n') {
+      p += 2; // skip \r\n
+      break;
+    }
+    if (*p == '\n') {
+      p++;
+      break;
+    }
+
+    // Parse header name
+    const char *header_name_start = p;
+    while (p < end && *p != ':') p++;
+    if (p >= end) break;
+
+    size_t header_name_len = p - header_name_start;
+    char header_name[256];
+    if (header_name_len >= sizeof(header_name)) header_name_len = sizeof(header_name) - 1;
+
+    // Copy and lowercase header name
+    for (size_t i = 0; i < header_name_len; i++) {
+      header_name[i] = tolower(header_name_start[i]);
+    }
+    header_name[header_name_len] = '\0';
+
+    p++; // skip ':'
+    while (p < end && (*p == ' ' || *p == '\t')) p++; // skip whitespace
+
+    const char *value_start = p;
+    while (p < end && *p != '\r' && *p != '\n') p++;
+
+    size_t value_len = p - value_start;
+    while (value_len > 0 && (value_start[value_len - 1] == ' ' || value_start[value_len - 1] == '\t'))
+      value_len--;
+
+    // Track special headers
+    if (strcmp(header_name, "content-length") == 0) {
+      char len_str[32];
+      if (value_len < sizeof(len_str)) {
+        memcpy(len_str, value_start, value_len);
+        len_str[value_len] = '\0';
+        info->content_length = strtoll(len_str, NULL, 10);
+      }
+    } else if (strcmp(header_name, "transfer-encoding") == 0) {
+      for (size_t i = 0; i + 7 <= value_len; i++) {
+        if (strncasecmp(value_start + i, "chunked", 7) == 0)
+          info->chunked = 1;
+      }
+    } else if (strcmp(header_name, "content-type") == 0) {
+      if (value_len < sizeof(info->content_type)) {
+        memcpy(info->content_type, value_start, value_len);
+        info->content_type[value_len] = '\0';
+      }
+    } else if (strcmp(header_name, "connection") == 0) {
+      if (value_len < sizeof(info->connection)) {
+        memcpy(info->connection, value_start, value_len);
+        info->connection[value_len] = '\0';
+      }
+    }
+
+    int repeated = 0;
+    for (int i = 0; i < nseen; i++) {
+      if (seen[i].len == header_name_len && strncasecmp(seen[i].name, header_name_start, header_name_len) == 0) {
+        repeated = 1;
+        break;
+      }
+    }
+
+    JSValue value = JS_NewStringLen(ctx, value_start, value_len);
+    if (!repeated) {
+      if (nseen < MAX_HEADERS) {
+        seen[nseen].name = header_name_start;
+        seen[nseen].len = header_name_len;
+        nseen++;
+      }
+      if (strcmp(header_name, "set-cookie") == 0) {
+        JSValue arr = JS_NewArray(ctx);
+        JS_SetPropertyUint32(ctx, arr, 0, value);
+        value = arr;
+      }
+      JS_SetPropertyStr(ctx, headers, header_name, value);
+    } else {
+      JSValue prev = JS_GetPropertyStr(ctx, headers, header_name);
+      if (JS_IsArray(ctx, prev) > 0) {
+        int64_t n = 0;
+        JSValue len_val = JS_GetPropertyStr(ctx, prev, "length");
+        JS_ToInt64(ctx, &n, len_val);
+        JS_FreeValue(ctx, len_val);
+        JS_SetPropertyInt64(ctx, prev, n, value);
+        JS_FreeValue(ctx, prev);
+      } else {
+        size_t prev_len;
+        const char *prev_str = JS_ToCStringLen(ctx, &prev_len, prev);
+        JS_FreeValue(ctx, prev);
+        if (prev_str) {
+          size_t joined_len = prev_len + 2 + value_len;
+          char *joined = malloc(joined_len);
+          if (joined) {
+            memcpy(joined, prev_str, prev_len);
+            memcpy(joined + prev_len, ", ", 2);
+            memcpy(joined + prev_len + 2, value_start, value_len);
+            JS_SetPropertyStr(ctx, headers, header_name, JS_NewStringLen(ctx, joined, joined_len));
+            free(joined);
+          }
+          JS_FreeCString(ctx, prev_str);
+        }
+        JS_FreeValue(ctx, value);
+      }
+    }
+
+    // Skip to next line
+    if (p < end && *p == '\r') p++;
+    if (p < end && *p == '\n') p++;
+  }
+
+  return p;
+}
+
+// Query strings
+//
+// http_set_target() reads a request target in one pass without copying it:
+// url, path and every key and value are slices of the target. Only a slice
+// that holds '%' or '+' is decoded, into a scratch buffer kept from one
+// request to the next. The bytes that split the query are looked for 32
+// (AVX2) or 16 (SSE2) at a time, which is what long tracking parameters
+// (utm_*, gclid, fbclid) cost.
+
+static struct {
+  char *scratch;
+  size_t cap;
+} query;
+
+// The first '&', '=', '%' or '+' in p[0..end), or end
+static const char *query_special(const char *p, const char *end) {
+#if defined(__AVX2__)
+  const __m256i amp = _mm256_set1_epi8('&'), eq = _mm256_set1_epi8('=');
+  const __m256i pct = _mm256_set1_epi8('%'), plus = _mm256_set1_epi8('+');
+  for (; simd_on && end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, eq)),
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(v, pct), _mm256_cmpeq_epi8(v, plus)));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  const __m128i amp = _mm_set1_epi8('&'), eq = _mm_set1_epi8('=');
+  const __m128i pct = _mm_set1_epi8('%'), plus = _mm_set1_epi8('+');
+  for (; simd_on && end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, eq)),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; p++) {
+    if (*p == '&' || *p == '=' || *p == '%' || *p == '+')
+      return p;
+  }
+  return end;
+}
+
+// Decodes src[0..len) into the scratch buffer: '+' is a space, %XX a byte,
+// and a '%' without two hex digits stays. The decoded length, or -1.
+static ssize_t query_unescape(const char *src, size_t len) {
+  if (len > query.cap) {
+    size_t cap = query.cap ? query.cap : 256;
+    while (cap < len)
+      cap *= 2;
+    char *scratch = realloc(query.scratch, cap);
+    if (!scratch)
+      return -1;
+    query.scratch = scratch;
+    query.cap = cap;
+  }
+  char *o = query.scratch;
+  for (const char *p = src, *end = src + len; p < end; p++) {
+    int hi, lo;
+    if (*p == '+') {
+      *o++ = ' ';
+    } else if (*p == '%' && end - p > 2 && (hi = form_hex((uint8_t)p[1])) >= 0 && (lo = form_hex((uint8_t)p[2])) >= 0) {
+      *o++ = (char)(hi << 4 | lo);
+      p += 2;
+    } else {
+      *o++ = *p;
+    }
+  }
+  return o - query.scratch;
+}
+
+// Adds one key=value pair to params; esc says which side needs decoding
+static int query_param(JSContext *ctx, JSValueConst params, const char *key, size_t key_len,
+                       const char *value, size_t value_len, const int esc[2]) {
+  ssize_t n;
+  JSValue v;
+  if (esc[1]) {
+    if ((n = query_unescape(value, value_len)) < 0)
+      return -1;
+    v = JS_NewStringLen(ctx, query.scratch, (size_t)n);
+  } else {
+    v = JS_NewStringLen(ctx, value, value_len);
+  }
+  if (esc[0]) {
+    if ((n = query_unescape(key, key_len)) < 0) {
+      JS_FreeValue(ctx, v);
+      return -1;
+    }
+    key = query.scratch;
+    key_len = (size_t)n;
+  }
+  form_add(ctx, params, key, key_len, v);
+  return 0;
+}
+
+// Sets url, path and query on result from a request target. A key given
+// more than once gets an array of its values.
+static int http_set_target(JSContext *ctx, JSValue result, const char *target, size_t target_len) {
+  const char *end = target + target_len;
+  const char *mark = memchr(target, '?', target_len);
+  JSValue params = JS_NewObject(ctx);
+
+  // Each pair is key[..eq) and (eq..s), s its '&' or the end
+  const char *key = mark ? mark + 1 : end, *eq = NULL, *p = key;
+  int esc[2] = { 0, 0 }; // '%' or '+' in the key, in the value
+  while (key < end) {
+    const char *s = query_special(p, end);
+    if (s < end && *s != '&') {
+      if (*s != '=')
+        esc[eq != NULL] = 1;
+      else if (!eq)
+        eq = s;
+      p = s + 1;
+      continue;
+    }
+    if (s > key) {
+      const char *value = eq ? eq + 1 : s;
+      if (query_param(ctx, params, key, (size_t)((eq ? eq : s) - key), value, (size_t)(s - value), esc) < 0) {
+        JS_FreeValue(ctx, params);
+        return -1;
+      }
+    }
+    if (s == end)
+      break;
+    key = p = s + 1;
+    eq = NULL;
+    esc[0] = esc[1] = 0;
+  }
+
+  JS_SetPropertyStr(ctx, result, "url", JS_NewStringLen(ctx, target, target_len));
+  JS_SetPropertyStr(ctx, result, "path", JS_NewStringLen(ctx, target, mark ? (size_t)(mark - target) : target_len));
+  JS_SetPropertyStr(ctx, result, "query", params);
+  return 0;
+}
+
+// simd_enable(on) -> the scans now in use: "avx2", "sse2" or "scalar".
+// Off, the query and multipart scans take their byte loops, for comparing
+// the two; builds for other CPUs have only those.
+static JSValue js_simd_enable(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  simd_on = JS_ToBool(ctx, argv[0]);
+#if defined(__AVX2__)
+  return JS_NewString(ctx, simd_on ? "avx2" : "scalar");
+#elif defined(__SSE2__)
+  return JS_NewString(ctx, simd_on ? "sse2" : "scalar");
+#else
+  return JS_NewString(ctx, "scalar");
+#endif
+}
+
+// parse_http_request(data, fd) -> {method, url, path, query, headers, body, httpVersion}
+// data is a string or the bytes of the request; fd is optional and only
+// labels the trace span
+static JSValue js_parse_http_request(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  uint64_t started = metrics.enabled || trace.ring ? now_ns() : 0;
+  int fd = -1;
+  if (js_is_present(argc, argv, 1) && JS_ToInt32(ctx, &fd, argv[1]))
+    return JS_EXCEPTION;
+  size_t data_len;
+  const char *data = js_get_data(ctx, argv[0], &data_len);
+  if (!data)
+    return JS_EXCEPTION;
+
+  if (data_len == 0) {
+    js_free_data(ctx, argv[0], data);
+    return JS_ThrowInternalError(ctx, "Empty request data");
+  }
+
+  JSValue result = JS_NewObject(ctx);
+  JSValue headers = JS_NewObject(ctx);
+  
+  const char *p = data;
+  const char *end = data + data_len;
+
+  // Parse request line: METHOD URL HTTP/VERSION
+  const char *method_start = p;
+  while (p < end && *p != ' ') p++;
+  if (p >= end) goto error;
+  
+  JS_SetPropertyStr(ctx, result, "method", JS_NewStringLen(ctx, method_start, p - method_start));
+  p++; // skip space
+
+  // Parse URL
+  const char *url_start = p;
+  if (!(p = memchr(p, ' ', end - p))) goto error;
+  size_t url_len = p - url_start;
+
+  // Parse HTTP version (e.g., "HTTP/1.0" or "HTTP/1.1")
+  p++; // skip space
+  const char *version_start = p;
+  const char *eol = memchr(p, '\n', end - p);
+  p = eol ? eol + 1 : end;
+  size_t version_len = (eol ? eol : end) - version_start;
+  if (version_len > 0 && version_start[version_len - 1] == '\r')
+    version_len--;
+  JS_SetPropertyStr(ctx, result, "httpVersion", JS_NewStringLen(ctx, version_start, version_len));
+
+  if (http_set_target(ctx, result, url_start, url_len) < 0)
+    goto error;
+  
+  // Parse headers
+  http_head_info_t info;
+  p = http_parse_headers(ctx, p, end, headers, &info);
+  int64_t content_length = info.content_length;
+  const char *content_type = info.content_type;
+
+  JS_SetPropertyStr(ctx, result, "headers", headers);
+
+  // Parse body (p now points to start of body)
+  size_t body_len = 0;
+  if (content_length > 0 && p < end) {
+    size_t available = end - p;
+    body_len = (uint64_t)content_length < available ? (size_t)content_length : available;
+  }
+  http_set_body(ctx, result, p, body_len, content_type);
+
+  js_free_data(ctx, argv[0], data);
+  if (started) {
+    uint64_t done = now_ns();
+    if (metrics.enabled)
+      hist_record(&metrics.parse, done - started);
+    if (trace.ring)
+      trace_add(TRACE_PARSE, fd, started, done, (int32_t)data_len);
+    PROBE2(parse, data_len, done - started);
+  } else {
+    PROBE2(parse, data_len, 0);
+  }
+  return result;
+
+error:
+  js_free_data(ctx, argv[0], data);
+  JS_FreeValue(ctx, headers);
+  JS_FreeValue(ctx, result);
+  return JS_ThrowInternalError(ctx, "Invalid HTTP request");
+}
+
+// Decode a chunked body starting at p. Returns the first byte after the
+// trailers, or NULL if the body is not complete yet. Sets *bad on
+// malformed input; out receives the payload (caller frees).
+static const char *http_decode_chunked(const char *p, const char *end, char **out, size_t *out_len, int *bad) {
+  size_t cap = 0, len = 0;
+  char *buf = NULL;
+
+  *bad = 0;
+  for (;;) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol)
+      goto incomplete;
+
+    // chunk-size [; extensions] CRLF
+    uint64_t size = 0;
+    const char *q = p;
+    int digits = 0;
+    while (q < eol && isxdigit((unsigned char)*q)) {
+      int c = tolower((unsigned char)*q);
+      if (size >> 60) {
+        *bad = 1;
+        goto incomplete;
+      }
+      size = size * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+      q++;
+      digits++;
+    }
+    if (digits == 0 || (q < eol && *q != ';' && *q != '\r' && *q != ' ' && *q != '\t')) {
+      *bad = 1;
+      goto incomplete;
+    }
+    p = eol + 1;
+
+    if (size == 0) {
+      // Trailer fields until an empty line
+      for (;;) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol)
+          goto incomplete;
+        int empty = eol == p || (eol == p + 1 && *p == '\r');
+        p = eol + 1;
+        if (empty)
+          break;
+      }
+      *out = buf;
+      *out_len = len;
+      return p;
+    }
+
+    if ((uint64_t)(end - p) < size + 1)
+      goto incomplete;
+    if (len + size > cap) {
+      size_t ncap = cap ? cap : 4096;
+      while (ncap < len + size) ncap *= 2;
+      char *nbuf = realloc(buf, ncap);
+      if (!nbuf) {
+        *bad = 1;
+        goto incomplete;
+      }
+      buf = nbuf;
+      cap = ncap;
+    }
+    memcpy(buf + len, p, size);
+    len += size;
+    p += size;
+
+    // CRLF after the chunk data
+    if (*p == '\r') {
+      if (end - p < 2)
+        goto incomplete;
+      p++;
+    }
+    if (*p != '\n') {
+      *bad = 1;
+      goto incomplete;
+    }
+    p++;
+  }
+
+incomplete:
+  free(buf);
+  return NULL;
+}
+
+// parse_http_response(data, noBody, eof) -> {statusCode, statusText, httpVersion, headers, body, rest} | null
+// Returns null until data, a string or the bytes read, holds a complete
+// response. Bodies are framed by Content-Length, chunked encoding or, with
+// eof set, the end of the stream; noBody is for replies to HEAD. Interim
+// 1xx responses are skipped. body is a string, or an ArrayBuffer if it is
+// not UTF-8; rest holds any pipelined bytes that follow, as an ArrayBuffer
+// when data is bytes.
+static JSValue js_parse_http_response(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  size_t data_len;
+  int no_body = 0, eof = 0;
+  const char *data = js_get_data(ctx, argv[0], &data_len);
+  if (!data)
+    return JS_EXCEPTION;
+  if (argc > 1)
+    no_body = JS_ToBool(ctx, argv[1]);
+  if (argc > 2)
+    eof = JS_ToBool(ctx, argv[2]);
+
+  const char *p = data;
+  const char *end = data + data_len;
+  const char *head_end;
+  int status;
+
+  for (;;) {
+    // Wait for the whole head
+    head_end = NULL;
+    for (const char *q = p; q < end; q++) {
+      q = memchr(q, '\n', end - q);
+      if (!q)
+        break;
+      if (q + 1 < end && q[1] == '\n') {
+        head_end = q + 2;
+        break;
+      }
+      if (q + 2 < end && q[1] == '\r' && q[2] == '\n') {
+        head_end = q + 3;
+        break;
+      }
+    }
+    if (!head_end) {
+      js_free_data(ctx, argv[0], data);
+      if (data_len > MAX_RESPONSE_HEAD)
+        return JS_ThrowInternalError(ctx, "Response head too large");
+      return JS_NULL;
+    }
+
+    // Status line: HTTP/x.y SP 3DIGIT [SP reason]
+    if (end - p < 12 || memcmp(p, "HTTP/", 5) != 0 || p[8] != ' ' ||
+        !isdigit((unsigned char)p[9]) || !isdigit((unsigned char)p[10]) || !isdigit((unsigned char)p[11]))
+      goto error;
+    status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+
+    // 1xx (except 101 Switching Protocols) precede the real response
+    if (status >= 100 && status < 200 && status != 101) {
+      p = head_end;
+      continue;
+    }
+    break;
+  }
+
+  JSValue result = JS_NewObject(ctx);
+  JSValue headers = JS_NewObject(ctx);
+
+  const char *eol = memchr(p, '\n', end - p);
+  const char *reason = p + 12;
+  const char *reason_end = eol > reason && eol[-1] == '\r' ? eol - 1 : eol;
+  if (reason < reason_end && *reason == ' ') reason++;
+  if (reason > reason_end) reason = reason_end;
+
+  JS_SetPropertyStr(ctx, result, "statusCode", JS_NewInt32(ctx, status));
+  JS_SetPropertyStr(ctx, result, "statusText", JS_NewStringLen(ctx, reason, reason_end - reason));
+  JS_SetPropertyStr(ctx, result, "httpVersion", JS_NewStringLen(ctx, p, 8));
+
+  http_head_info_t info;
+  http_parse_headers(ctx, eol + 1, head_end, headers, &info);
+  JS_SetPropertyStr(ctx, result, "headers", headers);
+
+  const char *body_start = head_end;
+  const char *next;
+  char *decoded = NULL;
+  size_t body_len = 0;
+
+  if (no_body || status == 204 || status == 304 || status == 101) {
+    next = body_start;
+  } else if (info.chunked) {
+    int bad;
+    next = http_decode_chunked(body_start, end, &decoded, &body_len, &bad);
+    if (bad)
+      goto error_result;
+    if (!next)
+      goto incomplete;
+  } else if (info.content_length >= 0) {
+    if ((uint64_t)(end - body_start) < (uint64_t)info.content_length)
+      goto incomplete;
+    body_len = (size_t)info.content_length;
+    next = body_start + body_len;
+  } else {
+    // No framing: the body runs until the server closes the connection
+    if (!eof)
+      goto incomplete;
+    body_len = end - body_start;
+    next = end;
+  }
+
+  JS_SetPropertyStr(ctx, result, "body", http_body_value(ctx, decoded ? decoded : body_start, body_len));
+  JS_SetPropertyStr(ctx, result, "rest", JS_IsString(argv[0])
+                    ? JS_NewStringLen(ctx, next, end - next)
+                    : JS_NewArrayBufferCopy(ctx, (const uint8_t *)next, end - next));
+  free(decoded);
+  js_free_data(ctx, argv[0], data);
+  return result;
+
+incomplete:
+  JS_FreeValue(ctx, result);
+  js_free_data(ctx, argv[0], data);
+  return JS_NULL;
+
+error_result:
+  JS_FreeValue(ctx, result);
+error:
+  js_free_data(ctx, argv[0], data);
+  return JS_ThrowInternalError(ctx, "Invalid HTTP response");
+}
+
+// byte_length(string) -> UTF-8 length in bytes
+static JSValue js_byte_length(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  size_t len;
+  const char *str = JS_ToCStringLen(ctx, &len, argv[0]);
+  if (!str)
+    return JS_EXCEPTION;
+  JS_FreeCString(ctx, str);
+  return JS_NewInt64(ctx, len);
+}
+
+// getsockopt(sockfd, level, optname) -> optval
+static JSValue js_getsockopt(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int sockfd, level, optname, optval = 0;
+  socklen_t optlen = sizeof(optval);
+
+  if (JS_ToInt32(ctx, &sockfd, argv[0]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &level, argv[1]))
+    return JS_EXCEPTION;
+  if (JS_ToInt32(ctx, &optname, argv[2]))
+    return JS_EXCEPTION;
+
+  if (getsockopt(sockfd, level, optname, &optval, &optlen) < 0)
+    return JS_ThrowInternalError(ctx, "getsockopt() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, optval);
+}
+
+// get_error() -> returns current errno string
+static JSValue js_get_error(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  return JS_NewString(ctx, strerror(errno));
+}
+
+// is_connected(fd) -> returns boolean
+static JSValue js_is_connected(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  
+  // Get peer address
+  if (getpeername(fd, (struct sockaddr *)&sa, &len) < 0) {
+    return JS_NewBool(ctx, 0);
+  }
+  
+  // Check if socket is ready for writing (connected)
+  fd_set wfds;
+  struct timeval tv = {0, 0};
   
   FD_ZERO(&wfds);
   FD_SET(fd, &wfds);
@@ -659,8 +8503,4017 @@ static JSValue js_is_connected(JSContext *ctx, JSValueConst this_val, int argc,
     getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errlen);
     return JS_NewBool(ctx, error == 0);
   }
-  
-  return JS_NewBool(ctx, 0);
+  
+  return JS_NewBool(ctx, 0);
+}
+
+// Offload pool: worker threads with private QuickJS runtimes.
+// Jobs carry the function source and a serialized argument; results are
+// serialized back and handed to the main thread through an eventfd.
+typedef struct offload_job {
+  struct offload_job *next;
+  char *source;
+  size_t source_len;
+  uint8_t *input;
+  size_t input_len;
+  uint8_t *output;
+  size_t output_len;
+  char *error;
+  JSValue resolving_funcs[2]; // only touched by the main thread
+} offload_job_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  offload_job_t *queue_head, *queue_tail;
+  offload_job_t *done_head, *done_tail;
+  int nthreads;     // configured size, 0 = number of CPUs
+  int started;
+  int efd;
+} offload_pool_t;
+
+static offload_pool_t offload_pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  NULL, NULL, NULL, NULL, 0, 0, -1
+};
+
+typedef struct {
+  char *source;
+  size_t len;
+  JSValue fn;
+} offload_fn_entry_t;
+
+static char *offload_exception_string(JSContext *ctx) {
+  JSValue exc = JS_GetException(ctx);
+  const char *msg = JS_ToCString(ctx, exc);
+  char *err = strdup(msg ? msg : "offload job failed");
+  if (msg)
+    JS_FreeCString(ctx, msg);
+  JS_FreeValue(ctx, exc);
+  return err;
+}
+
+// Compile "(source)" once per worker and keep it in a small round-robin cache
+static JSValue offload_lookup_fn(JSContext *ctx, offload_fn_entry_t *cache, int *next_slot,
+                                 const char *source, size_t len) {
+  for (int i = 0; i < OFFLOAD_FN_CACHE; i++) {
+    if (cache[i].source && cache[i].len == len && memcmp(cache[i].source, source, len) == 0)
+      return JS_DupValue(ctx, cache[i].fn);
+  }
+
+  char *wrapped = malloc(len + 3);
+  if (!wrapped)
+    return JS_ThrowOutOfMemory(ctx);
+  wrapped[0] = '(';
+  memcpy(wrapped + 1, source, len);
+  wrapped[len + 1] = ')';
+  wrapped[len + 2] = '\0';
+  JSValue fn = JS_Eval(ctx, wrapped, len + 2, "<offload>", JS_EVAL_TYPE_GLOBAL);
+  free(wrapped);
+  if (JS_IsException(fn))
+    return fn;
+  if (!JS_IsFunction(ctx, fn)) {
+    JS_FreeValue(ctx, fn);
+    return JS_ThrowTypeError(ctx, "offload source is not a function");
+  }
+
+  offload_fn_entry_t *e = &cache[*next_slot];
+  *next_slot = (*next_slot + 1) % OFFLOAD_FN_CACHE;
+  if (e->source) {
+    free(e->source);
+    JS_FreeValue(ctx, e->fn);
+  }
+  e->source = malloc(len);
+  if (e->source) {
+    memcpy(e->source, source, len);
+    e->len = len;
+    e->fn = JS_DupValue(ctx, fn);
+  }
+  return fn;
+}
+
+static void offload_run_job(JSContext *ctx, offload_fn_entry_t *cache, int *next_slot, offload_job_t *job) {
+  JSRuntime *rt = JS_GetRuntime(ctx);
+  JSValue fn = offload_lookup_fn(ctx, cache, next_slot, job->source, job->source_len);
+  if (JS_IsException(fn)) {
+    job->error = offload_exception_string(ctx);
+    return;
+  }
+
+  JSValue arg = JS_ReadObject(ctx, job->input, job->input_len, 0);
+  if (JS_IsException(arg)) {
+    JS_FreeValue(ctx, fn);
+    job->error = offload_exception_string(ctx);
+    return;
+  }
+
+  JSValue ret = JS_Call(ctx, fn, JS_UNDEFINED, 1, (JSValueConst *)&arg);
+  JS_FreeValue(ctx, arg);
+  JS_FreeValue(ctx, fn);
+
+  // Async job functions settle entirely inside the worker
+  if (!JS_IsException(ret) && JS_IsObject(ret) && JS_PromiseState(ctx, ret) != (JSPromiseStateEnum)-1) {
+    JSContext *jctx;
+    while (JS_ExecutePendingJob(rt, &jctx) > 0) {}
+    JSPromiseStateEnum state = JS_PromiseState(ctx, ret);
+    JSValue settled = JS_PromiseResult(ctx, ret);
+    JS_FreeValue(ctx, ret);
+    if (state == JS_PROMISE_FULFILLED) {
+      ret = settled;
+    } else {
+      ret = JS_Throw(ctx, state == JS_PROMISE_REJECTED ? settled : JS_NewError(ctx));
+      if (state != JS_PROMISE_REJECTED)
+        JS_FreeValue(ctx, settled);
+    }
+  }
+
+  if (JS_IsException(ret)) {
+    job->error = offload_exception_string(ctx);
+    return;
+  }
+
+  size_t len;
+  uint8_t *buf = JS_WriteObject(ctx, &len, ret, 0);
+  JS_FreeValue(ctx, ret);
+  if (!buf) {
+    job->error = offload_exception_string(ctx);
+    return;
+  }
+
+  // Copy out of the worker heap; the main runtime frees it with free()
+  job->output = malloc(len);
+  if (job->output) {
+    memcpy(job->output, buf, len);
+    job->output_len = len;
+  } else {
+    job->error = strdup("out of memory");
+  }
+  js_free(ctx, buf);
+}
+
+static void *offload_worker(void *arg) {
+  (void)arg;
+  JSRuntime *rt = JS_NewRuntime();
+  JSContext *ctx = rt ? JS_NewContext(rt) : NULL;
+  offload_fn_entry_t cache[OFFLOAD_FN_CACHE];
+  int next_slot = 0;
+  memset(cache, 0, sizeof(cache));
+
+  for (;;) {
+    pthread_mutex_lock(&offload_pool.lock);
+    while (!offload_pool.queue_head)
+      pthread_cond_wait(&offload_pool.cond, &offload_pool.lock);
+    offload_job_t *job = offload_pool.queue_head;
+    offload_pool.queue_head = job->next;
+    if (!offload_pool.queue_head)
+      offload_pool.queue_tail = NULL;
+    pthread_mutex_unlock(&offload_pool.lock);
+
+    job->next = NULL;
+    if (ctx)
+      offload_run_job(ctx, cache, &next_slot, job);
+    else
+      job->error = strdup("offload worker has no JS context");
+
+    pthread_mutex_lock(&offload_pool.lock);
+    if (offload_pool.done_tail)
+      offload_pool.done_tail->next = job;
+    else
+      offload_pool.done_head = job;
+    offload_pool.done_tail = job;
+    pthread_mutex_unlock(&offload_pool.lock);
+
+    uint64_t one = 1;
+    ssize_t w = write(offload_pool.efd, &one, sizeof(one));
+    (void)w;
+  }
+  return NULL;
+}
+
+static int offload_open_eventfd(JSContext *ctx) {
+  if (offload_pool.efd >= 0)
+    return 0;
+  offload_pool.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (offload_pool.efd < 0) {
+    JS_ThrowInternalError(ctx, "eventfd() failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int offload_start(JSContext *ctx) {
+  if (offload_pool.started)
+    return 0;
+  if (offload_open_eventfd(ctx) < 0)
+    return -1;
+
+  int n = offload_pool.nthreads;
+  if (n <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = cpus > 0 ? (int)cpus : 2;
+  }
+  if (n > OFFLOAD_MAX_THREADS)
+    n = OFFLOAD_MAX_THREADS;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int created = 0;
+  for (int i = 0; i < n; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, &attr, offload_worker, NULL) == 0)
+      created++;
+  }
+  pthread_attr_destroy(&attr);
+
+  if (created == 0) {
+    JS_ThrowInternalError(ctx, "pthread_create() failed");
+    return -1;
+  }
+
+  offload_pool.nthreads = created;
+  offload_pool.started = 1;
+  return 0;
+}
+
+// offload_init(threads) -> 0
+static JSValue js_offload_init(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int threads;
+
+  if (JS_ToInt32(ctx, &threads, argv[0]))
+    return JS_EXCEPTION;
+
+  if (offload_pool.started)
+    return JS_ThrowInternalError(ctx, "offload pool already started");
+
+  offload_pool.nthreads = threads;
+  return JS_NewInt32(ctx, 0);
+}
+
+// offload_fd() -> eventfd that becomes readable when jobs complete
+static JSValue js_offload_fd(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  if (offload_open_eventfd(ctx) < 0)
+    return JS_EXCEPTION;
+  return JS_NewInt32(ctx, offload_pool.efd);
+}
+
+// offload(fn, data) -> Promise resolved with fn(data) computed on a worker thread
+static JSValue js_offload(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  if (!JS_IsFunction(ctx, argv[0]))
+    return JS_ThrowTypeError(ctx, "offload() expects a function");
+
+  if (offload_start(ctx) < 0)
+    return JS_EXCEPTION;
+
+  offload_job_t *job = calloc(1, sizeof(*job));
+  if (!job)
+    return JS_ThrowOutOfMemory(ctx);
+
+  size_t source_len;
+  const char *source = JS_ToCStringLen(ctx, &source_len, argv[0]);
+  if (!source) {
+    free(job);
+    return JS_EXCEPTION;
+  }
+  job->source = malloc(source_len);
+  if (job->source)
+    memcpy(job->source, source, source_len);
+  job->source_len = source_len;
+  JS_FreeCString(ctx, source);
+
+  size_t input_len;
+  uint8_t *input = JS_WriteObject(ctx, &input_len, argc > 1 ? argv[1] : JS_UNDEFINED, 0);
+  if (!input) {
+    free(job->source);
+    free(job);
+    return JS_EXCEPTION;
+  }
+  job->input = malloc(input_len);
+  if (job->input)
+    memcpy(job->input, input, input_len);
+  job->input_len = input_len;
+  js_free(ctx, input);
+
+  if (!job->source || !job->input) {
+    free(job->source);
+    free(job->input);
+    free(job);
+    return JS_ThrowOutOfMemory(ctx);
+  }
+
+  JSValue promise = JS_NewPromiseCapability(ctx, job->resolving_funcs);
+  if (JS_IsException(promise)) {
+    free(job->source);
+    free(job->input);
+    free(job);
+    return promise;
+  }
+
+  pthread_mutex_lock(&offload_pool.lock);
+  if (offload_pool.queue_tail)
+    offload_pool.queue_tail->next = job;
+  else
+    offload_pool.queue_head = job;
+  offload_pool.queue_tail = job;
+  pthread_cond_signal(&offload_pool.cond);
+  pthread_mutex_unlock(&offload_pool.lock);
+
+  return promise;
+}
+
+// offload_poll() -> number of settled jobs
+static JSValue js_offload_poll(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  if (offload_pool.efd < 0)
+    return JS_NewInt32(ctx, 0);
+
+  uint64_t count;
+  ssize_t r = read(offload_pool.efd, &count, sizeof(count));
+  (void)r;
+
+  pthread_mutex_lock(&offload_pool.lock);
+  offload_job_t *job = offload_pool.done_head;
+  offload_pool.done_head = offload_pool.done_tail = NULL;
+  pthread_mutex_unlock(&offload_pool.lock);
+
+  int settled = 0;
+  while (job) {
+    offload_job_t *next = job->next;
+    JSValue value;
+    int fulfilled = 0;
+
+    if (job->error) {
+      value = JS_NewError(ctx);
+      JS_SetPropertyStr(ctx, value, "message", JS_NewString(ctx, job->error));
+    } else {
+      value = JS_ReadObject(ctx, job->output, job->output_len, 0);
+      if (JS_IsException(value))
+        value = JS_GetException(ctx);
+      else
+        fulfilled = 1;
+    }
+
+    JSValue ret = JS_Call(ctx, job->resolving_funcs[fulfilled ? 0 : 1], JS_UNDEFINED, 1, (JSValueConst *)&value);
+    JS_FreeValue(ctx, ret);
+    JS_FreeValue(ctx, value);
+    JS_FreeValue(ctx, job->resolving_funcs[0]);
+    JS_FreeValue(ctx, job->resolving_funcs[1]);
+
+    free(job->source);
+    free(job->input);
+    free(job->output);
+    free(job->error);
+    free(job);
+    job = next;
+    settled++;
+  }
+
+  return JS_NewInt32(ctx, settled);
+}
+
+// now_us() -> monotonic clock in microseconds (fractional)
+static JSValue js_now_us(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  return JS_NewFloat64(ctx, (double)now_ns() / 1000.0);
+}
+
+// metrics_request(status, startUs, readyUs) counts one response once it has
+// been sent. startUs (handler called) and readyUs (response built) come from
+// now_us(); without them only the status is counted.
+static JSValue js_metrics_request(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int status;
+  double start_us = -1, ready_us = -1;
+
+  if (JS_ToInt32(ctx, &status, argv[0]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 1) && JS_ToFloat64(ctx, &start_us, argv[1]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 2) && JS_ToFloat64(ctx, &ready_us, argv[2]))
+    return JS_EXCEPTION;
+
+  METRIC_ADD(metrics.requests, 1);
+  METRIC_ADD(metrics.status[status >= 100 && status < METRICS_STATUS_MAX ? status : 0], 1);
+  if (metrics.enabled && start_us >= 0 && ready_us >= start_us) {
+    double now_us = (double)now_ns() / 1000.0;
+    uint64_t handler_ns = (uint64_t)((ready_us - start_us) * 1000.0);
+    uint64_t send_ns = now_us >= ready_us ? (uint64_t)((now_us - ready_us) * 1000.0) : 0;
+    hist_record(&metrics.handler, handler_ns);
+    hist_record(&metrics.send, send_ns);
+    PROBE3(response, status, handler_ns, send_ns);
+  } else {
+    PROBE3(response, status, 0, 0);
+  }
+
+  return JS_UNDEFINED;
+}
+
+// divisor turns nanoseconds into microseconds; 1 for plain counts
+static JSValue metrics_hist_to_js(JSContext *ctx, const metrics_hist_t *h, double divisor) {
+  JSValue obj = JS_NewObject(ctx);
+  uint64_t count = METRIC_LOAD(h->count);
+  double min = 0, max = 0, mean = 0, p50 = 0, p90 = 0, p99 = 0, p999 = 0;
+
+  if (count > 0) {
+    min = (double)~METRIC_LOAD(h->min_inv) / divisor;
+    max = (double)METRIC_LOAD(h->max) / divisor;
+    mean = (double)METRIC_LOAD(h->sum) / (double)count / divisor;
+    p50 = (double)hist_percentile(h, count, 0.5) / divisor;
+    p90 = (double)hist_percentile(h, count, 0.9) / divisor;
+    p99 = (double)hist_percentile(h, count, 0.99) / divisor;
+    p999 = (double)hist_percentile(h, count, 0.999) / divisor;
+  }
+
+  JS_SetPropertyStr(ctx, obj, "count", JS_NewInt64(ctx, (int64_t)count));
+  JS_SetPropertyStr(ctx, obj, "min", JS_NewFloat64(ctx, min));
+  JS_SetPropertyStr(ctx, obj, "max", JS_NewFloat64(ctx, max));
+  JS_SetPropertyStr(ctx, obj, "mean", JS_NewFloat64(ctx, mean));
+  JS_SetPropertyStr(ctx, obj, "p50", JS_NewFloat64(ctx, p50));
+  JS_SetPropertyStr(ctx, obj, "p90", JS_NewFloat64(ctx, p90));
+  JS_SetPropertyStr(ctx, obj, "p99", JS_NewFloat64(ctx, p99));
+  JS_SetPropertyStr(ctx, obj, "p999", JS_NewFloat64(ctx, p999));
+  return obj;
+}
+
+// metrics() -> {accepts, activeConnections, bytesIn, bytesOut, requests, status,
+//               parseUs, handlerUs, sendUs, loopLagUs, queueUs, epollBatch, gcUs,
+//               gcIdle, uptimeMs, enabled}
+static JSValue js_metrics(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  JSValue status = JS_NewObject(ctx);
+
+  for (int i = 0; i < METRICS_STATUS_MAX; i++) {
+    uint64_t n = METRIC_LOAD(metrics.status[i]);
+    if (n > 0)
+      JS_SetPropertyUint32(ctx, status, (uint32_t)i, JS_NewInt64(ctx, (int64_t)n));
+  }
+
+  JS_SetPropertyStr(ctx, obj, "enabled", JS_NewBool(ctx, metrics.enabled));
+  JS_SetPropertyStr(ctx, obj, "uptimeMs", JS_NewFloat64(ctx, (double)(now_ns() - metrics.started) / 1e6));
+  JS_SetPropertyStr(ctx, obj, "accepts", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(metrics.accepts)));
+  JS_SetPropertyStr(ctx, obj, "activeConnections", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(metrics.active)));
+  JS_SetPropertyStr(ctx, obj, "bytesIn", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(metrics.bytes_in)));
+  JS_SetPropertyStr(ctx, obj, "bytesOut", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(metrics.bytes_out)));
+  JS_SetPropertyStr(ctx, obj, "requests", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(metrics.requests)));
+  JS_SetPropertyStr(ctx, obj, "status", status);
+  JS_SetPropertyStr(ctx, obj, "parseUs", metrics_hist_to_js(ctx, &metrics.parse, 1000.0));
+  JS_SetPropertyStr(ctx, obj, "handlerUs", metrics_hist_to_js(ctx, &metrics.handler, 1000.0));
+  JS_SetPropertyStr(ctx, obj, "sendUs", metrics_hist_to_js(ctx, &metrics.send, 1000.0));
+  JS_SetPropertyStr(ctx, obj, "loopLagUs", metrics_hist_to_js(ctx, &metrics.loop_lag, 1000.0));
+  JS_SetPropertyStr(ctx, obj, "queueUs", metrics_hist_to_js(ctx, &metrics.queue, 1000.0));
+  JS_SetPropertyStr(ctx, obj, "epollBatch", metrics_hist_to_js(ctx, &metrics.epoll_batch, 1.0));
+  JS_SetPropertyStr(ctx, obj, "gcUs", metrics_hist_to_js(ctx, &metrics.gc, 1000.0));
+  JS_SetPropertyStr(ctx, obj, "gcIdle", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(metrics.gc_idle)));
+  return obj;
+}
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+} metrics_text_t;
+
+static void metrics_text_printf(metrics_text_t *t, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    t->len = t->len + (size_t)n < t->cap ? t->len + (size_t)n : t->cap - 1;
+}
+
+static void metrics_text_hist(metrics_text_t *t, const char *name, const metrics_hist_t *h, double divisor) {
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  uint64_t count = METRIC_LOAD(h->count);
+
+  metrics_text_printf(t, "# TYPE %s summary\n", name);
+  for (size_t i = 0; i < countof(quantiles); i++) {
+    double v = count ? (double)hist_percentile(h, count, quantiles[i]) / divisor : 0;
+    metrics_text_printf(t, "%s{quantile=\"%g\"} %.9g\n", name, quantiles[i], v);
+  }
+  metrics_text_printf(t, "%s_sum %.9g\n", name, (double)METRIC_LOAD(h->sum) / divisor);
+  metrics_text_printf(t, "%s_count %llu\n", name, (unsigned long long)count);
+}
+
+// metrics_text() -> metrics() in the Prometheus text format
+static JSValue js_metrics_text(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  static const struct { const char *name; const char *type; uint64_t *value; } scalars[] = {
+    { "qjs_accepts_total", "counter", &metrics.accepts },
+    { "qjs_active_connections", "gauge", &metrics.active },
+    { "qjs_bytes_in_total", "counter", &metrics.bytes_in },
+    { "qjs_bytes_out_total", "counter", &metrics.bytes_out },
+  };
+  metrics_text_t t = { malloc(METRICS_TEXT_MAX), 0, METRICS_TEXT_MAX };
+  if (!t.buf)
+    return JS_ThrowOutOfMemory(ctx);
+  t.buf[0] = '\0';
+
+  for (size_t i = 0; i < countof(scalars); i++) {
+    metrics_text_printf(&t, "# TYPE %s %s\n%s %llu\n", scalars[i].name, scalars[i].type,
+                        scalars[i].name, (unsigned long long)METRIC_LOAD(*scalars[i].value));
+  }
+
+  metrics_text_printf(&t, "# TYPE qjs_requests_total counter\n");
+  for (int i = 0; i < METRICS_STATUS_MAX; i++) {
+    unsigned long long n = METRIC_LOAD(metrics.status[i]);
+    if (n > 0 && i > 0)
+      metrics_text_printf(&t, "qjs_requests_total{status=\"%d\"} %llu\n", i, n);
+    else if (n > 0)
+      metrics_text_printf(&t, "qjs_requests_total{status=\"other\"} %llu\n", n);
+  }
+
+  metrics_text_hist(&t, "qjs_parse_seconds", &metrics.parse, 1e9);
+  metrics_text_hist(&t, "qjs_handler_seconds", &metrics.handler, 1e9);
+  metrics_text_hist(&t, "qjs_send_seconds", &metrics.send, 1e9);
+  metrics_text_hist(&t, "qjs_loop_lag_seconds", &metrics.loop_lag, 1e9);
+  metrics_text_hist(&t, "qjs_queue_delay_seconds", &metrics.queue, 1e9);
+  metrics_text_hist(&t, "qjs_epoll_batch_size", &metrics.epoll_batch, 1.0);
+  metrics_text_hist(&t, "qjs_gc_seconds", &metrics.gc, 1e9);
+  metrics_text_printf(&t, "# TYPE qjs_gc_idle_total counter\nqjs_gc_idle_total %llu\n",
+                      (unsigned long long)METRIC_LOAD(metrics.gc_idle));
+
+  JSValue result = JS_NewStringLen(ctx, t.buf, t.len);
+  free(t.buf);
+  return result;
+}
+
+// metrics_enable(on) -> previous setting. Off skips the clock reads behind
+// the latency histograms; counters keep running.
+static JSValue js_metrics_enable(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int previous = metrics.enabled;
+  int on = JS_ToBool(ctx, argv[0]);
+  if (on < 0)
+    return JS_EXCEPTION;
+  metrics.enabled = on;
+  metrics.loop_mark = 0;
+  return JS_NewBool(ctx, previous);
+}
+
+// metrics_reset() zeroes counters and histograms; activeConnections is kept
+static JSValue js_metrics_reset(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  metrics.accepts = 0;
+  metrics.bytes_in = 0;
+  metrics.bytes_out = 0;
+  metrics.requests = 0;
+  memset(metrics.status, 0, sizeof(metrics.status));
+  memset(&metrics.parse, 0, sizeof(metrics.parse));
+  memset(&metrics.handler, 0, sizeof(metrics.handler));
+  memset(&metrics.send, 0, sizeof(metrics.send));
+  memset(&metrics.loop_lag, 0, sizeof(metrics.loop_lag));
+  memset(&metrics.queue, 0, sizeof(metrics.queue));
+  memset(&metrics.epoll_batch, 0, sizeof(metrics.epoll_batch));
+  memset(&metrics.gc, 0, sizeof(metrics.gc));
+  metrics.gc_idle = 0;
+  metrics.loop_mark = 0;
+  metrics.started = now_ns();
+  return JS_UNDEFINED;
+}
+
+// trace_enable(records) -> 0. Keeps the last records phase spans (rounded up
+// to a power of two); 0 turns tracing off and drops the ring.
+static JSValue js_trace_enable(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int64_t records;
+
+  if (JS_ToInt64(ctx, &records, argv[0]))
+    return JS_EXCEPTION;
+  if (records < 0 || records > TRACE_MAX_RECORDS)
+    return JS_ThrowRangeError(ctx, "records must be between 0 and %d", TRACE_MAX_RECORDS);
+  if (trace_set_capacity((uint64_t)records) < 0)
+    return JS_ThrowOutOfMemory(ctx);
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// trace_enabled() -> boolean
+static JSValue js_trace_enabled(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  return JS_NewBool(ctx, trace.ring != NULL);
+}
+
+// trace_request(fd, status, startUs, routedUs, readyUs) records the route,
+// handler and write spans of a response that has just been sent
+static JSValue js_trace_request(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, status;
+  double start_us, routed_us, ready_us;
+
+  if (!trace.ring)
+    return JS_UNDEFINED;
+  if (JS_ToInt32(ctx, &fd, argv[0]) || JS_ToInt32(ctx, &status, argv[1]))
+    return JS_EXCEPTION;
+  if (JS_ToFloat64(ctx, &start_us, argv[2]) || JS_ToFloat64(ctx, &routed_us, argv[3]) ||
+      JS_ToFloat64(ctx, &ready_us, argv[4]))
+    return JS_EXCEPTION;
+
+  uint64_t start = (uint64_t)(start_us * 1000.0);
+  uint64_t ready = (uint64_t)(ready_us * 1000.0);
+  uint64_t routed = routed_us >= start_us && routed_us <= ready_us ? (uint64_t)(routed_us * 1000.0) : start;
+
+  trace_add(TRACE_ROUTE, fd, start, routed, status);
+  trace_add(TRACE_HANDLER, fd, routed, ready, status);
+  trace_add(TRACE_WRITE, fd, ready, now_ns(), status);
+  return JS_UNDEFINED;
+}
+
+// trace_dump(path) -> spans written, or trace_dump() -> Chrome trace JSON
+static JSValue js_trace_dump(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  if (!trace.ring)
+    return JS_ThrowInternalError(ctx, "tracing is not enabled");
+
+  if (js_is_present(argc, argv, 0)) {
+    const char *path = JS_ToCString(ctx, argv[0]);
+    if (!path)
+      return JS_EXCEPTION;
+    FILE *f = fopen(path, "w");
+    if (!f) {
+      JSValue err = JS_ThrowInternalError(ctx, "fopen(%s) failed: %s", path, strerror(errno));
+      JS_FreeCString(ctx, path);
+      return err;
+    }
+    JS_FreeCString(ctx, path);
+    uint64_t count = trace_write_json(f);
+    fclose(f);
+    return JS_NewInt64(ctx, (int64_t)count);
+  }
+
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&buf, &len);
+  if (!f)
+    return JS_ThrowOutOfMemory(ctx);
+  trace_write_json(f);
+  fclose(f);
+  JSValue result = JS_NewStringLen(ctx, buf, len);
+  free(buf);
+  return result;
+}
+
+// Access log
+//
+// log_access() copies a fixed-size record into a single-producer ring and
+// returns; a writer thread formats records and appends them with O_APPEND
+// in batches of up to LOG_BATCH bytes, so the loop never formats dates or
+// makes syscalls for logging. A full ring drops (and counts) records
+// rather than stalling requests. Batches end on line boundaries, so
+// cluster workers can share one file. SIGHUP or log_reopen() reopens the
+// path after logrotate has moved the file.
+#define LOG_TEXT_MAX 256
+#define LOG_METHOD_MAX 16
+#define LOG_ADDR_MAX 48
+#define LOG_LINE_MAX (LOG_TEXT_MAX + LOG_METHOD_MAX + LOG_ADDR_MAX + 96)
+#define LOG_BATCH 65536
+#define LOG_DEFAULT_RECORDS 8192
+#define LOG_MAX_RECORDS (1 << 20)
+#define LOG_FLUSH_MS 50
+
+typedef struct {
+  int64_t time_us;     // wall clock
+  uint32_t duration_us;
+  uint32_t bytes;
+  int32_t status;      // 0: text is a plain message
+  char method[LOG_METHOD_MAX];
+  char addr[LOG_ADDR_MAX];
+  char text[LOG_TEXT_MAX];
+} log_record_t;
+
+static struct {
+  log_record_t *ring;
+  uint64_t mask;
+  uint64_t head;       // written by the loop thread
+  uint64_t tail;       // written by the writer thread
+  int fd;
+  char *path;
+  pthread_t thread;
+  int running;
+  int sighup_installed;
+  uint32_t sample;     // keep 1 in sample responses below 400
+  uint32_t sample_tick;
+  uint64_t written;
+  uint64_t dropped;
+  uint64_t sampled;
+  uint64_t write_errors;
+  volatile sig_atomic_t reopen;
+} access_log = { .fd = -1 };
+
+static void log_copy(char *dst, size_t cap, const char *src, size_t len) {
+  if (len >= cap)
+    len = cap - 1;
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+}
+
+// Slot for the next record, or NULL when the writer has fallen behind
+static log_record_t *log_reserve(void) {
+  uint64_t tail = __atomic_load_n(&access_log.tail, __ATOMIC_ACQUIRE);
+  if (access_log.head - tail > access_log.mask) {
+    METRIC_ADD(access_log.dropped, 1);
+    return NULL;
+  }
+  return &access_log.ring[access_log.head & access_log.mask];
+}
+
+static void log_commit(void) {
+  __atomic_store_n(&access_log.head, access_log.head + 1, __ATOMIC_RELEASE);
+}
+
+static void log_flush(char *buf, size_t *len) {
+  size_t off = 0;
+  while (off < *len) {
+    ssize_t n = write(access_log.fd, buf + off, *len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      METRIC_ADD(access_log.write_errors, 1);
+      break;
+    }
+    off += (size_t)n;
+  }
+  *len = 0;
+}
+
+static int log_open_file(const char *path) {
+  return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+static void *log_writer(void *arg) {
+  char *buf = malloc(LOG_BATCH);
+  size_t len = 0;
+  char date[40] = "";
+  time_t date_sec = -1;
+
+  for (;;) {
+    int running = __atomic_load_n(&access_log.running, __ATOMIC_ACQUIRE);
+
+    if (access_log.reopen) {
+      access_log.reopen = 0;
+      int fd = log_open_file(access_log.path);
+      if (fd >= 0) {
+        close(access_log.fd);
+        access_log.fd = fd;
+      }
+    }
+
+    uint64_t head = __atomic_load_n(&access_log.head, __ATOMIC_ACQUIRE);
+    uint64_t tail = access_log.tail;
+    while (buf && tail != head) {
+      const log_record_t *r = &access_log.ring[tail & access_log.mask];
+      time_t sec = (time_t)(r->time_us / 1000000);
+      if (sec != date_sec) {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        date_sec = sec;
+      }
+
+      if (len + LOG_LINE_MAX > LOG_BATCH)
+        log_flush(buf, &len);
+      int n;
+      if (r->status) {
+        n = snprintf(buf + len, LOG_BATCH - len, "%s - - [%s] \"%s %s\" %d %u %uus\n",
+                     r->addr, date, r->method, r->text, r->status, r->bytes, r->duration_us);
+      } else {
+        n = snprintf(buf + len, LOG_BATCH - len, "[%s] %s\n", date, r->text);
+      }
+      if (n > 0)
+        len += (size_t)n < LOG_BATCH - len ? (size_t)n : LOG_BATCH - len - 1;
+
+      tail++;
+      __atomic_store_n(&access_log.tail, tail, __ATOMIC_RELEASE);
+      METRIC_ADD(access_log.written, 1);
+    }
+    if (len > 0)
+      log_flush(buf, &len);
+
+    if (!running)
+      break;
+    struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+    nanosleep(&ts, NULL);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+static void log_on_sighup(int sig) {
+  access_log.reopen = 1;
+}
+
+static void log_stop(void) {
+  if (!access_log.ring)
+    return;
+  __atomic_store_n(&access_log.running, 0, __ATOMIC_RELEASE);
+  pthread_join(access_log.thread, NULL);
+  close(access_log.fd);
+  free(access_log.ring);
+  free(access_log.path);
+  access_log.ring = NULL;
+  access_log.path = NULL;
+  access_log.fd = -1;
+}
+
+// log_open(path, {records, sample}) -> 0. Starts the writer thread; records
+// is the ring size (8192), sample keeps 1 in N responses below 400.
+static JSValue js_log_open(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int64_t records = LOG_DEFAULT_RECORDS;
+  int32_t sample = 1;
+
+  if (js_is_present(argc, argv, 1)) {
+    JSValue v = JS_GetPropertyStr(ctx, argv[1], "records");
+    int r = JS_IsUndefined(v) ? 0 : JS_ToInt64(ctx, &records, v);
+    JS_FreeValue(ctx, v);
+    if (r)
+      return JS_EXCEPTION;
+    v = JS_GetPropertyStr(ctx, argv[1], "sample");
+    r = JS_IsUndefined(v) ? 0 : JS_ToInt32(ctx, &sample, v);
+    JS_FreeValue(ctx, v);
+    if (r)
+      return JS_EXCEPTION;
+  }
+  if (records < 1 || records > LOG_MAX_RECORDS)
+    return JS_ThrowRangeError(ctx, "records must be between 1 and %d", LOG_MAX_RECORDS);
+  if (sample < 1)
+    return JS_ThrowRangeError(ctx, "sample must be at least 1");
+
+  const char *path = JS_ToCString(ctx, argv[0]);
+  if (!path)
+    return JS_EXCEPTION;
+  int fd = log_open_file(path);
+  if (fd < 0) {
+    JSValue err = JS_ThrowInternalError(ctx, "open(%s) failed: %s", path, strerror(errno));
+    JS_FreeCString(ctx, path);
+    return err;
+  }
+
+  log_stop();
+
+  uint64_t cap = 1;
+  while (cap < (uint64_t)records) cap <<= 1;
+  access_log.ring = calloc(cap, sizeof(log_record_t));
+  access_log.path = strdup(path);
+  JS_FreeCString(ctx, path);
+  if (!access_log.ring || !access_log.path) {
+    close(fd);
+    free(access_log.ring);
+    free(access_log.path);
+    access_log.ring = NULL;
+    access_log.path = NULL;
+    return JS_ThrowOutOfMemory(ctx);
+  }
+  access_log.mask = cap - 1;
+  access_log.head = access_log.tail = 0;
+  access_log.fd = fd;
+  access_log.sample = (uint32_t)sample;
+  access_log.running = 1;
+
+  if (pthread_create(&access_log.thread, NULL, log_writer, NULL) != 0) {
+    access_log.running = 0;
+    close(fd);
+    free(access_log.ring);
+    free(access_log.path);
+    access_log.ring = NULL;
+    access_log.path = NULL;
+    access_log.fd = -1;
+    return JS_ThrowInternalError(ctx, "pthread_create() failed");
+  }
+
+  if (!access_log.sighup_installed) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = log_on_sighup;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, NULL);
+    access_log.sighup_installed = 1;
+  }
+
+  return JS_NewInt32(ctx, 0);
+}
+
+static int64_t log_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Copies a JS string into a record field, truncating it to fit
+static int log_copy_js(JSContext *ctx, char *dst, size_t cap, JSValueConst val) {
+  size_t len;
+  const char *s = JS_ToCStringLen(ctx, &len, val);
+  if (!s)
+    return -1;
+  log_copy(dst, cap, s, len);
+  JS_FreeCString(ctx, s);
+  return 0;
+}
+
+// log_access(address, method, url, status, bytes, startUs) -> queued
+// startUs comes from now_us(); the duration runs until this call
+static JSValue js_log_access(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int32_t status, bytes = 0;
+  double start_us = -1;
+
+  if (!access_log.ring)
+    return JS_FALSE;
+  if (JS_ToInt32(ctx, &status, argv[3]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 4) && JS_ToInt32(ctx, &bytes, argv[4]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 5) && JS_ToFloat64(ctx, &start_us, argv[5]))
+    return JS_EXCEPTION;
+
+  if (status < 400 && access_log.sample > 1 && ++access_log.sample_tick % access_log.sample) {
+    METRIC_ADD(access_log.sampled, 1);
+    return JS_FALSE;
+  }
+
+  log_record_t *r = log_reserve();
+  if (!r)
+    return JS_FALSE;
+  if (log_copy_js(ctx, r->addr, sizeof(r->addr), argv[0]) < 0 ||
+      log_copy_js(ctx, r->method, sizeof(r->method), argv[1]) < 0 ||
+      log_copy_js(ctx, r->text, sizeof(r->text), argv[2]) < 0)
+    return JS_EXCEPTION;
+
+  double now_us = (double)now_ns() / 1000.0;
+  r->time_us = log_now_us();
+  r->status = status > 0 ? status : 1;
+  r->bytes = bytes > 0 ? (uint32_t)bytes : 0;
+  r->duration_us = start_us >= 0 && now_us >= start_us ? (uint32_t)(now_us - start_us) : 0;
+  log_commit();
+  return JS_TRUE;
+}
+
+// log_message(text) -> queued. Logs "[date] text"; never sampled.
+static JSValue js_log_message(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  if (!access_log.ring)
+    return JS_FALSE;
+
+  log_record_t *r = log_reserve();
+  if (!r)
+    return JS_FALSE;
+  if (log_copy_js(ctx, r->text, sizeof(r->text), argv[0]) < 0)
+    return JS_EXCEPTION;
+
+  r->time_us = log_now_us();
+  r->status = 0;
+  log_commit();
+  return JS_TRUE;
+}
+
+// log_reopen() -> 0, as on SIGHUP
+static JSValue js_log_reopen(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  access_log.reopen = 1;
+  return JS_NewInt32(ctx, 0);
+}
+
+// log_close() -> 0. Writes out everything queued and stops the writer.
+static JSValue js_log_close(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  log_stop();
+  return JS_NewInt32(ctx, 0);
+}
+
+// log_stats() -> {written, queued, dropped, sampled, writeErrors}
+static JSValue js_log_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  uint64_t tail = __atomic_load_n(&access_log.tail, __ATOMIC_ACQUIRE);
+
+  JS_SetPropertyStr(ctx, obj, "written", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(access_log.written)));
+  JS_SetPropertyStr(ctx, obj, "queued", JS_NewInt64(ctx, (int64_t)(access_log.head - tail)));
+  JS_SetPropertyStr(ctx, obj, "dropped", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(access_log.dropped)));
+  JS_SetPropertyStr(ctx, obj, "sampled", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(access_log.sampled)));
+  JS_SetPropertyStr(ctx, obj, "writeErrors", JS_NewInt64(ctx, (int64_t)METRIC_LOAD(access_log.write_errors)));
+  return obj;
+}
+
+// Response cache
+//
+// Handlers opt in with res.cache(ttlMs); after the response is sent,
+// cache_store() keeps the serialized bytes under "METHOD target" plus the
+// request's values for the headers the handler named in vary. The loop
+// offers every buffered keep-alive GET/HEAD to cache_serve() before
+// parsing it, and a hit is written to the socket from here, so the request
+// never becomes a JS object. The Date header is rewritten in place once a
+// second. After the TTL an entry is stale: the first request is let through
+// to regenerate it while the rest keep getting the stale copy, until the
+// new one is stored or the stale window ends. Entries are evicted least
+// recently used first once they exceed the byte budget.
+#define RESP_CACHE_BUCKETS 1024
+#define RESP_CACHE_DEFAULT_BYTES (16 << 20)
+#define RESP_CACHE_MAX_VARY 8
+#define RESP_CACHE_REFRESH_NS 1000000000ull // let another request regenerate after 1s
+#define RESP_CACHE_DATE_LEN 29              // "Sun, 18 Oct 2026 10:00:00 GMT"
+
+typedef struct resp_cache_entry {
+  struct resp_cache_entry *next; // bucket chain
+  struct resp_cache_entry *lru_prev, *lru_next;
+  uint32_t hash;
+  int status;
+  uint64_t expires;              // now_ns()
+  uint64_t stale_until;
+  uint64_t refreshing;           // when a request was let through to regenerate, 0 if none
+  int64_t date_sec;              // wall-clock second in the Date header
+  size_t date_off;               // offset of the Date value, 0 if there is none
+  size_t key_len;                // "METHOD target"
+  size_t vary_len;               // "name\nvalue\n" for each vary header
+  size_t size;                   // response bytes
+  char data[];                   // key, vary, response
+} resp_cache_entry_t;
+
+static struct {
+  resp_cache_entry_t *buckets[RESP_CACHE_BUCKETS];
+  resp_cache_entry_t *lru_head, *lru_tail; // most recently used first
+  size_t bytes;
+  size_t max_bytes;
+  uint32_t entries;
+  uint64_t hits;
+  uint64_t stale_hits;
+  uint64_t misses;
+  uint64_t refreshes;
+  uint64_t stores;
+  uint64_t evictions;
+} resp_cache = { .max_bytes = RESP_CACHE_DEFAULT_BYTES };
+
+// Parses the first request in buf. Returns -1 unless it is a complete,
+// bodiless keep-alive GET or HEAD with an ASCII head (so byte and string
+// offsets agree for the caller).
+static int resp_cache_parse(const char *buf, size_t len, http_head_t *r) {
+  if (http_head_parse(buf, len, r) < 0 || r->has_body || !r->keep_alive)
+    return -1;
+  if (!(r->method_len == 3 && memcmp(r->method, "GET", 3) == 0) &&
+      !(r->method_len == 4 && memcmp(r->method, "HEAD", 4) == 0))
+    return -1;
+  for (size_t i = 0; i < r->length; i++)
+    if ((unsigned char)buf[i] >= 0x80)
+      return -1;
+  return 0;
+}
+
+static uint32_t resp_cache_hash(const http_head_t *r) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < r->method_len; i++)
+    h = (h ^ (unsigned char)r->method[i]) * 16777619u;
+  h = (h ^ ' ') * 16777619u;
+  for (size_t i = 0; i < r->target_len; i++)
+    h = (h ^ (unsigned char)r->target[i]) * 16777619u;
+  return h;
+}
+
+static int resp_cache_key_eq(const resp_cache_entry_t *e, const http_head_t *r) {
+  return e->key_len == r->method_len + 1 + r->target_len &&
+         memcmp(e->data, r->method, r->method_len) == 0 &&
+         memcmp(e->data + r->method_len + 1, r->target, r->target_len) == 0;
+}
+
+// Does r carry the header values e was stored under?
+static int resp_cache_vary_eq(const resp_cache_entry_t *e, const http_head_t *r) {
+  const char *p = e->data + e->key_len, *end = p + e->vary_len;
+  while (p < end) {
+    const char *name_end = memchr(p, '\n', end - p);
+    const char *value = name_end + 1, *value_end = memchr(value, '\n', end - value);
+    size_t len = 0;
+    const char *v = http_head_header(r, p, (size_t)(name_end - p), &len);
+    if (!v)
+      len = 0;
+    if (len != (size_t)(value_end - value) || (len && memcmp(v, value, len) != 0))
+      return 0;
+    p = value_end + 1;
+  }
+  return 1;
+}
+
+static resp_cache_entry_t **resp_cache_find(const http_head_t *r, uint32_t hash) {
+  resp_cache_entry_t **pp = &resp_cache.buckets[hash % RESP_CACHE_BUCKETS];
+  for (; *pp; pp = &(*pp)->next)
+    if ((*pp)->hash == hash && resp_cache_key_eq(*pp, r) && resp_cache_vary_eq(*pp, r))
+      return pp;
+  return NULL;
+}
+
+static void resp_cache_lru_unlink(resp_cache_entry_t *e) {
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    resp_cache.lru_head = e->lru_next;
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    resp_cache.lru_tail = e->lru_prev;
+}
+
+static void resp_cache_lru_push(resp_cache_entry_t *e) {
+  e->lru_prev = NULL;
+  e->lru_next = resp_cache.lru_head;
+  if (resp_cache.lru_head)
+    resp_cache.lru_head->lru_prev = e;
+  else
+    resp_cache.lru_tail = e;
+  resp_cache.lru_head = e;
+}
+
+static size_t resp_cache_entry_bytes(const resp_cache_entry_t *e) {
+  return sizeof(*e) + e->key_len + e->vary_len + e->size;
+}
+
+// Unlinks *pp from its bucket and the LRU list and frees it
+static void resp_cache_remove(resp_cache_entry_t **pp) {
+  resp_cache_entry_t *e = *pp;
+  *pp = e->next;
+  resp_cache_lru_unlink(e);
+  resp_cache.bytes -= resp_cache_entry_bytes(e);
+  resp_cache.entries--;
+  free(e);
+}
+
+static void resp_cache_remove_lru(void) {
+  resp_cache_entry_t *e = resp_cache.lru_tail, **pp = &resp_cache.buckets[e->hash % RESP_CACHE_BUCKETS];
+  while (*pp != e)
+    pp = &(*pp)->next;
+  resp_cache_remove(pp);
+}
+
+static void resp_cache_evict(size_t max_bytes) {
+  while (resp_cache.bytes > max_bytes && resp_cache.lru_tail) {
+    resp_cache_remove_lru();
+    resp_cache.evictions++;
+  }
+}
+
+// Keeps the cached Date header current; formats at most once a second
+static void resp_cache_touch_date(resp_cache_entry_t *e) {
+  static int64_t formatted_sec = -1;
+  static char formatted[RESP_CACHE_DATE_LEN + 1];
+
+  int64_t sec = (int64_t)time(NULL);
+  if (!e->date_off || e->date_sec == sec)
+    return;
+  if (formatted_sec != sec) {
+    time_t t = (time_t)sec;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(formatted, sizeof(formatted), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    formatted_sec = sec;
+  }
+  memcpy(e->data + e->key_len + e->vary_len + e->date_off, formatted, RESP_CACHE_DATE_LEN);
+  e->date_sec = sec;
+}
+
+// Writes the whole response, waiting up to ~10ms for a full socket buffer
+// like the JS writer does. Returns -1 if the connection should be dropped.
+static int resp_cache_write(int fd, const char *data, size_t len) {
+  int attempts = 0;
+  size_t off = 0;
+  while (off < len) {
+    ssize_t n = conn_send(fd, data + off, len - off, MSG_NOSIGNAL);
+    if (n > 0) {
+      off += (size_t)n;
+      attempts = 0;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && attempts++ < 5) {
+      struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+      poll(&pfd, 1, 2);
+      continue;
+    }
+    return -1;
+  }
+  METRIC_ADD(metrics.bytes_out, (uint64_t)len);
+  PROBE2(send, fd, len);
+  return 0;
+}
+
+static void resp_cache_log(JSContext *ctx, JSValueConst address, const http_head_t *r,
+                           int status, size_t bytes, uint64_t start) {
+  if (!access_log.ring)
+    return;
+  if (status < 400 && access_log.sample > 1 && ++access_log.sample_tick % access_log.sample) {
+    METRIC_ADD(access_log.sampled, 1);
+    return;
+  }
+  log_record_t *rec = log_reserve();
+  if (!rec || log_copy_js(ctx, rec->addr, sizeof(rec->addr), address) < 0)
+    return;
+  log_copy(rec->method, sizeof(rec->method), r->method, r->method_len);
+  log_copy(rec->text, sizeof(rec->text), r->target, r->target_len);
+  rec->time_us = log_now_us();
+  rec->status = status;
+  rec->bytes = (uint32_t)bytes;
+  rec->duration_us = (uint32_t)((now_ns() - start) / 1000);
+  log_commit();
+}
+
+// cache_serve(fd, buffer, address?) -> bytes of buffer consumed, 0 on a
+// miss, -1 if the response could not be written and fd should be closed.
+// Pass the peer address to have hits written to the access log.
+static JSValue js_cache_serve(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+  size_t len;
+
+  if (resp_cache.entries == 0)
+    return JS_NewInt32(ctx, 0);
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  const char *buf = js_get_data(ctx, argv[1], &len);
+  if (!buf)
+    return JS_EXCEPTION;
+
+  uint64_t start = now_ns();
+  http_head_t r;
+  resp_cache_entry_t **pp;
+  if (resp_cache_parse(buf, len, &r) < 0) {
+    js_free_data(ctx, argv[1], buf);
+    return JS_NewInt32(ctx, 0);
+  }
+  pp = resp_cache_find(&r, resp_cache_hash(&r));
+
+  resp_cache_entry_t *e = pp ? *pp : NULL;
+  if (e && start >= e->stale_until) {
+    resp_cache_remove(pp);
+    e = NULL;
+  }
+  if (e && start >= e->expires) {
+    if (!e->refreshing || start - e->refreshing >= RESP_CACHE_REFRESH_NS) {
+      // This request regenerates the entry; the others get the stale copy
+      e->refreshing = start;
+      resp_cache.refreshes++;
+      e = NULL;
+    } else {
+      resp_cache.stale_hits++;
+    }
+  }
+  if (!e) {
+    resp_cache.misses++;
+    js_free_data(ctx, argv[1], buf);
+    return JS_NewInt32(ctx, 0);
+  }
+
+  resp_cache.hits++;
+  resp_cache_lru_unlink(e);
+  resp_cache_lru_push(e);
+  resp_cache_touch_date(e);
+  uint64_t ready = now_ns();
+  if (resp_cache_write(fd, e->data + e->key_len + e->vary_len, e->size) < 0) {
+    js_free_data(ctx, argv[1], buf);
+    return JS_NewInt32(ctx, -1);
+  }
+
+  METRIC_ADD(metrics.requests, 1);
+  METRIC_ADD(metrics.status[e->status], 1);
+  if (metrics.enabled) {
+    uint64_t end = now_ns();
+    hist_record(&metrics.handler, ready - start);
+    hist_record(&metrics.send, end - ready);
+    PROBE3(response, e->status, ready - start, end - ready);
+  }
+  if (js_is_present(argc, argv, 2))
+    resp_cache_log(ctx, argv[2], &r, e->status, e->size, start);
+
+  js_free_data(ctx, argv[1], buf);
+  return JS_NewInt64(ctx, (int64_t)r.length);
+}
+
+// cache_store(request, response, ttlMs, staleMs, vary?) -> stored
+// request is the raw request head the response answers, as a string or
+// bytes; vary lists the
+// header names whose values become part of the key.
+static JSValue js_cache_store(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  double ttl_ms, stale_ms = 0;
+  size_t head_len, size;
+  const char *names[RESP_CACHE_MAX_VARY] = { 0 };
+  uint32_t nvary = 0;
+  JSValue ret = JS_EXCEPTION;
+
+  if (JS_ToFloat64(ctx, &ttl_ms, argv[2]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 3) && JS_ToFloat64(ctx, &stale_ms, argv[3]))
+    return JS_EXCEPTION;
+  if (!(ttl_ms > 0) || stale_ms < 0)
+    return JS_ThrowRangeError(ctx, "ttl must be positive and stale not negative");
+
+  if (js_is_present(argc, argv, 4)) {
+    JSValue n = JS_GetPropertyStr(ctx, argv[4], "length");
+    int ok = JS_ToUint32(ctx, &nvary, n) == 0;
+    JS_FreeValue(ctx, n);
+    if (!ok)
+      return JS_EXCEPTION;
+    if (nvary > RESP_CACHE_MAX_VARY)
+      return JS_ThrowRangeError(ctx, "at most %d vary headers", RESP_CACHE_MAX_VARY);
+  }
+
+  const char *head = js_get_data(ctx, argv[0], &head_len);
+  const char *response = head ? JS_ToCStringLen(ctx, &size, argv[1]) : NULL;
+  if (!response)
+    goto done;
+  for (uint32_t i = 0; i < nvary; i++) {
+    JSValue v = JS_GetPropertyUint32(ctx, argv[4], i);
+    names[i] = JS_ToCString(ctx, v);
+    JS_FreeValue(ctx, v);
+    if (!names[i])
+      goto done;
+  }
+
+  http_head_t r;
+  const char *status_sp = memchr(response, ' ', size < 16 ? size : 16);
+  int status = status_sp ? atoi(status_sp + 1) : 0;
+  if (resp_cache_parse(head, head_len, &r) < 0 || status < 100 || status >= METRICS_STATUS_MAX ||
+      size > resp_cache.max_bytes / 8) {
+    ret = JS_FALSE;
+    goto done;
+  }
+
+  // "name\nvalue\n" per vary header, names lowercased
+  size_t vary_len = 0, value_lens[RESP_CACHE_MAX_VARY];
+  const char *values[RESP_CACHE_MAX_VARY];
+  for (uint32_t i = 0; i < nvary; i++) {
+    values[i] = http_head_header(&r, names[i], strlen(names[i]), &value_lens[i]);
+    if (!values[i])
+      value_lens[i] = 0;
+    vary_len += strlen(names[i]) + value_lens[i] + 2;
+  }
+
+  size_t key_len = r.method_len + 1 + r.target_len;
+  resp_cache_entry_t *e = malloc(sizeof(*e) + key_len + vary_len + size);
+  if (!e) {
+    ret = JS_ThrowOutOfMemory(ctx);
+    goto done;
+  }
+  memset(e, 0, sizeof(*e));
+  char *p = e->data;
+  memcpy(p, r.method, r.method_len);
+  p[r.method_len] = ' ';
+  memcpy(p + r.method_len + 1, r.target, r.target_len);
+  p += key_len;
+  for (uint32_t i = 0; i < nvary; i++) {
+    for (const char *c = names[i]; *c; c++)
+      *p++ = (char)tolower((unsigned char)*c);
+    *p++ = '\n';
+    memcpy(p, values[i], value_lens[i]);
+    p += value_lens[i];
+    *p++ = '\n';
+  }
+  memcpy(p, response, size);
+
+  uint64_t now = now_ns();
+  e->hash = resp_cache_hash(&r);
+  e->status = status;
+  e->expires = now + (uint64_t)(ttl_ms * 1e6);
+  e->stale_until = e->expires + (uint64_t)(stale_ms * 1e6);
+  e->key_len = key_len;
+  e->vary_len = vary_len;
+  e->size = size;
+  e->date_sec = -1;
+  const char *head_end = memmem(p, size, "\r\n\r\n", 4);
+  const char *date = head_end ? memmem(p, (size_t)(head_end - p), "\r\nDate: ", 8) : NULL;
+  if (date && head_end - (date + 8) >= RESP_CACHE_DATE_LEN && memcmp(date + 8 + RESP_CACHE_DATE_LEN - 4, " GMT", 4) == 0)
+    e->date_off = (size_t)(date + 8 - p);
+
+  // Same key and vary values: the new response replaces the old one
+  resp_cache_entry_t **old = resp_cache_find(&r, e->hash);
+  if (old)
+    resp_cache_remove(old);
+
+  resp_cache_entry_t **bucket = &resp_cache.buckets[e->hash % RESP_CACHE_BUCKETS];
+  e->next = *bucket;
+  *bucket = e;
+  resp_cache_lru_push(e);
+  resp_cache.bytes += resp_cache_entry_bytes(e);
+  resp_cache.entries++;
+  resp_cache.stores++;
+  resp_cache_evict(resp_cache.max_bytes);
+  ret = JS_TRUE;
+
+done:
+  for (uint32_t i = 0; i < nvary; i++)
+    if (names[i])
+      JS_FreeCString(ctx, names[i]);
+  if (response)
+    JS_FreeCString(ctx, response);
+  if (head)
+    js_free_data(ctx, argv[0], head);
+  return ret;
+}
+
+// cache_limit(maxBytes) -> previous limit. Responses larger than an eighth
+// of the limit are not stored.
+static JSValue js_cache_limit(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int64_t max_bytes;
+  size_t previous = resp_cache.max_bytes;
+
+  if (JS_ToInt64(ctx, &max_bytes, argv[0]))
+    return JS_EXCEPTION;
+  if (max_bytes < 0)
+    return JS_ThrowRangeError(ctx, "limit must not be negative");
+
+  resp_cache.max_bytes = (size_t)max_bytes;
+  resp_cache_evict(resp_cache.max_bytes);
+  return JS_NewInt64(ctx, (int64_t)previous);
+}
+
+// cache_clear() -> number of entries dropped
+static JSValue js_cache_clear(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  uint32_t dropped = resp_cache.entries;
+  while (resp_cache.lru_tail)
+    resp_cache_remove_lru();
+  return JS_NewInt64(ctx, dropped);
+}
+
+// cache_stats() -> {entries, bytes, maxBytes, hits, staleHits, misses, refreshes, stores, evictions}
+static JSValue js_cache_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+
+  JS_SetPropertyStr(ctx, obj, "entries", JS_NewInt64(ctx, resp_cache.entries));
+  JS_SetPropertyStr(ctx, obj, "bytes", JS_NewInt64(ctx, (int64_t)resp_cache.bytes));
+  JS_SetPropertyStr(ctx, obj, "maxBytes", JS_NewInt64(ctx, (int64_t)resp_cache.max_bytes));
+  JS_SetPropertyStr(ctx, obj, "hits", JS_NewInt64(ctx, (int64_t)resp_cache.hits));
+  JS_SetPropertyStr(ctx, obj, "staleHits", JS_NewInt64(ctx, (int64_t)resp_cache.stale_hits));
+  JS_SetPropertyStr(ctx, obj, "misses", JS_NewInt64(ctx, (int64_t)resp_cache.misses));
+  JS_SetPropertyStr(ctx, obj, "refreshes", JS_NewInt64(ctx, (int64_t)resp_cache.refreshes));
+  JS_SetPropertyStr(ctx, obj, "stores", JS_NewInt64(ctx, (int64_t)resp_cache.stores));
+  JS_SetPropertyStr(ctx, obj, "evictions", JS_NewInt64(ctx, (int64_t)resp_cache.evictions));
+  return obj;
+}
+
+// Shared-memory tables
+//
+// shm.open(name, size) maps /dev/shm/qjs-<name> into every process that
+// opens the same name, so cluster workers can share counters and cached
+// values. Slots have a fixed size and are grouped SHM_GROUP_SLOTS at a
+// time; a key can only live in the group its hash selects. Writers hold
+// the group's process-shared robust mutex, so a worker killed mid-write
+// costs at most the slot it was writing. Readers take no lock: they copy
+// the slot and retry if its sequence number was odd or changed meanwhile.
+// A full group evicts with a clock sweep over bits that reads set.
+#define SHM_MAGIC 0x31627468736a71ull // "qjshtb1"
+#define SHM_GROUP_SLOTS 16
+#define SHM_DEFAULT_SLOT 256
+#define SHM_MAX_SLOT 65536
+#define SHM_MAX_TABLES 16
+#define SHM_MAX_NAME 48
+#define SHM_READ_RETRIES 64
+#define SHM_OPEN_WAIT_MS 1000
+
+enum { SHM_EMPTY, SHM_USED };
+enum { SHM_STRING, SHM_NUMBER };
+
+typedef struct {
+  uint32_t seq;       // odd while a writer is inside
+  uint8_t state;
+  uint8_t type;
+  uint8_t ref;        // clock bit
+  uint8_t unused;
+  uint32_t hash;
+  uint32_t key_len;
+  uint32_t value_len;
+  int64_t expires;    // now_ms() deadline, 0 = never
+  char data[];        // key, then value
+} shm_slot_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  uint32_t hand;      // next slot the clock looks at
+} __attribute__((aligned(64))) shm_group_t;
+
+typedef struct {
+  uint64_t magic;
+  uint32_t ready;
+  uint32_t slot_size;
+  uint32_t groups;
+  uint64_t size;
+} __attribute__((aligned(64))) shm_header_t;
+
+typedef struct {
+  char *base;         // NULL: slot is free
+  uint32_t gen;       // bumped by each open, so handles to a closed table miss
+  size_t size;
+  shm_group_t *groups;
+  char *slots;
+  uint32_t slot_size;
+  uint32_t ngroups;
+  uint64_t hits;      // this process only
+  uint64_t misses;
+  uint64_t evictions;
+  char name[SHM_MAX_NAME + 1];
+} shm_table_t;
+
+static shm_table_t shm_tables[SHM_MAX_TABLES];
+
+// A value as stored: a number is its 8-byte double
+typedef struct {
+  uint8_t type;
+  const char *data;
+  size_t len;
+  double number;
+} shm_value_t;
+
+static inline shm_slot_t *shm_slot(shm_table_t *t, uint32_t group, int i) {
+  return (shm_slot_t *)(t->slots + ((size_t)group * SHM_GROUP_SLOTS + i) * t->slot_size);
+}
+
+static uint32_t shm_hash(const char *key, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)key[i]) * 16777619u;
+  return h;
+}
+
+static void shm_write_begin(shm_slot_t *s) {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shm_write_end(shm_slot_t *s) {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void shm_lock(shm_table_t *t, uint32_t group) {
+  shm_group_t *g = &t->groups[group];
+  if (pthread_mutex_lock(&g->lock) == EOWNERDEAD) {
+    // The previous owner died; drop whatever slot it left half-written
+    for (int i = 0; i < SHM_GROUP_SLOTS; i++) {
+      shm_slot_t *s = shm_slot(t, group, i);
+      if (s->seq & 1) {
+        s->state = SHM_EMPTY;
+        shm_write_end(s);
+      }
+    }
+    pthread_mutex_consistent(&g->lock);
+  }
+}
+
+static void shm_unlock(shm_table_t *t, uint32_t group) {
+  pthread_mutex_unlock(&t->groups[group].lock);
+}
+
+// Slot holding a live key, or -1. Caller holds the group lock.
+static int shm_find_locked(shm_table_t *t, uint32_t group, uint32_t hash, const char *key, size_t klen, int64_t now) {
+  for (int i = 0; i < SHM_GROUP_SLOTS; i++) {
+    shm_slot_t *s = shm_slot(t, group, i);
+    if (s->state == SHM_USED && s->hash == hash && s->key_len == klen && memcmp(s->data, key, klen) == 0)
+      return s->expires && s->expires <= now ? -1 : i;
+  }
+  return -1;
+}
+
+// Slot for a new key: a free or expired one, else the clock's victim
+static int shm_claim_locked(shm_table_t *t, uint32_t group, int64_t now) {
+  for (int i = 0; i < SHM_GROUP_SLOTS; i++) {
+    shm_slot_t *s = shm_slot(t, group, i);
+    if (s->state != SHM_USED || (s->expires && s->expires <= now))
+      return i;
+  }
+  shm_group_t *g = &t->groups[group];
+  for (;;) {
+    int i = (int)(g->hand++ % SHM_GROUP_SLOTS);
+    shm_slot_t *s = shm_slot(t, group, i);
+    if (__atomic_load_n(&s->ref, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&s->ref, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+    t->evictions++;
+    return i;
+  }
+}
+
+static void shm_fill(shm_slot_t *s, uint32_t hash, const char *key, size_t klen, const shm_value_t *v, int64_t expires) {
+  shm_write_begin(s);
+  s->state = SHM_USED;
+  s->type = v->type;
+  s->ref = 0;
+  s->hash = hash;
+  s->key_len = (uint32_t)klen;
+  s->value_len = (uint32_t)v->len;
+  s->expires = expires;
+  memcpy(s->data, key, klen);
+  memcpy(s->data + klen, v->data, v->len);
+  shm_write_end(s);
+}
+
+static void shm_clear(shm_slot_t *s) {
+  shm_write_begin(s);
+  s->state = SHM_EMPTY;
+  shm_write_end(s);
+}
+
+static int shm_fits(shm_table_t *t, size_t klen, size_t vlen) {
+  return sizeof(shm_slot_t) + klen + vlen <= t->slot_size;
+}
+
+// Copies the value of key into buf (slot_size bytes) without locking.
+// Returns 1 and fills *out (pointing into buf) if the key is live.
+static int shm_read(shm_table_t *t, const char *key, size_t klen, char *buf, shm_value_t *out) {
+  uint32_t hash = shm_hash(key, klen), group = hash % t->ngroups;
+  size_t payload = t->slot_size - sizeof(shm_slot_t);
+
+  for (int i = 0; i < SHM_GROUP_SLOTS; i++) {
+    shm_slot_t *s = shm_slot(t, group, i), h;
+    for (int attempt = 0; attempt < SHM_READ_RETRIES; attempt++) {
+      uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+        continue;
+      memcpy(&h, s, sizeof(h));
+      int candidate = h.state == SHM_USED && h.hash == hash && h.key_len == klen && klen + h.value_len <= payload;
+      if (candidate)
+        memcpy(buf, s->data, klen + h.value_len);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+        continue;
+      if (!candidate || memcmp(buf, key, klen) != 0)
+        break;
+      if (h.expires && h.expires <= now_ms())
+        return 0;
+      if (!__atomic_load_n(&s->ref, __ATOMIC_RELAXED))
+        __atomic_store_n(&s->ref, 1, __ATOMIC_RELAXED);
+      out->type = h.type;
+      out->data = buf + klen;
+      out->len = h.value_len;
+      if (h.type == SHM_NUMBER)
+        memcpy(&out->number, out->data, sizeof(double));
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int shm_valid_name(const char *name) {
+  size_t len = strlen(name);
+  if (len == 0 || len > SHM_MAX_NAME)
+    return 0;
+  for (const char *p = name; *p; p++)
+    if (!isalnum((unsigned char)*p) && *p != '-' && *p != '_' && *p != '.')
+      return 0;
+  return 1;
+}
+
+// The first process to open name creates and lays out the table; the
+// others map it at the size it was created with and wait until it is ready.
+// size 0 only attaches to an existing table.
+static int shm_map(shm_table_t *t, const char *name, size_t size, uint32_t slot_size) {
+  char path[SHM_MAX_NAME + 8];
+  struct stat st;
+  snprintf(path, sizeof(path), "/qjs-%s", name);
+
+  int fd = size ? shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600) : -1;
+  int creator = fd >= 0;
+  if (creator) {
+    if (ftruncate(fd, (off_t)size) < 0) {
+      int saved = errno;
+      close(fd);
+      shm_unlink(path);
+      errno = saved;
+      return -1;
+    }
+  } else {
+    if ((size && errno != EEXIST) || (fd = shm_open(path, O_RDWR, 0)) < 0)
+      return -1;
+    for (int waited = 0;; waited++) {
+      if (fstat(fd, &st) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+      }
+      if (st.st_size > 0)
+        break;
+      if (waited >= SHM_OPEN_WAIT_MS) {
+        close(fd);
+        errno = ETIMEDOUT;
+        return -1;
+      }
+      usleep(1000);
+    }
+    size = (size_t)st.st_size;
+  }
+
+  char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return -1;
+  shm_header_t *hdr = (shm_header_t *)base;
+
+  if (creator) {
+    size_t group_bytes = sizeof(shm_group_t) + (size_t)SHM_GROUP_SLOTS * slot_size;
+    hdr->slot_size = slot_size;
+    hdr->groups = (uint32_t)((size - sizeof(shm_header_t)) / group_bytes);
+    hdr->size = size;
+    shm_group_t *groups = (shm_group_t *)(base + sizeof(shm_header_t));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (uint32_t i = 0; i < hdr->groups; i++)
+      pthread_mutex_init(&groups[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    hdr->magic = SHM_MAGIC;
+    __atomic_store_n(&hdr->ready, 1, __ATOMIC_RELEASE);
+  } else {
+    for (int waited = 0; !__atomic_load_n(&hdr->ready, __ATOMIC_ACQUIRE); waited++) {
+      if (waited >= SHM_OPEN_WAIT_MS) {
+        munmap(base, size);
+        errno = ETIMEDOUT;
+        return -1;
+      }
+      usleep(1000);
+    }
+    if (hdr->magic != SHM_MAGIC || hdr->size != size) {
+      munmap(base, size);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  t->base = base;
+  t->size = size;
+  t->slot_size = hdr->slot_size;
+  t->ngroups = hdr->groups;
+  t->groups = (shm_group_t *)(base + sizeof(shm_header_t));
+  t->slots = (char *)(t->groups + t->ngroups);
+  t->hits = t->misses = t->evictions = 0;
+  snprintf(t->name, sizeof(t->name), "%s", name);
+  return 0;
+}
+
+// A table's handle is its slot and the generation of the open that filled
+// it, so that once closed it never names whatever opens in the slot next
+static int32_t shm_handle(const shm_table_t *t) {
+  return (int32_t)(t->gen * SHM_MAX_TABLES + (uint32_t)(t - shm_tables));
+}
+
+// Open table a handle names, or NULL
+static shm_table_t *shm_lookup(int32_t id) {
+  if (id < 0)
+    return NULL;
+  shm_table_t *t = &shm_tables[id % SHM_MAX_TABLES];
+  return t->base && t->gen == (uint32_t)(id / SHM_MAX_TABLES) ? t : NULL;
+}
+
+// Table behind a shm.open() object, or NULL with an exception pending
+static shm_table_t *shm_this(JSContext *ctx, JSValueConst this_val) {
+  int32_t id = -1;
+  JSValue v = JS_GetPropertyStr(ctx, this_val, "id");
+  int err = JS_ToInt32(ctx, &id, v);
+  JS_FreeValue(ctx, v);
+  if (err)
+    return NULL;
+  shm_table_t *t = shm_lookup(id);
+  if (!t)
+    JS_ThrowTypeError(ctx, "shared-memory table is closed");
+  return t;
+}
+
+// Borrows a JS string or number as a stored value; free with shm_value_free
+static int shm_value_from_js(JSContext *ctx, JSValueConst val, shm_value_t *v) {
+  if (JS_IsNumber(val)) {
+    if (JS_ToFloat64(ctx, &v->number, val))
+      return -1;
+    v->type = SHM_NUMBER;
+    v->data = (const char *)&v->number;
+    v->len = sizeof(double);
+    return 0;
+  }
+  if (!JS_IsString(val)) {
+    JS_ThrowTypeError(ctx, "value must be a string or a number");
+    return -1;
+  }
+  v->type = SHM_STRING;
+  v->data = JS_ToCStringLen(ctx, &v->len, val);
+  return v->data ? 0 : -1;
+}
+
+static void shm_value_free(JSContext *ctx, shm_value_t *v) {
+  if (v->type == SHM_STRING && v->data)
+    JS_FreeCString(ctx, v->data);
+}
+
+static JSValue shm_value_to_js(JSContext *ctx, const shm_value_t *v) {
+  if (v->type == SHM_NUMBER)
+    return JS_NewFloat64(ctx, v->number);
+  return JS_NewStringLen(ctx, v->data, v->len);
+}
+
+static int64_t shm_expires(JSContext *ctx, int argc, JSValueConst *argv, int i, int *err) {
+  double ttl_ms = 0;
+  *err = js_is_present(argc, argv, i) && JS_ToFloat64(ctx, &ttl_ms, argv[i]);
+  return ttl_ms > 0 ? now_ms() + (int64_t)ttl_ms : 0;
+}
+
+// table.get(key) -> string | number | undefined
+static JSValue js_shm_get(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  shm_table_t *t = shm_this(ctx, this_val);
+  if (!t)
+    return JS_EXCEPTION;
+  size_t klen;
+  const char *key = JS_ToCStringLen(ctx, &klen, argv[0]);
+  if (!key)
+    return JS_EXCEPTION;
+
+  char stack[4096];
+  char *buf = t->slot_size <= sizeof(stack) ? stack : malloc(t->slot_size);
+  if (!buf) {
+    JS_FreeCString(ctx, key);
+    return JS_ThrowOutOfMemory(ctx);
+  }
+  shm_value_t v;
+  JSValue ret = JS_UNDEFINED;
+  if (shm_read(t, key, klen, buf, &v)) {
+    t->hits++;
+    ret = shm_value_to_js(ctx, &v);
+  } else {
+    t->misses++;
+  }
+  if (buf != stack)
+    free(buf);
+  JS_FreeCString(ctx, key);
+  return ret;
+}
+
+// table.set(key, value, ttlMs?) -> stored (false if it does not fit a slot)
+static JSValue js_shm_set(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  shm_table_t *t = shm_this(ctx, this_val);
+  shm_value_t v = { 0 };
+  int err;
+  if (!t)
+    return JS_EXCEPTION;
+  int64_t expires = shm_expires(ctx, argc, argv, 2, &err);
+  if (err || shm_value_from_js(ctx, argv[1], &v) < 0)
+    return JS_EXCEPTION;
+  size_t klen;
+  const char *key = JS_ToCStringLen(ctx, &klen, argv[0]);
+  if (!key) {
+    shm_value_free(ctx, &v);
+    return JS_EXCEPTION;
+  }
+
+  int stored = shm_fits(t, klen, v.len);
+  if (stored) {
+    uint32_t hash = shm_hash(key, klen), group = hash % t->ngroups;
+    int64_t now = now_ms();
+    shm_lock(t, group);
+    int i = shm_find_locked(t, group, hash, key, klen, now);
+    if (i < 0)
+      i = shm_claim_locked(t, group, now);
+    shm_fill(shm_slot(t, group, i), hash, key, klen, &v, expires);
+    shm_unlock(t, group);
+  }
+
+  JS_FreeCString(ctx, key);
+  shm_value_free(ctx, &v);
+  return JS_NewBool(ctx, stored);
+}
+
+// table.incr(key, delta=1, ttlMs?) -> new value. A missing key starts at
+// 0 and gets ttlMs; an existing one keeps its expiry.
+static JSValue js_shm_incr(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  shm_table_t *t = shm_this(ctx, this_val);
+  double delta = 1;
+  int err;
+  if (!t)
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 1) && JS_ToFloat64(ctx, &delta, argv[1]))
+    return JS_EXCEPTION;
+  int64_t expires = shm_expires(ctx, argc, argv, 2, &err);
+  if (err)
+    return JS_EXCEPTION;
+  size_t klen;
+  const char *key = JS_ToCStringLen(ctx, &klen, argv[0]);
+  if (!key)
+    return JS_EXCEPTION;
+  if (!shm_fits(t, klen, sizeof(double))) {
+    JS_FreeCString(ctx, key);
+    return JS_ThrowRangeError(ctx, "key does not fit a slot");
+  }
+
+  uint32_t hash = shm_hash(key, klen), group = hash % t->ngroups;
+  int64_t now = now_ms();
+  shm_value_t v = { .type = SHM_NUMBER, .len = sizeof(double) };
+  v.data = (const char *)&v.number;
+  shm_lock(t, group);
+  int i = shm_find_locked(t, group, hash, key, klen, now);
+  shm_slot_t *s = i >= 0 ? shm_slot(t, group, i) : NULL;
+  if (s && s->type != SHM_NUMBER) {
+    shm_unlock(t, group);
+    JS_FreeCString(ctx, key);
+    return JS_ThrowTypeError(ctx, "value is not a number");
+  }
+  if (s) {
+    memcpy(&v.number, s->data + klen, sizeof(double));
+    v.number += delta;
+    shm_write_begin(s);
+    memcpy(s->data + klen, &v.number, sizeof(double));
+    shm_write_end(s);
+  } else {
+    v.number = delta;
+    shm_fill(shm_slot(t, group, shm_claim_locked(t, group, now)), hash, key, klen, &v, expires);
+  }
+  shm_unlock(t, group);
+
+  JS_FreeCString(ctx, key);
+  return JS_NewFloat64(ctx, v.number);
+}
+
+// table.cas(key, expected, value, ttlMs?) -> swapped. expected undefined
+// means the key must be absent; value undefined deletes it.
+static JSValue js_shm_cas(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  shm_table_t *t = shm_this(ctx, this_val);
+  shm_value_t expected = { 0 }, v = { 0 };
+  int has_expected = argc > 1 && !JS_IsUndefined(argv[1]);
+  int has_value = argc > 2 && !JS_IsUndefined(argv[2]);
+  int err, swapped = 0;
+  JSValue ret = JS_EXCEPTION;
+  const char *key = NULL;
+  size_t klen;
+  if (!t)
+    return JS_EXCEPTION;
+  int64_t expires = shm_expires(ctx, argc, argv, 3, &err);
+  if (err)
+    return JS_EXCEPTION;
+  if ((has_expected && shm_value_from_js(ctx, argv[1], &expected) < 0) ||
+      (has_value && shm_value_from_js(ctx, argv[2], &v) < 0) ||
+      !(key = JS_ToCStringLen(ctx, &klen, argv[0])))
+    goto done;
+
+  if (!has_value || shm_fits(t, klen, v.len)) {
+    uint32_t hash = shm_hash(key, klen), group = hash % t->ngroups;
+    int64_t now = now_ms();
+    shm_lock(t, group);
+    int i = shm_find_locked(t, group, hash, key, klen, now);
+    shm_slot_t *s = i >= 0 ? shm_slot(t, group, i) : NULL;
+    if (!has_expected)
+      swapped = !s;
+    else
+      swapped = s && s->type == expected.type && s->value_len == expected.len &&
+                memcmp(s->data + klen, expected.data, expected.len) == 0;
+    if (swapped && !has_value && s)
+      shm_clear(s);
+    else if (swapped && has_value)
+      shm_fill(s ? s : shm_slot(t, group, shm_claim_locked(t, group, now)), hash, key, klen, &v, expires);
+    shm_unlock(t, group);
+  }
+  ret = JS_NewBool(ctx, swapped);
+
+done:
+  if (key)
+    JS_FreeCString(ctx, key);
+  shm_value_free(ctx, &expected);
+  shm_value_free(ctx, &v);
+  return ret;
+}
+
+// table.delete(key) -> existed
+static JSValue js_shm_delete(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  shm_table_t *t = shm_this(ctx, this_val);
+  if (!t)
+    return JS_EXCEPTION;
+  size_t klen;
+  const char *key = JS_ToCStringLen(ctx, &klen, argv[0]);
+  if (!key)
+    return JS_EXCEPTION;
+
+  uint32_t hash = shm_hash(key, klen), group = hash % t->ngroups;
+  shm_lock(t, group);
+  int i = shm_find_locked(t, group, hash, key, klen, now_ms());
+  if (i >= 0)
+    shm_clear(shm_slot(t, group, i));
+  shm_unlock(t, group);
+
+  JS_FreeCString(ctx, key);
+  return JS_NewBool(ctx, i >= 0);
+}
+
+// table.stats() -> {size, slots, slotSize, used, hits, misses, evictions}
+// used is counted across processes; the rest only for this one.
+static JSValue js_shm_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  shm_table_t *t = shm_this(ctx, this_val);
+  if (!t)
+    return JS_EXCEPTION;
+
+  int64_t now = now_ms(), used = 0;
+  for (uint32_t g = 0; g < t->ngroups; g++) {
+    for (int i = 0; i < SHM_GROUP_SLOTS; i++) {
+      shm_slot_t *s = shm_slot(t, g, i);
+      if (__atomic_load_n(&s->state, __ATOMIC_RELAXED) == SHM_USED && !(s->expires && s->expires <= now))
+        used++;
+    }
+  }
+
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "size", JS_NewInt64(ctx, (int64_t)t->size));
+  JS_SetPropertyStr(ctx, obj, "slots", JS_NewInt64(ctx, (int64_t)t->ngroups * SHM_GROUP_SLOTS));
+  JS_SetPropertyStr(ctx, obj, "slotSize", JS_NewInt64(ctx, t->slot_size));
+  JS_SetPropertyStr(ctx, obj, "used", JS_NewInt64(ctx, used));
+  JS_SetPropertyStr(ctx, obj, "hits", JS_NewInt64(ctx, (int64_t)t->hits));
+  JS_SetPropertyStr(ctx, obj, "misses", JS_NewInt64(ctx, (int64_t)t->misses));
+  JS_SetPropertyStr(ctx, obj, "evictions", JS_NewInt64(ctx, (int64_t)t->evictions));
+  return obj;
+}
+
+// table.close() -> 0. Unmaps the table; the data stays for other processes.
+static JSValue js_shm_close(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  shm_table_t *t = shm_this(ctx, this_val);
+  if (!t)
+    return JS_EXCEPTION;
+  munmap(t->base, t->size);
+  t->base = NULL;
+  return JS_NewInt32(ctx, 0);
+}
+
+static const JSCFunctionListEntry js_shm_table_funcs[] = {
+  JS_CFUNC_DEF("get", 1, js_shm_get),
+  JS_CFUNC_DEF("set", 3, js_shm_set),
+  JS_CFUNC_DEF("incr", 3, js_shm_incr),
+  JS_CFUNC_DEF("cas", 4, js_shm_cas),
+  JS_CFUNC_DEF("delete", 1, js_shm_delete),
+  JS_CFUNC_DEF("stats", 0, js_shm_stats),
+  JS_CFUNC_DEF("close", 0, js_shm_close),
+};
+
+// shm.open(name, size, {slotSize=256}) -> table
+// size and slotSize only apply to the process that creates the table;
+// size 0 attaches to one that must already exist.
+static JSValue js_shm_open(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int64_t size;
+  int32_t slot_size = SHM_DEFAULT_SLOT;
+
+  const char *name = JS_ToCString(ctx, argv[0]);
+  if (!name)
+    return JS_EXCEPTION;
+  if (!shm_valid_name(name)) {
+    JS_FreeCString(ctx, name);
+    return JS_ThrowRangeError(ctx, "name must be 1-%d characters of [A-Za-z0-9._-]", SHM_MAX_NAME);
+  }
+  if (JS_ToInt64(ctx, &size, argv[1]))
+    goto fail;
+  if (js_is_present(argc, argv, 2)) {
+    JSValue v = JS_GetPropertyStr(ctx, argv[2], "slotSize");
+    int err = !JS_IsUndefined(v) && JS_ToInt32(ctx, &slot_size, v);
+    JS_FreeValue(ctx, v);
+    if (err)
+      goto fail;
+  }
+  if (slot_size < 64 || slot_size > SHM_MAX_SLOT || slot_size % 8) {
+    JS_ThrowRangeError(ctx, "slotSize must be a multiple of 8 between 64 and %d", SHM_MAX_SLOT);
+    goto fail;
+  }
+  if (size != 0 && size < (int64_t)(sizeof(shm_header_t) + sizeof(shm_group_t) + (size_t)SHM_GROUP_SLOTS * slot_size)) {
+    JS_ThrowRangeError(ctx, "size is too small for one group of %d slots", SHM_GROUP_SLOTS);
+    goto fail;
+  }
+
+  int id = 0;
+  while (id < SHM_MAX_TABLES && shm_tables[id].base)
+    id++;
+  if (id == SHM_MAX_TABLES) {
+    JS_ThrowRangeError(ctx, "at most %d shared-memory tables", SHM_MAX_TABLES);
+    goto fail;
+  }
+  if (shm_map(&shm_tables[id], name, (size_t)size, (uint32_t)slot_size) < 0) {
+    JS_ThrowInternalError(ctx, "shm_open() failed: %s", strerror(errno));
+    goto fail;
+  }
+  JS_FreeCString(ctx, name);
+
+  shm_table_t *t = &shm_tables[id];
+  t->gen = (t->gen + 1) % (INT32_MAX / SHM_MAX_TABLES);
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyFunctionList(ctx, obj, js_shm_table_funcs, countof(js_shm_table_funcs));
+  JS_SetPropertyStr(ctx, obj, "id", JS_NewInt32(ctx, shm_handle(t)));
+  JS_SetPropertyStr(ctx, obj, "name", JS_NewString(ctx, t->name));
+  JS_SetPropertyStr(ctx, obj, "slotSize", JS_NewInt32(ctx, (int32_t)t->slot_size));
+  return obj;
+
+fail:
+  JS_FreeCString(ctx, name);
+  return JS_EXCEPTION;
+}
+
+// shm.unlink(name) -> 0. Removes the name; processes that have it open keep their mapping.
+static JSValue js_shm_unlink(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  char path[SHM_MAX_NAME + 8];
+  const char *name = JS_ToCString(ctx, argv[0]);
+  if (!name)
+    return JS_EXCEPTION;
+  int valid = shm_valid_name(name);
+  if (valid)
+    snprintf(path, sizeof(path), "/qjs-%s", name);
+  JS_FreeCString(ctx, name);
+  if (!valid)
+    return JS_ThrowRangeError(ctx, "invalid table name");
+  if (shm_unlink(path) < 0)
+    return JS_ThrowInternalError(ctx, "shm_unlink() failed: %s", strerror(errno));
+  return JS_NewInt32(ctx, 0);
+}
+
+static const JSCFunctionListEntry js_shm_funcs[] = {
+  JS_CFUNC_DEF("open", 3, js_shm_open),
+  JS_CFUNC_DEF("unlink", 1, js_shm_unlink),
+};
+
+// limit_rule(prefix, {rate, burst=rate, header, accept, close}) -> number of rules
+// rate is in requests (or, with accept, connections) per second per client.
+// Adding a rule for an existing prefix and kind replaces it.
+static JSValue js_limit_rule(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  limit_rule_t r = { 0 };
+  const char *s;
+  size_t len;
+
+  if (!(s = JS_ToCStringLen(ctx, &len, argv[0])))
+    return JS_EXCEPTION;
+  if (len >= LIMIT_MAX_PREFIX) {
+    JS_FreeCString(ctx, s);
+    return JS_ThrowRangeError(ctx, "prefix longer than %d bytes", LIMIT_MAX_PREFIX - 1);
+  }
+  memcpy(r.prefix, s, len);
+  r.prefix_len = len;
+  JS_FreeCString(ctx, s);
+
+  JSValue v = JS_GetPropertyStr(ctx, argv[1], "rate");
+  int err = JS_ToFloat64(ctx, &r.rate, v);
+  JS_FreeValue(ctx, v);
+  if (err)
+    return JS_EXCEPTION;
+  r.burst = r.rate;
+  v = JS_GetPropertyStr(ctx, argv[1], "burst");
+  err = !JS_IsUndefined(v) && JS_ToFloat64(ctx, &r.burst, v);
+  JS_FreeValue(ctx, v);
+  if (err)
+    return JS_EXCEPTION;
+  if (!(r.rate > 0) || !(r.burst >= 1))
+    return JS_ThrowRangeError(ctx, "rate must be positive and burst at least 1");
+
+  v = JS_GetPropertyStr(ctx, argv[1], "header");
+  if (!JS_IsUndefined(v)) {
+    s = JS_ToCStringLen(ctx, &len, v);
+    JS_FreeValue(ctx, v);
+    if (!s)
+      return JS_EXCEPTION;
+    if (len >= LIMIT_MAX_HEADER) {
+      JS_FreeCString(ctx, s);
+      return JS_ThrowRangeError(ctx, "header name longer than %d bytes", LIMIT_MAX_HEADER - 1);
+    }
+    memcpy(r.header, s, len);
+    r.header_len = len;
+    JS_FreeCString(ctx, s);
+  }
+  v = JS_GetPropertyStr(ctx, argv[1], "accept");
+  r.accept = JS_ToBool(ctx, v) > 0;
+  JS_FreeValue(ctx, v);
+  v = JS_GetPropertyStr(ctx, argv[1], "close");
+  r.close = JS_ToBool(ctx, v) > 0;
+  JS_FreeValue(ctx, v);
+
+  if (!limiter.buckets && !(limiter.buckets = calloc(LIMIT_SLOTS, sizeof(limit_bucket_t))))
+    return JS_ThrowOutOfMemory(ctx);
+
+  int retry_after = (int)(1.0 / r.rate);
+  if (retry_after < 1.0 / r.rate || retry_after < 1)
+    retry_after++; // whole seconds until the next token, rounded up
+  for (int k = 0; k < 2; k++) {
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 429 Too Many Requests\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: 17\r\n"
+                     "Retry-After: %d\r\n"
+                     "Connection: %s\r\n\r\n"
+                     "Too Many Requests",
+                     retry_after, k ? "close" : "keep-alive");
+    r.response[k] = malloc((size_t)n);
+    if (!r.response[k]) {
+      free(r.response[0]);
+      return JS_ThrowOutOfMemory(ctx);
+    }
+    memcpy(r.response[k], buf, (size_t)n);
+    r.response_len[k] = (size_t)n;
+  }
+
+  // Same prefix and kind replaces the rule, else insert keeping longer prefixes first
+  int i = 0;
+  while (i < limiter.nrules && !(limiter.rules[i].accept == r.accept &&
+         limiter.rules[i].prefix_len == r.prefix_len && memcmp(limiter.rules[i].prefix, r.prefix, r.prefix_len) == 0))
+    i++;
+  if (i < limiter.nrules) {
+    free(limiter.rules[i].response[0]);
+    free(limiter.rules[i].response[1]);
+    limiter.rules[i] = r;
+    return JS_NewInt32(ctx, limiter.nrules);
+  }
+  if (limiter.nrules == LIMIT_MAX_RULES) {
+    free(r.response[0]);
+    free(r.response[1]);
+    return JS_ThrowRangeError(ctx, "at most %d rate limit rules", LIMIT_MAX_RULES);
+  }
+  i = 0;
+  while (i < limiter.nrules && limiter.rules[i].prefix_len >= r.prefix_len)
+    i++;
+  memmove(&limiter.rules[i + 1], &limiter.rules[i], (size_t)(limiter.nrules - i) * sizeof(r));
+  limiter.rules[i] = r;
+  limiter.nrules++;
+  limiter.accept_rules += r.accept;
+  return JS_NewInt32(ctx, limiter.nrules);
+}
+
+// limit_request(fd, request, address) -> 0 to serve it, 1 if a 429 was
+// sent, -1 if a 429 was sent and fd should be closed. request is one
+// complete request, as a string or bytes; address keys rules without a
+// header.
+static JSValue js_limit_request(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+  size_t len, key_len;
+  http_head_t h;
+
+  if (limiter.nrules == limiter.accept_rules)
+    return JS_NewInt32(ctx, 0);
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  const char *buf = js_get_data(ctx, argv[1], &len);
+  if (!buf)
+    return JS_EXCEPTION;
+  if (http_head_parse(buf, len, &h) < 0) {
+    js_free_data(ctx, argv[1], buf);
+    return JS_NewInt32(ctx, 0);
+  }
+
+  const char *query = memchr(h.target, '?', h.target_len);
+  size_t path_len = query ? (size_t)(query - h.target) : h.target_len;
+  int i = 0;
+  while (i < limiter.nrules && (limiter.rules[i].accept || limiter.rules[i].prefix_len > path_len ||
+         memcmp(limiter.rules[i].prefix, h.target, limiter.rules[i].prefix_len) != 0))
+    i++;
+  if (i == limiter.nrules) {
+    js_free_data(ctx, argv[1], buf);
+    return JS_NewInt32(ctx, 0);
+  }
+
+  limit_rule_t *r = &limiter.rules[i];
+  const char *key = r->header_len ? http_head_header(&h, r->header, r->header_len, &key_len) : NULL;
+  const char *addr = NULL;
+  if (!key) {
+    if (!(addr = JS_ToCStringLen(ctx, &key_len, argv[2]))) {
+      js_free_data(ctx, argv[1], buf);
+      return JS_EXCEPTION;
+    }
+    key = addr;
+  }
+  int allowed = limit_take(i, key, key_len, now_ns());
+  int keep_alive = h.keep_alive && !r->close;
+  if (addr)
+    JS_FreeCString(ctx, addr);
+  js_free_data(ctx, argv[1], buf);
+  if (allowed) {
+    limiter.allowed++;
+    return JS_NewInt32(ctx, 0);
+  }
+
+  r->limited++;
+  limiter.limited++;
+  METRIC_ADD(metrics.requests, 1);
+  METRIC_ADD(metrics.status[429], 1);
+  PROBE3(response, 429, 0, 0);
+  ssize_t n = conn_send(fd, r->response[!keep_alive], r->response_len[!keep_alive], MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (n > 0)
+    METRIC_ADD(metrics.bytes_out, (uint64_t)n);
+  return JS_NewInt32(ctx, keep_alive && n == (ssize_t)r->response_len[0] ? 1 : -1);
+}
+
+// limit_clear() -> rules. Drops every rule and bucket.
+static JSValue js_limit_clear(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int n = limiter.nrules;
+  for (int i = 0; i < limiter.nrules; i++) {
+    free(limiter.rules[i].response[0]);
+    free(limiter.rules[i].response[1]);
+  }
+  limiter.nrules = 0;
+  limiter.accept_rules = 0;
+  free(limiter.buckets);
+  limiter.buckets = NULL;
+  return JS_NewInt32(ctx, n);
+}
+
+// limit_stats() -> {allowed, limited, refused, rules: [{prefix, header, rate, burst, accept, limited}]}
+static JSValue js_limit_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  JSValue rules = JS_NewArray(ctx);
+
+  for (int i = 0; i < limiter.nrules; i++) {
+    const limit_rule_t *r = &limiter.rules[i];
+    JSValue rule = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, rule, "prefix", JS_NewStringLen(ctx, r->prefix, r->prefix_len));
+    if (r->header_len)
+      JS_SetPropertyStr(ctx, rule, "header", JS_NewStringLen(ctx, r->header, r->header_len));
+    JS_SetPropertyStr(ctx, rule, "rate", JS_NewFloat64(ctx, r->rate));
+    JS_SetPropertyStr(ctx, rule, "burst", JS_NewFloat64(ctx, r->burst));
+    JS_SetPropertyStr(ctx, rule, "accept", JS_NewBool(ctx, r->accept));
+    JS_SetPropertyStr(ctx, rule, "limited", JS_NewInt64(ctx, (int64_t)r->limited));
+    JS_SetPropertyUint32(ctx, rules, (uint32_t)i, rule);
+  }
+  JS_SetPropertyStr(ctx, obj, "allowed", JS_NewInt64(ctx, (int64_t)limiter.allowed));
+  JS_SetPropertyStr(ctx, obj, "limited", JS_NewInt64(ctx, (int64_t)limiter.limited));
+  JS_SetPropertyStr(ctx, obj, "refused", JS_NewInt64(ctx, (int64_t)limiter.refused));
+  JS_SetPropertyStr(ctx, obj, "rules", rules);
+  return obj;
+}
+
+// Reads a numeric option, leaving *out alone when it is undefined
+static int js_number_option(JSContext *ctx, JSValueConst obj, const char *name, double *out) {
+  JSValue v = JS_GetPropertyStr(ctx, obj, name);
+  int err = !JS_IsUndefined(v) && JS_ToFloat64(ctx, out, v);
+  JS_FreeValue(ctx, v);
+  return err ? -1 : 0;
+}
+
+// overload_enable(epfd, listenFd, events, {lagMs, queueMs, maxConnections, retryAfter}) -> 0
+// Watches the loop polling epfd and pauses listenFd (registered there with
+// events) under load. lagMs (50) and queueMs (50) of 0 turn that signal
+// off; maxConnections 0 is no cap; retryAfter (1) goes into 503s.
+static JSValue js_overload_enable(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int epfd, listen_fd;
+  uint32_t events;
+  double lag_ms = 50, queue_ms = 50, max_conns = 0, retry_after = 1;
+
+  if (JS_ToInt32(ctx, &epfd, argv[0]) || JS_ToInt32(ctx, &listen_fd, argv[1]) ||
+      JS_ToUint32(ctx, &events, argv[2]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 3) &&
+      (js_number_option(ctx, argv[3], "lagMs", &lag_ms) ||
+       js_number_option(ctx, argv[3], "queueMs", &queue_ms) ||
+       js_number_option(ctx, argv[3], "maxConnections", &max_conns) ||
+       js_number_option(ctx, argv[3], "retryAfter", &retry_after)))
+    return JS_EXCEPTION;
+  if (!(lag_ms >= 0) || !(queue_ms >= 0) || !(max_conns >= 0) || !(retry_after >= 0))
+    return JS_ThrowRangeError(ctx, "overload thresholds must not be negative");
+
+  if (overload.paused && overload.listen_fd != listen_fd) {
+    overload.shedding = 0;
+    overload.max_conns = 0;
+    overload_listen_update(); // hand the previous listener back to its loop
+  }
+  overload.epfd = epfd;
+  overload.listen_fd = listen_fd;
+  overload.listen_events = events;
+  overload.lag_target = lag_ms > 0 ? (uint64_t)(lag_ms * 1e6) : UINT64_MAX;
+  overload.queue_target = queue_ms > 0 ? (uint64_t)(queue_ms * 1e6) : UINT64_MAX;
+  overload.max_conns = (uint64_t)max_conns;
+  overload.above_since = overload.below_since = 0;
+  overload.response_len = (size_t)snprintf(overload.response, sizeof(overload.response),
+                                           "HTTP/1.1 503 Service Unavailable\r\n"
+                                           "Content-Type: text/plain\r\n"
+                                           "Content-Length: 19\r\n"
+                                           "Retry-After: %.0f\r\n"
+                                           "Connection: close\r\n\r\n"
+                                           "Service Unavailable",
+                                           retry_after < 1e6 ? retry_after : 1e6);
+  overload.enabled = 1;
+  return JS_NewInt32(ctx, 0);
+}
+
+// overload_disable() -> 0. Stops shedding and puts a paused listener back.
+static JSValue js_overload_disable(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  overload.enabled = 0;
+  overload.shedding = 0;
+  overload.max_conns = 0;
+  overload_listen_update();
+  overload.listen_fd = -1;
+  overload.epfd = -1;
+  return JS_NewInt32(ctx, 0);
+}
+
+// overload_reject(fd) -> -1. Sends the 503; fd should be closed.
+static JSValue js_overload_reject(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  overload.shed++;
+  METRIC_ADD(metrics.requests, 1);
+  METRIC_ADD(metrics.status[503], 1);
+  PROBE3(response, 503, 0, 0);
+  ssize_t n = conn_send(fd, overload.response, overload.response_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (n > 0)
+    METRIC_ADD(metrics.bytes_out, (uint64_t)n);
+  return JS_NewInt32(ctx, -1);
+}
+
+// overload_check(fd) -> 0 to serve the request about to be dispatched on
+// fd, -1 if it was answered with a 503 and fd should be closed. On an
+// HTTP/2 connection it is 1 instead and nothing is sent: the caller answers
+// the stream, and the other streams carry on.
+static JSValue js_overload_check(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (!overload.enabled)
+    return JS_NewInt32(ctx, 0);
+  uint64_t now = now_ns();
+  uint64_t waited = metrics.loop_mark && now > metrics.loop_mark ? now - metrics.loop_mark : 0;
+  if (metrics.enabled)
+    hist_record(&metrics.queue, waited);
+  if (!overload.shedding && waited <= overload.queue_target)
+    return JS_NewInt32(ctx, 0);
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  if (c && c->h2) {
+    overload.shed++;
+    return JS_NewInt32(ctx, 1);
+  }
+  return js_overload_reject(ctx, this_val, argc, argv);
+}
+
+// overload_stats() -> {enabled, shedding, paused, lagUs, shed, pauses, pausedMs}
+static JSValue js_overload_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  uint64_t paused_ns = overload.paused_ns + (overload.paused ? now_ns() - overload.paused_at : 0);
+  JS_SetPropertyStr(ctx, obj, "enabled", JS_NewBool(ctx, overload.enabled));
+  JS_SetPropertyStr(ctx, obj, "shedding", JS_NewBool(ctx, overload.shedding));
+  JS_SetPropertyStr(ctx, obj, "paused", JS_NewBool(ctx, overload.paused));
+  JS_SetPropertyStr(ctx, obj, "lagUs", JS_NewFloat64(ctx, (double)overload.lag / 1000.0));
+  JS_SetPropertyStr(ctx, obj, "shed", JS_NewInt64(ctx, (int64_t)overload.shed));
+  JS_SetPropertyStr(ctx, obj, "pauses", JS_NewInt64(ctx, (int64_t)overload.pauses));
+  JS_SetPropertyStr(ctx, obj, "pausedMs", JS_NewFloat64(ctx, (double)paused_ns / 1e6));
+  return obj;
+}
+
+enum { WS_SOCKET, WS_EVENTS, WS_HTTP2 };
+
+// State for a connection taken over as a WebSocket, event stream or HTTP/2
+static ws_conn_t *ws_conn_new(int fd, int kind) {
+  if ((size_t)fd >= ws.cap) {
+    size_t cap = ws.cap ? ws.cap : 1024;
+    while (cap <= (size_t)fd)
+      cap *= 2;
+    ws_conn_t **conns = realloc(ws.conns, cap * sizeof(*conns));
+    if (!conns)
+      return NULL;
+    memset(conns + ws.cap, 0, (cap - ws.cap) * sizeof(*conns));
+    ws.conns = conns;
+    ws.cap = cap;
+  }
+  h2_conn_free(fd); // left over from an earlier connection on this fd
+  ws_conn_t *c = calloc(1, sizeof(ws_conn_t));
+  if (!c)
+    return NULL;
+  c->fd = fd;
+  c->sse = kind == WS_EVENTS;
+  ws.conns[fd] = c;
+  if (kind == WS_EVENTS)
+    ws.streams++;
+  else if (kind == WS_SOCKET)
+    ws.open++;
+  return c;
+}
+
+// ws_upgrade(fd, request, {protocol, maxMessage}) -> true if request was a
+// valid WebSocket handshake and the 101 response was sent. From then on fd
+// is read with ws_read(); protocol is echoed as Sec-WebSocket-Protocol.
+static JSValue js_ws_upgrade(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  int fd;
+  size_t len, vlen, key_len, protocol_len = 0;
+  double max_message = WS_MAX_MESSAGE;
+  const char *protocol = NULL, *v;
+  http_head_t h;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (fd < 0)
+    return JS_ThrowRangeError(ctx, "invalid fd");
+  if (js_is_present(argc, argv, 2)) {
+    if (js_number_option(ctx, argv[2], "maxMessage", &max_message))
+      return JS_EXCEPTION;
+    JSValue p = JS_GetPropertyStr(ctx, argv[2], "protocol");
+    if (!JS_IsUndefined(p) && !JS_IsNull(p))
+      protocol = JS_ToCStringLen(ctx, &protocol_len, p);
+    JS_FreeValue(ctx, p);
+    if (!JS_IsUndefined(p) && !JS_IsNull(p) && !protocol)
+      return JS_EXCEPTION;
+  }
+  if (!(max_message >= 1))
+    max_message = WS_MAX_MESSAGE;
+  const char *buf = js_get_data(ctx, argv[1], &len);
+  if (!buf) {
+    JS_FreeCString(ctx, protocol);
+    return JS_EXCEPTION;
+  }
+
+  int ok = http_head_parse(buf, len, &h) >= 0 && h.method_len == 3 && memcmp(h.method, "GET", 3) == 0;
+  ok = ok && (v = http_head_header(&h, "upgrade", 7, &vlen)) && vlen == 9 && strncasecmp(v, "websocket", 9) == 0;
+  if (ok && (ok = (v = http_head_header(&h, "connection", 10, &vlen)) != NULL)) {
+    ok = 0; // a token list such as "keep-alive, Upgrade"
+    for (size_t i = 0; i + 7 <= vlen && !ok; i++)
+      ok = strncasecmp(v + i, "upgrade", 7) == 0;
+  }
+  ok = ok && (v = http_head_header(&h, "sec-websocket-version", 21, &vlen)) && vlen == 2 && memcmp(v, "13", 2) == 0;
+  const char *key = ok ? http_head_header(&h, "sec-websocket-key", 17, &key_len) : NULL;
+  if (!key || key_len != 24) {
+    js_free_data(ctx, argv[1], buf);
+    JS_FreeCString(ctx, protocol);
+    return JS_FALSE;
+  }
+
+  char concat[24 + sizeof(guid)], accept[29];
+  uint8_t digest[20];
+  memcpy(concat, key, 24);
+  memcpy(concat + 24, guid, sizeof(guid) - 1);
+  sha1((const uint8_t *)concat, 24 + sizeof(guid) - 1, digest);
+  base64_encode(digest, sizeof(digest), accept);
+  js_free_data(ctx, argv[1], buf);
+
+  char response[512];
+  int n = snprintf(response, sizeof(response),
+                   "HTTP/1.1 101 Switching Protocols\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: %s\r\n"
+                   "%s%.*s%s\r\n",
+                   accept, protocol ? "Sec-WebSocket-Protocol: " : "", protocol ? (int)protocol_len : 0,
+                   protocol ? protocol : "", protocol ? "\r\n" : "");
+  JS_FreeCString(ctx, protocol);
+  if (n <= 0 || n >= (int)sizeof(response))
+    return JS_ThrowRangeError(ctx, "protocol too long");
+
+  ws_conn_t *c = ws_conn_new(fd, WS_SOCKET);
+  if (!c)
+    return JS_ThrowOutOfMemory(ctx);
+  c->max_message = (size_t)max_message;
+  if (ws_write(c, fd, (const uint8_t *)response, (size_t)n, NULL, 0) < 0) {
+    ws_conn_free(fd);
+    return JS_FALSE;
+  }
+  return JS_TRUE;
+}
+
+// ws_read(fd, maxBytes) -> {messages, more, close, reason}. Reads up to
+// maxBytes (64 KB) of frames: messages are strings (text) and ArrayBuffers
+// (binary); more means the budget ran out before the socket was drained.
+// close is set once fd should be closed: the peer's close status, the one
+// sent after a protocol error, or 1006 if the connection dropped.
+static JSValue js_ws_read(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, max_bytes = WS_RECV_BUF;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 1) && JS_ToInt32(ctx, &max_bytes, argv[1]))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  if (!c || c->sse || c->h2)
+    return JS_ThrowRangeError(ctx, "fd %d is not a WebSocket", fd);
+  if (!ws.buf && !(ws.buf = malloc(WS_RECV_BUF)))
+    return JS_ThrowOutOfMemory(ctx);
+
+  JSValue messages = JS_NewArray(ctx);
+  uint32_t count = 0;
+  int rc = 0;
+  size_t total = 0;
+  while (total < (size_t)max_bytes) {
+    uint64_t traced = trace_start();
+    ssize_t n = conn_recv(fd, ws.buf, WS_RECV_BUF, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      rc = 1006;
+      break;
+    }
+    METRIC_ADD(metrics.bytes_in, (uint64_t)n);
+    trace_end(TRACE_RECV, fd, traced, (int32_t)n);
+    PROBE2(recv, fd, n);
+    total += (size_t)n;
+    if ((rc = ws_consume(ctx, c, fd, ws.buf, (size_t)n, messages, &count)))
+      break;
+  }
+
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "messages", messages);
+  JS_SetPropertyStr(ctx, obj, "more", JS_NewBool(ctx, !rc && total >= (size_t)max_bytes));
+  if (rc) {
+    JS_SetPropertyStr(ctx, obj, "close", JS_NewInt32(ctx, rc));
+    if (c->opcode == WS_CLOSE && c->ctl_len > 2)
+      JS_SetPropertyStr(ctx, obj, "reason", JS_NewStringLen(ctx, (const char *)c->ctl + 2, c->ctl_len - 2));
+  }
+  return obj;
+}
+
+// ws_send(fd, data) -> bytes still queued for fd, or -1 if it is closing,
+// gone or more than 4 MB behind. Strings go out as text messages,
+// ArrayBuffers and typed arrays as binary ones.
+static JSValue js_ws_send(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, rc;
+  size_t len;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  if (!c || c->sse || c->h2)
+    return JS_ThrowRangeError(ctx, "fd %d is not a WebSocket", fd);
+  if (c->close_sent)
+    return JS_NewInt32(ctx, -1);
+  if (JS_IsString(argv[1])) {
+    const char *s = JS_ToCStringLen(ctx, &len, argv[1]);
+    if (!s)
+      return JS_EXCEPTION;
+    rc = ws_send_frame(c, fd, WS_TEXT, (const uint8_t *)s, len);
+    JS_FreeCString(ctx, s);
+  } else {
+    const uint8_t *data = js_get_bytes(ctx, argv[1], &len);
+    if (!data)
+      return JS_EXCEPTION;
+    rc = ws_send_frame(c, fd, WS_BINARY, data, len);
+  }
+  if (rc < 0)
+    return JS_NewInt32(ctx, -1);
+  ws.messages_out++;
+  return JS_NewInt64(ctx, (int64_t)c->out_bytes);
+}
+
+// ws_flush(fd) -> bytes still queued, -1 if fd is gone. Call when fd (a
+// WebSocket, event stream or HTTP/2 connection) is writable.
+static JSValue js_ws_flush(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  if (!c)
+    return JS_NewInt32(ctx, -1);
+  ssize_t waiting;
+  if (ws_flush(c, fd) < 0 || (c->h2 && h2_pump(c, fd) < 0) || (waiting = conn_flush(fd)) < 0)
+    return JS_NewInt32(ctx, -1);
+  return JS_NewInt64(ctx, (int64_t)(c->out_bytes + (size_t)waiting));
+}
+
+// ws_ping(fd) -> 0, -1 if fd is gone. The pong is consumed by ws_read().
+static JSValue js_ws_ping(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  if (!c || c->sse || c->h2 || c->close_sent)
+    return JS_NewInt32(ctx, -1);
+  return JS_NewInt32(ctx, ws_send_frame(c, fd, WS_PING, NULL, 0));
+}
+
+// ws_close(fd, code=1000, reason) -> 0, -1 if fd is gone. Starts the closing
+// handshake; ws_read() reports the peer's answer.
+static JSValue js_ws_close(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, code = 1000;
+  size_t len = 0;
+  const char *reason = NULL;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 1) && JS_ToInt32(ctx, &code, argv[1]))
+    return JS_EXCEPTION;
+  if (code != 1000 && !(code >= 3000 && code <= 4999) && !(code >= 1001 && code <= 1011 && ws_close_code_valid(code)))
+    return JS_ThrowRangeError(ctx, "invalid close code %d", code);
+  if (js_is_present(argc, argv, 2) && !(reason = JS_ToCStringLen(ctx, &len, argv[2])))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  int rc = c && !c->sse && !c->h2 ? ws_send_close(c, fd, code, reason, len) : -1;
+  JS_FreeCString(ctx, reason);
+  return JS_NewInt32(ctx, rc);
+}
+
+// ws_stats() -> {open, messagesIn, messagesOut, pings}
+static JSValue js_ws_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "open", JS_NewInt64(ctx, (int64_t)ws.open));
+  JS_SetPropertyStr(ctx, obj, "messagesIn", JS_NewInt64(ctx, (int64_t)ws.messages_in));
+  JS_SetPropertyStr(ctx, obj, "messagesOut", JS_NewInt64(ctx, (int64_t)ws.messages_out));
+  JS_SetPropertyStr(ctx, obj, "pings", JS_NewInt64(ctx, (int64_t)ws.pings));
+  return obj;
+}
+
+// pubsub_subscribe(fd, topic) -> subscribers of topic. fd must be a
+// WebSocket or event stream; its subscriptions end when it is closed.
+static JSValue js_pubsub_subscribe(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+  size_t len;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  if (!c || c->h2)
+    return JS_ThrowRangeError(ctx, "fd %d is not a WebSocket or event stream", fd);
+  const char *name = JS_ToCStringLen(ctx, &len, argv[1]);
+  if (!name)
+    return JS_EXCEPTION;
+  ws_topic_t *t = ws_topic_get(name, len, 1);
+  JS_FreeCString(ctx, name);
+  if (!t)
+    return JS_ThrowOutOfMemory(ctx);
+  for (ws_sub_t *s = c->subs; s; s = s->next)
+    if (s->topic == t)
+      return JS_NewUint32(ctx, t->count);
+
+  if (t->count == t->cap) {
+    uint32_t cap = t->cap ? t->cap * 2 : 16;
+    ws_sub_t **subs = realloc(t->subs, cap * sizeof(*subs));
+    if (!subs) {
+      ws_topic_release(t);
+      return JS_ThrowOutOfMemory(ctx);
+    }
+    t->subs = subs;
+    t->cap = cap;
+  }
+  ws_sub_t *s = calloc(1, sizeof(ws_sub_t));
+  if (!s) {
+    ws_topic_release(t);
+    return JS_ThrowOutOfMemory(ctx);
+  }
+  s->topic = t;
+  s->conn = c;
+  s->fd = fd;
+  s->index = t->count;
+  t->subs[t->count++] = s;
+  s->next = c->subs;
+  c->subs = s;
+  ws.subscriptions++;
+  return JS_NewUint32(ctx, t->count);
+}
+
+// pubsub_unsubscribe(fd, topic) -> true if fd was subscribed
+static JSValue js_pubsub_unsubscribe(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+  size_t len;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  const char *name = JS_ToCStringLen(ctx, &len, argv[1]);
+  if (!name)
+    return JS_EXCEPTION;
+  ws_topic_t *t = ws_topic_get(name, len, 0);
+  JS_FreeCString(ctx, name);
+  ws_conn_t *c = ws_get(fd);
+  if (!c || !t)
+    return JS_FALSE;
+  for (ws_sub_t **pp = &c->subs; *pp; pp = &(*pp)->next) {
+    ws_sub_t *s = *pp;
+    if (s->topic == t) {
+      *pp = s->next;
+      ws_sub_free(s);
+      return JS_TRUE;
+    }
+  }
+  return JS_FALSE;
+}
+
+// pubsub_publish(topic, data) -> subscribers that get the message: written,
+// queued, or held to be coalesced. WebSockets get a text message for a
+// string and a binary one for bytes, event streams an event with data as
+// its data; each encoding is built once for all subscribers.
+static JSValue js_pubsub_publish(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  size_t len, data_len;
+  const uint8_t *data;
+  const char *str = NULL;
+  int opcode = WS_TEXT;
+
+  const char *name = JS_ToCStringLen(ctx, &len, argv[0]);
+  if (!name)
+    return JS_EXCEPTION;
+  ws_topic_t *t = ws_topic_get(name, len, 0);
+  JS_FreeCString(ctx, name);
+  if (JS_IsString(argv[1])) {
+    if (!(str = JS_ToCStringLen(ctx, &data_len, argv[1])))
+      return JS_EXCEPTION;
+    data = (const uint8_t *)str;
+  } else {
+    if (!(data = js_get_bytes(ctx, argv[1], &data_len)))
+      return JS_EXCEPTION;
+    opcode = WS_BINARY;
+  }
+  if (!t || !t->count) {
+    JS_FreeCString(ctx, str);
+    return JS_NewInt32(ctx, 0);
+  }
+
+  ws_frame_t *frames[2] = { NULL, NULL }; // WebSocket frame, event
+  uint32_t reached = 0;
+  int oom = 0;
+  for (uint32_t i = 0; i < t->count; i++) {
+    ws_sub_t *s = t->subs[i];
+    ws_conn_t *c = s->conn;
+    if (c->close_sent)
+      continue;
+    ws_frame_t *f = frames[c->sse];
+    if (!f && c->sse) {
+      f = frames[1] = ws_frame_new(sse_encode(NULL, NULL, 0, NULL, 0, data, data_len));
+      if (f)
+        sse_encode(f->data, NULL, 0, NULL, 0, data, data_len);
+    } else if (!f) {
+      uint8_t head[10];
+      size_t head_len = ws_frame_head(head, opcode, data_len);
+      f = frames[0] = ws_frame_new(head_len + data_len);
+      if (f) {
+        memcpy(f->data, head, head_len);
+        if (data_len)
+          memcpy(f->data + head_len, data, data_len);
+      }
+    }
+    if ((oom = !f))
+      break;
+    if (c->out_bytes > t->high_water && t->coalesce) {
+      if (s->latest) {
+        ws_frame_unref(s->latest);
+        ws.coalesced++;
+      } else {
+        c->held++;
+      }
+      f->refs++;
+      s->latest = f;
+      reached++;
+    } else if (c->out_bytes > t->high_water || ws_write_shared(c, s->fd, f) < 0) {
+      t->dropped++;
+      ws.dropped++;
+    } else {
+      reached++;
+      ws.delivered++;
+    }
+  }
+  ws_frame_unref(frames[0]);
+  ws_frame_unref(frames[1]);
+  JS_FreeCString(ctx, str);
+  if (oom)
+    return JS_ThrowOutOfMemory(ctx);
+  t->published++;
+  ws.published++;
+  return JS_NewUint32(ctx, reached);
+}
+
+// pubsub_topic(topic, {policy='drop', highWater=262144}) -> subscribers.
+// Sets what happens to a message for a subscriber with more than highWater
+// bytes queued: 'drop' skips it, 'coalesce' keeps only the newest one until
+// the queue has drained. The topic is kept even without subscribers.
+static JSValue js_pubsub_topic(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  size_t len;
+  double high_water = WS_HIGH_WATER;
+  int coalesce = 0;
+
+  if (js_is_present(argc, argv, 1)) {
+    if (js_number_option(ctx, argv[1], "highWater", &high_water))
+      return JS_EXCEPTION;
+    JSValue p = JS_GetPropertyStr(ctx, argv[1], "policy");
+    if (!JS_IsUndefined(p)) {
+      const char *policy = JS_ToCString(ctx, p);
+      JS_FreeValue(ctx, p);
+      if (!policy)
+        return JS_EXCEPTION;
+      coalesce = strcmp(policy, "coalesce") == 0;
+      int known = coalesce || strcmp(policy, "drop") == 0;
+      JS_FreeCString(ctx, policy);
+      if (!known)
+        return JS_ThrowRangeError(ctx, "policy must be 'drop' or 'coalesce'");
+    }
+  }
+  if (!(high_water >= 0))
+    return JS_ThrowRangeError(ctx, "highWater must be >= 0");
+  const char *name = JS_ToCStringLen(ctx, &len, argv[0]);
+  if (!name)
+    return JS_EXCEPTION;
+  ws_topic_t *t = ws_topic_get(name, len, 1);
+  JS_FreeCString(ctx, name);
+  if (!t)
+    return JS_ThrowOutOfMemory(ctx);
+  t->configured = 1;
+  t->coalesce = (uint8_t)coalesce;
+  t->high_water = (size_t)high_water;
+  return JS_NewUint32(ctx, t->count);
+}
+
+// pubsub_stats() -> {topics, subscriptions, published, delivered, dropped, coalesced}
+// pubsub_stats(topic) -> {subscribers, published, dropped} or null
+static JSValue js_pubsub_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj;
+
+  if (js_is_present(argc, argv, 0)) {
+    size_t len;
+    const char *name = JS_ToCStringLen(ctx, &len, argv[0]);
+    if (!name)
+      return JS_EXCEPTION;
+    ws_topic_t *t = ws_topic_get(name, len, 0);
+    JS_FreeCString(ctx, name);
+    if (!t)
+      return JS_NULL;
+    obj = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, obj, "subscribers", JS_NewUint32(ctx, t->count));
+    JS_SetPropertyStr(ctx, obj, "published", JS_NewInt64(ctx, (int64_t)t->published));
+    JS_SetPropertyStr(ctx, obj, "dropped", JS_NewInt64(ctx, (int64_t)t->dropped));
+    return obj;
+  }
+  obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "topics", JS_NewInt64(ctx, (int64_t)ws.topic_count));
+  JS_SetPropertyStr(ctx, obj, "subscriptions", JS_NewInt64(ctx, (int64_t)ws.subscriptions));
+  JS_SetPropertyStr(ctx, obj, "published", JS_NewInt64(ctx, (int64_t)ws.published));
+  JS_SetPropertyStr(ctx, obj, "delivered", JS_NewInt64(ctx, (int64_t)ws.delivered));
+  JS_SetPropertyStr(ctx, obj, "dropped", JS_NewInt64(ctx, (int64_t)ws.dropped));
+  JS_SetPropertyStr(ctx, obj, "coalesced", JS_NewInt64(ctx, (int64_t)ws.coalesced));
+  return obj;
+}
+
+// sse_open(fd, head, {retry}) -> true if fd now carries an event stream.
+// Sends head, the response status line and headers up to the blank line,
+// then retry (ms before the client reconnects) if given.
+static JSValue js_sse_open(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+  size_t len;
+  double retry = 0;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (fd < 0)
+    return JS_ThrowRangeError(ctx, "invalid fd");
+  if (js_is_present(argc, argv, 2) && js_number_option(ctx, argv[2], "retry", &retry))
+    return JS_EXCEPTION;
+  const char *head = JS_ToCStringLen(ctx, &len, argv[1]);
+  if (!head)
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_conn_new(fd, WS_EVENTS);
+  if (!c) {
+    JS_FreeCString(ctx, head);
+    return JS_ThrowOutOfMemory(ctx);
+  }
+  char tail[32];
+  int n = retry >= 1 && retry < 1e9 ? snprintf(tail, sizeof(tail), "retry: %.0f\n\n", retry) : 0;
+  int rc = ws_write(c, fd, (const uint8_t *)head, len, (const uint8_t *)tail, (size_t)n);
+  JS_FreeCString(ctx, head);
+  if (rc < 0) {
+    ws_conn_free(fd);
+    return JS_FALSE;
+  }
+  return JS_TRUE;
+}
+
+// sse_event(fd, data, id, type) -> bytes still queued for fd, or -1 if it is
+// gone or more than 4 MB behind. Each line of data becomes a data field;
+// id and type are left out when undefined.
+static JSValue js_sse_event(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+  size_t len, id_len = 0, type_len = 0;
+  const char *id = NULL, *type = NULL;
+  uint8_t stack[4096];
+  JSValue ret;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  if (!c || !c->sse)
+    return JS_ThrowRangeError(ctx, "fd %d is not an event stream", fd);
+  const char *data = JS_ToCStringLen(ctx, &len, argv[1]);
+  if (!data)
+    return JS_EXCEPTION;
+  if ((js_is_present(argc, argv, 2) && !(id = JS_ToCStringLen(ctx, &id_len, argv[2]))) ||
+      (js_is_present(argc, argv, 3) && !(type = JS_ToCStringLen(ctx, &type_len, argv[3])))) {
+    JS_FreeCString(ctx, data);
+    JS_FreeCString(ctx, id);
+    return JS_EXCEPTION;
+  }
+  size_t n = sse_encode(NULL, id, id_len, type, type_len, (const uint8_t *)data, len);
+  uint8_t *buf = n <= sizeof(stack) ? stack : malloc(n);
+  if ((id && strpbrk(id, "\r\n")) || (type && strpbrk(type, "\r\n"))) {
+    ret = JS_ThrowRangeError(ctx, "id and type must not contain line breaks");
+  } else if (!buf) {
+    ret = JS_ThrowOutOfMemory(ctx);
+  } else {
+    sse_encode(buf, id, id_len, type, type_len, (const uint8_t *)data, len);
+    if (ws_write(c, fd, buf, n, NULL, 0) < 0) {
+      ret = JS_NewInt32(ctx, -1);
+    } else {
+      ws.events++;
+      ret = JS_NewInt64(ctx, (int64_t)c->out_bytes);
+    }
+  }
+  if (buf != stack)
+    free(buf);
+  JS_FreeCString(ctx, data);
+  JS_FreeCString(ctx, id);
+  JS_FreeCString(ctx, type);
+  return ret;
+}
+
+// sse_heartbeat(intervalMs) -> {written, failed}. Sends a comment to every
+// event stream not written for intervalMs, so proxies keep it open. failed
+// lists the fds of streams whose write failed (a dead client, or one more
+// than 4 MB behind), for the caller to close.
+static JSValue js_sse_heartbeat(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  double interval_ms;
+
+  if (JS_ToFloat64(ctx, &interval_ms, argv[0]))
+    return JS_EXCEPTION;
+  uint64_t now = now_ns(), idle = interval_ms > 0 ? (uint64_t)(interval_ms * 1e6) : 0;
+  uint32_t written = 0, failed = 0;
+  JSValue fds = JS_NewArray(ctx);
+  if (JS_IsException(fds))
+    return fds;
+  ws_conn_t *last = ws.newest; // streams written here move behind it
+  while (ws.oldest && ws.oldest->written_ns + idle <= now) {
+    ws_conn_t *c = ws.oldest;
+    if (ws_write(c, c->fd, (const uint8_t *)":\n\n", 3, NULL, 0) < 0)
+      JS_SetPropertyUint32(ctx, fds, failed++, JS_NewInt32(ctx, c->fd));
+    else
+      written++;
+    if (c == last)
+      break;
+  }
+  ws.heartbeats += written;
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "written", JS_NewUint32(ctx, written));
+  JS_SetPropertyStr(ctx, obj, "failed", fds);
+  return obj;
+}
+
+// sse_stats() -> {streams, events, heartbeats}
+static JSValue js_sse_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "streams", JS_NewInt64(ctx, (int64_t)ws.streams));
+  JS_SetPropertyStr(ctx, obj, "events", JS_NewInt64(ctx, (int64_t)ws.events));
+  JS_SetPropertyStr(ctx, obj, "heartbeats", JS_NewInt64(ctx, (int64_t)ws.heartbeats));
+  return obj;
+}
+
+// h2_open(fd, {upgrade, maxStreams, maxBody}) -> true if fd now speaks
+// HTTP/2 and the server's SETTINGS were sent. upgrade is the HTTP2-Settings
+// value of an HTTP/1.1 request that asked for h2c: the 101 response goes
+// first, and that request becomes stream 1, to be answered with
+// h2_respond(). Otherwise the client preface is expected next. maxStreams
+// (100) caps concurrent streams and maxBody (1 MB) request bodies; larger
+// ones are answered 413 here.
+static JSValue js_h2_open(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+  int fd;
+  double max_streams = H2_MAX_STREAMS, max_body = H2_MAX_BODY;
+  uint8_t settings[256];
+  ssize_t settings_len = -1;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (fd < 0)
+    return JS_ThrowRangeError(ctx, "invalid fd");
+  if (js_is_present(argc, argv, 1)) {
+    if (js_number_option(ctx, argv[1], "maxStreams", &max_streams) ||
+        js_number_option(ctx, argv[1], "maxBody", &max_body))
+      return JS_EXCEPTION;
+    JSValue v = JS_GetPropertyStr(ctx, argv[1], "upgrade");
+    if (!JS_IsUndefined(v) && !JS_IsNull(v)) {
+      size_t len;
+      const char *s = JS_ToCStringLen(ctx, &len, v);
+      JS_FreeValue(ctx, v);
+      if (!s)
+        return JS_EXCEPTION;
+      settings_len = len <= sizeof(settings) * 4 / 3 ? base64url_decode(s, len, settings) : -1;
+      JS_FreeCString(ctx, s);
+      if (settings_len < 0 || settings_len % 6)
+        return JS_FALSE;
+    }
+  }
+  if (max_streams < 1 || max_streams > 1 << 20 || max_body < 0 || max_body > 1e15)
+    return JS_ThrowRangeError(ctx, "invalid HTTP/2 limits");
+
+  h2_conn_t *h = calloc(1, sizeof(h2_conn_t));
+  if (!h)
+    return JS_ThrowOutOfMemory(ctx);
+  h->dec.max = h->enc.max = H2_TABLE_SIZE;
+  h->max_streams = (uint32_t)max_streams;
+  h->max_body = (size_t)max_body;
+  h->peer_frame = 16384;
+  h->peer_window = h->send_window = 65535;
+  h->recv_window = H2_CONN_WINDOW;
+  if (settings_len > 0 && h2_settings(h, settings, (size_t)settings_len)) {
+    free(h);
+    return JS_FALSE;
+  }
+  ws_conn_t *c = ws_conn_new(fd, WS_HTTP2);
+  if (!c) {
+    free(h);
+    return JS_ThrowOutOfMemory(ctx);
+  }
+  c->h2 = h;
+  h2.open++;
+
+  // SETTINGS, then the connection window opened past the 64 KB default
+  uint8_t out[sizeof(switching) + 9 + 18 + 9 + 4], *p = out;
+  if (settings_len >= 0) {
+    memcpy(p, switching, sizeof(switching) - 1);
+    p += sizeof(switching) - 1;
+  }
+  static const uint8_t head[9] = { 0, 0, 18, H2_SETTINGS };
+  memcpy(p, head, 9);
+  p += 9;
+  uint32_t values[3][2] = { { 3, h->max_streams }, { 4, H2_WINDOW }, { 6, H2_MAX_HEADERS } };
+  for (int i = 0; i < 3; i++, p += 6) {
+    p[0] = 0;
+    p[1] = (uint8_t)values[i][0];
+    h2_put_u32(p + 2, values[i][1]);
+  }
+  static const uint8_t update[9] = { 0, 0, 4, H2_WINDOW_UPDATE };
+  memcpy(p, update, 9);
+  h2_put_u32(p + 9, H2_CONN_WINDOW - 65535);
+  p += 13;
+
+  if (settings_len >= 0) {
+    h2_stream_t *s = h2_stream_new(h, 1);
+    if (s)
+      s->ended = 1;
+    h->last_stream = 1;
+  }
+  if (ws_write(c, fd, out, (size_t)(p - out), NULL, 0) < 0) {
+    h2_conn_free(fd);
+    return JS_FALSE;
+  }
+  return JS_TRUE;
+}
+
+// The request on s as parse_http_request() returns it, plus its stream id.
+// Repeated fields are joined with commas (cookies with semicolons), and
+// :authority stands in for a missing host.
+static JSValue h2_request(JSContext *ctx, h2_stream_t *s) {
+  JSValue result = JS_NewObject(ctx), headers = JS_NewObject(ctx);
+  const char *path = "/", *authority = NULL, *content_type = "";
+  size_t path_len = 1;
+  int has_host = 0;
+
+  JS_SetPropertyStr(ctx, result, "stream", JS_NewUint32(ctx, s->id));
+  for (size_t off = 0; off < s->fields_len;) {
+    uint32_t lens[2];
+    memcpy(lens, s->fields + off, 8);
+    const char *name = (const char *)s->fields + off + 8, *value = name + lens[0] + 1;
+    size_t start = off;
+    off += 10 + lens[0] + lens[1];
+    if (name[0] == ':') {
+      if (!strcmp(name, ":method"))
+        JS_SetPropertyStr(ctx, result, "method", JS_NewStringLen(ctx, value, lens[1]));
+      else if (!strcmp(name, ":path"))
+        path = value, path_len = lens[1];
+      else if (!strcmp(name, ":authority"))
+        authority = value;
+      continue;
+    }
+    if (!strcmp(name, "content-type"))
+      content_type = value;
+    has_host |= !strcmp(name, "host");
+    int repeated = 0;
+    for (size_t o = 0; o < start && !repeated;) {
+      uint32_t l[2];
+      memcpy(l, s->fields + o, 8);
+      repeated = l[0] == lens[0] && !memcmp(s->fields + o + 8, name, lens[0]);
+      o += 10 + l[0] + l[1];
+    }
+    if (repeated) {
+      JSValue prev = JS_GetPropertyStr(ctx, headers, name);
+      size_t prev_len;
+      const char *p = JS_ToCStringLen(ctx, &prev_len, prev);
+      JS_FreeValue(ctx, prev);
+      char *joined = p ? malloc(prev_len + 2 + lens[1]) : NULL;
+      if (joined) {
+        memcpy(joined, p, prev_len);
+        memcpy(joined + prev_len, strcmp(name, "cookie") ? ", " : "; ", 2);
+        memcpy(joined + prev_len + 2, value, lens[1]);
+        JS_SetPropertyStr(ctx, headers, name, JS_NewStringLen(ctx, joined, prev_len + 2 + lens[1]));
+        free(joined);
+      }
+      JS_FreeCString(ctx, p);
+    } else {
+      JS_SetPropertyStr(ctx, headers, name, JS_NewStringLen(ctx, value, lens[1]));
+    }
+  }
+  if (authority && !has_host)
+    JS_SetPropertyStr(ctx, headers, "host", JS_NewString(ctx, authority));
+  JS_SetPropertyStr(ctx, result, "httpVersion", JS_NewString(ctx, "HTTP/2.0"));
+  http_set_target(ctx, result, path, path_len);
+  JS_SetPropertyStr(ctx, result, "headers", headers);
+  http_set_body(ctx, result, s->body ? (const char *)s->body : "", s->body_len, content_type);
+  return result;
+}
+
+// h2_read(fd, maxBytes) -> {requests, more, close}. Reads up to maxBytes
+// (64 KB) of frames; requests are the ones completed meanwhile, in the
+// shape parse_http_request() returns plus a stream id for h2_respond().
+// close is set once fd should be closed: the client went away or broke the
+// protocol (GOAWAY was sent), or said GOAWAY itself and nothing is pending.
+static JSValue js_h2_read(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, max_bytes = WS_RECV_BUF, rc = 0;
+  size_t total = 0;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 1) && JS_ToInt32(ctx, &max_bytes, argv[1]))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  if (!c || !c->h2)
+    return JS_ThrowRangeError(ctx, "fd %d is not an HTTP/2 connection", fd);
+  if (!ws.buf && !(ws.buf = malloc(WS_RECV_BUF)))
+    return JS_ThrowOutOfMemory(ctx);
+
+  while (total < (size_t)max_bytes) {
+    uint64_t traced = trace_start();
+    ssize_t n = conn_recv(fd, ws.buf, WS_RECV_BUF, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      rc = 1;
+      break;
+    }
+    METRIC_ADD(metrics.bytes_in, (uint64_t)n);
+    trace_end(TRACE_RECV, fd, traced, (int32_t)n);
+    PROBE2(recv, fd, n);
+    total += (size_t)n;
+    if ((rc = h2_consume(c, fd, ws.buf, (size_t)n)))
+      break;
+  }
+
+  h2_conn_t *h = c->h2;
+  JSValue requests = JS_NewArray(ctx);
+  uint32_t count = 0;
+  for (h2_stream_t *s = h->list; s; s = s->next) {
+    if (!s->ready)
+      continue;
+    s->ready = 0;
+    JS_SetPropertyUint32(ctx, requests, count++, h2_request(ctx, s));
+    free(s->fields);
+    free(s->body);
+    s->fields = s->body = NULL;
+    s->fields_len = s->fields_cap = s->body_len = s->body_cap = 0;
+    h2.requests++;
+  }
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "requests", requests);
+  JS_SetPropertyStr(ctx, obj, "more", JS_NewBool(ctx, !rc && total >= (size_t)max_bytes));
+  JS_SetPropertyStr(ctx, obj, "close", JS_NewBool(ctx, rc || (h->goaway && !h->streams)));
+  return obj;
+}
+
+static int h2_connection_field(const char *name, size_t len) {
+  static const char *const names[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+                                       "upgrade" };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    if (strlen(names[i]) == len && !memcmp(names[i], name, len))
+      return 1;
+  return 0;
+}
+
+// h2_respond(fd, stream, status, fields, body) -> bytes still queued for
+// fd, or -1 if it is gone or more than 4 MB behind. fields is a flat array
+// of names and values; connection-specific ones are dropped and
+// content-length comes from body unless that is empty (as for HEAD). body
+// is a string, ArrayBuffer or typed array. A stream the client reset in the
+// meantime is skipped.
+static JSValue js_h2_respond(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, status;
+  uint32_t id, count = 0;
+  size_t len = 0, block_len = 64;
+  const uint8_t *body = NULL;
+  const char *body_str = NULL;
+  JSValue ret = JS_EXCEPTION;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]) || JS_ToUint32(ctx, &id, argv[1]) || JS_ToInt32(ctx, &status, argv[2]))
+    return JS_EXCEPTION;
+  if (status < 100 || status > 999)
+    return JS_ThrowRangeError(ctx, "invalid status %d", status);
+  ws_conn_t *c = ws_get(fd);
+  if (!c || !c->h2)
+    return JS_NewInt32(ctx, -1);
+  h2_conn_t *h = c->h2;
+  h2_stream_t *s = h2_stream_get(h, id);
+  if (!s || !s->ended || s->out)
+    return JS_NewInt64(ctx, (int64_t)c->out_bytes);
+
+  JSValue v = JS_GetPropertyStr(ctx, argv[3], "length");
+  int err = JS_ToUint32(ctx, &count, v);
+  JS_FreeValue(ctx, v);
+  if (err)
+    return JS_EXCEPTION;
+  count &= ~1u;
+  const char **strs = calloc(count + 1, sizeof(*strs));
+  size_t *lens = calloc(count + 1, sizeof(*lens));
+  uint8_t *block = NULL;
+  if (!strs || !lens) {
+    JS_ThrowOutOfMemory(ctx);
+    goto done;
+  }
+  // Every field is checked before any is encoded: the dynamic table must
+  // not change for a block that is never sent
+  for (uint32_t i = 0; i < count; i++) {
+    v = JS_GetPropertyUint32(ctx, argv[3], i);
+    strs[i] = JS_ToCStringLen(ctx, &lens[i], v);
+    JS_FreeValue(ctx, v);
+    if (!strs[i])
+      goto done;
+    for (size_t k = 0; k < lens[i]; k++) {
+      char ch = strs[i][k];
+      if (ch == '\r' || ch == '\n' || ch == '\0' || (!(i & 1) && (ch == ':' || ch == ' ')))
+        goto invalid;
+    }
+    if (!(i & 1) && (!lens[i] || lens[i] > 255))
+      goto invalid;
+    block_len += lens[i] + 8;
+  }
+  if (JS_IsString(argv[4])) {
+    if (!(body_str = JS_ToCStringLen(ctx, &len, argv[4])))
+      goto done;
+    body = (const uint8_t *)body_str;
+  } else if (js_is_present(argc, argv, 4) && !JS_IsNull(argv[4])) {
+    if (!(body = js_get_bytes(ctx, argv[4], &len)))
+      goto done;
+  }
+  if (!(block = malloc(block_len))) {
+    JS_ThrowOutOfMemory(ctx);
+    goto done;
+  }
+
+  char value[24], name[256];
+  size_t n = h2_block_start(h, block);
+  snprintf(value, sizeof(value), "%d", status);
+  n += h2_encode(h, block + n, ":status", 7, value, 3);
+  for (uint32_t i = 0; i < count; i += 2) {
+    for (size_t k = 0; k < lens[i]; k++)
+      name[k] = (char)tolower((unsigned char)strs[i][k]);
+    if (h2_connection_field(name, lens[i]) || (len && lens[i] == 14 && !memcmp(name, "content-length", 14)))
+      continue;
+    n += h2_encode(h, block + n, name, lens[i], strs[i + 1], lens[i + 1]);
+  }
+  if (len) {
+    int k = snprintf(value, sizeof(value), "%zu", len);
+    n += h2_encode(h, block + n, "content-length", 14, value, (size_t)k);
+  }
+  if (h2_send_block(c, fd, id, block, n, !len) < 0) {
+    ret = JS_NewInt32(ctx, -1);
+    goto done;
+  }
+  ssize_t framed = len ? h2_data(c, fd, s, body, len) : 0;
+  if (framed < 0) {
+    ret = JS_NewInt32(ctx, -1);
+    goto done;
+  }
+  if ((size_t)framed < len) {
+    if (!(s->out = malloc(len - (size_t)framed))) {
+      h2_reset(c, fd, id, H2_INTERNAL_ERROR);
+    } else {
+      memcpy(s->out, body + framed, len - (size_t)framed);
+      s->out_len = len - (size_t)framed;
+    }
+  } else {
+    h2_stream_free(h, s);
+  }
+  ret = JS_NewInt64(ctx, (int64_t)c->out_bytes);
+  goto done;
+
+invalid:
+  JS_ThrowRangeError(ctx, "invalid HTTP/2 response field");
+done:
+  for (uint32_t i = 0; strs && i < count; i++)
+    JS_FreeCString(ctx, strs[i]);
+  JS_FreeCString(ctx, body_str);
+  free(strs);
+  free(lens);
+  free(block);
+  return ret;
+}
+
+// h2_close(fd, code=0) -> 0, -1 if fd is gone. Sends GOAWAY: streams open
+// so far are still answered, new ones are refused.
+static JSValue js_h2_close(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, code = H2_NO_ERROR;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (js_is_present(argc, argv, 1) && JS_ToInt32(ctx, &code, argv[1]))
+    return JS_EXCEPTION;
+  ws_conn_t *c = ws_get(fd);
+  if (!c || !c->h2)
+    return JS_NewInt32(ctx, -1);
+  h2_goaway(c, fd, code);
+  return JS_NewInt32(ctx, 0);
+}
+
+// h2_stats() -> {connections, streams, requests, resets}
+static JSValue js_h2_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "connections", JS_NewInt64(ctx, (int64_t)h2.open));
+  JS_SetPropertyStr(ctx, obj, "streams", JS_NewInt64(ctx, (int64_t)h2.streams));
+  JS_SetPropertyStr(ctx, obj, "requests", JS_NewInt64(ctx, (int64_t)h2.requests));
+  JS_SetPropertyStr(ctx, obj, "resets", JS_NewInt64(ctx, (int64_t)h2.resets));
+  return obj;
+}
+
+#ifdef QJS_TLS
+// A string option as a C string to free with JS_FreeCString; NULL in *out
+// if it is absent. -1 with an exception pending.
+static int js_string_option(JSContext *ctx, JSValueConst obj, const char *name, const char **out) {
+  JSValue v = JS_GetPropertyStr(ctx, obj, name);
+  *out = NULL;
+  if (!JS_IsUndefined(v) && !JS_IsNull(v))
+    *out = JS_ToCString(ctx, v);
+  int err = JS_IsException(v) || (!JS_IsUndefined(v) && !JS_IsNull(v) && !*out);
+  JS_FreeValue(ctx, v);
+  return err ? -1 : 0;
+}
+
+// An array of protocol names in ALPN wire format (length-prefixed)
+static int tls_alpn_option(JSContext *ctx, JSValueConst obj, uint8_t *out, size_t *out_len) {
+  JSValue list = JS_GetPropertyStr(ctx, obj, "alpn");
+  uint32_t count = 0;
+  int rc = 0;
+  *out_len = 0;
+  if (JS_IsUndefined(list) || JS_IsNull(list))
+    return 0;
+  JSValue length = JS_GetPropertyStr(ctx, list, "length");
+  if (!JS_IsArray(ctx, list) || JS_ToUint32(ctx, &count, length)) {
+    rc = -1;
+    JS_ThrowTypeError(ctx, "alpn must be an array of strings");
+  }
+  JS_FreeValue(ctx, length);
+  for (uint32_t i = 0; !rc && i < count; i++) {
+    size_t len;
+    JSValue v = JS_GetPropertyUint32(ctx, list, i);
+    const char *name = JS_ToCStringLen(ctx, &len, v);
+    JS_FreeValue(ctx, v);
+    if (!name) {
+      rc = -1;
+    } else if (len == 0 || len > 255 || *out_len + 1 + len > 255) {
+      rc = -1;
+      JS_ThrowRangeError(ctx, "alpn names must be 1-255 bytes, 255 in all");
+    } else {
+      out[(*out_len)++] = (uint8_t)len;
+      memcpy(out + *out_len, name, len);
+      *out_len += len;
+    }
+    JS_FreeCString(ctx, name);
+  }
+  JS_FreeValue(ctx, list);
+  return rc;
+}
+
+// Picks the first of the server's protocols that the client offers. A client
+// offering none of them gets no ALPN answer instead of a failed handshake.
+static int tls_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *out_len, const unsigned char *in,
+                           unsigned int in_len, void *arg) {
+  unsigned char *selected;
+  if (SSL_select_next_proto(&selected, out_len, tls.alpn, (unsigned int)tls.alpn_len, in, in_len) !=
+      OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+// Sessions in the shared-memory cache are keyed "tls:" and the session id
+static size_t tls_cache_key(const unsigned char *id, size_t id_len, char *key) {
+  memcpy(key, "tls:", 4);
+  memcpy(key + 4, id, id_len);
+  return 4 + id_len;
+}
+
+static shm_table_t *tls_cache_table(void) {
+  return shm_lookup(tls.cache);
+}
+
+static int tls_cache_new(SSL *ssl, SSL_SESSION *sess) {
+  shm_table_t *t = tls_cache_table();
+  char key[4 + SSL_MAX_SSL_SESSION_ID_LENGTH];
+  unsigned int id_len;
+  const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+  int len = i2d_SSL_SESSION(sess, NULL);
+  size_t klen = tls_cache_key(id, id_len, key);
+  if (!t || len <= 0 || !shm_fits(t, klen, (size_t)len))
+    return 0;
+  unsigned char *der = malloc((size_t)len), *p = der;
+  if (!der)
+    return 0;
+  i2d_SSL_SESSION(sess, &p);
+
+  shm_value_t v = { .type = SHM_STRING, .data = (const char *)der, .len = (size_t)len };
+  uint32_t hash = shm_hash(key, klen), group = hash % t->ngroups;
+  int64_t now = now_ms();
+  shm_lock(t, group);
+  int i = shm_find_locked(t, group, hash, key, klen, now);
+  if (i < 0)
+    i = shm_claim_locked(t, group, now);
+  shm_fill(shm_slot(t, group, i), hash, key, klen, &v, now + (int64_t)SSL_SESSION_get_timeout(sess) * 1000);
+  shm_unlock(t, group);
+  free(der);
+  return 0; // OpenSSL keeps no extra reference
+}
+
+static SSL_SESSION *tls_cache_get(SSL *ssl, const unsigned char *id, int id_len, int *copy) {
+  shm_table_t *t = tls_cache_table();
+  char key[4 + SSL_MAX_SSL_SESSION_ID_LENGTH];
+  SSL_SESSION *sess = NULL;
+  shm_value_t v;
+  *copy = 0;
+  if (!t || id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+    return NULL;
+  char *buf = malloc(t->slot_size);
+  if (!buf)
+    return NULL;
+  if (shm_read(t, key, tls_cache_key(id, (size_t)id_len, key), buf, &v)) {
+    const unsigned char *p = (const unsigned char *)v.data;
+    sess = d2i_SSL_SESSION(NULL, &p, (long)v.len);
+  }
+  if (sess)
+    t->hits++;
+  else
+    t->misses++;
+  free(buf);
+  ERR_clear_error();
+  return sess;
+}
+
+static void tls_cache_remove(SSL_CTX *sctx, SSL_SESSION *sess) {
+  shm_table_t *t = tls_cache_table();
+  char key[4 + SSL_MAX_SSL_SESSION_ID_LENGTH];
+  unsigned int id_len;
+  const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+  if (!t)
+    return;
+  size_t klen = tls_cache_key(id, id_len, key);
+  uint32_t hash = shm_hash(key, klen), group = hash % t->ngroups;
+  shm_lock(t, group);
+  int i = shm_find_locked(t, group, hash, key, klen, now_ms());
+  if (i >= 0)
+    shm_clear(shm_slot(t, group, i));
+  shm_unlock(t, group);
+}
+
+// Throws err with OpenSSL's reason for the last failure
+static JSValue tls_throw(JSContext *ctx, const char *err) {
+  unsigned long e = ERR_peek_last_error();
+  const char *reason = e ? ERR_reason_error_string(e) : NULL;
+  ERR_clear_error();
+  return JS_ThrowInternalError(ctx, "%s: %s", err, reason ? reason : "unknown error");
+}
+
+// tls_server({cert, key, alpn, ticketKey, cache, ktls=false}) -> true
+// Loads the certificate chain and private key (PEM files) that
+// tls_accept() uses from then on; connections already open keep the old
+// ones. alpn lists protocols in order of preference. Workers given the
+// same ticketKey (a file of 80 random bytes) resume each other's sessions
+// from tickets. cache is a table from shm.open() with slots of about 1 KB:
+// sessions are stored there, and without a ticketKey TLS 1.3 tickets
+// point into it instead of carrying the session. ktls: true hands
+// encryption to the kernel after the handshake; a KeyUpdate that asks for
+// the server's then ends the connection, as OpenSSL cannot send it.
+static JSValue js_tls_server(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  const char *cert = NULL, *key = NULL, *ticket_key = NULL;
+  uint8_t alpn[256], keys[80];
+  size_t alpn_len = 0;
+  int ktls = 0, cache = -1;
+  SSL_CTX *sctx = NULL;
+  JSValue ret = JS_EXCEPTION;
+
+  if (!JS_IsObject(argv[0]))
+    return JS_ThrowTypeError(ctx, "options must be an object");
+  if (js_string_option(ctx, argv[0], "cert", &cert) || js_string_option(ctx, argv[0], "key", &key) ||
+      js_string_option(ctx, argv[0], "ticketKey", &ticket_key) ||
+      tls_alpn_option(ctx, argv[0], alpn, &alpn_len))
+    goto done;
+  if (!cert || !key) {
+    JS_ThrowTypeError(ctx, "cert and key are required");
+    goto done;
+  }
+  JSValue v = JS_GetPropertyStr(ctx, argv[0], "ktls");
+  if (!JS_IsUndefined(v))
+    ktls = JS_ToBool(ctx, v);
+  JS_FreeValue(ctx, v);
+  v = JS_GetPropertyStr(ctx, argv[0], "cache");
+  if (!JS_IsUndefined(v) && !JS_IsNull(v)) {
+    shm_table_t *t = shm_this(ctx, v);
+    cache = t ? shm_handle(t) : -2;
+  }
+  JS_FreeValue(ctx, v);
+  if (cache == -2)
+    goto done;
+  if (ticket_key) {
+    int fd = open(ticket_key, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, keys, sizeof(keys)) : -1;
+    if (fd >= 0)
+      close(fd);
+    if (n != (ssize_t)sizeof(keys)) {
+      JS_ThrowRangeError(ctx, "ticketKey must be a file of at least %d bytes", (int)sizeof(keys));
+      goto done;
+    }
+  }
+
+  if (!(sctx = SSL_CTX_new(TLS_server_method()))) {
+    tls_throw(ctx, "SSL_CTX_new() failed");
+    goto done;
+  }
+  SSL_CTX_set_min_proto_version(sctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(sctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+  // Idle connections give back OpenSSL's read and write buffers
+  SSL_CTX_set_mode(sctx, SSL_MODE_RELEASE_BUFFERS);
+  if (SSL_CTX_use_certificate_chain_file(sctx, cert) != 1) {
+    tls_throw(ctx, "cannot load cert");
+    goto done;
+  }
+  if (SSL_CTX_use_PrivateKey_file(sctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(sctx) != 1) {
+    tls_throw(ctx, "cannot load key");
+    goto done;
+  }
+  SSL_CTX_set_session_id_context(sctx, (const unsigned char *)"qjs_sockets", 11);
+  if (ticket_key && SSL_CTX_set_tlsext_ticket_keys(sctx, keys, sizeof(keys)) != 1) {
+    tls_throw(ctx, "cannot set ticketKey");
+    goto done;
+  }
+  if (cache >= 0) {
+    SSL_CTX_set_session_cache_mode(sctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(sctx, tls_cache_new);
+    SSL_CTX_sess_set_get_cb(sctx, tls_cache_get);
+    SSL_CTX_sess_set_remove_cb(sctx, tls_cache_remove);
+    if (!ticket_key)
+      SSL_CTX_set_options(sctx, SSL_OP_NO_TICKET);
+  }
+  if (alpn_len)
+    SSL_CTX_set_alpn_select_cb(sctx, tls_alpn_select, NULL);
+  if (ktls)
+    SSL_CTX_set_keylog_callback(sctx, tls_keylog);
+
+  SSL_CTX_free(tls.server); // open connections hold their own references
+  tls.server = sctx;
+  sctx = NULL;
+  memcpy(tls.alpn, alpn, alpn_len);
+  tls.alpn_len = alpn_len;
+  tls.cache = cache;
+  tls.ktls = (uint8_t)ktls;
+  ret = JS_TRUE;
+
+done:
+  OPENSSL_cleanse(keys, sizeof(keys));
+  SSL_CTX_free(sctx);
+  JS_FreeCString(ctx, cert);
+  JS_FreeCString(ctx, key);
+  JS_FreeCString(ctx, ticket_key);
+  return ret;
+}
+
+// tls_accept(fd) -> 0. fd, an accepted non-blocking socket, speaks TLS from
+// now on with what tls_server() set up; the handshake runs inside the
+// first reads.
+static JSValue js_tls_accept(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (!tls.server)
+    return JS_ThrowTypeError(ctx, "tls_server() has not been called");
+  if (fd < 0)
+    return JS_ThrowRangeError(ctx, "invalid fd %d", fd);
+  if (!tls_conn_new(fd, tls.server, 1))
+    return JS_ThrowOutOfMemory(ctx);
+  return JS_NewInt32(ctx, 0);
+}
+
+// Client context: the system's trust store unless verify is off, or ca
+static SSL_CTX *tls_client_ctx(JSContext *ctx, int verify, const char *ca) {
+  SSL_CTX **slot = ca ? &tls.client_ca : &tls.client[verify];
+  if (*slot && (!ca || !strcmp(ca, tls.client_ca_path)))
+    return *slot;
+  SSL_CTX *cctx = SSL_CTX_new(TLS_client_method());
+  if (!cctx) {
+    tls_throw(ctx, "SSL_CTX_new() failed");
+    return NULL;
+  }
+  SSL_CTX_set_min_proto_version(cctx, TLS1_2_VERSION);
+  SSL_CTX_set_mode(cctx, SSL_MODE_RELEASE_BUFFERS);
+  SSL_CTX_set_session_cache_mode(cctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  if (verify) {
+    SSL_CTX_set_verify(cctx, SSL_VERIFY_PEER, NULL);
+    if ((ca ? SSL_CTX_load_verify_locations(cctx, ca, NULL) : SSL_CTX_set_default_verify_paths(cctx)) != 1) {
+      SSL_CTX_free(cctx);
+      tls_throw(ctx, "cannot load ca");
+      return NULL;
+    }
+  }
+  if (ca) {
+    char *path = strdup(ca);
+    if (!path) {
+      SSL_CTX_free(cctx);
+      JS_ThrowOutOfMemory(ctx);
+      return NULL;
+    }
+    free(tls.client_ca_path);
+    tls.client_ca_path = path;
+  }
+  SSL_CTX_free(*slot);
+  *slot = cctx;
+  return cctx;
+}
+
+// tls_client(fd, {servername, alpn, session, verify=true, ca}) -> 0
+// Starts a handshake as the client on fd, a connected non-blocking socket,
+// and sends the ClientHello. Reads finish it; sends fail with EAGAIN until
+// then. The peer is verified against the system's trust store (or the PEM
+// file ca) and servername, which is also sent as SNI. session is what
+// tls_session() returned for an earlier connection to the same server.
+static JSValue js_tls_client(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd, verify = 1;
+  const char *servername = NULL, *ca = NULL;
+  uint8_t alpn[256];
+  size_t alpn_len = 0, session_len = 0;
+  const uint8_t *session = NULL;
+  JSValue ret = JS_EXCEPTION, session_val = JS_UNDEFINED;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  if (fd < 0)
+    return JS_ThrowRangeError(ctx, "invalid fd %d", fd);
+  if (js_is_present(argc, argv, 1)) {
+    if (js_string_option(ctx, argv[1], "servername", &servername) || js_string_option(ctx, argv[1], "ca", &ca) ||
+        tls_alpn_option(ctx, argv[1], alpn, &alpn_len))
+      goto done;
+    JSValue v = JS_GetPropertyStr(ctx, argv[1], "verify");
+    if (!JS_IsUndefined(v))
+      verify = JS_ToBool(ctx, v);
+    JS_FreeValue(ctx, v);
+    session_val = JS_GetPropertyStr(ctx, argv[1], "session");
+    if (!JS_IsUndefined(session_val) && !JS_IsNull(session_val) &&
+        !(session = js_get_bytes(ctx, session_val, &session_len))) {
+      JS_ThrowTypeError(ctx, "session must be an ArrayBuffer");
+      goto done;
+    }
+  }
+
+  SSL_CTX *cctx = tls_client_ctx(ctx, verify, verify ? ca : NULL);
+  if (!cctx)
+    goto done;
+  tls_conn_t *t = tls_conn_new(fd, cctx, 0);
+  if (!t) {
+    JS_ThrowOutOfMemory(ctx);
+    goto done;
+  }
+  if ((servername && (SSL_set_tlsext_host_name(t->ssl, servername) != 1 ||
+                      (verify && SSL_set1_host(t->ssl, servername) != 1))) ||
+      (alpn_len && SSL_set_alpn_protos(t->ssl, alpn, (unsigned int)alpn_len) != 0)) {
+    tls_conn_free(fd);
+    tls_throw(ctx, "invalid servername or alpn");
+    goto done;
+  }
+  if (session) {
+    const unsigned char *p = session;
+    SSL_SESSION *sess = d2i_SSL_SESSION(NULL, &p, (long)session_len);
+    if (sess) {
+      SSL_set_session(t->ssl, sess);
+      SSL_SESSION_free(sess);
+    }
+    ERR_clear_error(); // a stale session just means a full handshake
+  }
+  int n = SSL_do_handshake(t->ssl);
+  if ((n <= 0 && SSL_get_error(t->ssl, n) != SSL_ERROR_WANT_READ) || tls_flush(t, fd) < 0) {
+    tls_conn_free(fd);
+    tls_throw(ctx, "handshake failed");
+    goto done;
+  }
+  ret = JS_NewInt32(ctx, 0);
+
+done:
+  JS_FreeValue(ctx, session_val);
+  JS_FreeCString(ctx, servername);
+  JS_FreeCString(ctx, ca);
+  return ret;
+}
+
+// tls_info(fd) -> {established, version, cipher, alpn, servername, resumed, ktls}
+// or undefined if fd does not speak TLS
+static JSValue js_tls_info(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  tls_conn_t *t = tls_get(fd);
+  if (!t)
+    return JS_UNDEFINED;
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "established", JS_NewBool(ctx, t->established));
+  if (t->established) {
+    const unsigned char *alpn;
+    unsigned int alpn_len;
+    const char *servername = SSL_get_servername(t->ssl, TLSEXT_NAMETYPE_host_name);
+    SSL_get0_alpn_selected(t->ssl, &alpn, &alpn_len);
+    JS_SetPropertyStr(ctx, obj, "version", JS_NewString(ctx, SSL_get_version(t->ssl)));
+    JS_SetPropertyStr(ctx, obj, "cipher", JS_NewString(ctx, SSL_get_cipher_name(t->ssl)));
+    JS_SetPropertyStr(ctx, obj, "alpn", alpn_len ? JS_NewStringLen(ctx, (const char *)alpn, alpn_len) : JS_NULL);
+    JS_SetPropertyStr(ctx, obj, "servername", servername ? JS_NewString(ctx, servername) : JS_NULL);
+    JS_SetPropertyStr(ctx, obj, "resumed", JS_NewBool(ctx, SSL_session_reused(t->ssl)));
+  }
+  JS_SetPropertyStr(ctx, obj, "ktls", JS_NewBool(ctx, t->ktls));
+  return obj;
+}
+
+// tls_session(fd) -> ArrayBuffer to resume with tls_client(), or undefined
+// while the client connection fd has no resumable session. TLS 1.3
+// servers send it after the handshake, so it is there once a response
+// has been read.
+static JSValue js_tls_session(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  tls_conn_t *t = tls_get(fd);
+  SSL_SESSION *sess = t && !t->server ? SSL_get1_session(t->ssl) : NULL;
+  if (!sess || !SSL_SESSION_is_resumable(sess)) {
+    SSL_SESSION_free(sess);
+    return JS_UNDEFINED;
+  }
+  int len = i2d_SSL_SESSION(sess, NULL);
+  uint8_t *der = len > 0 ? malloc((size_t)len) : NULL, *p = der;
+  if (der)
+    i2d_SSL_SESSION(sess, &p);
+  SSL_SESSION_free(sess);
+  if (!der)
+    return JS_ThrowOutOfMemory(ctx);
+  JSValue ab = JS_NewArrayBufferCopy(ctx, der, (size_t)len);
+  free(der);
+  return ab;
+}
+
+// tls_flush(fd) -> bytes still waiting, -1 if fd is gone. Call when a TLS
+// connection is writable: what the socket refused of the last send goes out.
+static JSValue js_tls_flush(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int fd;
+
+  if (JS_ToInt32(ctx, &fd, argv[0]))
+    return JS_EXCEPTION;
+  return JS_NewInt64(ctx, (int64_t)conn_flush(fd));
+}
+
+// tls_stats() -> {connections, handshakes, resumed, failures, ktls}
+static JSValue js_tls_stats(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "connections", JS_NewInt64(ctx, (int64_t)tls.open));
+  JS_SetPropertyStr(ctx, obj, "handshakes", JS_NewInt64(ctx, (int64_t)tls.handshakes));
+  JS_SetPropertyStr(ctx, obj, "resumed", JS_NewInt64(ctx, (int64_t)tls.resumed));
+  JS_SetPropertyStr(ctx, obj, "failures", JS_NewInt64(ctx, (int64_t)tls.failures));
+  JS_SetPropertyStr(ctx, obj, "ktls", JS_NewInt64(ctx, (int64_t)tls.ktls_conns));
+  return obj;
+}
+#else
+// Every tls_* function when the module was built without OpenSSL
+static JSValue js_tls_unavailable(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  return JS_ThrowTypeError(ctx, "built without TLS (OpenSSL headers were not found)");
+}
+#define js_tls_server js_tls_unavailable
+#define js_tls_accept js_tls_unavailable
+#define js_tls_client js_tls_unavailable
+#define js_tls_info js_tls_unavailable
+#define js_tls_session js_tls_unavailable
+#define js_tls_flush js_tls_unavailable
+#define js_tls_stats js_tls_unavailable
+#endif
+
+// profile_start(hz) -> 0. Samples JS stacks hz times per CPU second (99).
+static JSValue js_profile_start(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int hz = PROFILE_DEFAULT_HZ;
+
+  if (js_is_present(argc, argv, 0) && JS_ToInt32(ctx, &hz, argv[0]))
+    return JS_EXCEPTION;
+  if (hz < 1 || hz > 10000)
+    return JS_ThrowRangeError(ctx, "hz must be between 1 and 10000");
+  if (profile.running)
+    return JS_ThrowInternalError(ctx, "profiler already running");
+  if (profile_start(ctx, hz) < 0)
+    return JS_ThrowInternalError(ctx, "setitimer() failed: %s", strerror(errno));
+
+  return JS_NewInt32(ctx, 0);
+}
+
+// profile_stop() -> {samples, stacks, dropped}. The folded stacks are kept
+// until the next profile_start().
+static JSValue js_profile_stop(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  profile_stop();
+
+  JSValue obj = JS_NewObject(ctx);
+  JS_SetPropertyStr(ctx, obj, "samples", JS_NewInt64(ctx, (int64_t)profile.samples));
+  JS_SetPropertyStr(ctx, obj, "stacks", JS_NewInt64(ctx, (int64_t)profile.stacks));
+  JS_SetPropertyStr(ctx, obj, "dropped", JS_NewInt64(ctx, (int64_t)profile.dropped));
+  return obj;
+}
+
+// profile_folded(path) -> stacks written, or profile_folded() -> string,
+// in the folded format of flamegraph.pl
+static JSValue js_profile_folded(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  if (js_is_present(argc, argv, 0)) {
+    const char *path = JS_ToCString(ctx, argv[0]);
+    if (!path)
+      return JS_EXCEPTION;
+    FILE *f = fopen(path, "w");
+    if (!f) {
+      JSValue err = JS_ThrowInternalError(ctx, "fopen(%s) failed: %s", path, strerror(errno));
+      JS_FreeCString(ctx, path);
+      return err;
+    }
+    JS_FreeCString(ctx, path);
+    profile_write(f);
+    fclose(f);
+    return JS_NewInt64(ctx, (int64_t)profile.stacks);
+  }
+
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&buf, &len);
+  if (!f)
+    return JS_ThrowOutOfMemory(ctx);
+  profile_write(f);
+  fclose(f);
+  JSValue result = JS_NewStringLen(ctx, buf, len);
+  free(buf);
+  return result;
+}
+
+static int64_t memory_rss(void) {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return -1;
+  int ok = fscanf(f, "%ld %ld", &pages, &resident) == 2;
+  fclose(f);
+  return ok ? (int64_t)resident * sysconf(_SC_PAGESIZE) : -1;
+}
+
+// memory_usage() -> JS_ComputeMemoryUsage() fields in camelCase, plus rss
+// and gcThreshold. Walks the whole heap; meant for scrapes, not requests.
+static JSValue js_memory_usage(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSMemoryUsage u;
+  JS_ComputeMemoryUsage(JS_GetRuntime(ctx), &u);
+
+  const struct { const char *name; int64_t value; } fields[] = {
+    { "mallocSize", u.malloc_size }, { "mallocLimit", u.malloc_limit },
+    { "memoryUsedSize", u.memory_used_size }, { "mallocCount", u.malloc_count },
+    { "memoryUsedCount", u.memory_used_count }, { "atomCount", u.atom_count },
+    { "atomSize", u.atom_size }, { "strCount", u.str_count }, { "strSize", u.str_size },
+    { "objCount", u.obj_count }, { "objSize", u.obj_size }, { "propCount", u.prop_count },
+    { "propSize", u.prop_size }, { "shapeCount", u.shape_count }, { "shapeSize", u.shape_size },
+    { "jsFuncCount", u.js_func_count }, { "jsFuncSize", u.js_func_size },
+    { "jsFuncCodeSize", u.js_func_code_size }, { "cFuncCount", u.c_func_count },
+    { "arrayCount", u.array_count }, { "fastArrayCount", u.fast_array_count },
+    { "fastArrayElements", u.fast_array_elements }, { "binaryObjectCount", u.binary_object_count },
+    { "binaryObjectSize", u.binary_object_size }, { "rss", memory_rss() },
+    { "gcThreshold", gc_sched.threshold },
+  };
+
+  JSValue obj = JS_NewObject(ctx);
+  for (size_t i = 0; i < countof(fields); i++)
+    JS_SetPropertyStr(ctx, obj, fields[i].name, JS_NewInt64(ctx, fields[i].value));
+  return obj;
+}
+
+// gc() -> pause in microseconds
+static JSValue js_gc(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  uint64_t start = now_ns();
+  gc_collect(JS_GetRuntime(ctx), 0);
+  return JS_NewFloat64(ctx, (double)(gc_sched.last - start) / 1000.0);
+}
+
+// gc_threshold(bytes) -> 0. Heap growth that triggers an automatic collection.
+static JSValue js_gc_threshold(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int64_t bytes;
+
+  if (JS_ToInt64(ctx, &bytes, argv[0]))
+    return JS_EXCEPTION;
+  if (bytes < 0)
+    return JS_ThrowRangeError(ctx, "threshold must not be negative");
+
+  JS_SetGCThreshold(JS_GetRuntime(ctx), (size_t)bytes);
+  gc_sched.threshold = bytes;
+  return JS_NewInt32(ctx, 0);
+}
+
+// memory_limit(bytes) -> 0. Allocations past it throw; 0 removes the limit.
+static JSValue js_memory_limit(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int64_t bytes;
+
+  if (JS_ToInt64(ctx, &bytes, argv[0]))
+    return JS_EXCEPTION;
+  if (bytes < 0)
+    return JS_ThrowRangeError(ctx, "limit must not be negative");
+
+  JS_SetMemoryLimit(JS_GetRuntime(ctx), bytes ? (size_t)bytes : (size_t)-1);
+  return JS_NewInt32(ctx, 0);
+}
+
+// gc_idle(intervalMs) -> 0. Collect when epoll_wait() finds nothing to do,
+// at most every intervalMs and only after traffic; 0 turns it off.
+static JSValue js_gc_idle(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  int64_t interval;
+
+  if (JS_ToInt64(ctx, &interval, argv[0]))
+    return JS_EXCEPTION;
+  if (interval < 0)
+    return JS_ThrowRangeError(ctx, "interval must not be negative");
+
+  gc_sched.idle_interval_ms = interval;
+  return JS_NewInt32(ctx, 0);
+}
+
+// run_pending_jobs() -> number of promise jobs executed
+static JSValue js_run_pending_jobs(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+  JSRuntime *rt = JS_GetRuntime(ctx);
+  JSContext *jctx;
+  int executed = 0;
+
+  for (;;) {
+    int r = JS_ExecutePendingJob(rt, &jctx);
+    if (r == 0)
+      break;
+    if (r < 0)
+      return JS_Throw(ctx, JS_GetException(jctx));
+    executed++;
+  }
+
+  return JS_NewInt32(ctx, executed);
 }
 
 static const JSCFunctionListEntry js_socket_funcs[] = {
@@ -669,25 +12522,129 @@ static const JSCFunctionListEntry js_socket_funcs[] = {
   JS_CFUNC_DEF("listen", 2, js_listen),
   JS_CFUNC_DEF("accept", 1, js_accept),
   JS_CFUNC_DEF("connect", 3, js_connect),
+  JS_CFUNC_DEF("getsockname", 1, js_getsockname),
   JS_CFUNC_DEF("send", 3, js_send),
-  JS_CFUNC_DEF("recv", 3, js_recv),
+  JS_CFUNC_DEF("recv", 4, js_recv),
   JS_CFUNC_DEF("close", 1, js_close),
   JS_CFUNC_DEF("setsockopt", 4, js_setsockopt),
+  JS_CFUNC_DEF("getsockopt", 3, js_getsockopt),
   JS_CFUNC_DEF("shutdown", 2, js_shutdown),
   JS_CFUNC_DEF("gethostbyname", 1, js_gethostbyname),
+  JS_CFUNC_DEF("recvmmsg", 6, js_recvmmsg),
+  JS_CFUNC_DEF("sendmmsg", 7, js_sendmmsg),
+  JS_CFUNC_DEF("udp_addr", 2, js_udp_addr),
+  JS_CFUNC_DEF("udp_set_addr", 5, js_udp_set_addr),
+  JS_CFUNC_DEF("buffer_string", 3, js_buffer_string),
+  JS_CFUNC_DEF("buffer_write", 3, js_buffer_write),
+  JS_CFUNC_DEF("resolve", 2, js_resolve),
+  JS_CFUNC_DEF("dns_config", 1, js_dns_config),
+  JS_CFUNC_DEF("dns_fd", 0, js_dns_fd),
+  JS_CFUNC_DEF("dns_poll", 0, js_dns_poll),
+  JS_CFUNC_DEF("dns_cache_clear", 0, js_dns_cache_clear),
   JS_CFUNC_DEF("setnonblocking", 1, js_setnonblocking),
   JS_CFUNC_DEF("epoll_create1", 1, js_epoll_create1),
   JS_CFUNC_DEF("epoll_ctl", 4, js_epoll_ctl),
   JS_CFUNC_DEF("epoll_wait", 3, js_epoll_wait),
-  JS_CFUNC_DEF("parse_http_request", 1, js_parse_http_request),
+  JS_CFUNC_DEF("parse_http_request", 2, js_parse_http_request),
+  JS_CFUNC_DEF("simd_enable", 1, js_simd_enable),
+  JS_CFUNC_DEF("parse_http_response", 3, js_parse_http_response),
+  JS_CFUNC_DEF("http_frame", 4, js_http_frame),
+  JS_CFUNC_DEF("byte_length", 1, js_byte_length),
   JS_CFUNC_DEF("get_error", 0, js_get_error),
   JS_CFUNC_DEF("is_connected", 1, js_is_connected),
+  JS_CFUNC_DEF("offload", 2, js_offload),
+  JS_CFUNC_DEF("offload_init", 1, js_offload_init),
+  JS_CFUNC_DEF("offload_fd", 0, js_offload_fd),
+  JS_CFUNC_DEF("offload_poll", 0, js_offload_poll),
+  JS_CFUNC_DEF("run_pending_jobs", 0, js_run_pending_jobs),
+  JS_CFUNC_DEF("now_us", 0, js_now_us),
+  JS_CFUNC_DEF("metrics", 0, js_metrics),
+  JS_CFUNC_DEF("metrics_text", 0, js_metrics_text),
+  JS_CFUNC_DEF("metrics_request", 3, js_metrics_request),
+  JS_CFUNC_DEF("metrics_enable", 1, js_metrics_enable),
+  JS_CFUNC_DEF("metrics_reset", 0, js_metrics_reset),
+  JS_CFUNC_DEF("trace_enable", 1, js_trace_enable),
+  JS_CFUNC_DEF("trace_enabled", 0, js_trace_enabled),
+  JS_CFUNC_DEF("trace_request", 5, js_trace_request),
+  JS_CFUNC_DEF("trace_dump", 1, js_trace_dump),
+  JS_CFUNC_DEF("log_open", 2, js_log_open),
+  JS_CFUNC_DEF("log_access", 6, js_log_access),
+  JS_CFUNC_DEF("log_message", 1, js_log_message),
+  JS_CFUNC_DEF("log_reopen", 0, js_log_reopen),
+  JS_CFUNC_DEF("log_close", 0, js_log_close),
+  JS_CFUNC_DEF("log_stats", 0, js_log_stats),
+  JS_CFUNC_DEF("cache_serve", 3, js_cache_serve),
+  JS_CFUNC_DEF("cache_store", 5, js_cache_store),
+  JS_CFUNC_DEF("cache_limit", 1, js_cache_limit),
+  JS_CFUNC_DEF("cache_clear", 0, js_cache_clear),
+  JS_CFUNC_DEF("cache_stats", 0, js_cache_stats),
+  JS_OBJECT_DEF("shm", js_shm_funcs, countof(js_shm_funcs), JS_PROP_CONFIGURABLE),
+  JS_CFUNC_DEF("limit_rule", 2, js_limit_rule),
+  JS_CFUNC_DEF("limit_request", 3, js_limit_request),
+  JS_CFUNC_DEF("limit_clear", 0, js_limit_clear),
+  JS_CFUNC_DEF("limit_stats", 0, js_limit_stats),
+  JS_CFUNC_DEF("overload_enable", 4, js_overload_enable),
+  JS_CFUNC_DEF("overload_disable", 0, js_overload_disable),
+  JS_CFUNC_DEF("overload_check", 1, js_overload_check),
+  JS_CFUNC_DEF("overload_reject", 1, js_overload_reject),
+  JS_CFUNC_DEF("overload_stats", 0, js_overload_stats),
+  JS_CFUNC_DEF("ws_upgrade", 3, js_ws_upgrade),
+  JS_CFUNC_DEF("ws_read", 2, js_ws_read),
+  JS_CFUNC_DEF("ws_send", 2, js_ws_send),
+  JS_CFUNC_DEF("ws_flush", 1, js_ws_flush),
+  JS_CFUNC_DEF("ws_ping", 1, js_ws_ping),
+  JS_CFUNC_DEF("ws_close", 3, js_ws_close),
+  JS_CFUNC_DEF("ws_stats", 0, js_ws_stats),
+  JS_CFUNC_DEF("pubsub_subscribe", 2, js_pubsub_subscribe),
+  JS_CFUNC_DEF("pubsub_unsubscribe", 2, js_pubsub_unsubscribe),
+  JS_CFUNC_DEF("pubsub_publish", 2, js_pubsub_publish),
+  JS_CFUNC_DEF("pubsub_topic", 2, js_pubsub_topic),
+  JS_CFUNC_DEF("pubsub_stats", 1, js_pubsub_stats),
+  JS_CFUNC_DEF("sse_open", 3, js_sse_open),
+  JS_CFUNC_DEF("sse_event", 4, js_sse_event),
+  JS_CFUNC_DEF("sse_heartbeat", 1, js_sse_heartbeat),
+  JS_CFUNC_DEF("sse_stats", 0, js_sse_stats),
+  JS_CFUNC_DEF("h2_open", 2, js_h2_open),
+  JS_CFUNC_DEF("h2_read", 2, js_h2_read),
+  JS_CFUNC_DEF("h2_respond", 5, js_h2_respond),
+  JS_CFUNC_DEF("h2_close", 2, js_h2_close),
+  JS_CFUNC_DEF("h2_stats", 0, js_h2_stats),
+  JS_CFUNC_DEF("tls_server", 1, js_tls_server),
+  JS_CFUNC_DEF("tls_accept", 1, js_tls_accept),
+  JS_CFUNC_DEF("tls_client", 2, js_tls_client),
+  JS_CFUNC_DEF("tls_info", 1, js_tls_info),
+  JS_CFUNC_DEF("tls_session", 1, js_tls_session),
+  JS_CFUNC_DEF("tls_flush", 1, js_tls_flush),
+  JS_CFUNC_DEF("tls_stats", 0, js_tls_stats),
+  JS_CFUNC_DEF("proxy", 3, js_proxy),
+  JS_CFUNC_DEF("proxy_fd", 0, js_proxy_fd),
+  JS_CFUNC_DEF("proxy_poll", 0, js_proxy_poll),
+  JS_CFUNC_DEF("proxy_stats", 0, js_proxy_stats),
+  JS_CFUNC_DEF("http_upstream", 2, js_http_upstream),
+  JS_CFUNC_DEF("http_forward", 5, js_http_forward),
+  JS_CFUNC_DEF("http_upstream_stats", 1, js_http_upstream_stats),
+  JS_CFUNC_DEF("body_open", 3, js_body_open),
+  JS_CFUNC_DEF("body_read", 2, js_body_read),
+  JS_CFUNC_DEF("body_value", 1, js_body_value),
+  JS_CFUNC_DEF("body_close", 1, js_body_close),
+  JS_CFUNC_DEF("body_stats", 0, js_body_stats),
+  JS_CFUNC_DEF("profile_start", 1, js_profile_start),
+  JS_CFUNC_DEF("profile_stop", 0, js_profile_stop),
+  JS_CFUNC_DEF("profile_folded", 1, js_profile_folded),
+  JS_CFUNC_DEF("memory_usage", 0, js_memory_usage),
+  JS_CFUNC_DEF("gc", 0, js_gc),
+  JS_CFUNC_DEF("gc_threshold", 1, js_gc_threshold),
+  JS_CFUNC_DEF("memory_limit", 1, js_memory_limit),
+  JS_CFUNC_DEF("gc_idle", 1, js_gc_idle),
   JS_PROP_INT32_DEF("EPOLL_CTL_ADD", EPOLL_CTL_ADD, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("EPOLL_CTL_MOD", EPOLL_CTL_MOD, JS_PROP_CONFIGURABLE),
   JS_PROP_INT32_DEF("EPOLL_CTL_DEL", EPOLL_CTL_DEL, JS_PROP_CONFIGURABLE),
 };
 
 static int js_sockets_init(JSContext *ctx, JSModuleDef *m) {
+  metrics.started = now_ns();
+  trace_init_from_env();
+  profile_init_from_env();
   JSValue sockets = JS_NewObject(ctx);
   JS_SetPropertyFunctionList(ctx, sockets, js_socket_funcs, countof(js_socket_funcs));
   JS_SetPropertyFunctionList(ctx, sockets, js_socket_constants, countof(js_socket_constants));
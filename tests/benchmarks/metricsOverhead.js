@@ -0,0 +1,41 @@
+// Cost of metrics recording per request: parse_http_request() with the
+// histograms on and off, plus the calls express makes around each handler.
+// The total is compared with the time budget of one request at peak RPS.
+//
+//   qjs tests/benchmarks/metricsOverhead.js [iterations] [peakRps]
+import sockets from '../../dist/network_sockets.so';
+
+const ITERATIONS = Number(scriptArgs[1] || 500000);
+const PEAK_RPS = Number(scriptArgs[2] || 20000);
+
+const raw = 'GET /api/users/1?fields=name HTTP/1.1\r\n' +
+  'Host: 127.0.0.1:8080\r\n' +
+  'User-Agent: ApacheBench/2.3\r\n' +
+  'Accept: */*\r\n' +
+  'Connection: keep-alive\r\n\r\n';
+
+function nsPerOp(fn) {
+  for (let i = 0; i < 10000; i++) fn(); // warm up
+  const start = sockets.now_us();
+  for (let i = 0; i < ITERATIONS; i++) fn();
+  return (sockets.now_us() - start) * 1000 / ITERATIONS;
+}
+
+function record() {
+  const start = sockets.now_us();
+  sockets.metrics_request(200, start, sockets.now_us());
+}
+
+sockets.metrics_enable(false);
+const parseOff = nsPerOp(() => sockets.parse_http_request(raw));
+sockets.metrics_enable(true);
+const parseOn = nsPerOp(() => sockets.parse_http_request(raw));
+const express = nsPerOp(record);
+sockets.metrics_reset();
+
+const budget = 1e9 / PEAK_RPS;
+const cost = Math.max(parseOn - parseOff, 0) + express;
+
+console.log(`parse_http_request  off ${parseOff.toFixed(0)} ns  on ${parseOn.toFixed(0)} ns`);
+console.log(`now_us x2 + metrics_request  ${express.toFixed(0)} ns`);
+console.log(`${cost.toFixed(0)} ns per request = ${(cost / budget * 100).toFixed(2)}% of ${budget.toFixed(0)} ns at ${PEAK_RPS} req/s`);
@@ -0,0 +1,101 @@
+// Broadcast of 1 KB messages to many WebSocket subscribers: one native
+// pubsub_publish() per message against a JS loop of ws_send() per socket,
+// then a publisher running ahead of clients that stopped reading.
+//
+//   ulimit -n 32768; qjs tests/benchmarks/pubsubFanout.js [subscribers] [messages]
+import sockets from '../../dist/network_sockets.so';
+
+const SUBSCRIBERS = parseInt(scriptArgs[1] || '10000', 10);
+const MESSAGES = parseInt(scriptArgs[2] || '20', 10);
+const PAYLOAD = 'x'.repeat(1024);
+const PATH = `@qjs-bench-pubsub-${Date.now()}`;
+const HANDSHAKE = 'GET / HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n' +
+  'Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n';
+
+function openSubscribers(count) {
+  const listenFd = sockets.socket(sockets.AF_UNIX, sockets.SOCK_STREAM, 0);
+  sockets.bind(listenFd, PATH, 0);
+  sockets.listen(listenFd, 128);
+
+  const conns = [];
+  for (let i = 0; i < count; i++) {
+    const client = sockets.socket(sockets.AF_UNIX, sockets.SOCK_STREAM, 0);
+    sockets.connect(client, PATH, 0);
+    const fd = sockets.accept(listenFd).fd;
+    sockets.setnonblocking(fd);
+    sockets.setnonblocking(client);
+    // Stalled clients would otherwise pin 200 KB of socket buffer each
+    sockets.setsockopt(fd, sockets.SOL_SOCKET, sockets.SO_SNDBUF, 32768);
+    sockets.ws_upgrade(fd, HANDSHAKE);
+    sockets.pubsub_subscribe(fd, 'bench');
+    conns.push({ fd, client });
+  }
+  sockets.close(listenFd);
+  drain(conns);
+  return conns;
+}
+
+// What the clients read, in characters
+function drain(conns) {
+  let received = 0;
+  for (const c of conns) {
+    for (;;) {
+      const chunk = sockets.recv(c.client, 65536, 0);
+      if (chunk.length === 0) break;
+      received += chunk.length;
+    }
+  }
+  return received;
+}
+
+function fanOut(conns, label, publish) {
+  let us = 0;
+  let received = 0;
+  for (let m = 0; m < MESSAGES; m++) {
+    const start = sockets.now_us();
+    publish();
+    us += sockets.now_us() - start;
+    received += drain(conns); // the clients reading, not timed
+  }
+  const perMessage = us / MESSAGES;
+  console.log(`${label}  ${(perMessage / 1000).toFixed(2)} ms per message, ` +
+    `${(perMessage * 1000 / conns.length).toFixed(0)} ns per subscriber, ` +
+    `${(received / MESSAGES / conns.length).toFixed(0)} chars received each`);
+}
+
+function slowConsumers(conns, policy) {
+  sockets.pubsub_topic('bench', { policy, highWater: 16 << 10 });
+  const before = sockets.pubsub_stats();
+  const start = sockets.now_us();
+  for (let m = 0; m < 200; m++) sockets.pubsub_publish('bench', PAYLOAD);
+  const ms = (sockets.now_us() - start) / 1000;
+  const after = sockets.pubsub_stats();
+
+  let received = 0;
+  for (let round = 0; round < 100; round++) {
+    const got = drain(conns);
+    for (const c of conns) sockets.ws_flush(c.fd);
+    received += got;
+    if (got === 0 && round > 0) break;
+  }
+  console.log(`${policy.padEnd(8)}  200 messages nobody read in ${ms.toFixed(0)} ms: ` +
+    `${after.dropped - before.dropped} dropped, ${after.coalesced - before.coalesced} coalesced, ` +
+    `${(received / 1028 / conns.length).toFixed(1)} messages per client once they read`);
+}
+
+const conns = openSubscribers(SUBSCRIBERS);
+console.log(`${conns.length} subscribers, ${MESSAGES} messages of ${PAYLOAD.length} bytes`);
+
+fanOut(conns, 'pubsub_publish ', () => sockets.pubsub_publish('bench', PAYLOAD));
+fanOut(conns, 'ws_send loop   ', () => {
+  for (const c of conns) sockets.ws_send(c.fd, PAYLOAD);
+});
+
+slowConsumers(conns, 'drop');
+slowConsumers(conns, 'coalesce');
+
+for (const c of conns) {
+  sockets.close(c.fd);
+  sockets.close(c.client);
+}
+console.log(JSON.stringify(sockets.pubsub_stats()));
@@ -0,0 +1,40 @@
+// Cost of the query string in parse_http_request(): a landing-page hit
+// carrying the usual tracking parameters, with the SIMD byte scans on and
+// off, against the same request without a query.
+//
+//   qjs tests/benchmarks/queryDecode.js [iterations]
+import sockets from '../../dist/network_sockets.so';
+
+const ITERATIONS = Number(scriptArgs[1] || 500000);
+
+const query = 'utm_source=newsletter_weekly_digest&utm_medium=email' +
+  '&utm_campaign=autumn_clearance_2026_eu_west_segment_b' +
+  '&utm_content=hero_banner_variant_c_lifestyle_image&utm_term=running+shoes+waterproof' +
+  '&gclid=Cj0KCQjw9IayBhBJEiwAVuc3fvnPpLmWLxhN3vOwpSb8XqJkT0hZlY2Rj7QfZpW1vKxNcE4aAhZ8EALw_wcB' +
+  '&fbclid=IwAR2F4-1zQx9kLmNpQrStUvWxYz0A1B2C3D4E5F6G7H8I9J0KaLbMcNdOeP' +
+  '&mc_eid=4f2a9c81d3&_hsenc=p2ANqtz-8xYvZ' +
+  '&redirect=https%3A%2F%2Fshop.example.com%2Fcollections%2Foutdoor%3Fsort%3Dprice';
+const head = ' HTTP/1.1\r\n' +
+  'Host: shop.example.com\r\n' +
+  'User-Agent: Mozilla/5.0\r\n' +
+  'Accept: */*\r\n\r\n';
+const tracked = `GET /landing?${query}${head}`;
+const plain = `GET /landing${head}`;
+
+function nsPerOp(fn) {
+  for (let i = 0; i < 10000; i++) fn(); // warm up
+  const start = sockets.now_us();
+  for (let i = 0; i < ITERATIONS; i++) fn();
+  return (sockets.now_us() - start) * 1000 / ITERATIONS;
+}
+
+const none = nsPerOp(() => sockets.parse_http_request(plain));
+for (const on of [true, false]) {
+  const scans = sockets.simd_enable(on);
+  const ns = nsPerOp(() => sockets.parse_http_request(tracked));
+  console.log(`${scans.padEnd(6)} ${query.length}-byte query  ${ns.toFixed(0)} ns  (+${(ns - none).toFixed(0)} ns over none)`);
+}
+sockets.simd_enable(true);
+
+const { query: params } = sockets.parse_http_request(tracked);
+console.log(`${Object.keys(params).length} parameters, redirect=${params.redirect}`);
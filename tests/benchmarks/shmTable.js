@@ -0,0 +1,51 @@
+// Shared-memory table throughput against a Map in the same process, then
+// one counter incremented by several processes at once.
+//
+//   qjs tests/benchmarks/shmTable.js [iterations] [processes]
+import * as os from 'os';
+import sockets from '../../dist/network_sockets.so';
+
+const NAME = 'bench-shm';
+
+function nsPerOp(iterations, fn) {
+  for (let i = 0; i < 10000; i++) fn(i); // warm up
+  const start = sockets.now_us();
+  for (let i = 0; i < iterations; i++) fn(i);
+  return (sockets.now_us() - start) * 1000 / iterations;
+}
+
+function bench(iterations, processes) {
+  try { sockets.shm.unlink(NAME); } catch (e) { /* first run */ }
+  const table = sockets.shm.open(NAME, 64 << 20);
+  const map = new Map();
+  const keys = Array.from({ length: 1024 }, (_, i) => `session:${i}`);
+  const value = 'x'.repeat(100);
+  const ns = (fn) => nsPerOp(iterations, fn).toFixed(0);
+
+  console.log(`${table.stats().slots} slots of ${table.slotSize} bytes`);
+  console.log(`set   shm ${ns((i) => table.set(keys[i & 1023], value))} ns   Map ${ns((i) => map.set(keys[i & 1023], value))} ns`);
+  console.log(`get   shm ${ns((i) => table.get(keys[i & 1023]))} ns   Map ${ns((i) => map.get(keys[i & 1023]))} ns`);
+  console.log(`incr  shm ${ns(() => table.incr('counter'))} ns`);
+
+  const per = Math.floor(iterations / processes);
+  const start = sockets.now_us();
+  const pids = [];
+  for (let p = 0; p < processes; p++) {
+    pids.push(os.exec(['qjs', scriptArgs[0], '--incr', String(per)], { block: false }));
+  }
+  for (const pid of pids) os.waitpid(pid, 0);
+  const ms = (sockets.now_us() - start) / 1000;
+  const total = table.get('hits');
+  const verdict = total === processes * per ? 'ok' : 'LOST UPDATES';
+  console.log(`${processes} processes x ${per} incr: ${total} counted, ${verdict}, ${ms.toFixed(0)} ms`);
+
+  table.close();
+  sockets.shm.unlink(NAME);
+}
+
+if (scriptArgs[1] === '--incr') {
+  const table = sockets.shm.open(NAME, 0);
+  for (let i = Number(scriptArgs[2]); i > 0; i--) table.incr('hits');
+} else {
+  bench(Number(scriptArgs[1] || 1000000), Number(scriptArgs[2] || 4));
+}
@@ -0,0 +1,75 @@
+// Many idle server-sent event streams in one process: resident memory per
+// stream, a broadcast to all of them, and the heartbeat sweep that the
+// express loop runs once a second.
+//
+//   ulimit -n 120000; qjs tests/benchmarks/sseIdle.js [streams]
+import * as std from 'std';
+import sockets from '../../dist/network_sockets.so';
+
+const STREAMS = parseInt(scriptArgs[1] || '50000', 10);
+const PATH = `@qjs-bench-sse-${Date.now()}`;
+const HEAD = 'HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n\r\n';
+
+function rssKb() {
+  const status = std.loadFile('/proc/self/status') || '';
+  const m = status.match(/VmRSS:\s+(\d+)/);
+  return m ? parseInt(m[1], 10) : 0;
+}
+
+function drain(conns) {
+  let received = 0;
+  for (const c of conns) {
+    for (;;) {
+      const chunk = sockets.recv(c.client, 65536, 0);
+      if (chunk.length === 0) break;
+      received += chunk.length;
+    }
+  }
+  return received;
+}
+
+const listenFd = sockets.socket(sockets.AF_UNIX, sockets.SOCK_STREAM, 0);
+sockets.bind(listenFd, PATH, 0);
+sockets.listen(listenFd, 128);
+
+const before = rssKb();
+const conns = [];
+for (let i = 0; i < STREAMS; i++) {
+  const client = sockets.socket(sockets.AF_UNIX, sockets.SOCK_STREAM, 0);
+  sockets.connect(client, PATH, 0);
+  const fd = sockets.accept(listenFd).fd;
+  sockets.setnonblocking(fd);
+  sockets.setnonblocking(client);
+  sockets.sse_open(fd, HEAD, { retry: 5000 });
+  sockets.pubsub_subscribe(fd, 'bench');
+  conns.push({ fd, client });
+}
+sockets.close(listenFd);
+drain(conns);
+const after = rssKb();
+console.log(`${conns.length} streams, ${((after - before) * 1024 / conns.length).toFixed(0)} bytes ` +
+  'resident each (both socket ends, kernel buffers not counted)');
+
+let start = sockets.now_us();
+const reached = sockets.pubsub_publish('bench', '{"tick":1}');
+let us = sockets.now_us() - start;
+console.log(`publish      ${(us / 1000).toFixed(2)} ms to ${reached} streams, ` +
+  `${(drain(conns) / conns.length).toFixed(0)} chars each`);
+
+// Nothing is due yet: the sweep stops at the first stream written too recently
+start = sockets.now_us();
+let written = sockets.sse_heartbeat(15000).written;
+us = sockets.now_us() - start;
+console.log(`heartbeat    ${us} us with nothing due (${written} written)`);
+
+start = sockets.now_us();
+written = sockets.sse_heartbeat(0).written;
+us = sockets.now_us() - start;
+drain(conns);
+console.log(`heartbeat    ${(us / 1000).toFixed(2)} ms with every stream due (${written} written)`);
+
+for (const c of conns) {
+  sockets.close(c.fd);
+  sockets.close(c.client);
+}
+console.log(JSON.stringify(sockets.sse_stats()));
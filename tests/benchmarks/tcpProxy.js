@@ -0,0 +1,80 @@
+// Forwarding a TCP stream through this process: recv()/send() through JS
+// strings against sockets.proxy(), which splices it through a pipe. Both
+// ends run in this process over loopback; only client -> upstream is timed.
+//
+//   qjs tests/benchmarks/tcpProxy.js [megabytes]
+import sockets from '../../dist/network_sockets.so';
+
+const MEGABYTES = parseInt(scriptArgs[1] || '512', 10);
+const PORT = 18644;
+const CHUNK = 'x'.repeat(65536);
+
+const listenFd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+sockets.setsockopt(listenFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+sockets.bind(listenFd, '127.0.0.1', PORT);
+sockets.listen(listenFd, 8);
+
+// Returns [our end, far end] of a loopback connection, both non-blocking
+function connection() {
+  const fd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+  sockets.connect(fd, '127.0.0.1', PORT);
+  const peer = sockets.accept(listenFd).fd;
+  sockets.setnonblocking(fd);
+  sockets.setnonblocking(peer);
+  return [fd, peer];
+}
+
+// pump() moves what it can from the proxy's client side to its upstream side
+function run(name, pump, client, upstream) {
+  const total = MEGABYTES << 20;
+  let sent = 0;
+  let received = 0;
+  const start = sockets.now_us();
+  while (received < total) {
+    while (sent < total) {
+      const n = sockets.send(client, CHUNK, 0);
+      if (n <= 0) break;
+      sent += n;
+    }
+    pump();
+    for (;;) {
+      const got = sockets.recv(upstream, 65536, 0).length;
+      if (got === 0) break;
+      received += got;
+    }
+  }
+  const us = sockets.now_us() - start;
+  console.log(`${name} ${(total / us).toFixed(0)} MB/s`);
+}
+
+{
+  const [client, fromClient] = connection();
+  const [toUpstream, upstream] = connection();
+  let pending = '';
+  run('recv/send   ', () => {
+    for (;;) {
+      if (pending.length === 0) pending = sockets.recv(fromClient, 65536, 0);
+      if (pending.length === 0) return;
+      const n = sockets.send(toUpstream, pending, 0);
+      pending = pending.slice(n);
+      if (n === 0) return;
+    }
+  }, client, upstream);
+  for (const fd of [client, fromClient, toUpstream, upstream]) sockets.close(fd);
+}
+
+{
+  const [client, fromClient] = connection();
+  const [toUpstream, upstream] = connection();
+  const done = sockets.proxy(fromClient, toUpstream);
+  run('proxy()     ', () => sockets.proxy_poll(), client, upstream);
+  sockets.shutdown(client, sockets.SHUT_WR);
+  sockets.shutdown(upstream, sockets.SHUT_WR);
+  while (sockets.proxy_poll() === 0);
+  sockets.run_pending_jobs();
+  done.then((result) => console.log(JSON.stringify(result)));
+  sockets.run_pending_jobs();
+  for (const fd of [client, fromClient, toUpstream, upstream]) sockets.close(fd);
+}
+
+sockets.close(listenFd);
@@ -0,0 +1,90 @@
+// Loopback TCP vs Unix domain socket throughput (run with qjs from the repo root)
+//   qjs tests/benchmarks/tcpVsUds.js [roundTrips] [bulkMegabytes]
+import * as os from 'os';
+import sockets from '../../dist/network_sockets.so';
+
+const ROUND_TRIPS = parseInt(scriptArgs[1] || '50000', 10);
+const BULK_MB = parseInt(scriptArgs[2] || '256', 10);
+const MESSAGE = 'x'.repeat(64);
+const CHUNK = 'y'.repeat(65536);
+
+function makePair(family) {
+  const server = sockets.socket(family, sockets.SOCK_STREAM, 0);
+  let target;
+
+  if (family === sockets.AF_UNIX) {
+    target = { address: `/tmp/qjs-bench-${Date.now()}.sock`, port: 0 };
+    sockets.bind(server, target.address, 0);
+  } else {
+    sockets.setsockopt(server, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+    sockets.bind(server, '127.0.0.1', 0);
+    target = sockets.getsockname(server);
+  }
+  sockets.listen(server, 1);
+
+  const client = sockets.socket(family, sockets.SOCK_STREAM, 0);
+  sockets.connect(client, target.address, target.port);
+  const peer = sockets.accept(server).fd;
+
+  if (family !== sockets.AF_UNIX) {
+    sockets.setsockopt(client, sockets.IPPROTO_TCP, sockets.TCP_NODELAY, 1);
+    sockets.setsockopt(peer, sockets.IPPROTO_TCP, sockets.TCP_NODELAY, 1);
+  }
+
+  return { server, client, peer, path: family === sockets.AF_UNIX ? target.address : null };
+}
+
+function recvExactly(fd, n) {
+  let got = 0;
+  while (got < n) {
+    const chunk = sockets.recv(fd, n - got, 0);
+    if (chunk.length === 0) throw new Error('connection closed');
+    got += chunk.length;
+  }
+}
+
+function roundTrips(pair) {
+  const start = Date.now();
+  for (let i = 0; i < ROUND_TRIPS; i++) {
+    sockets.send(pair.client, MESSAGE, 0);
+    recvExactly(pair.peer, MESSAGE.length);
+    sockets.send(pair.peer, MESSAGE, 0);
+    recvExactly(pair.client, MESSAGE.length);
+  }
+  return ROUND_TRIPS / ((Date.now() - start) / 1000);
+}
+
+function bulk(pair) {
+  const total = BULK_MB * 1024 * 1024;
+  let sent = 0;
+  let received = 0;
+
+  sockets.setnonblocking(pair.client);
+  sockets.setnonblocking(pair.peer);
+
+  const start = Date.now();
+  while (received < total) {
+    if (sent < total) {
+      sent += sockets.send(pair.client, CHUNK, 0);
+    }
+    received += sockets.recv(pair.peer, 65536, 0).length;
+  }
+  return (total / (1024 * 1024)) / ((Date.now() - start) / 1000);
+}
+
+function run(name, family) {
+  const pair = makePair(family);
+  const rtt = roundTrips(pair);
+  const mbps = bulk(pair);
+
+  for (const fd of [pair.client, pair.peer, pair.server]) sockets.close(fd);
+  if (pair.path) os.remove(pair.path);
+
+  console.log(`${name.padEnd(12)} ${rtt.toFixed(0).padStart(10)} round trips/s ${mbps.toFixed(1).padStart(10)} MB/s`);
+  return { rtt, mbps };
+}
+
+console.log(`${ROUND_TRIPS} x 64-byte round trips, ${BULK_MB} MB bulk transfer\n`);
+const tcp = run('TCP loopback', sockets.AF_INET);
+const uds = run('Unix socket', sockets.AF_UNIX);
+console.log(`\nUDS vs TCP: ${(uds.rtt / tcp.rtt).toFixed(2)}x round trips, ${(uds.mbps / tcp.mbps).toFixed(2)}x bulk`);
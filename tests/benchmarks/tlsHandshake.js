@@ -0,0 +1,89 @@
+// TLS in one process over loopback TCP: full and resumed handshakes per
+// second (client and server cost together), then bulk throughput from the
+// server side, which goes through kTLS where the kernel has the tls module.
+//
+//   openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 30 \
+//     -subj /CN=localhost -addext subjectAltName=DNS:localhost -keyout /tmp/key.pem -out /tmp/cert.pem
+//   qjs tests/benchmarks/tlsHandshake.js /tmp/cert.pem /tmp/key.pem [handshakes] [megabytes]
+import sockets from '../../dist/network_sockets.so';
+
+const CERT = scriptArgs[1] || '/tmp/cert.pem';
+const KEY = scriptArgs[2] || '/tmp/key.pem';
+const HANDSHAKES = parseInt(scriptArgs[3] || '1000', 10);
+const MEGABYTES = parseInt(scriptArgs[4] || '256', 10);
+const PORT = 18643;
+
+sockets.tls_server({ cert: CERT, key: KEY, alpn: ['http/1.1'], ktls: true });
+
+const listenFd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+sockets.setsockopt(listenFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+sockets.bind(listenFd, '127.0.0.1', PORT);
+sockets.listen(listenFd, 128);
+
+function connect(options) {
+  const client = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+  sockets.connect(client, '127.0.0.1', PORT);
+  const server = sockets.accept(listenFd).fd;
+  for (const fd of [server, client]) {
+    sockets.setnonblocking(fd);
+    sockets.setsockopt(fd, sockets.IPPROTO_TCP, sockets.TCP_NODELAY, 1);
+  }
+  sockets.tls_accept(server);
+  sockets.tls_client(client, options);
+  // Each side's reads carry its half of the handshake
+  while (!sockets.tls_info(server).established || !sockets.tls_info(client).established) {
+    sockets.recv(server, 1, 0);
+    sockets.recv(client, 1, 0);
+  }
+  return { server, client };
+}
+
+function close(pair) {
+  sockets.close(pair.client);
+  sockets.close(pair.server);
+}
+
+const options = { servername: 'localhost', ca: CERT };
+
+let start = sockets.now_us();
+for (let i = 0; i < HANDSHAKES; i++) close(connect(options));
+let us = sockets.now_us() - start;
+console.log(`full         ${(HANDSHAKES * 1e6 / us).toFixed(0)} handshakes/s`);
+
+// A TLS 1.3 ticket arrives after the handshake, with the first read of data
+const first = connect(options);
+sockets.send(first.server, 'x', 0);
+while (sockets.recv(first.client, 1, 0).length === 0);
+options.session = sockets.tls_session(first.client);
+close(first);
+
+start = sockets.now_us();
+for (let i = 0; i < HANDSHAKES; i++) close(connect(options));
+us = sockets.now_us() - start;
+console.log(`resumed      ${(HANDSHAKES * 1e6 / us).toFixed(0)} handshakes/s`);
+
+const bulk = connect({ servername: 'localhost', ca: CERT });
+const chunk = 'x'.repeat(65536);
+const total = MEGABYTES << 20;
+let sent = 0;
+let received = 0;
+start = sockets.now_us();
+while (received < total) {
+  while (sent < total) {
+    const n = sockets.send(bulk.server, chunk, 0);
+    if (n <= 0) break;
+    sent += n;
+  }
+  for (;;) {
+    const got = sockets.recv(bulk.client, 65536, 0).length;
+    if (got === 0) break;
+    received += got;
+  }
+}
+us = sockets.now_us() - start;
+const info = sockets.tls_info(bulk.server);
+console.log(`bulk         ${(total / us).toFixed(0)} MB/s, ${info.cipher}, kTLS ${info.ktls ? 'on' : 'off'}`);
+close(bulk);
+
+sockets.close(listenFd);
+console.log(JSON.stringify(sockets.tls_stats()));
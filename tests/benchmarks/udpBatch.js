@@ -0,0 +1,61 @@
+// Datagram receive rate on loopback: one recv() per packet vs recvmmsg()
+// batches. Both ends live in this process; the sender always uses sendmmsg.
+//
+//   qjs tests/benchmarks/udpBatch.js [packets] [batch] [size]
+import * as std from 'std';
+import sockets from '../../dist/network_sockets.so';
+
+const PACKETS = Number(scriptArgs[1] || 1000000);
+const BATCH = Math.min(Number(scriptArgs[2] || 256), sockets.UDP_BATCH_MAX);
+const SIZE = Number(scriptArgs[3] || 64);
+
+function udpSocket() {
+  const fd = sockets.socket(sockets.AF_INET, sockets.SOCK_DGRAM, 0);
+  sockets.setsockopt(fd, sockets.SOL_SOCKET, sockets.SO_RCVBUF, 16 * 1024 * 1024);
+  sockets.setsockopt(fd, sockets.SOL_SOCKET, sockets.SO_SNDBUF, 16 * 1024 * 1024);
+  sockets.bind(fd, '127.0.0.1', 0);
+  sockets.setnonblocking(fd);
+  return fd;
+}
+
+const rx = udpSocket();
+const tx = udpSocket();
+sockets.connect(tx, '127.0.0.1', sockets.getsockname(rx).port);
+
+const out = new ArrayBuffer(BATCH * SIZE);
+const outLengths = new Int32Array(BATCH).fill(SIZE);
+new Uint8Array(out).fill(0x61);
+
+const inBuf = new ArrayBuffer(BATCH * 2048);
+const inLengths = new Int32Array(BATCH);
+const inAddrs = new ArrayBuffer(BATCH * sockets.UDP_ADDR_SIZE);
+
+function run(name, receive) {
+  let sent = 0, received = 0, bytes = 0;
+  const start = Date.now();
+  while (received < PACKETS) {
+    if (sent - received < BATCH * 4 && sent < PACKETS) {
+      sent += sockets.sendmmsg(tx, out, SIZE, outLengths, Math.min(BATCH, PACKETS - sent));
+    }
+    const n = receive();
+    if (n === 0 && sent >= PACKETS) break; // dropped by the kernel
+    received += n;
+    bytes += n * SIZE;
+  }
+  const seconds = (Date.now() - start) / 1000;
+  console.log(`${name.padEnd(10)} ${Math.round(received / seconds).toString().padStart(9)} pkt/s  ${(bytes / seconds / 1048576).toFixed(1)} MB/s  (${PACKETS - received} lost)`);
+}
+
+console.log(`${PACKETS} packets of ${SIZE} bytes, batch ${BATCH}`);
+
+run('recv', () => {
+  let n = 0;
+  while (n < BATCH && sockets.recv(rx, 2048, 0).length > 0) n++;
+  return n;
+});
+
+run('recvmmsg', () => sockets.recvmmsg(rx, inBuf, 2048, inLengths, inAddrs));
+
+sockets.close(rx);
+sockets.close(tx);
+std.exit(0);
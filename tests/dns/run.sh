@@ -0,0 +1,11 @@
+#!/bin/bash
+# Starts the DNS stub, runs the resolver tests under qjs, then stops the stub
+cd "$(dirname "$0")/../.."
+
+node tests/dns/stubServer.js 5353 &
+STUB_PID=$!
+trap 'kill $STUB_PID 2>/dev/null' EXIT
+sleep 0.5
+
+qjs tests/dns/test.js | tee /tmp/dns_test_output.txt
+grep -q ", 0 failed" /tmp/dns_test_output.txt
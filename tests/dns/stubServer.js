@@ -0,0 +1,125 @@
+// Minimal authoritative DNS stub for the resolver tests (run with Node.js)
+const dgram = require('dgram');
+
+const PORT = parseInt(process.argv[2] || '5353', 10);
+const SOA_MINIMUM = 5;
+
+const records = {
+  'a.test': { A: ['10.0.0.1'], AAAA: ['2001:db8::1'], ttl: 60 },
+  'v4only.test': { A: ['10.0.0.2'], ttl: 60 },
+  'short.test': { A: ['10.0.0.3'], ttl: 1 },
+  'spoofed.test': { A: ['10.0.0.4'], ttl: 60 },
+};
+
+const queryCounts = {};
+
+function encodeName(name) {
+  const parts = name.split('.').filter(Boolean);
+  const bufs = parts.map(p => Buffer.concat([Buffer.from([p.length]), Buffer.from(p)]));
+  return Buffer.concat([...bufs, Buffer.from([0])]);
+}
+
+function decodeQuestion(msg) {
+  const labels = [];
+  let off = 12;
+  while (msg[off] !== 0) {
+    const len = msg[off];
+    labels.push(msg.slice(off + 1, off + 1 + len).toString());
+    off += len + 1;
+  }
+  off++;
+  const qtype = msg.readUInt16BE(off);
+  return { name: labels.join('.').toLowerCase(), qtype, end: off + 4 };
+}
+
+function ipv6Bytes(addr) {
+  const [head, tail] = addr.split('::');
+  const h = head ? head.split(':') : [];
+  const t = tail !== undefined && tail ? tail.split(':') : [];
+  const groups = [...h, ...Array(8 - h.length - t.length).fill('0'), ...t];
+  const buf = Buffer.alloc(16);
+  groups.forEach((g, i) => buf.writeUInt16BE(parseInt(g, 16), i * 2));
+  return buf;
+}
+
+function rr(type, ttl, rdata) {
+  const head = Buffer.alloc(12);
+  head.writeUInt16BE(0xc00c, 0); // pointer to the question name
+  head.writeUInt16BE(type, 2);
+  head.writeUInt16BE(1, 4);
+  head.writeUInt32BE(ttl, 6);
+  head.writeUInt16BE(rdata.length, 10);
+  return Buffer.concat([head, rdata]);
+}
+
+function soa() {
+  const tail = Buffer.alloc(20);
+  tail.writeUInt32BE(SOA_MINIMUM, 16);
+  const rdata = Buffer.concat([encodeName('ns.test'), encodeName('admin.test'), tail]);
+  return rr(6, 300, rdata);
+}
+
+const server = dgram.createSocket('udp4');
+// Sends forged answers from another port, as an off-path attacker would
+const spoofer = dgram.createSocket('udp4');
+
+server.on('message', (msg, rinfo) => {
+  const q = decodeQuestion(msg);
+  queryCounts[q.name] = (queryCounts[q.name] || 0) + 1;
+
+  if (q.name === 'slow.test') return; // never answered
+
+  const answers = [];
+  const authority = [];
+  let rcode = 0;
+
+  if (q.name === 'counter.test') {
+    // Reports how many queries a.test has seen, never cached (ttl 0)
+    if (q.qtype === 1) {
+      answers.push(rr(1, 0, Buffer.from([10, 9, 0, queryCounts['a.test'] || 0])));
+    }
+  } else if (q.name === 'port.test') {
+    // Reports the port the query came from, never cached
+    if (q.qtype === 1) {
+      answers.push(rr(1, 0, Buffer.from([10, 8, rinfo.port >> 8, rinfo.port & 255])));
+    }
+  } else {
+    const rec = records[q.name];
+    if (!rec) {
+      rcode = 3;
+      authority.push(soa());
+    } else {
+      const list = q.qtype === 1 ? rec.A : q.qtype === 28 ? rec.AAAA : null;
+      if (list && list.length) {
+        for (const addr of list) {
+          const rdata = q.qtype === 1 ? Buffer.from(addr.split('.').map(Number)) : ipv6Bytes(addr);
+          answers.push(rr(q.qtype, rec.ttl, rdata));
+        }
+      } else {
+        authority.push(soa());
+      }
+    }
+  }
+
+  const header = Buffer.alloc(12);
+  msg.copy(header, 0, 0, 2);
+  header.writeUInt16BE(0x8180 | rcode, 2);
+  header.writeUInt16BE(1, 4);
+  header.writeUInt16BE(answers.length, 6);
+  header.writeUInt16BE(authority.length, 8);
+
+  const reply = Buffer.concat([header, msg.slice(12, q.end), ...answers, ...authority]);
+  if (q.name === 'spoofed.test') {
+    // The forgery wins the race; the real answer follows
+    const forged = Buffer.from(reply);
+    forged.set([10, 6, 6, 6], forged.length - 4);
+    spoofer.send(forged, rinfo.port, rinfo.address);
+    setTimeout(() => server.send(reply, rinfo.port, rinfo.address), 20);
+    return;
+  }
+  server.send(reply, rinfo.port, rinfo.address);
+});
+
+server.bind(PORT, '127.0.0.1', () => {
+  console.log(`DNS stub listening on 127.0.0.1:${PORT}`);
+});
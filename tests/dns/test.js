@@ -0,0 +1,129 @@
+// Resolver tests against tests/dns/stubServer.js (run with qjs, see run.sh)
+import sockets from '../../dist/network_sockets.so';
+
+const PORT = 5353;
+
+sockets.dns_config({ servers: [`127.0.0.1:${PORT}`], timeout: 200, attempts: 2 });
+
+const epfd = sockets.epoll_create1(0);
+sockets.epoll_ctl(epfd, sockets.EPOLL_CTL_ADD, sockets.dns_fd(), sockets.EPOLLIN);
+
+let passed = 0;
+let failed = 0;
+
+async function test(name, fn) {
+  try {
+    await fn();
+    console.log(`✓ ${name}`);
+    passed++;
+  } catch (e) {
+    console.log(`✗ ${name}: ${e.message}`);
+    failed++;
+  }
+}
+
+function assert(cond, msg) {
+  if (!cond) throw new Error(msg);
+}
+
+async function expectError(promise, code) {
+  try {
+    await promise;
+  } catch (e) {
+    assert(e.code === code, `expected ${code}, got ${e.code}`);
+    return;
+  }
+  throw new Error(`expected ${code}, lookup succeeded`);
+}
+
+async function main() {
+  await test('dns_config() reports the servers in use', async () => {
+    const config = sockets.dns_config({});
+    assert(JSON.stringify(config) === `{"servers":["127.0.0.1:${PORT}"],"skipped":0}`, JSON.stringify(config));
+    let threw = false;
+    try {
+      sockets.dns_config({ servers: ['127.0.0.1', '[::1]:53'] });
+    } catch (e) {
+      threw = e instanceof RangeError;
+    }
+    assert(threw, 'mixed address families accepted');
+  });
+
+  await test('A + AAAA results', async () => {
+    const addrs = await sockets.resolve('a.test');
+    const v4 = addrs.filter(a => a.family === 4).map(a => a.address);
+    const v6 = addrs.filter(a => a.family === 6).map(a => a.address);
+    assert(v4.length === 1 && v4[0] === '10.0.0.1', `A: ${v4}`);
+    assert(v6.length === 1 && v6[0] === '2001:db8::1', `AAAA: ${v6}`);
+    assert(addrs[0].ttl === 60, `ttl ${addrs[0].ttl}`);
+  });
+
+  await test('positive answers are served from cache', async () => {
+    await sockets.resolve('a.test');
+    await sockets.resolve('a.test');
+    const [counter] = await sockets.resolve('counter.test', 4);
+    assert(counter.address === '10.9.0.2', `a.test was queried ${counter.address.split('.')[3]} times`);
+  });
+
+  await test('family filter', async () => {
+    const addrs = await sockets.resolve('a.test', 6);
+    assert(addrs.length === 1 && addrs[0].family === 6, JSON.stringify(addrs));
+  });
+
+  await test('NODATA for AAAA still returns A', async () => {
+    const addrs = await sockets.resolve('v4only.test');
+    assert(addrs.length === 1 && addrs[0].address === '10.0.0.2', JSON.stringify(addrs));
+  });
+
+  await test('NXDOMAIN rejects with ENOTFOUND', async () => {
+    await expectError(sockets.resolve('missing.test'), 'ENOTFOUND');
+  });
+
+  await test('negative answers are cached', async () => {
+    await expectError(sockets.resolve('missing.test'), 'ENOTFOUND');
+  });
+
+  await test('unanswered queries time out', async () => {
+    await expectError(sockets.resolve('slow.test'), 'ETIMEOUT');
+  });
+
+  await test('answers from a source that was not asked are dropped', async () => {
+    const addrs = await sockets.resolve('spoofed.test', 4);
+    assert(addrs.length === 1 && addrs[0].address === '10.0.0.4', JSON.stringify(addrs));
+  });
+
+  await test('each lookup sends from its own port', async () => {
+    const ports = [];
+    for (let i = 0; i < 3; i++) {
+      const [addr] = await sockets.resolve('port.test', 4);
+      const [, , hi, lo] = addr.address.split('.').map(Number);
+      ports.push(hi * 256 + lo);
+    }
+    assert(new Set(ports).size === 3 && ports.every((port) => port >= 1024), JSON.stringify(ports));
+  });
+
+  await test('literal addresses resolve without a query', async () => {
+    const [v6] = await sockets.resolve('::1');
+    assert(v6.family === 6 && v6.address === '::1', JSON.stringify(v6));
+  });
+
+  await test('expired entries are queried again', async () => {
+    await sockets.resolve('short.test');
+    const start = Date.now();
+    while (Date.now() - start < 1100) sockets.epoll_wait(epfd, 8, 100);
+    const [addr] = await sockets.resolve('short.test');
+    assert(addr.ttl === 1, `ttl ${addr.ttl}`);
+  });
+}
+
+let done = false;
+main().finally(() => { done = true; });
+
+while (!done) {
+  sockets.epoll_wait(epfd, 8, 50);
+  sockets.dns_poll();
+  sockets.run_pending_jobs();
+}
+
+console.log(`\n${passed} passed, ${failed} failed`);
+sockets.close(epfd);
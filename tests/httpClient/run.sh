@@ -0,0 +1,7 @@
+#!/bin/bash
+# Runs the HTTP client tests; the express app under test shares the client's loop
+cd "$(dirname "$0")/../.."
+
+rm -f /tmp/qjs-http-client-test-18080.log
+timeout 30 qjs tests/httpClient/test.js | tee /tmp/http_client_test_output.txt
+grep -q ", 0 failed" /tmp/http_client_test_output.txt
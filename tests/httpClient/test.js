@@ -0,0 +1,985 @@
+// HTTP client tests against an express app served from the same loop (run with qjs)
+import * as std from 'std';
+import * as os from 'os';
+import sockets from '../../dist/network_sockets.so';
+import express from '../../extra/express.js';
+import { Agent, get, post, request } from '../../extra/http.js';
+
+const PORT = 18080;
+const BASE = `http://127.0.0.1:${PORT}`;
+const ACCESS_LOG = `/tmp/qjs-http-client-test-${PORT}.log`;
+
+const app = express();
+app.metrics();
+app.accessLog(ACCESS_LOG);
+app.http2();
+let served = 0;
+
+app.use((req, res, next) => { served++; next(); });
+app.get('/hello', (req, res) => res.send('hello'));
+app.post('/echo', (req, res) => res.json({ got: req.body }));
+app.get('/seq/:n', (req, res) => res.json({ n: Number(req.params.n) }));
+app.get('/close', (req, res) => { res.set('Connection', 'close'); res.send('bye'); });
+app.get('/hang', () => new Promise(() => {}));
+app.get('/utf8', (req, res) => res.send('ñandú'));
+app.get('/big', (req, res) => res.send('ñ€'.repeat(1 << 19))); // 2.5 MB over 1 MB of characters
+app.get('/query', (req, res) => res.json({ url: req.url, path: req.path, query: req.query }));
+app.post('/sum', (req, res) => {
+  const bytes = new Uint8Array(req.body);
+  res.json({ binary: req.body instanceof ArrayBuffer, length: bytes.length, sum: bytes.reduce((a, b) => a + b, 0) });
+});
+
+// The loop has no timers of its own; a worker sleeping is one
+const sleep = (ms) => sockets.offload((ms) => { const end = Date.now() + ms; while (Date.now() < end); }, ms);
+
+let cachedRuns = 0;
+app.get('/cached', async (req, res) => {
+  const run = ++cachedRuns;
+  await sleep(50);
+  res.cache(200, { stale: 5000 }).send(`run ${run}`);
+});
+
+// Small cap on uploads; streamed bodies are counted as they arrive
+app.body('/upload', { limit: 64 });
+app.post('/upload', (req, res) => res.send(String(req.body.length)));
+app.body('/stream', { stream: true, limit: 1 << 20 });
+app.post('/stream', async (req, res) => {
+  let bytes = 0;
+  for await (const chunk of req) bytes += chunk.byteLength;
+  res.send(String(bytes));
+});
+
+// Uploaded files are read back before answering: they close with the response
+app.body('/form', { maxFiles: 2 });
+app.post('/form', (req, res) => res.json({
+  fields: req.body,
+  files: req.files.map((file) => {
+    const bytes = new Uint8Array(file.size);
+    os.read(file.fd, bytes.buffer, 0, file.size);
+    return { name: file.name, filename: file.filename, type: file.type, sum: bytes.reduce((a, b) => a + b, 0) };
+  })
+}));
+
+// Forwards to this app itself, and to a port nobody listens on
+app.proxy('/up', [`127.0.0.1:${PORT}`, `127.0.0.1:${PORT + 3}`], { strip: true, maxFails: 1 });
+// Forwards to the two backend() servers, which the tests start
+const BACKENDS = [`127.0.0.1:${PORT + 4}`, `127.0.0.1:${PORT + 5}`];
+app.proxy('/lc', BACKENDS, { balance: 'least-conn', strip: true });
+app.proxy('/hash', BACKENDS, { balance: 'hash', key: 'path', strip: true });
+app.proxy('/retry', BACKENDS, { timeout: 200, strip: true });
+app.proxy('/slow', BACKENDS.slice(0, 1), { timeout: 200, strip: true });
+
+app.rateLimit('/limited', { rate: 1, burst: 2 });
+app.get('/limited', (req, res) => res.send('ok'));
+
+let wsClosed = null;
+app.ws('/ws', (ws) => {
+  ws.onmessage = (msg) => ws.send(typeof msg === 'string' ? `echo:${msg}` : `bytes:${msg.byteLength}`);
+  ws.onclose = (code) => { wsClosed = code; };
+  ws.subscribe('news');
+});
+
+let streamClosed = false;
+app.get('/events', (req, res) => {
+  const stream = res.sse({ retry: 1000 });
+  stream.event(req.get('last-event-id') || 1, 'line1\nline2', 'greeting');
+  stream.subscribe('news');
+  stream.onclose = () => { streamClosed = true; };
+});
+
+let passed = 0;
+let failed = 0;
+
+async function test(name, fn) {
+  try {
+    await fn();
+    console.log(`✓ ${name}`);
+    passed++;
+  } catch (e) {
+    console.log(`✗ ${name}: ${e.message}`);
+    failed++;
+  }
+}
+
+function assert(cond, msg) {
+  if (!cond) throw new Error(msg);
+}
+
+async function expectError(promise, code) {
+  try {
+    await promise;
+  } catch (e) {
+    assert(e.code === code, `expected ${code}, got ${e.code} (${e.message})`);
+    return;
+  }
+  throw new Error(`expected ${code}, request succeeded`);
+}
+
+// Client end of long-lived connections: a plain socket read from the app's own loop
+function rawConnect(request, port = PORT) {
+  const fd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+  sockets.connect(fd, '127.0.0.1', port);
+  sockets.send(fd, request, 0);
+  const conn = { fd, data: '', eof: false, wake: null };
+  app.watch(fd, () => {
+    const chunk = sockets.recv(fd, 65536, 0);
+    if (chunk.length === 0) {
+      conn.eof = true;
+      app.unwatch(fd);
+    }
+    conn.data += chunk;
+    if (conn.wake) conn.wake();
+  });
+  conn.until = (pred) => new Promise((resolve, reject) => {
+    const check = () => {
+      if (pred(conn)) resolve(conn.data);
+      else if (conn.eof) reject(new Error(`closed after ${JSON.stringify(conn.data)}`));
+      else conn.wake = check;
+    };
+    check();
+  });
+  // Client frames are masked
+  conn.frame = (opcode, payload) => {
+    const mask = [0x12, 0x34, 0x56, 0x78];
+    const bytes = new Uint8Array(6 + payload.length);
+    bytes.set([0x80 | opcode, 0x80 | payload.length, ...mask]);
+    payload.forEach((b, i) => { bytes[6 + i] = b ^ mask[i & 3]; });
+    sockets.send(fd, bytes, 0);
+  };
+  return conn;
+}
+
+// A keep-alive HTTP/1.1 server on the app's loop that answers `${name}:${path}`,
+// except that /hang, and /hang-${name} on this one only, wait for release().
+// requests holds each request as it came, body framing included.
+function backend(port, name) {
+  const listenFd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+  sockets.setsockopt(listenFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+  sockets.bind(listenFd, '127.0.0.1', port);
+  sockets.listen(listenFd, 64);
+  sockets.setnonblocking(listenFd);
+  const server = { name, accepted: 0, requests: [], held: [], fds: new Set() };
+  const reply = (fd, path) => {
+    const body = `${name}:${path}`;
+    sockets.send(fd, `HTTP/1.1 200 OK\r\nContent-Length: ${body.length}\r\n\r\n${body}`, 0);
+  };
+  const drop = (fd) => {
+    app.unwatch(fd);
+    sockets.close(fd);
+    server.fds.delete(fd);
+  };
+  app.watch(listenFd, () => {
+    for (let client; (client = sockets.accept(listenFd));) {
+      const fd = client.fd;
+      let data = '';
+      server.accepted++;
+      server.fds.add(fd);
+      sockets.setnonblocking(fd);
+      app.watch(fd, () => {
+        const chunk = sockets.recv(fd, 65536, 0);
+        if (chunk.length === 0) return drop(fd);
+        data += chunk;
+        for (let headEnd; (headEnd = data.indexOf('\r\n\r\n')) >= 0;) {
+          const head = data.substring(0, headEnd);
+          const length = Number((head.match(/^content-length:\s*(\d+)/im) || [])[1] || 0);
+          const last = data.indexOf('\r\n0\r\n\r\n', headEnd + 2);
+          const end = /^transfer-encoding:\s*chunked/im.test(head) ? (last < 0 ? -1 : last + 7) : headEnd + 4 + length;
+          if (end < 0 || end > data.length) break;
+          const path = head.split(' ')[1];
+          server.requests.push(data.substring(0, end));
+          data = data.substring(end);
+          if (/^\/hang(\?|$)/.test(path) || path.startsWith(`/hang-${name}`)) server.held.push({ fd, path });
+          else reply(fd, path);
+        }
+      });
+    }
+  });
+  // Answers the requests held so far
+  server.release = () => {
+    for (const { fd, path } of server.held.splice(0)) {
+      if (server.fds.has(fd)) reply(fd, path);
+    }
+  };
+  // Closes its side of every connection, as a backend's idle timeout does
+  server.disconnect = () => {
+    for (const fd of [...server.fds]) drop(fd);
+  };
+  server.close = () => {
+    server.disconnect();
+    app.unwatch(listenFd);
+    sockets.close(listenFd);
+  };
+  return server;
+}
+
+// HTTP/2 frames with literal fields named from the static table, so every byte stays ASCII
+const h2Frame = (type, flags, stream, payload) =>
+  [0, payload.length >> 8, payload.length & 255, type, flags, 0, 0, 0, stream, ...payload];
+const h2Field = (index, value) => [index, value.length, ...Array.from(value, (ch) => ch.charCodeAt(0))];
+const h2Get = (stream, path) => h2Frame(1, 5, stream,
+  [...h2Field(2, 'GET'), ...h2Field(4, path), ...h2Field(6, 'http'), ...h2Field(1, '127.0.0.1')]);
+
+function wsConnect(path) {
+  return rawConnect(`GET ${path} HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n` +
+    'Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n');
+}
+
+// Both ends of a TLS connection over loopback TCP, stepped from this thread
+// until cond(server, client) holds
+function tlsPair(listenFd, options) {
+  const client = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+  sockets.connect(client, '127.0.0.1', PORT + 1);
+  const server = sockets.accept(listenFd).fd;
+  sockets.setnonblocking(server);
+  sockets.setnonblocking(client);
+  sockets.tls_accept(server);
+  sockets.tls_client(client, options);
+  const pair = { server, client, got: '' };
+  pair.step = (cond) => {
+    for (let i = 0; i < 1000 && !cond(pair); i++) {
+      sockets.recv(server, 1, 0);
+      pair.got += sockets.recv(client, 65536, 0);
+    }
+    assert(cond(pair), `stuck: ${JSON.stringify(sockets.tls_info(client))}`);
+  };
+  return pair;
+}
+
+async function main() {
+  await test('GET', async () => {
+    const res = await get(`${BASE}/hello`);
+    assert(res.statusCode === 200 && res.body === 'hello', `${res.statusCode} ${res.body}`);
+    assert(res.get('Content-Length') === '5', JSON.stringify(res.headers));
+  });
+
+  await test('query strings keep every parameter and repeated keys', async () => {
+    const long = 'x'.repeat(5000);
+    const res = await get(`${BASE}/query?a=1&b=x%20y+z&a=2&&c&long=${long}%21`);
+    const got = res.json();
+    assert(got.path === '/query' && got.url === `/query?a=1&b=x%20y+z&a=2&&c&long=${long}%21`, res.body.slice(0, 200));
+    assert(JSON.stringify(got.query.a) === '["1","2"]' && got.query.b === 'x y z' && got.query.c === '' &&
+      got.query.long === `${long}!`, res.body.slice(0, 200));
+  });
+
+  await test('POST JSON body', async () => {
+    const res = await post(`${BASE}/echo`, { a: 1 });
+    assert(res.json().got.a === 1, res.body);
+  });
+
+  await test('UTF-8 bodies are framed by bytes', async () => {
+    const res = await get(`${BASE}/utf8`);
+    assert(res.body === 'ñandú', res.body);
+  });
+
+  await test('a chunked body that is not UTF-8 comes back as bytes', async () => {
+    // A server that answers every request with the bytes 0..255, in chunks split mid-frame
+    const listenFd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+    sockets.setsockopt(listenFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+    sockets.bind(listenFd, '127.0.0.1', PORT + 6);
+    sockets.listen(listenFd, 8);
+    sockets.setnonblocking(listenFd);
+    const body = Uint8Array.from({ length: 256 }, (_, i) => i);
+    const head = 'HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n80\r\n';
+    const bytes = new Uint8Array(head.length + 128 + 2 + 5 + 128 + 7);
+    let n = 0;
+    for (const part of [head, body.subarray(0, 128), '\r\n80\r\n', body.subarray(128), '\r\n0\r\n\r\n']) {
+      if (typeof part === 'string') for (const ch of part) bytes[n++] = ch.charCodeAt(0);
+      else { bytes.set(part, n); n += part.length; }
+    }
+    const fds = [];
+    app.watch(listenFd, () => {
+      for (let client; (client = sockets.accept(listenFd));) {
+        const fd = client.fd;
+        fds.push(fd);
+        sockets.setnonblocking(fd);
+        app.watch(fd, () => {
+          const requests = sockets.recv(fd, 65536, 0).split('\r\n\r\n').length - 1;
+          for (let i = 0; i < requests; i++) {
+            sockets.send(fd, bytes.subarray(0, head.length + 64), 0);
+            sockets.send(fd, bytes.subarray(head.length + 64), 0);
+          }
+        });
+      }
+    });
+    const agent = new Agent();
+    const url = `http://127.0.0.1:${PORT + 6}/`;
+    const responses = [await agent.get(url), await agent.get(url)];
+    assert(agent.stats.connects === 1, `${agent.stats.connects} connects`);
+    agent.destroy();
+    for (const fd of [listenFd, ...fds]) {
+      app.unwatch(fd);
+      sockets.close(fd);
+    }
+    for (const res of responses) {
+      assert(res.body instanceof ArrayBuffer && res.body.byteLength === 256, String(res.body));
+      assert(new Uint8Array(res.body).every((byte, i) => byte === i), 'body bytes changed');
+    }
+  });
+
+  await test('HEAD has no body', async () => {
+    const res = await request(`${BASE}/hello`, { method: 'HEAD' });
+    assert(res.statusCode === 200 && res.body === '', `${res.statusCode} "${res.body}"`);
+  });
+
+  await test('404 resolves with the status', async () => {
+    const res = await get(`${BASE}/missing`);
+    assert(res.statusCode === 404 && !res.ok, `${res.statusCode}`);
+  });
+
+  await test('sequential requests reuse one keep-alive socket', async () => {
+    const agent = new Agent();
+    for (let i = 0; i < 20; i++) {
+      const res = await agent.get(`${BASE}/seq/${i}`);
+      assert(res.json().n === i, res.body);
+    }
+    assert(agent.stats.connects === 1, `${agent.stats.connects} connects`);
+    agent.destroy();
+  });
+
+  await test('maxSockets caps concurrent connections', async () => {
+    const agent = new Agent({ maxSockets: 4 });
+    const all = [];
+    for (let i = 0; i < 50; i++) all.push(agent.get(`${BASE}/seq/${i}`));
+    const results = await Promise.all(all);
+    results.forEach((res, i) => assert(res.json().n === i, `response ${i}: ${res.body}`));
+    assert(agent.stats.connects === 4, `${agent.stats.connects} connects`);
+    agent.destroy();
+  });
+
+  await test('pipelined responses arrive in order', async () => {
+    const agent = new Agent({ maxSockets: 1, pipelining: 8 });
+    const all = [];
+    for (let i = 0; i < 40; i++) all.push(agent.get(`${BASE}/seq/${i}`));
+    const results = await Promise.all(all);
+    results.forEach((res, i) => assert(res.json().n === i, `response ${i}: ${res.body}`));
+    assert(agent.stats.connects === 1, `${agent.stats.connects} connects`);
+    agent.destroy();
+  });
+
+  await test('deep pipelines and large bodies span several turns', async () => {
+    const agent = new Agent({ maxSockets: 1, pipelining: 64 });
+    const all = [];
+    for (let i = 0; i < 64; i++) all.push(agent.get(`${BASE}/seq/${i}`)); // 4x requestBudget
+    const results = await Promise.all(all);
+    results.forEach((res, i) => assert(res.json().n === i, `response ${i}: ${res.body}`));
+    agent.destroy();
+
+    // More than readBudget arrives in one edge; the rest must not wait for another
+    const res = await post(`${BASE}/echo`, { pad: 'x'.repeat(4 * app.readBudget) });
+    assert(res.statusCode === 200 && res.json().got.pad.length === 4 * app.readBudget, `${res.statusCode}`);
+  });
+
+  await test('large responses are read whole, up to maxResponseSize', async () => {
+    const res = await get(`${BASE}/big`);
+    assert(res.body.length === 1 << 20 && res.body.endsWith('ñ€'), `${res.body.length}`);
+    const agent = new Agent({ maxResponseSize: 1 << 20 });
+    await expectError(agent.get(`${BASE}/big`), 'EMSGSIZE');
+    assert((await agent.get(`${BASE}/hello`)).body === 'hello', 'agent unusable after EMSGSIZE');
+    agent.destroy();
+  });
+
+  await test('Connection: close retires the socket', async () => {
+    const agent = new Agent();
+    const res = await agent.get(`${BASE}/close`);
+    assert(res.body === 'bye', res.body);
+    await agent.get(`${BASE}/hello`);
+    assert(agent.stats.connects === 2, `${agent.stats.connects} connects`);
+    agent.destroy();
+  });
+
+  await test('idle sockets expire', async () => {
+    const agent = new Agent({ keepAliveTimeout: 100 });
+    await agent.get(`${BASE}/hello`);
+    await sleep(300);
+    assert(agent.stats.idleClosed === 1, `${agent.stats.idleClosed} idle sockets closed`);
+    await agent.get(`${BASE}/hello`);
+    assert(agent.stats.connects === 2, `${agent.stats.connects} connects`);
+    agent.destroy();
+  });
+
+  await test('request timeout', async () => {
+    await expectError(get(`${BASE}/hang`, { timeout: 200 }), 'ETIMEDOUT');
+  });
+
+  await test('connection refused', async () => {
+    await expectError(get('http://127.0.0.1:1/'), 'ECONNREFUSED');
+  });
+
+  await test('/metrics skips middleware and counts responses', async () => {
+    const before = served;
+    const res = await get(`${BASE}/metrics`);
+    assert(res.statusCode === 200 && served === before, `${res.statusCode}, ${served - before} middleware calls`);
+    assert(/qjs_requests_total\{status="404"\} [1-9]/.test(res.body), res.body);
+    const m = sockets.metrics();
+    assert(m.accepts > 0 && m.bytesIn > 0 && m.handlerUs.count === m.requests, JSON.stringify(m));
+    assert(m.parseUs.count >= m.requests && m.epollBatch.max >= 1, JSON.stringify(m));
+  });
+
+  await test('cyclic garbage is collected once the loop goes idle', async () => {
+    const idle = sockets.metrics().gcIdle;
+    sockets.gc();
+    const base = sockets.memory_usage().memoryUsedSize;
+    sockets.gc_threshold(1 << 30); // no threshold-driven collection meanwhile
+    for (let i = 0; i < 50000; i++) {
+      const a = { pad: [i] };
+      a.self = { a };
+    }
+    const grown = sockets.memory_usage().memoryUsedSize;
+    sockets.gc_idle(10);
+    await get(`${BASE}/hello`); // traffic since the last collection
+    await sleep(50);
+    const m = sockets.metrics();
+    const after = sockets.memory_usage().memoryUsedSize;
+    sockets.gc_idle(app.idleGcInterval);
+    sockets.gc_threshold(256 * 1024); // QuickJS's default
+    assert(m.gcIdle > idle && m.gcUs.count > 0, JSON.stringify(m));
+    assert(grown - base > 1 << 20 && after < base + (grown - base) / 4, `${base} -> ${grown} -> ${after}`);
+  });
+
+  await test('trace ring dumps Chrome trace JSON', async () => {
+    const agent = new Agent(); // a fresh socket, so the accept is traced too
+    sockets.trace_enable(1024);
+    await agent.get(`${BASE}/hello`);
+    await agent.get(`${BASE}/hello`);
+    agent.destroy();
+    const names = new Set(JSON.parse(sockets.trace_dump()).traceEvents.map((e) => e.name));
+    sockets.trace_enable(0);
+    for (const phase of ['accept', 'recv', 'parse', 'handler', 'send']) {
+      assert(names.has(phase), `no ${phase} span in ${[...names]}`);
+    }
+  });
+
+  await test('access log is written off the loop', async () => {
+    await get(`${BASE}/seq/4242`);
+    await sleep(200); // the writer flushes every 50 ms
+    const log = std.loadFile(ACCESS_LOG) || '';
+    assert(/"GET \/seq\/4242" 200 \d+ \d+us\n/.test(log), log.slice(-300));
+    assert(sockets.log_stats().dropped === 0, JSON.stringify(sockets.log_stats()));
+  });
+
+  await test('cached responses skip JS and revalidate once', async () => {
+    const first = await get(`${BASE}/cached`);
+    const before = served;
+    const second = await get(`${BASE}/cached`);
+    assert(second.body === first.body && served === before, `${second.body}, ${served - before} middleware calls`);
+    assert(sockets.cache_stats().hits >= 1, JSON.stringify(sockets.cache_stats()));
+
+    await sleep(250); // past the TTL, inside the stale window
+    const runs = cachedRuns;
+    const agents = [new Agent(), new Agent(), new Agent()];
+    const bodies = (await Promise.all(agents.map((a) => a.get(`${BASE}/cached`)))).map((r) => r.body);
+    agents.forEach((a) => a.destroy());
+    assert(cachedRuns === runs + 1, `${cachedRuns - runs} regenerations`);
+    assert(bodies.filter((b) => b === first.body).length === 2, bodies.join());
+    assert((await get(`${BASE}/cached`)).body === `run ${cachedRuns}`, 'refreshed entry not served');
+  });
+
+  await test('rate limit answers 429 without running JS', async () => {
+    const ok = [await get(`${BASE}/limited`), await get(`${BASE}/limited`)];
+    const before = served;
+    const res = await get(`${BASE}/limited`);
+    assert(ok.every((r) => r.statusCode === 200), ok.map((r) => r.statusCode).join());
+    assert(res.statusCode === 429 && res.headers['retry-after'] === '1' && served === before,
+      `${res.statusCode}, ${served - before} middleware calls`);
+    assert(sockets.limit_stats().limited >= 1, JSON.stringify(sockets.limit_stats()));
+  });
+
+  await test('WebSocket upgrade echoes frames and closes cleanly', async () => {
+    const c = wsConnect('/ws');
+    const head = await c.until((c) => c.data.includes('\r\n\r\n'));
+    assert(head.startsWith('HTTP/1.1 101') && head.includes('s3pPLMBiTxaQ9kYGzzhZRbK+xOo='), head);
+    c.frame(0x1, [...'hi'].map((ch) => ch.charCodeAt(0)));
+    await c.until((c) => c.data.includes('echo:hi'));
+    c.frame(0x2, [1, 2, 3]);
+    await c.until((c) => c.data.includes('bytes:3'));
+    c.frame(0x8, [0x03, 0xe8]); // 1000
+    await c.until((c) => c.eof);
+    sockets.close(c.fd);
+    assert(wsClosed === 1000, `closed with ${wsClosed}`);
+    assert(sockets.ws_stats().messagesIn >= 2, JSON.stringify(sockets.ws_stats()));
+  });
+
+  await test('published messages reach every subscriber', async () => {
+    const clients = [wsConnect('/ws'), wsConnect('/ws')];
+    for (const c of clients) await c.until((c) => c.data.includes('\r\n\r\n'));
+    const reached = app.publish('news', 'flash');
+    assert(reached === 2, `published to ${reached}`);
+    for (const c of clients) await c.until((c) => c.data.includes('flash'));
+    for (const c of clients) {
+      app.unwatch(c.fd);
+      sockets.close(c.fd);
+    }
+    await sleep(20); // the server reads the hangups
+    assert(sockets.pubsub_stats('news') === null, 'topic outlived its subscribers');
+  });
+
+  await test('event streams stay open for events, broadcasts and heartbeats', async () => {
+    const c = rawConnect('GET /events HTTP/1.1\r\nHost: 127.0.0.1\r\nLast-Event-ID: 7\r\n\r\n');
+    const head = await c.until((c) => c.data.includes('data: line2\n\n'));
+    assert(head.startsWith('HTTP/1.1 200') && head.includes('Content-Type: text/event-stream'), head);
+    assert(head.includes('retry: 1000\n\nid: 7\nevent: greeting\ndata: line1\ndata: line2\n\n'), head);
+    assert(app.publish('news', 'flash') === 1, 'not subscribed');
+    await c.until((c) => c.data.endsWith('data: flash\n\n'));
+    assert(sockets.sse_heartbeat(0).written === 1, 'no heartbeat');
+    await c.until((c) => c.data.endsWith(':\n\n'));
+    app.unwatch(c.fd);
+    sockets.close(c.fd);
+    await sleep(20);
+    assert(streamClosed && sockets.sse_stats().streams === 0, JSON.stringify(sockets.sse_stats()));
+  });
+
+  await test('a heartbeat that cannot be written reports the stream', async () => {
+    streamClosed = false;
+    const c = rawConnect('GET /events HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n');
+    await c.until((c) => c.data.includes('data: line2\n\n'));
+    app.unwatch(c.fd);
+    sockets.close(c.fd);
+    // A write after the hangup fails once the client's reset is in, at the
+    // latest on the second sweep; both run before the server reads the EOF
+    let beat = { written: 0, failed: [] };
+    for (let i = 0; i < 3 && beat.failed.length === 0; i++) beat = sockets.sse_heartbeat(0);
+    assert(beat.failed.length === 1 && app.clients.get(beat.failed[0]).sse, JSON.stringify(beat));
+    app._closeClient(beat.failed[0]);
+    assert(streamClosed && sockets.sse_stats().streams === 0, JSON.stringify(sockets.sse_stats()));
+  });
+
+  await test('HTTP/2 with prior knowledge multiplexes requests on one connection', async () => {
+    const requests = sockets.h2_stats().requests;
+    const c = rawConnect('PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n');
+    sockets.send(c.fd, new Uint8Array([...h2Frame(4, 0, 0, []), ...h2Get(1, '/hello'), ...h2Get(3, '/seq/7')]), 0);
+    await c.until((c) => c.data.includes('hello') && c.data.includes('{"n":7}'));
+    assert(sockets.h2_stats().requests === requests + 2, JSON.stringify(sockets.h2_stats()));
+    app.unwatch(c.fd);
+    sockets.close(c.fd);
+    await sleep(20);
+    assert(sockets.h2_stats().connections === 0, JSON.stringify(sockets.h2_stats()));
+  });
+
+  await test('Upgrade: h2c answers the request as stream 1', async () => {
+    const c = rawConnect('GET /hello HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: Upgrade, HTTP2-Settings\r\n' +
+      'Upgrade: h2c\r\nHTTP2-Settings: AAMAAABkAAQCAAAAAAIAAAAA\r\n\r\n');
+    await c.until((c) => c.data.includes('hello'));
+    assert(c.data.startsWith('HTTP/1.1 101 Switching Protocols\r\n'), c.data);
+    sockets.send(c.fd, 'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n', 0);
+    sockets.send(c.fd, new Uint8Array([...h2Frame(4, 0, 0, []), ...h2Get(3, '/seq/9')]), 0);
+    await c.until((c) => c.data.includes('{"n":9}'));
+    app.unwatch(c.fd);
+    sockets.close(c.fd);
+  });
+
+  await test('plain GET to a WebSocket route gets 426', async () => {
+    const res = await get(`${BASE}/ws`);
+    assert(res.statusCode === 426 && res.get('Sec-WebSocket-Version') === '13', `${res.statusCode}`);
+  });
+
+  await test('buffered bytes over the worker budget are shed with 503', async () => {
+    app.overload({ maxBuffered: 4096, lagMs: 0, queueMs: 0 });
+    const shed = sockets.overload_stats().shed;
+    let status;
+    try {
+      status = (await post(`${BASE}/echo`, { pad: 'x'.repeat(32768) })).statusCode;
+    } catch (e) {
+      status = e.code; // the close can reset the socket before the 503 is read
+    }
+    app.maxBuffered = 0;
+    assert(status === 503 || status === 'ECONNRESET', `${status}`);
+    assert(sockets.overload_stats().shed === shed + 1, JSON.stringify(sockets.overload_stats()));
+    assert((await get(`${BASE}/hello`)).statusCode === 200, 'not serving after shedding');
+  });
+
+  await test('TLS handshake, ALPN and session resumption', async () => {
+    let built = true;
+    try {
+      sockets.tls_stats();
+    } catch (e) {
+      built = false; // no OpenSSL headers at build time
+    }
+    if (!built) return;
+    const cert = `/tmp/qjs-http-client-test-${PORT}.pem`;
+    const key = `/tmp/qjs-http-client-test-${PORT}.key`;
+    const quiet = std.open('/dev/null', 'w');
+    os.exec(['openssl', 'req', '-x509', '-newkey', 'ec', '-pkeyopt', 'ec_paramgen_curve:P-256', '-nodes',
+      '-days', '1', '-subj', '/CN=localhost', '-addext', 'subjectAltName=DNS:localhost',
+      '-keyout', key, '-out', cert], { stdout: quiet.fileno(), stderr: quiet.fileno() });
+    quiet.close();
+    sockets.tls_server({ cert, key, alpn: ['h2', 'http/1.1'] });
+
+    const listenFd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+    sockets.setsockopt(listenFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+    sockets.bind(listenFd, '127.0.0.1', PORT + 1);
+    sockets.listen(listenFd, 8);
+    const options = { servername: 'localhost', ca: cert, alpn: ['http/1.1'] };
+    try {
+      const first = tlsPair(listenFd, options);
+      first.step((p) => sockets.tls_info(p.server).established && sockets.tls_info(p.client).established);
+      const info = sockets.tls_info(first.client);
+      assert(info.alpn === 'http/1.1' && !info.resumed, JSON.stringify(info));
+      assert(!sockets.tls_info(first.server).ktls, 'kTLS on without ktls: true');
+      assert(sockets.send(first.server, 'pong', 0) === 4, 'server send');
+      first.step((p) => p.got === 'pong');
+      const session = sockets.tls_session(first.client);
+      assert(session instanceof ArrayBuffer, 'no session to resume');
+      sockets.close(first.client);
+      sockets.close(first.server);
+
+      const second = tlsPair(listenFd, Object.assign({ session }, options));
+      second.step((p) => sockets.tls_info(p.client).established);
+      assert(sockets.tls_info(second.client).resumed, JSON.stringify(sockets.tls_info(second.client)));
+      sockets.close(second.client);
+      sockets.close(second.server);
+    } finally {
+      sockets.close(listenFd);
+    }
+    assert(sockets.tls_stats().resumed >= 1, JSON.stringify(sockets.tls_stats()));
+  });
+
+  await test('shared-memory tables, and handles that outlive close()', async () => {
+    const name = `qjs-client-test-${PORT}`;
+    const a = sockets.shm.open(name, 1 << 16);
+    try {
+      assert(a.set('k', 'v') && a.get('k') === 'v' && a.incr('n', 2) === 2 && a.incr('n') === 3, 'set/get/incr');
+      assert(a.cas('n', 3, 'x') && !a.cas('n', 3, 'y') && a.get('n') === 'x', 'cas');
+      assert(a.delete('k') && a.get('k') === undefined, 'delete');
+      const b = sockets.shm.open(name, 0); // a second handle on the same data
+      assert(b.get('n') === 'x', 'data not shared');
+      b.close();
+    } finally {
+      a.close();
+    }
+    const other = `${name}-other`;
+    const c = sockets.shm.open(other, 1 << 16); // takes the slot a had
+    try {
+      c.set('k', 'c');
+      for (const call of [() => a.get('k'), () => a.set('k', 'a'), () => a.close()]) {
+        let threw = false;
+        try {
+          call();
+        } catch (e) {
+          threw = e instanceof TypeError;
+        }
+        assert(threw, `closed handle used: ${call}`);
+      }
+      assert(c.get('k') === 'c', `reused slot changed: ${c.get('k')}`);
+      let built = true;
+      try {
+        sockets.tls_stats();
+      } catch (e) {
+        built = false;
+      }
+      if (built) {
+        let threw = false;
+        try {
+          sockets.tls_server({ cert: '/nonexistent', key: '/nonexistent', cache: a });
+        } catch (e) {
+          threw = e instanceof TypeError;
+        }
+        assert(threw, 'tls_server() took a closed cache');
+      }
+    } finally {
+      c.close();
+      sockets.shm.unlink(name);
+      sockets.shm.unlink(other);
+    }
+  });
+
+  await test('proxy() splices a connection through to the app, half-close included', async () => {
+    const listenFd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+    sockets.setsockopt(listenFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+    sockets.bind(listenFd, '127.0.0.1', PORT + 2);
+    sockets.listen(listenFd, 8);
+    // The app watches proxy_fd() already, for its proxied prefix
+
+    const request = 'GET /hello HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n';
+    const c = rawConnect(request, PORT + 2);
+    const accepted = sockets.accept(listenFd).fd;
+    const upstream = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+    sockets.connect(upstream, '127.0.0.1', PORT);
+    const done = sockets.proxy(accepted, upstream);
+    await c.until((c) => c.data.endsWith('hello'));
+    // The app closes the keep-alive connection on EOF, which reaches the client as its own
+    sockets.shutdown(c.fd, sockets.SHUT_WR);
+    const result = await done;
+    await c.until((c) => c.eof);
+    assert(result.sent === request.length && result.received === c.data.length && !result.error,
+      JSON.stringify(result));
+    assert(sockets.proxy_stats().active === 0, JSON.stringify(sockets.proxy_stats()));
+    for (const fd of [c.fd, accepted, upstream, listenFd]) sockets.close(fd);
+  });
+
+  await test('proxy() sends what was read early once a connecting upstream is up', async () => {
+    const listenFd = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+    sockets.setsockopt(listenFd, sockets.SOL_SOCKET, sockets.SO_REUSEADDR, 1);
+    sockets.bind(listenFd, '127.0.0.1', PORT + 2);
+    sockets.listen(listenFd, 8);
+
+    const body = JSON.stringify({ pad: 'e'.repeat(60000) });
+    const request = `POST /echo HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Type: application/json\r\n` +
+      `Content-Length: ${body.length}\r\n\r\n${body}`;
+    const c = rawConnect(request, PORT + 2);
+    const accepted = sockets.accept(listenFd).fd;
+    sockets.setnonblocking(accepted);
+    let early = '';
+    while (early.length < request.length) early += sockets.recv(accepted, 65536, 0);
+    const upstream = sockets.socket(sockets.AF_INET, sockets.SOCK_STREAM, 0);
+    sockets.setnonblocking(upstream);
+    sockets.connect(upstream, '127.0.0.1', PORT); // still in progress
+    const done = sockets.proxy(accepted, upstream, early);
+    await c.until((c) => c.data.endsWith('"}}'));
+    assert(c.data.includes(body), c.data.slice(0, 200));
+    sockets.shutdown(c.fd, sockets.SHUT_WR);
+    const result = await done;
+    assert(result.sent === request.length && !result.error, JSON.stringify(result));
+    for (const fd of [c.fd, accepted, upstream, listenFd]) sockets.close(fd);
+  });
+
+  await test('a Unix connect to a full backlog throws instead of hanging', async () => {
+    const path = `/tmp/qjs-backlog-${PORT}.sock`;
+    os.remove(path);
+    const listenFd = sockets.socket(sockets.AF_UNIX, sockets.SOCK_STREAM, 0);
+    sockets.bind(listenFd, path, 0);
+    sockets.listen(listenFd, 0);
+    const clients = [];
+    let error = null;
+    for (let i = 0; i < 8 && !error; i++) {
+      const fd = sockets.socket(sockets.AF_UNIX, sockets.SOCK_STREAM, 0);
+      sockets.setnonblocking(fd);
+      clients.push(fd);
+      try {
+        sockets.connect(fd, path, 0);
+      } catch (e) {
+        error = e;
+      }
+    }
+    for (const fd of [...clients, listenFd]) sockets.close(fd);
+    os.remove(path);
+    assert(error && error.message.startsWith('connect() failed'), String(error));
+  });
+
+  await test('a body over its route limit is refused from the head', async () => {
+    const res = await post(`${BASE}/upload`, 'x'.repeat(100));
+    assert(res.statusCode === 413, `${res.statusCode}`);
+    assert((await post(`${BASE}/upload`, 'x'.repeat(60))).body === '60', 'small body refused');
+  });
+
+  await test('Expect: 100-continue waits for the go-ahead', async () => {
+    const c = rawConnect('POST /echo HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Type: text/plain\r\n' +
+      'Content-Length: 5\r\nExpect: 100-continue\r\nConnection: close\r\n\r\n');
+    await c.until((c) => c.data.includes('100 Continue\r\n\r\n'));
+    sockets.send(c.fd, 'hello', 0);
+    const data = await c.until((c) => c.eof);
+    assert(data.includes('"got":"hello"'), JSON.stringify(data));
+    sockets.close(c.fd);
+  });
+
+  await test('chunked request bodies are decoded', async () => {
+    const c = rawConnect('POST /echo HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Type: text/plain\r\n' +
+      'Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n4\r\nWiki\r\n5\r\npedia\r\n0\r\n\r\n');
+    const data = await c.until((c) => c.eof);
+    assert(data.includes('"got":"Wikipedia"'), JSON.stringify(data));
+    sockets.close(c.fd);
+  });
+
+  await test('large bodies spill to a file, streamed ones reach the handler in pieces', async () => {
+    const spilled = sockets.body_stats().spilled;
+    const res = await post(`${BASE}/echo`, { pad: 'y'.repeat(2 * app.bodySpill) });
+    assert(res.json().got.pad.length === 2 * app.bodySpill, `${res.statusCode}`);
+    assert(sockets.body_stats().spilled === spilled + 1, JSON.stringify(sockets.body_stats()));
+    const streamed = await post(`${BASE}/stream`, 'z'.repeat(300000));
+    assert(streamed.body === '300000', streamed.body);
+    assert(sockets.body_stats().active === 0, JSON.stringify(sockets.body_stats()));
+  });
+
+  await test('forms are decoded and uploaded files land on disk', async () => {
+    const urlencoded = await post(`${BASE}/echo`, 'a=1&b=x+y%21&a=2&__proto__=p',
+      { headers: { 'content-type': 'application/x-www-form-urlencoded' } });
+    const got = urlencoded.json().got;
+    assert(JSON.stringify(got) === '{"a":["1","2"],"b":"x y!","__proto__":"p"}', urlencoded.body);
+
+    // File bytes that keep looking like the start of a delimiter
+    const content = 'data\r\n--XyZ-not-it\r\n-'.repeat(8000);
+    const sum = [...content].reduce((a, c) => a + c.charCodeAt(0), 0);
+    const body = '--XyZ\r\nContent-Disposition: form-data; name="title"\r\n\r\nhi\r\n' +
+      '--XyZ\r\nContent-Disposition: form-data; name="doc"; filename="a.txt"\r\nContent-Type: text/plain\r\n\r\n' +
+      content + '\r\n--XyZ--\r\n';
+    const files = sockets.body_stats().files;
+    const res = await post(`${BASE}/form`, body, { headers: { 'content-type': 'multipart/form-data; boundary=XyZ' } });
+    const form = res.json();
+    assert(form.fields.title === 'hi', res.body);
+    assert(form.files.length === 1 && form.files[0].filename === 'a.txt' && form.files[0].type === 'text/plain' &&
+      form.files[0].sum === sum, res.body);
+    assert(sockets.body_stats().files === files + 1 && sockets.body_stats().active === 0,
+      JSON.stringify(sockets.body_stats()));
+  });
+
+  await test('uploaded bytes that are not UTF-8 reach the file as sent', async () => {
+    const file = Uint8Array.from({ length: 512 }, (_, i) => 255 - (i & 0xff));
+    const text = (s) => Uint8Array.from(s, (c) => c.charCodeAt(0));
+    const head = text('--XyZ\r\nContent-Disposition: form-data; name="bin"; filename="b.bin"\r\n\r\n');
+    const tail = text('\r\n--XyZ--\r\n');
+    const req = text('POST /form HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n' +
+      'Content-Type: multipart/form-data; boundary=XyZ\r\n' +
+      `Content-Length: ${head.length + file.length + tail.length}\r\n\r\n`);
+    const bytes = new Uint8Array(req.length + head.length + file.length + tail.length);
+    bytes.set(req);
+    bytes.set(head, req.length);
+    bytes.set(file, req.length + head.length);
+    bytes.set(tail, req.length + head.length + file.length);
+    const data = await rawConnect(bytes).until((c) => c.eof);
+    const form = JSON.parse(data.substring(data.indexOf('\r\n\r\n') + 4));
+    assert(form.files.length === 1 && form.files[0].sum === file.reduce((a, b) => a + b, 0), data);
+  });
+
+  await test('a small binary body reaches the handler as sent', async () => {
+    const body = Uint8Array.from({ length: 10240 }, (_, i) => (i * 7) & 0xff);
+    const head = Uint8Array.from('POST /sum HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n' +
+      `Content-Type: application/octet-stream\r\nContent-Length: ${body.length}\r\n\r\n`, (c) => c.charCodeAt(0));
+    const bytes = new Uint8Array(head.length + body.length);
+    bytes.set(head);
+    bytes.set(body, head.length);
+    const data = await rawConnect(bytes).until((c) => c.eof);
+    const got = JSON.parse(data.substring(data.indexOf('\r\n\r\n') + 4));
+    assert(got.binary && got.length === body.length && got.sum === body.reduce((a, b) => a + b, 0), data);
+  });
+
+  await test('file parts are capped apart from fields', async () => {
+    const part = (name, file) => `--XyZ\r\nContent-Disposition: form-data; name="${name}"` +
+      (file ? `; filename="${name}.txt"` : '') + `\r\n\r\n${name}\r\n`;
+    const form = (fields, files) => post(`${BASE}/form`,
+      Array.from({ length: fields }, (_, i) => part(`f${i}`, false)).join('') +
+      Array.from({ length: files }, (_, i) => part(`u${i}`, true)).join('') + '--XyZ--\r\n',
+      { headers: { 'content-type': 'multipart/form-data; boundary=XyZ' } });
+    const ok = await form(50, 2);
+    assert(ok.statusCode === 200 && ok.json().files.length === 2 && ok.json().fields.f49 === 'f49', ok.body);
+    const over = await form(0, 3);
+    assert(over.statusCode === 413, `${over.statusCode}`);
+    assert(sockets.body_stats().active === 0, JSON.stringify(sockets.body_stats()));
+  });
+
+  await test('app.proxy() forwards a prefix over pooled connections, past a dead server', async () => {
+    for (let i = 0; i < 4; i++) {
+      const res = await get(`${BASE}/up/hello`);
+      assert(res.statusCode === 200 && res.body === 'hello', `${res.statusCode} ${res.body}`);
+    }
+    const res = await post(`${BASE}/up/echo`, { a: 2 });
+    assert(res.json().got.a === 2, res.body);
+    const stats = app.proxyStats('/up');
+    const dead = stats.servers[1];
+    assert(dead.down && dead.failures >= 1, JSON.stringify(stats));
+    assert(stats.reused >= 1 && stats.servers[0].requests >= 5, JSON.stringify(stats));
+  });
+
+  const backends = [backend(PORT + 4, 'a'), backend(PORT + 5, 'b')];
+
+  await test('least-conn sends requests past a server that is still busy', async () => {
+    const hung = rawConnect('GET /lc/hang HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n');
+    while (backends.every((b) => b.held.length === 0)) await sleep(5);
+    const busy = backends.find((b) => b.held.length > 0);
+    const bodies = [];
+    for (let i = 0; i < 3; i++) bodies.push((await get(`${BASE}/lc/x`)).body);
+    assert(bodies.every((body) => body === bodies[0] && !body.startsWith(busy.name)), bodies.join());
+    busy.release();
+    await hung.until((c) => c.data.endsWith(`${busy.name}:/hang`));
+    app.unwatch(hung.fd);
+    sockets.close(hung.fd);
+  });
+
+  await test('hash keeps each path on one server and spreads the paths', async () => {
+    const names = new Set();
+    for (let i = 0; i < 16; i++) {
+      const first = (await get(`${BASE}/hash/k${i}`)).body;
+      const again = (await get(`${BASE}/hash/k${i}?again`)).body;
+      assert(again === `${first}?again`, `${first} ${again}`);
+      names.add(first[0]);
+    }
+    assert(names.size === 2, [...names].join());
+  });
+
+  await test('a chunked body is forwarded as sent and a pipelined request comes back', async () => {
+    const body = '5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n';
+    const c = rawConnect('POST /hash/upload HTTP/1.1\r\nHost: 127.0.0.1\r\nTransfer-Encoding: chunked\r\n\r\n' +
+      body + 'GET /hello HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n');
+    const data = await c.until((c) => c.eof);
+    sockets.close(c.fd);
+    assert(/\r\n\r\n[ab]:\/upload/.test(data) && data.endsWith('hello'), JSON.stringify(data));
+    const forwarded = backends.flatMap((b) => b.requests).find((r) => r.startsWith('POST /upload '));
+    assert(forwarded && forwarded.endsWith(`\r\n\r\n${body}`) && /^transfer-encoding: chunked/im.test(forwarded),
+      JSON.stringify(forwarded));
+  });
+
+  await test('a pooled connection the server closed is replaced', async () => {
+    const [a] = backends;
+    assert((await get(`${BASE}/slow/x`)).body === 'a:/x', 'first request');
+    const accepted = a.accepted;
+    const reused = app.proxyStats('/slow').reused;
+    assert((await get(`${BASE}/slow/x`)).body === 'a:/x', 'second request');
+    assert(a.accepted === accepted && app.proxyStats('/slow').reused === reused + 1, 'not pooled');
+    a.disconnect();
+    await sleep(20); // the FIN reaches the idle connection
+    const res = await get(`${BASE}/slow/x`);
+    const stats = app.proxyStats('/slow');
+    assert(res.statusCode === 200 && res.body === 'a:/x', `${res.statusCode} ${res.body}`);
+    assert(a.accepted === accepted + 1 && stats.reused === reused + 1 && stats.servers[0].failures === 0,
+      JSON.stringify(stats));
+  });
+
+  await test('a server that does not answer in time gets a 504, or the request goes elsewhere', async () => {
+    const slow = await get(`${BASE}/slow/hang-a`);
+    assert(slow.statusCode === 504, `${slow.statusCode} ${slow.body}`);
+    const retried = app.proxyStats('/retry').retried;
+    // Round robin tries a first, which holds the request until the pool gives up on it
+    for (let i = 0; i < 2; i++) {
+      const res = await get(`${BASE}/retry/hang-a`);
+      assert(res.statusCode === 200 && res.body === 'b:/hang-a', `${res.statusCode} ${res.body}`);
+    }
+    const stats = app.proxyStats('/retry');
+    assert(stats.retried > retried && stats.servers[0].failures >= 1, JSON.stringify(stats));
+  });
+
+  await test('a proxied request with both Content-Length and chunked is refused', async () => {
+    const requests = backends.reduce((n, b) => n + b.requests.length, 0);
+    const c = rawConnect('POST /hash/x HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: 5\r\n' +
+      'Transfer-Encoding: chunked\r\n\r\n0\r\n\r\n');
+    const data = await c.until((c) => c.eof);
+    sockets.close(c.fd);
+    assert(data.startsWith('HTTP/1.1 400'), JSON.stringify(data));
+    assert(backends.reduce((n, b) => n + b.requests.length, 0) === requests, 'forwarded anyway');
+  });
+
+  await test('a proxied request whose last coding is not chunked is refused', async () => {
+    const requests = backends.reduce((n, b) => n + b.requests.length, 0);
+    for (const te of ['chunked, gzip', 'chunked\r\nTransfer-Encoding: gzip', 'chunked, chunked', 'gzip']) {
+      const c = rawConnect(`POST /hash/x HTTP/1.1\r\nHost: 127.0.0.1\r\nTransfer-Encoding: ${te}\r\n\r\n0\r\n\r\n`);
+      const data = await c.until((c) => c.eof);
+      sockets.close(c.fd);
+      assert(data.startsWith('HTTP/1.1 400'), `${te}: ${JSON.stringify(data)}`);
+    }
+    assert(backends.reduce((n, b) => n + b.requests.length, 0) === requests, 'forwarded anyway');
+  });
+
+  for (const b of backends) b.close();
+
+  await test('the profiler finds a hot loop in the folded stacks', async () => {
+    function hotLoop(n) {
+      let x = 0;
+      for (let i = 0; i < n; i++) x += Math.sqrt(i);
+      return x;
+    }
+    sockets.profile_start(999);
+    const end = Date.now() + 200;
+    while (Date.now() < end) hotLoop(100000);
+    const stats = sockets.profile_stop();
+    const folded = sockets.profile_folded();
+    assert(stats.samples > 0 && /\bhotLoop \(/.test(folded), JSON.stringify(stats) + '\n' + folded);
+  });
+
+  await test('https is rejected', async () => {
+    await expectError(get('https://127.0.0.1/'), 'EPROTONOSUPPORT');
+  });
+}
+
+app.listen(PORT, '127.0.0.1', () => {
+  main().finally(() => {
+    console.log(`\n${passed} passed, ${failed} failed (${served} requests served)`);
+    app.close();
+  });
+});